@@ -16,6 +16,8 @@
 
 #include "update_engine/binder_service_brillo.h"
 
+#include <utility>
+
 #include <base/bind.h>
 
 #include <binderwrapper/binder_wrapper.h>
@@ -46,6 +48,12 @@ Status ToStatus(ErrorPtr* error) {
   return Status::fromServiceSpecificError(
       1, String8{error->get()->GetMessage().c_str()});
 }
+
+void SendStatusToCallback(IUpdateEngineStatusCallback* callback,
+                          const UpdateEngineStatus& update_engine_status) {
+  callback->HandleStatusUpdate(
+      ParcelableUpdateEngineStatus(update_engine_status));
+}
 }  // namespace
 
 template <typename... Parameters, typename... Arguments>
@@ -198,16 +206,7 @@ Status BinderUpdateEngineBrilloService::GetRollbackPartition(
 
 Status BinderUpdateEngineBrilloService::RegisterStatusCallback(
     const sp<IUpdateEngineStatusCallback>& callback) {
-  callbacks_.emplace_back(callback);
-
-  auto binder_wrapper = android::BinderWrapper::Get();
-
-  binder_wrapper->RegisterForDeathNotifications(
-      IUpdateEngineStatusCallback::asBinder(callback),
-      base::Bind(&BinderUpdateEngineBrilloService::UnregisterStatusCallback,
-                 base::Unretained(this),
-                 base::Unretained(callback.get())));
-
+  AddStatusCallback(callback, nullptr);
   return Status::ok();
 }
 
@@ -221,10 +220,69 @@ Status BinderUpdateEngineBrilloService::GetEolStatus(int* out_eol_status) {
   return CallCommonHandler(&UpdateEngineService::GetEolStatus, out_eol_status);
 }
 
+Status BinderUpdateEngineBrilloService::GetPerfStats(
+    String16* out_perf_stats) {
+  string perf_stats;
+  auto ret =
+      CallCommonHandler(&UpdateEngineService::GetPerfStats, &perf_stats);
+
+  *out_perf_stats = String16(perf_stats.c_str());
+  return ret;
+}
+
+Status BinderUpdateEngineBrilloService::SubscribeStatusCallback(
+    const sp<IUpdateEngineStatusCallback>& callback,
+    int fields,
+    int64_t min_interval_ms) {
+  UpdateEngineStatus update_engine_status;
+  auto ret =
+      CallCommonHandler(&UpdateEngineService::GetStatus, &update_engine_status);
+  if (!ret.isOk())
+    return ret;
+
+  // The subscription drops the status updates |callback| isn't interested in
+  // here, before they are sent.
+  auto subscription = std::make_unique<StatusSubscription>(
+      fields,
+      base::TimeDelta::FromMilliseconds(min_interval_ms),
+      base::Bind(&SendStatusToCallback, base::Unretained(callback.get())));
+  subscription->Offer(update_engine_status);
+  AddStatusCallback(callback, std::move(subscription));
+  return Status::ok();
+}
+
+Status BinderUpdateEngineBrilloService::UnsubscribeStatusCallback(
+    const sp<IUpdateEngineStatusCallback>& callback) {
+  auto binder = IUpdateEngineStatusCallback::asBinder(callback);
+  for (auto it = callbacks_.begin(); it != callbacks_.end(); it++) {
+    if (IUpdateEngineStatusCallback::asBinder(it->callback) == binder) {
+      android::BinderWrapper::Get()->UnregisterForDeathNotifications(binder);
+      callbacks_.erase(it);
+      return Status::ok();
+    }
+  }
+  return Status::fromServiceSpecificError(
+      1, String8{"Unknown status callback."});
+}
+
+void BinderUpdateEngineBrilloService::AddStatusCallback(
+    const sp<IUpdateEngineStatusCallback>& callback,
+    std::unique_ptr<StatusSubscription> subscription) {
+  callbacks_.push_back({callback, std::move(subscription)});
+
+  auto binder_wrapper = android::BinderWrapper::Get();
+
+  binder_wrapper->RegisterForDeathNotifications(
+      IUpdateEngineStatusCallback::asBinder(callback),
+      base::Bind(&BinderUpdateEngineBrilloService::UnregisterStatusCallback,
+                 base::Unretained(this),
+                 base::Unretained(callback.get())));
+}
+
 void BinderUpdateEngineBrilloService::UnregisterStatusCallback(
     IUpdateEngineStatusCallback* callback) {
   auto it = callbacks_.begin();
-  while (it != callbacks_.end() && it->get() != callback)
+  while (it != callbacks_.end() && it->callback.get() != callback)
     it++;
 
   if (it == callbacks_.end()) {
@@ -239,8 +297,11 @@ void BinderUpdateEngineBrilloService::UnregisterStatusCallback(
 void BinderUpdateEngineBrilloService::SendStatusUpdate(
     const UpdateEngineStatus& update_engine_status) {
   ParcelableUpdateEngineStatus parcelable_status(update_engine_status);
-  for (auto& callback : callbacks_) {
-    callback->HandleStatusUpdate(parcelable_status);
+  for (auto& status_callback : callbacks_) {
+    if (status_callback.subscription)
+      status_callback.subscription->Offer(update_engine_status);
+    else
+      status_callback.callback->HandleStatusUpdate(parcelable_status);
   }
 }
 
@@ -28,6 +28,7 @@
 #include "update_engine/common_service.h"
 #include "update_engine/parcelable_update_engine_status.h"
 #include "update_engine/service_observer_interface.h"
+#include "update_engine/status_subscription.h"
 
 #include "android/brillo/BnUpdateEngine.h"
 #include "android/brillo/IUpdateEngineStatusCallback.h"
@@ -91,6 +92,15 @@ class BinderUpdateEngineBrilloService : public android::brillo::BnUpdateEngine,
   android::binder::Status GetLastAttemptError(
       int* out_last_attempt_error) override;
   android::binder::Status GetEolStatus(int* out_eol_status) override;
+  android::binder::Status GetPerfStats(
+      android::String16* out_perf_stats) override;
+  android::binder::Status SubscribeStatusCallback(
+      const android::sp<android::brillo::IUpdateEngineStatusCallback>& callback,
+      int fields,
+      int64_t min_interval_ms) override;
+  android::binder::Status UnsubscribeStatusCallback(
+      const android::sp<android::brillo::IUpdateEngineStatusCallback>& callback)
+      override;
 
  private:
   // Generic function for dispatching to the common service.
@@ -99,14 +109,25 @@ class BinderUpdateEngineBrilloService : public android::brillo::BnUpdateEngine,
       bool (UpdateEngineService::*Handler)(brillo::ErrorPtr*, Parameters...),
       Arguments... arguments);
 
+  // Adds |callback| to the ones sent the status updates, through
+  // |subscription| if not null.
+  void AddStatusCallback(
+      const android::sp<android::brillo::IUpdateEngineStatusCallback>& callback,
+      std::unique_ptr<StatusSubscription> subscription);
+
   // To be used as a death notification handler only.
   void UnregisterStatusCallback(
       android::brillo::IUpdateEngineStatusCallback* callback);
 
   std::unique_ptr<UpdateEngineService> common_;
 
-  std::vector<android::sp<android::brillo::IUpdateEngineStatusCallback>>
-      callbacks_;
+  // A registered status callback, and the subscription filtering the status
+  // updates sent to it if it was registered with SubscribeStatusCallback().
+  struct StatusCallback {
+    android::sp<android::brillo::IUpdateEngineStatusCallback> callback;
+    std::unique_ptr<StatusSubscription> subscription;
+  };
+  std::vector<StatusCallback> callbacks_;
 };
 
 }  // namespace chromeos_update_engine
@@ -18,6 +18,8 @@
 
 #include <binder/IServiceManager.h>
 
+#include <algorithm>
+
 #include <base/message_loop/message_loop.h>
 #include <utils/String8.h>
 
@@ -38,6 +40,20 @@ using update_engine::UpdateAttemptFlags;
 namespace update_engine {
 namespace internal {
 
+namespace {
+
+// Reports |status| to |handler|.
+void RunStatusUpdateHandler(StatusUpdateHandler* handler,
+                            const UpdateEngineStatus& status) {
+  handler->HandleStatusUpdate(status.last_checked_time,
+                              status.progress,
+                              status.status,
+                              status.new_version,
+                              status.new_size_bytes);
+}
+
+}  // namespace
+
 bool BinderUpdateEngineClient::Init() {
   if (!binder_watcher_.Init())
     return false;
@@ -154,17 +170,22 @@ bool BinderUpdateEngineClient::ResetStatus() {
 
 Status BinderUpdateEngineClient::StatusUpdateCallback::HandleStatusUpdate(
     const ParcelableUpdateEngineStatus& status) {
-  UpdateStatus update_status;
-
+  // Convert the parcel once for all the handlers.
+  UpdateEngineStatus update_status = {};
+  update_status.last_checked_time = status.last_checked_time_;
+  update_status.progress = status.progress_;
   StringToUpdateStatus(String8{status.current_operation_}.string(),
-                       &update_status);
-
-  for (auto& handler : client_->handlers_) {
-    handler->HandleStatusUpdate(status.last_checked_time_,
-                                status.progress_,
-                                update_status,
-                                String8{status.new_version_}.string(),
-                                status.new_size_);
+                       &update_status.status);
+  update_status.new_version = String8{status.new_version_}.string();
+  update_status.new_size_bytes = status.new_size_;
+
+  if (handler_) {
+    RunStatusUpdateHandler(handler_, update_status);
+    return Status::ok();
+  }
+  for (const auto& subscriber : client_->handlers_) {
+    if (!subscriber.callback.get())
+      RunStatusUpdateHandler(subscriber.handler, update_status);
   }
 
   return Status::ok();
@@ -179,32 +200,53 @@ bool BinderUpdateEngineClient::RegisterStatusUpdateHandler(
     }
   }
 
-  handlers_.push_back(handler);
+  handlers_.push_back({handler, nullptr});
 
-  int64_t last_checked_time;
-  double progress;
-  UpdateStatus update_status;
-  string new_version;
-  int64_t new_size;
+  UpdateEngineStatus status = {};
+  int64_t new_size = 0;
 
-  if (!GetStatus(&last_checked_time,
-                 &progress,
-                 &update_status,
-                 &new_version,
+  if (!GetStatus(&status.last_checked_time,
+                 &status.progress,
+                 &status.status,
+                 &status.new_version,
                  &new_size)) {
     handler->IPCError("Could not get status from binder service");
   }
+  status.new_size_bytes = new_size;
 
-  handler->HandleStatusUpdate(
-      last_checked_time, progress, update_status, new_version, new_size);
+  RunStatusUpdateHandler(handler, status);
+
+  return true;
+}
+
+bool BinderUpdateEngineClient::RegisterStatusUpdateHandler(
+    StatusUpdateHandler* handler, int32_t fields, int64_t min_interval_ms) {
+  if (fields == kStatusFieldAll && min_interval_ms == 0)
+    return RegisterStatusUpdateHandler(handler);
+
+  // The service filters the status updates of this handler and sends the
+  // current status right away.
+  android::sp<android::brillo::IUpdateEngineStatusCallback> callback =
+      new BinderUpdateEngineClient::StatusUpdateCallback(this, handler);
+  if (!service_->SubscribeStatusCallback(callback, fields, min_interval_ms)
+           .isOk()) {
+    return false;
+  }
+
+  handlers_.push_back({handler, callback});
 
   return true;
 }
 
 bool BinderUpdateEngineClient::UnregisterStatusUpdateHandler(
     StatusUpdateHandler* handler) {
-  auto it = std::find(handlers_.begin(), handlers_.end(), handler);
+  auto it = std::find_if(
+      handlers_.begin(), handlers_.end(), [handler](const Subscriber& s) {
+        return s.handler == handler;
+      });
   if (it != handlers_.end()) {
+    if (it->callback.get())
+      service_->UnsubscribeStatusCallback(it->callback);
     handlers_.erase(it);
     return true;
   }
@@ -260,5 +302,15 @@ bool BinderUpdateEngineClient::GetEolStatus(int32_t* eol_status) const {
   return true;
 }
 
+bool BinderUpdateEngineClient::GetPerfStats(string* perf_stats) const {
+  String16 out_as_string16;
+
+  if (!service_->GetPerfStats(&out_as_string16).isOk())
+    return false;
+
+  *perf_stats = String8{out_as_string16}.string();
+  return true;
+}
+
 }  // namespace internal
 }  // namespace update_engine
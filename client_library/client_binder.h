@@ -83,29 +83,44 @@ class BinderUpdateEngineClient : public UpdateEngineClient {
   bool GetChannel(std::string* out_channel) const override;
 
   bool RegisterStatusUpdateHandler(StatusUpdateHandler* handler) override;
+  bool RegisterStatusUpdateHandler(StatusUpdateHandler* handler,
+                                   int32_t fields,
+                                   int64_t min_interval_ms) override;
   bool UnregisterStatusUpdateHandler(StatusUpdateHandler* handler) override;
 
   bool GetLastAttemptError(int32_t* last_attempt_error) const override;
 
   bool GetEolStatus(int32_t* eol_status) const override;
 
+  bool GetPerfStats(std::string* perf_stats) const override;
+
  private:
   class StatusUpdateCallback
       : public android::brillo::BnUpdateEngineStatusCallback {
    public:
-    explicit StatusUpdateCallback(BinderUpdateEngineClient* client)
-        : client_(client) {}
+    // Reports the status updates to |handler|, or to all the handlers
+    // without their own callback if null.
+    explicit StatusUpdateCallback(BinderUpdateEngineClient* client,
+                                  StatusUpdateHandler* handler = nullptr)
+        : client_(client), handler_(handler) {}
 
     android::binder::Status HandleStatusUpdate(
         const android::brillo::ParcelableUpdateEngineStatus& status) override;
 
    private:
     BinderUpdateEngineClient* client_;
+    StatusUpdateHandler* handler_;
   };
 
   android::sp<android::brillo::IUpdateEngine> service_;
   android::sp<android::brillo::IUpdateEngineStatusCallback> status_callback_;
-  std::vector<update_engine::StatusUpdateHandler*> handlers_;
+  // A registered handler and, if it subscribed to some fields or rate, its
+  // own callback, whose status updates the service filters.
+  struct Subscriber {
+    StatusUpdateHandler* handler;
+    android::sp<android::brillo::IUpdateEngineStatusCallback> callback;
+  };
+  std::vector<Subscriber> handlers_;
   brillo::BinderWatcher binder_watcher_;
 
   DISALLOW_COPY_AND_ASSIGN(BinderUpdateEngineClient);
@@ -16,6 +16,10 @@
 
 #include "update_engine/client_library/client_dbus.h"
 
+#include <algorithm>
+#include <memory>
+
+#include <base/bind.h>
 #include <base/message_loop/message_loop.h>
 
 #include <dbus/bus.h>
@@ -24,6 +28,7 @@
 
 #include "update_engine/update_status_utils.h"
 
+using chromeos_update_engine::StatusSubscription;
 using chromeos_update_engine::StringToUpdateStatus;
 using dbus::Bus;
 using org::chromium::UpdateEngineInterfaceProxy;
@@ -33,6 +38,20 @@ using std::vector;
 namespace update_engine {
 namespace internal {
 
+namespace {
+
+// Reports |status| to |handler|.
+void RunStatusUpdateHandler(StatusUpdateHandler* handler,
+                            const UpdateEngineStatus& status) {
+  handler->HandleStatusUpdate(status.last_checked_time,
+                              status.progress,
+                              status.status,
+                              status.new_version,
+                              status.new_size_bytes);
+}
+
+}  // namespace
+
 bool DBusUpdateEngineClient::Init() {
   Bus::Options options;
   options.bus_type = Bus::SYSTEM;
@@ -149,9 +168,9 @@ bool DBusUpdateEngineClient::ResetStatus() {
 void DBusUpdateEngineClient::DBusStatusHandlersRegistered(
     const string& interface, const string& signal_name, bool success) const {
   if (!success) {
-    for (auto handler : handlers_) {
-      handler->IPCError("Could not connect to" + signal_name + " on " +
-                        interface);
+    for (const auto& subscriber : handlers_) {
+      subscriber.handler->IPCError("Could not connect to" + signal_name +
+                                   " on " + interface);
     }
   } else {
     StatusUpdateHandlersRegistered(nullptr);
@@ -160,25 +179,22 @@ void DBusUpdateEngineClient::DBusStatusHandlersRegistered(
 
 void DBusUpdateEngineClient::StatusUpdateHandlersRegistered(
     StatusUpdateHandler* handler) const {
-  int64_t last_checked_time;
-  double progress;
-  UpdateStatus update_status;
-  string new_version;
+  UpdateEngineStatus status = {};
   int64_t new_size;
 
-  if (!GetStatus(&last_checked_time,
-                 &progress,
-                 &update_status,
-                 &new_version,
+  if (!GetStatus(&status.last_checked_time,
+                 &status.progress,
+                 &status.status,
+                 &status.new_version,
                  &new_size)) {
     handler->IPCError("Could not query current status");
     return;
   }
+  status.new_size_bytes = new_size;
 
-  std::vector<update_engine::StatusUpdateHandler*> just_handler = {handler};
-  for (auto h : handler ? just_handler : handlers_) {
-    h->HandleStatusUpdate(
-        last_checked_time, progress, update_status, new_version, new_size);
+  for (const auto& subscriber : handlers_) {
+    if (!handler || subscriber.handler == handler)
+      subscriber.subscription->Offer(status);
   }
 }
 
@@ -188,18 +204,24 @@ void DBusUpdateEngineClient::RunStatusUpdateHandlers(
     const string& current_operation,
     const string& new_version,
     int64_t new_size) {
-  UpdateStatus status;
-  StringToUpdateStatus(current_operation, &status);
-
-  for (auto handler : handlers_) {
-    handler->HandleStatusUpdate(
-        last_checked_time, progress, status, new_version, new_size);
-  }
+  // Convert the signal once and let each subscription filter it.
+  UpdateEngineStatus status = {};
+  status.last_checked_time = last_checked_time;
+  status.progress = progress;
+  StringToUpdateStatus(current_operation, &status.status);
+  status.new_version = new_version;
+  status.new_size_bytes = new_size;
+
+  for (const auto& subscriber : handlers_)
+    subscriber.subscription->Offer(status);
 }
 
 bool DBusUpdateEngineClient::UnregisterStatusUpdateHandler(
     StatusUpdateHandler* handler) {
-  auto it = std::find(handlers_.begin(), handlers_.end(), handler);
+  auto it = std::find_if(
+      handlers_.begin(), handlers_.end(), [handler](const Subscriber& s) {
+        return s.handler == handler;
+      });
   if (it != handlers_.end()) {
     handlers_.erase(it);
     return true;
@@ -210,12 +232,22 @@ bool DBusUpdateEngineClient::UnregisterStatusUpdateHandler(
 
 bool DBusUpdateEngineClient::RegisterStatusUpdateHandler(
     StatusUpdateHandler* handler) {
+  return RegisterStatusUpdateHandler(handler, kStatusFieldAll, 0);
+}
+
+bool DBusUpdateEngineClient::RegisterStatusUpdateHandler(
+    StatusUpdateHandler* handler, int32_t fields, int64_t min_interval_ms) {
   if (!base::MessageLoopForIO::current()) {
     LOG(FATAL) << "Cannot get UpdateEngineClient outside of message loop.";
     return false;
   }
 
-  handlers_.push_back(handler);
+  handlers_.push_back(
+      {handler,
+       std::make_unique<StatusSubscription>(
+           fields,
+           base::TimeDelta::FromMilliseconds(min_interval_ms),
+           base::Bind(&RunStatusUpdateHandler, base::Unretained(handler)))});
 
   if (dbus_handler_registered_) {
     StatusUpdateHandlersRegistered(handler);
@@ -259,5 +291,9 @@ bool DBusUpdateEngineClient::GetEolStatus(int32_t* eol_status) const {
   return proxy_->GetEolStatus(eol_status, nullptr);
 }
 
+bool DBusUpdateEngineClient::GetPerfStats(string* perf_stats) const {
+  return proxy_->GetPerfStats(perf_stats, nullptr);
+}
+
 }  // namespace internal
 }  // namespace update_engine
@@ -26,6 +26,7 @@
 
 #include "update_engine/client_library/include/update_engine/client.h"
 #include "update_engine/dbus-proxies.h"
+#include "update_engine/status_subscription.h"
 
 namespace update_engine {
 namespace internal {
@@ -77,12 +78,17 @@ class DBusUpdateEngineClient : public UpdateEngineClient {
   bool GetChannel(std::string* out_channel) const override;
 
   bool RegisterStatusUpdateHandler(StatusUpdateHandler* handler) override;
+  bool RegisterStatusUpdateHandler(StatusUpdateHandler* handler,
+                                   int32_t fields,
+                                   int64_t min_interval_ms) override;
   bool UnregisterStatusUpdateHandler(StatusUpdateHandler* handler) override;
 
   bool GetLastAttemptError(int32_t* last_attempt_error) const override;
 
   bool GetEolStatus(int32_t* eol_status) const override;
 
+  bool GetPerfStats(std::string* perf_stats) const override;
+
  private:
   void DBusStatusHandlersRegistered(const std::string& interface,
                                     const std::string& signal_name,
@@ -100,7 +106,12 @@ class DBusUpdateEngineClient : public UpdateEngineClient {
                                int64_t new_size);
 
   std::unique_ptr<org::chromium::UpdateEngineInterfaceProxy> proxy_;
-  std::vector<update_engine::StatusUpdateHandler*> handlers_;
+  // A registered handler and the subscription filtering its status updates.
+  struct Subscriber {
+    StatusUpdateHandler* handler;
+    std::unique_ptr<chromeos_update_engine::StatusSubscription> subscription;
+  };
+  std::vector<Subscriber> handlers_;
   bool dbus_handler_registered_{false};
 
   DISALLOW_COPY_AND_ASSIGN(DBusUpdateEngineClient);
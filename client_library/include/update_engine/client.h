@@ -126,6 +126,15 @@ class UpdateEngineClient {
   // race conditions.
   virtual bool RegisterStatusUpdateHandler(StatusUpdateHandler* handler) = 0;
 
+  // Same as above, but the handler is only called when one of the |fields| of
+  // the status changes, see StatusField. The changes of the progress alone
+  // are coalesced and reported at most once every |min_interval_ms|
+  // milliseconds with the latest value; any other change is reported right
+  // away.
+  virtual bool RegisterStatusUpdateHandler(StatusUpdateHandler* handler,
+                                           int32_t fields,
+                                           int64_t min_interval_ms) = 0;
+
   // Unregister a status update handler
   virtual bool UnregisterStatusUpdateHandler(StatusUpdateHandler* handler) = 0;
 
@@ -135,6 +144,10 @@ class UpdateEngineClient {
   // Get the current end-of-life status code. See EolStatus enum for details.
   virtual bool GetEolStatus(int32_t* eol_status) const = 0;
 
+  // Get a human readable dump of the performance counters of the updates
+  // applied since the daemon started.
+  virtual bool GetPerfStats(std::string* perf_stats) const = 0;
+
  protected:
   // Use CreateInstance().
   UpdateEngineClient() = default;
@@ -56,6 +56,24 @@ enum UpdateAttemptFlags : int32_t {
 // Enable bit-wise operators for the above enumeration of flag values.
 DECLARE_FLAGS_ENUM(UpdateAttemptFlags);
 
+// Enum of bit-wise flags for selecting the fields of UpdateEngineStatus a
+// status observer is interested in.
+enum StatusField : int32_t {
+  kStatusFieldNone = 0,
+  kStatusFieldLastCheckedTime = (1 << 0),
+  kStatusFieldProgress = (1 << 1),
+  kStatusFieldStatus = (1 << 2),
+  // Both the new product and system versions.
+  kStatusFieldNewVersion = (1 << 3),
+  kStatusFieldNewSize = (1 << 4),
+  // Both the current product and system versions.
+  kStatusFieldCurrentVersion = (1 << 5),
+  kStatusFieldAll = (1 << 6) - 1,
+};
+
+// Enable bit-wise operators for the above enumeration of flag values.
+DECLARE_FLAGS_ENUM(StatusField);
+
 struct UpdateEngineStatus {
   // When the update_engine last checked for updates (time_t: seconds from unix
   // epoch)
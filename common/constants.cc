@@ -27,6 +27,7 @@ const char kStatefulPartition[] = "/mnt/stateful_partition";
 const char kPostinstallDefaultScript[] = "postinst";
 
 // Constants defining keys for the persisted state of update engine.
+const char kPrefsApplyMemoryBudget[] = "apply-memory-budget";
 const char kPrefsAttemptInProgress[] = "attempt-in-progress";
 const char kPrefsBackoffExpiryTime[] = "backoff-expiry-time";
 const char kPrefsBootId[] = "boot-id";
@@ -43,6 +44,8 @@ const char kPrefsFullPayloadAttemptNumber[] = "full-payload-attempt-number";
 const char kPrefsInstallDateDays[] = "install-date-days";
 const char kPrefsLastActivePingDay[] = "last-active-ping-day";
 const char kPrefsLastRollCallPingDay[] = "last-roll-call-ping-day";
+const char kPrefsManifestMetadata[] = "manifest-metadata";
+const char kPrefsManifestMetadataHash[] = "manifest-metadata-hash";
 const char kPrefsManifestMetadataSize[] = "manifest-metadata-size";
 const char kPrefsManifestSignatureSize[] = "manifest-signature-size";
 const char kPrefsMetricsAttemptLastReportingTime[] =
@@ -95,6 +98,8 @@ const char kPrefsUpdateStateSignedSHA256Context[] =
 const char kPrefsUpdateBootTimestampStart[] = "update-boot-timestamp-start";
 const char kPrefsUpdateTimestampStart[] = "update-timestamp-start";
 const char kPrefsUrlSwitchCount[] = "url-switch-count";
+const char kPrefsVerifySourceBeforeDownload[] =
+    "verify-source-before-download";
 const char kPrefsVerityWritten[] = "verity-written";
 const char kPrefsWallClockScatteringWaitPeriod[] = "wall-clock-wait-period";
 const char kPrefsWallClockStagingWaitPeriod[] =
@@ -32,6 +32,7 @@ extern const char kPostinstallDefaultScript[];
 extern const char kStatefulPartition[];
 
 // Constants related to preferences.
+extern const char kPrefsApplyMemoryBudget[];
 extern const char kPrefsAttemptInProgress[];
 extern const char kPrefsBackoffExpiryTime[];
 extern const char kPrefsBootId[];
@@ -46,6 +47,8 @@ extern const char kPrefsFullPayloadAttemptNumber[];
 extern const char kPrefsInstallDateDays[];
 extern const char kPrefsLastActivePingDay[];
 extern const char kPrefsLastRollCallPingDay[];
+extern const char kPrefsManifestMetadata[];
+extern const char kPrefsManifestMetadataHash[];
 extern const char kPrefsManifestMetadataSize[];
 extern const char kPrefsManifestSignatureSize[];
 extern const char kPrefsMetricsAttemptLastReportingTime[];
@@ -92,6 +95,7 @@ extern const char kPrefsUpdateStateSignedSHA256Context[];
 extern const char kPrefsUpdateBootTimestampStart[];
 extern const char kPrefsUpdateTimestampStart[];
 extern const char kPrefsUrlSwitchCount[];
+extern const char kPrefsVerifySourceBeforeDownload[];
 extern const char kPrefsVerityWritten[];
 extern const char kPrefsWallClockScatteringWaitPeriod[];
 extern const char kPrefsWallClockStagingWaitPeriod[];
@@ -188,6 +192,10 @@ const int kDownloadMaxRetryCountOobeNotComplete = 3;
 const int kDownloadMaxRetryCountInteractive = 3;
 const int kDownloadP2PMaxRetryCount = 5;
 
+// The maximum number of payloads downloaded at the same time, when an update
+// has several of them, for example when installing DLC modules.
+const int kDownloadMaxConcurrentPayloads = 4;
+
 // The connect timeout, in seconds.
 //
 // This is set high because some devices may have very poor
@@ -34,6 +34,7 @@
 #include "update_engine/omaha_request_params.h"
 #include "update_engine/omaha_utils.h"
 #include "update_engine/p2p_manager.h"
+#include "update_engine/payload_consumer/perf_counters.h"
 #include "update_engine/payload_state_interface.h"
 #include "update_engine/update_attempter.h"
 
@@ -428,4 +429,10 @@ bool UpdateEngineService::GetEolStatus(ErrorPtr* error,
   return true;
 }
 
+bool UpdateEngineService::GetPerfStats(ErrorPtr* /* error */,
+                                       string* out_perf_stats) {
+  *out_perf_stats = PerfCounters::Get()->ToString();
+  return true;
+}
+
 }  // namespace chromeos_update_engine
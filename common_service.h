@@ -157,6 +157,10 @@ class UpdateEngineService {
   // on every update check and persisted on disk across reboots.
   bool GetEolStatus(brillo::ErrorPtr* error, int32_t* out_eol_status);
 
+  // Returns a human readable dump of the performance counters of the updates
+  // applied since the daemon started.
+  bool GetPerfStats(brillo::ErrorPtr* error, std::string* out_perf_stats);
+
  private:
   SystemState* system_state_;
 };
@@ -27,6 +27,7 @@
 #include "update_engine/common/fake_prefs.h"
 #include "update_engine/fake_system_state.h"
 #include "update_engine/omaha_utils.h"
+#include "update_engine/payload_consumer/perf_counters.h"
 
 using std::string;
 using std::vector;
@@ -184,4 +185,15 @@ TEST_F(UpdateEngineServiceTest, GetEolStatusTest) {
   EXPECT_EQ(EolStatus::kSecurityOnly, static_cast<EolStatus>(eol_status));
 }
 
+TEST_F(UpdateEngineServiceTest, GetPerfStatsTest) {
+  PerfCounters::Get()->Reset();
+  PerfCounters::Get()->AddCheckpoint(base::TimeDelta::FromMilliseconds(2));
+  string perf_stats;
+  EXPECT_TRUE(common_service_.GetPerfStats(&error_, &perf_stats));
+  EXPECT_EQ(nullptr, error_);
+  EXPECT_EQ(PerfCounters::Get()->ToString(), perf_stats);
+  EXPECT_NE(string::npos, perf_stats.find("checkpoints: 1 in 0.002s"));
+  PerfCounters::Get()->Reset();
+}
+
 }  // namespace chromeos_update_engine
@@ -196,6 +196,11 @@ bool DBusUpdateEngineService::GetEolStatus(ErrorPtr* error,
   return common_->GetEolStatus(error, out_eol_status);
 }
 
+bool DBusUpdateEngineService::GetPerfStats(ErrorPtr* error,
+                                           string* out_perf_stats) {
+  return common_->GetPerfStats(error, out_perf_stats);
+}
+
 UpdateEngineAdaptor::UpdateEngineAdaptor(SystemState* system_state)
     : org::chromium::UpdateEngineInterfaceAdaptor(&dbus_service_),
       bus_(DBusConnection::Get()->GetDBus()),
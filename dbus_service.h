@@ -153,6 +153,11 @@ class DBusUpdateEngineService
   // Returns the current end-of-life status of the device in |out_eol_status|.
   bool GetEolStatus(brillo::ErrorPtr* error, int32_t* out_eol_status) override;
 
+  // Returns the performance counters of the updates applied since the daemon
+  // started in |out_perf_stats|.
+  bool GetPerfStats(brillo::ErrorPtr* error,
+                    std::string* out_perf_stats) override;
+
  private:
   std::unique_ptr<UpdateEngineService> common_;
 };
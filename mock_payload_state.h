@@ -58,6 +58,7 @@ class MockPayloadState : public PayloadStateInterface {
   MOCK_METHOD0(GetPayloadAttemptNumber, int());
   MOCK_METHOD0(GetFullPayloadAttemptNumber, int());
   MOCK_METHOD0(GetCurrentUrl, std::string());
+  MOCK_METHOD1(GetPayloadUrl, std::string(size_t payload_index));
   MOCK_METHOD0(GetUrlFailureCount, uint32_t());
   MOCK_METHOD0(GetUrlSwitchCount, uint32_t());
   MOCK_METHOD0(GetNumResponsesSeen, int());
@@ -20,9 +20,7 @@ using google::protobuf::RepeatedPtrField;
 
 namespace chromeos_update_engine {
 
-namespace {
-const brillo::Blob::size_type kOutputBufferLength = 16 * 1024;
-}
+const size_t BzipExtentWriter::kDefaultOutputBufferSize = 16 * 1024;
 
 BzipExtentWriter::~BzipExtentWriter() {
   TEST_AND_RETURN(BZ2_bzDecompressEnd(&stream_) == BZ_OK);
@@ -43,7 +41,7 @@ bool BzipExtentWriter::Init(FileDescriptorPtr fd,
 }
 
 bool BzipExtentWriter::Write(const void* bytes, size_t count) {
-  brillo::Blob output_buffer(kOutputBufferLength);
+  brillo::Blob output_buffer(output_buffer_size_);
 
   // Copy the input data into |input_buffer_| only if |input_buffer_| already
   // contains unconsumed data. Otherwise, process the data directly from the
@@ -34,8 +34,14 @@ namespace chromeos_update_engine {
 
 class BzipExtentWriter : public ExtentWriter {
  public:
+  // The default size of the buffer holding the decompressed data.
+  static const size_t kDefaultOutputBufferSize;
+
   explicit BzipExtentWriter(std::unique_ptr<ExtentWriter> next)
-      : next_(std::move(next)) {
+      : BzipExtentWriter(std::move(next), kDefaultOutputBufferSize) {}
+  BzipExtentWriter(std::unique_ptr<ExtentWriter> next,
+                   size_t output_buffer_size)
+      : next_(std::move(next)), output_buffer_size_(output_buffer_size) {
     memset(&stream_, 0, sizeof(stream_));
   }
   ~BzipExtentWriter() override;
@@ -47,6 +53,7 @@ class BzipExtentWriter : public ExtentWriter {
 
  private:
   std::unique_ptr<ExtentWriter> next_;  // The underlying ExtentWriter.
+  size_t output_buffer_size_;           // Size of the decompression buffer.
   bz_stream stream_;                    // the libbz2 stream
   brillo::Blob input_buffer_;
 };
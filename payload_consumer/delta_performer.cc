@@ -18,21 +18,26 @@
 
 #include <errno.h>
 #include <linux/fs.h>
+#include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
 #include <cstring>
+#include <limits>
 #include <map>
 #include <memory>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include <base/bind.h>
 #include <base/files/file_util.h>
 #include <base/format_macros.h>
 #include <base/metrics/histogram_macros.h>
 #include <base/strings/string_number_conversions.h>
 #include <base/strings/string_util.h>
 #include <base/strings/stringprintf.h>
+#include <base/threading/simple_thread.h>
 #include <base/time/time.h>
 #include <brillo/data_encoding.h>
 #include <bsdiff/bspatch.h>
@@ -48,18 +53,23 @@
 #include "update_engine/payload_consumer/cached_file_descriptor.h"
 #include "update_engine/payload_consumer/download_action.h"
 #include "update_engine/payload_consumer/extent_reader.h"
+#include "update_engine/payload_consumer/extent_stream_adapters.h"
 #include "update_engine/payload_consumer/extent_writer.h"
 #if USE_FEC
 #include "update_engine/payload_consumer/fec_file_descriptor.h"
 #endif  // USE_FEC
 #include "update_engine/payload_consumer/file_descriptor_utils.h"
+#include "update_engine/payload_consumer/hashing_file_descriptor.h"
+#include "update_engine/payload_consumer/lz4patch.h"
 #include "update_engine/payload_consumer/mount_history.h"
 #if USE_MTD
 #include "update_engine/payload_consumer/mtd_file_descriptor.h"
 #endif  // USE_MTD
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_consumer/payload_verifier.h"
+#include "update_engine/payload_consumer/perf_counters.h"
 #include "update_engine/payload_consumer/xz_extent_writer.h"
+#include "update_engine/payload_consumer/zstd_extent_writer.h"
 
 using google::protobuf::RepeatedPtrField;
 using std::min;
@@ -76,12 +86,18 @@ const uint64_t DeltaPerformer::kCheckpointFrequencySeconds = 1;
 namespace {
 const int kUpdateStateOperationInvalid = -1;
 const int kMaxResumedUpdateFailures = 10;
+// The largest block the manifest arena allocates at once. The arena doubles the
+// size of its blocks up to this one.
+const size_t kMaxManifestArenaBlockSize = 1024 * 1024;  // 1 MiB
+// The source partition is read by at most this many threads before the
+// download, more would mostly compete for the same storage.
+const long kMaxSourceVerifyThreads = 4;  // NOLINT(runtime/int)
+// How often the message loop checks whether the source was verified.
+const int kSourceVerificationCheckIntervalMs = 100;
 #if USE_MTD
 const int kUbiVolumeAttachTimeout = 5 * 60;
 #endif
 
-const uint64_t kCacheSize = 1024 * 1024;  // 1MB
-
 FileDescriptorPtr CreateFileDescriptor(const char* path) {
   FileDescriptorPtr ret;
 #if USE_MTD
@@ -112,9 +128,10 @@ FileDescriptorPtr CreateFileDescriptor(const char* path) {
 
 // Opens path for read/write. On success returns an open FileDescriptor
 // and sets *err to 0. On failure, sets *err to errno and returns nullptr.
+// Writes are cached in a buffer of |write_cache_size| bytes unless it is 0.
 FileDescriptorPtr OpenFile(const char* path,
                            int mode,
-                           bool cache_writes,
+                           size_t write_cache_size,
                            int* err) {
   // Try to mark the block device read-only based on the mode. Ignore any
   // failure since this won't work when passing regular files.
@@ -122,8 +139,8 @@ FileDescriptorPtr OpenFile(const char* path,
   utils::SetBlockDeviceReadOnly(path, read_only);
 
   FileDescriptorPtr fd = CreateFileDescriptor(path);
-  if (cache_writes && !read_only) {
-    fd = FileDescriptorPtr(new CachedFileDescriptor(fd, kCacheSize));
+  if (write_cache_size > 0 && !read_only) {
+    fd = FileDescriptorPtr(new CachedFileDescriptor(fd, write_cache_size));
     LOG(INFO) << "Caching writes.";
   }
 #if USE_MTD
@@ -174,8 +191,246 @@ bool DiscardPartitionTail(const FileDescriptorPtr& fd, uint64_t data_size) {
   return false;
 }
 
+// Verifies in a worker thread the source hash of the operations of a
+// partition, see DeltaPerformer::StartSourceVerification(). All the workers of
+// a partition take the next operation from |next_op_num|, count it in
+// |verified_ops| once done and stop once one of them finds a mismatch or
+// |stop| is set otherwise.
+class SourceHashVerifier : public base::DelegateSimpleThread::Delegate {
+ public:
+  SourceHashVerifier(const OperationTable& operation_table,
+                     const string& source_path,
+                     uint64_t block_size,
+                     uint64_t buffer_size,
+                     uint64_t end_op_num,
+                     std::atomic<uint64_t>* next_op_num,
+                     std::atomic<uint64_t>* verified_ops,
+                     std::atomic<bool>* stop)
+      : operation_table_(operation_table),
+        source_path_(source_path),
+        block_size_(block_size),
+        buffer_size_(buffer_size),
+        end_op_num_(end_op_num),
+        next_op_num_(next_op_num),
+        verified_ops_(verified_ops),
+        stop_(stop) {}
+  SourceHashVerifier(SourceHashVerifier&&) = default;
+  ~SourceHashVerifier() override {
+    if (source_fd_)
+      source_fd_->Close();
+    if (source_ecc_fd_)
+      source_ecc_fd_->Close();
+  }
+
+  // Overrides DelegateSimpleThread::Delegate.
+  void Run() override {
+    int err;
+    source_fd_ = OpenFile(source_path_.c_str(), O_RDONLY, 0, &err);
+    if (!source_fd_) {
+      open_failed_ = true;
+      stop_->store(true);
+      return;
+    }
+    InstallOperation operation;
+    while (!stop_->load()) {
+      uint64_t op_num = next_op_num_->fetch_add(1);
+      if (op_num >= end_op_num_)
+        return;
+      if (operation_table_.operation(op_num).flags &
+          OperationTable::kHasSrcHash) {
+        operation_table_.GetInstallOperation(op_num, &operation);
+        if (!VerifyOperation(operation)) {
+          has_mismatch_ = true;
+          mismatched_op_num_ = op_num;
+          stop_->store(true);
+          return;
+        }
+      }
+      verified_ops_->fetch_add(1);
+    }
+  }
+
+  bool open_failed() const { return open_failed_; }
+  bool has_mismatch() const { return has_mismatch_; }
+  uint64_t mismatched_op_num() const { return mismatched_op_num_; }
+  // The hash of the source data of the mismatched operation on the raw
+  // device.
+  const brillo::Blob& mismatched_hash() const { return hash_; }
+  const FileDescriptorPtr& source_fd() const { return source_fd_; }
+  uint64_t ecc_recovered_ops() const { return ecc_recovered_ops_; }
+
+ private:
+  bool VerifyOperation(const InstallOperation& operation) {
+    brillo::Blob expected_hash(operation.src_sha256_hash().begin(),
+                               operation.src_sha256_hash().end());
+    hash_.clear();
+    if (fd_utils::ReadAndHashExtents(source_fd_,
+                                     operation.src_extents(),
+                                     block_size_,
+                                     &hash_,
+                                     buffer_size_) &&
+        hash_ == expected_hash) {
+      return true;
+    }
+#if USE_FEC
+    // Applying the operation falls back to the error corrected device, so
+    // only a mismatch there too makes the update fail.
+    if (!source_ecc_fd_ && !source_ecc_open_failure_) {
+      source_ecc_fd_.reset(new FecFileDescriptor());
+      if (!source_ecc_fd_->Open(source_path_.c_str(), O_RDONLY, 0)) {
+        source_ecc_fd_.reset();
+        source_ecc_open_failure_ = true;
+      }
+    }
+    brillo::Blob ecc_hash;
+    if (source_ecc_fd_ &&
+        fd_utils::ReadAndHashExtents(source_ecc_fd_,
+                                     operation.src_extents(),
+                                     block_size_,
+                                     &ecc_hash,
+                                     buffer_size_) &&
+        ecc_hash == expected_hash) {
+      ecc_recovered_ops_++;
+      return true;
+    }
+#endif  // USE_FEC
+    return false;
+  }
+
+  const OperationTable& operation_table_;
+  const string& source_path_;  // NOLINT(runtime/member_string_references)
+  uint64_t block_size_;
+  uint64_t buffer_size_;
+  uint64_t end_op_num_;
+  std::atomic<uint64_t>* next_op_num_;
+  std::atomic<uint64_t>* verified_ops_;
+  std::atomic<bool>* stop_;
+
+  FileDescriptorPtr source_fd_;
+  FileDescriptorPtr source_ecc_fd_;
+#if USE_FEC
+  bool source_ecc_open_failure_{false};
+#endif  // USE_FEC
+  bool open_failed_{false};
+  bool has_mismatch_{false};
+  uint64_t mismatched_op_num_{0};
+  brillo::Blob hash_;
+  uint64_t ecc_recovered_ops_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(SourceHashVerifier);
+};
+
 }  // namespace
 
+// Verifies the source data of the partitions one after the other on its own
+// thread, with a pool of SourceHashVerifier workers per partition, so the
+// message loop keeps running meanwhile. The workers of the partition that
+// failed are kept for their results and their open source file.
+class DeltaPerformer::SourceVerification
+    : public base::DelegateSimpleThread::Delegate {
+ public:
+  struct Partition {
+    string name;
+    string source_path;
+    uint64_t begin_op_num;
+    uint64_t end_op_num;
+  };
+
+  SourceVerification(const OperationTable& operation_table,
+                     vector<Partition> partitions,
+                     uint64_t block_size,
+                     uint64_t buffer_size)
+      : operation_table_(operation_table),
+        partitions_(std::move(partitions)),
+        block_size_(block_size),
+        buffer_size_(buffer_size),
+        thread_(this, "verify-source") {
+    for (const Partition& partition : partitions_)
+      total_ops_ += partition.end_op_num - partition.begin_op_num;
+  }
+  ~SourceVerification() override {
+    Cancel();
+    if (thread_.HasBeenStarted() && !thread_.HasBeenJoined())
+      thread_.Join();
+  }
+
+  void Start() { thread_.Start(); }
+
+  // Makes the workers stop after their current operation.
+  void Cancel() { stop_.store(true); }
+
+  bool done() const { return done_.load(); }
+  uint64_t verified_ops() const { return verified_ops_.load(); }
+  uint64_t total_ops() const { return total_ops_; }
+
+  // The results once done(): the partition and the worker that failed, if
+  // any, and the number of operations only matching with error correction.
+  const Partition* failed_partition() const { return failed_partition_; }
+  const SourceHashVerifier* failed_verifier() const { return failed_verifier_; }
+  uint64_t ecc_recovered_ops() const { return ecc_recovered_ops_; }
+
+  // Overrides DelegateSimpleThread::Delegate.
+  void Run() override {
+    size_t num_threads = std::min(
+        std::max(sysconf(_SC_NPROCESSORS_ONLN), 1L), kMaxSourceVerifyThreads);
+    for (const Partition& partition : partitions_) {
+      if (stop_.load())
+        break;
+      std::atomic<uint64_t> next_op_num(partition.begin_op_num);
+      verifiers_.clear();
+      verifiers_.reserve(num_threads);
+      for (size_t t = 0; t < num_threads; t++) {
+        verifiers_.emplace_back(operation_table_,
+                                partition.source_path,
+                                block_size_,
+                                buffer_size_,
+                                partition.end_op_num,
+                                &next_op_num,
+                                &verified_ops_,
+                                &stop_);
+      }
+      base::DelegateSimpleThreadPool thread_pool("verify-source", num_threads);
+      thread_pool.Start();
+      for (SourceHashVerifier& verifier : verifiers_)
+        thread_pool.AddWork(&verifier);
+      thread_pool.JoinAll();
+
+      for (const SourceHashVerifier& verifier : verifiers_) {
+        ecc_recovered_ops_ += verifier.ecc_recovered_ops();
+        if (!failed_verifier_ &&
+            (verifier.open_failed() || verifier.has_mismatch())) {
+          failed_partition_ = &partition;
+          failed_verifier_ = &verifier;
+        }
+      }
+      if (failed_verifier_)
+        break;
+    }
+    done_.store(true);
+  }
+
+ private:
+  const OperationTable& operation_table_;
+  const vector<Partition> partitions_;
+  uint64_t block_size_;
+  uint64_t buffer_size_;
+  uint64_t total_ops_{0};
+
+  std::atomic<bool> stop_{false};
+  std::atomic<bool> done_{false};
+  std::atomic<uint64_t> verified_ops_{0};
+
+  // Only accessed by the verification thread until done().
+  vector<SourceHashVerifier> verifiers_;
+  const Partition* failed_partition_{nullptr};
+  const SourceHashVerifier* failed_verifier_{nullptr};
+  uint64_t ecc_recovered_ops_{0};
+
+  base::DelegateSimpleThread thread_;
+
+  DISALLOW_COPY_AND_ASSIGN(SourceVerification);
+};
+
 // Computes the ratio of |part| and |total|, scaled to |norm|, using integer
 // arithmetic.
 static uint64_t IntRatio(uint64_t part, uint64_t total, uint64_t norm) {
@@ -273,7 +528,7 @@ size_t DeltaPerformer::CopyDataToBuffer(const char** bytes_p,
                                         size_t* count_p,
                                         size_t max) {
   const size_t count = *count_p;
-  if (!count)
+  if (!count || buffer_.size() >= max)
     return 0;  // Special case shortcut.
   size_t read_len = min(count, max - buffer_.size());
   const char* bytes_start = *bytes_p;
@@ -297,20 +552,35 @@ bool DeltaPerformer::HandleOpResult(bool op_result,
              << next_operation_num_ << ", which is the operation "
              << next_operation_num_ - partition_first_op_num
              << " in partition \""
-             << partitions_[current_partition_].partition_name() << "\"";
+             << manifest_->partitions(current_partition_).partition_name()
+             << "\"";
   if (*error == ErrorCode::kSuccess)
     *error = ErrorCode::kDownloadOperationExecutionError;
   return false;
 }
 
+DeltaPerformer::~DeltaPerformer() {
+  CancelSourceVerification();
+}
+
 int DeltaPerformer::Close() {
+  CancelSourceVerification();
   int err = -CloseCurrentPartition();
   LOG_IF(ERROR,
          !payload_hash_calculator_.Finalize() ||
              !signed_hash_calculator_.Finalize())
       << "Unable to finalize the hash.";
-  if (!buffer_.empty()) {
-    LOG(INFO) << "Discarding " << buffer_.size() << " unused downloaded bytes";
+  if (source_ecc_recovered_failures_ > 0) {
+    LOG(INFO) << source_ecc_recovered_failures_
+              << " operations recovered from source corruption using error "
+              << "correction, " << source_ecc_repaired_blocks_
+              << " blocks repaired individually in "
+              << utils::FormatTimeDelta(source_ecc_repair_duration_);
+  }
+  if (!buffer_.empty() || !source_verification_data_.empty()) {
+    LOG(INFO) << "Discarding "
+              << buffer_.size() + source_verification_data_.size()
+              << " unused downloaded bytes";
     if (err >= 0)
       err = 1;
   }
@@ -333,9 +603,16 @@ int DeltaPerformer::CloseCurrentPartition() {
       err = 1;
   }
   source_ecc_fd_.reset();
+  source_ecc_repairer_.reset();
   source_ecc_open_failure_ = false;
   source_path_.clear();
 
+  if (target_hashing_fd_) {
+    if (next_operation_num_ >= acc_num_operations_[current_partition_])
+      FinishTargetHash();
+    target_hashing_fd_.reset();
+    target_verity_writer_.reset();
+  }
   if (target_fd_ && !target_fd_->Close()) {
     err = errno;
     PLOG(ERROR) << "Error closing target partition";
@@ -348,12 +625,12 @@ int DeltaPerformer::CloseCurrentPartition() {
 }
 
 bool DeltaPerformer::OpenCurrentPartition() {
-  if (current_partition_ >= partitions_.size())
+  if (current_partition_ >= static_cast<size_t>(manifest_->partitions_size()))
     return false;
 
-  const PartitionUpdate& partition = partitions_[current_partition_];
+  const PartitionUpdate& partition = manifest_->partitions(current_partition_);
   size_t num_previous_partitions =
-      install_plan_->partitions.size() - partitions_.size();
+      install_plan_->partitions.size() - manifest_->partitions_size();
   const InstallPlan::Partition& install_part =
       install_plan_->partitions[num_previous_partitions + current_partition_];
   // Open source fds if we have a delta payload with minor version >= 2.
@@ -364,7 +641,7 @@ bool DeltaPerformer::OpenCurrentPartition() {
       install_part.source_size > 0) {
     source_path_ = install_part.source_path;
     int err;
-    source_fd_ = OpenFile(source_path_.c_str(), O_RDONLY, false, &err);
+    source_fd_ = OpenFile(source_path_.c_str(), O_RDONLY, 0, &err);
     if (!source_fd_) {
       LOG(ERROR) << "Unable to open source partition "
                  << partition.partition_name() << " on slot "
@@ -384,16 +661,61 @@ bool DeltaPerformer::OpenCurrentPartition() {
   LOG(INFO) << "Opening " << target_path_ << " partition with"
             << (interactive_ ? "out" : "") << " O_DSYNC";
 
-  target_fd_ = OpenFile(target_path_.c_str(), flags, true, &err);
+  // Hash the target partition while writing it when all its operations run in
+  // this attempt. MOVE and BSDIFF operations overwrite the data they read.
+  uint64_t partition_first_op_num =
+      current_partition_ ? acc_num_operations_[current_partition_ - 1] : 0;
+  bool hash_target = next_operation_num_ == partition_first_op_num &&
+                     GetMinorVersion() != kInPlaceMinorPayloadVersion;
+  // The verity writer reads the partition back to compute the FEC, so the
+  // data that reaches the end of the FEC data is only hashed once flushed.
+  uint64_t inline_hash_end = std::numeric_limits<uint64_t>::max();
+  if (hash_target && install_plan_->write_verity &&
+      (install_part.hash_tree_size != 0 || install_part.fec_size != 0)) {
+    target_verity_writer_ = verity_writer::CreateVerityWriter();
+    if (target_verity_writer_->Init(install_part)) {
+      if (install_part.fec_size != 0) {
+        inline_hash_end =
+            install_part.fec_data_offset + install_part.fec_data_size;
+      }
+    } else {
+      LOG(WARNING) << "Unable to write the verity data of "
+                   << partition.partition_name() << " while applying it.";
+      target_verity_writer_.reset();
+      hash_target = false;
+    }
+  }
+
+  size_t write_cache_size = memory_budget_.write_cache_size();
+  target_fd_ = OpenFile(target_path_.c_str(),
+                        flags,
+                        hash_target ? 0 : write_cache_size,
+                        &err);
   if (!target_fd_) {
     LOG(ERROR) << "Unable to open target partition "
                << partition.partition_name() << " on slot "
                << BootControlInterface::SlotName(install_plan_->target_slot)
                << ", file " << target_path_;
+    target_verity_writer_.reset();
     return false;
   }
+  if (hash_target) {
+    target_hashing_fd_ = std::make_shared<HashingFileDescriptor>(
+        target_fd_, target_verity_writer_.get(), inline_hash_end);
+    target_fd_ = target_hashing_fd_;
+    // Cache the writes before they are hashed, so the data read back by
+    // |target_hashing_fd_| is never stale.
+    if (write_cache_size > 0) {
+      target_fd_ = FileDescriptorPtr(
+          new CachedFileDescriptor(target_fd_, write_cache_size));
+    }
+  }
 
-  LOG(INFO) << "Applying " << partition.operations().size()
+  LOG(INFO) << "Applying "
+            << acc_num_operations_[current_partition_] -
+                   (current_partition_
+                        ? acc_num_operations_[current_partition_ - 1]
+                        : 0)
             << " operations to partition \"" << partition.partition_name()
             << "\"";
 
@@ -403,6 +725,25 @@ bool DeltaPerformer::OpenCurrentPartition() {
   return true;
 }
 
+void DeltaPerformer::FinishTargetHash() {
+  size_t num_previous_partitions =
+      install_plan_->partitions.size() - manifest_->partitions_size();
+  InstallPlan::Partition& install_part =
+      install_plan_->partitions[num_previous_partitions + current_partition_];
+  brillo::Blob hash;
+  if (!target_fd_->Flush() ||
+      !target_hashing_fd_->Finish(install_part.target_size, &hash)) {
+    LOG(WARNING) << "Unable to hash partition " << install_part.name
+                 << " while applying it.";
+    return;
+  }
+  install_part.applied_target_hash = hash;
+  LOG(INFO) << "Hashed partition " << install_part.name << " while applying "
+            << "it: " << target_hashing_fd_->bytes_hashed_inline()
+            << " bytes as they were written and "
+            << target_hashing_fd_->bytes_read_back() << " bytes read back.";
+}
+
 bool DeltaPerformer::OpenCurrentECCPartition() {
   if (source_ecc_fd_)
     return true;
@@ -410,7 +751,7 @@ bool DeltaPerformer::OpenCurrentECCPartition() {
   if (source_ecc_open_failure_)
     return false;
 
-  if (current_partition_ >= partitions_.size())
+  if (current_partition_ >= static_cast<size_t>(manifest_->partitions_size()))
     return false;
 
   // No support for ECC in minor version 1 or full payloads.
@@ -419,13 +760,14 @@ bool DeltaPerformer::OpenCurrentECCPartition() {
     return false;
 
 #if USE_FEC
-  const PartitionUpdate& partition = partitions_[current_partition_];
+  const PartitionUpdate& partition = manifest_->partitions(current_partition_);
   size_t num_previous_partitions =
-      install_plan_->partitions.size() - partitions_.size();
+      install_plan_->partitions.size() - manifest_->partitions_size();
   const InstallPlan::Partition& install_part =
       install_plan_->partitions[num_previous_partitions + current_partition_];
   string path = install_part.source_path;
-  FileDescriptorPtr fd(new FecFileDescriptor());
+  FecFileDescriptor* fec_fd = new FecFileDescriptor();
+  FileDescriptorPtr fd(fec_fd);
   if (!fd->Open(path.c_str(), O_RDONLY, 0)) {
     PLOG(ERROR) << "Unable to open ECC source partition "
                 << partition.partition_name() << " on slot "
@@ -435,6 +777,12 @@ bool DeltaPerformer::OpenCurrentECCPartition() {
     return false;
   }
   source_ecc_fd_ = fd;
+
+  VerityHashTreeInfo verity_info;
+  if (source_fd_ && fec_fd->GetVerityHashTreeInfo(&verity_info)) {
+    source_ecc_repairer_.reset(
+        new VerityBlockRepairer(source_fd_, source_ecc_fd_, verity_info));
+  }
 #else
   // No support for ECC compiled.
   source_ecc_open_failure_ = true;
@@ -451,7 +799,8 @@ void LogPartitionInfoHash(const PartitionInfo& info, const string& tag) {
             << " size: " << info.size();
 }
 
-void LogPartitionInfo(const vector<PartitionUpdate>& partitions) {
+void LogPartitionInfo(
+    const google::protobuf::RepeatedPtrField<PartitionUpdate>& partitions) {
   for (const PartitionUpdate& partition : partitions) {
     if (partition.has_old_partition_info()) {
       LogPartitionInfoHash(partition.old_partition_info(),
@@ -465,8 +814,8 @@ void LogPartitionInfo(const vector<PartitionUpdate>& partitions) {
 }  // namespace
 
 uint32_t DeltaPerformer::GetMinorVersion() const {
-  if (manifest_.has_minor_version()) {
-    return manifest_.minor_version();
+  if (manifest_->has_minor_version()) {
+    return manifest_->minor_version();
   }
   return payload_->type == InstallPayloadType::kDelta
              ? kMaxSupportedMinorPayloadVersion
@@ -526,36 +875,47 @@ MetadataParseResult DeltaPerformer::ParsePayloadMetadata(
                  << "Trusting metadata size in payload = " << metadata_size_;
   }
 
-  string public_key;
-  if (!GetPublicKey(&public_key)) {
-    LOG(ERROR) << "Failed to get public key.";
-    *error = ErrorCode::kDownloadMetadataSignatureVerificationError;
-    return MetadataParseResult::kError;
-  }
-
-  // We have the full metadata in |payload|. Verify its integrity
-  // and authenticity based on the information we have in Omaha response.
-  *error = payload_metadata_.ValidateMetadataSignature(
-      payload, payload_->metadata_signature, public_key);
-  if (*error != ErrorCode::kSuccess) {
-    if (install_plan_->hash_checks_mandatory) {
-      // The autoupdate_CatchBadSignatures test checks for this string
-      // in log-files. Keep in sync.
-      LOG(ERROR) << "Mandatory metadata signature validation failed";
+  if (metadata_loaded_) {
+    LOG(INFO) << "Metadata signature already verified before the update was "
+              << "interrupted.";
+  } else {
+    string public_key;
+    if (!GetPublicKey(&public_key)) {
+      LOG(ERROR) << "Failed to get public key.";
+      *error = ErrorCode::kDownloadMetadataSignatureVerificationError;
       return MetadataParseResult::kError;
     }
 
-    // For non-mandatory cases, just send a UMA stat.
-    LOG(WARNING) << "Ignoring metadata signature validation failures";
-    *error = ErrorCode::kSuccess;
+    // We have the full metadata in |payload|. Verify its integrity
+    // and authenticity based on the information we have in Omaha response.
+    *error = payload_metadata_.ValidateMetadataSignature(
+        payload, payload_->metadata_signature, public_key);
+    if (*error != ErrorCode::kSuccess) {
+      if (install_plan_->hash_checks_mandatory) {
+        // The autoupdate_CatchBadSignatures test checks for this string
+        // in log-files. Keep in sync.
+        LOG(ERROR) << "Mandatory metadata signature validation failed";
+        return MetadataParseResult::kError;
+      }
+
+      // For non-mandatory cases, just send a UMA stat.
+      LOG(WARNING) << "Ignoring metadata signature validation failures";
+      *error = ErrorCode::kSuccess;
+    }
   }
 
   // The payload metadata is deemed valid, it's safe to parse the protobuf.
-  if (!payload_metadata_.GetManifest(payload, &manifest_)) {
+  base::TimeTicks parse_start_time = base::TimeTicks::Now();
+  if (!payload_metadata_.GetManifest(payload, manifest_)) {
     LOG(ERROR) << "Unable to parse manifest in update file.";
     *error = ErrorCode::kDownloadManifestParseError;
     return MetadataParseResult::kError;
   }
+  LOG(INFO) << "Parsed the manifest of " << metadata_size_ << " bytes in "
+            << utils::FormatTimeDelta(base::TimeTicks::Now() -
+                                      parse_start_time)
+            << " into " << manifest_arena_->SpaceAllocated()
+            << " bytes of arena blocks.";
 
   manifest_parsed_ = true;
   return MetadataParseResult::kSuccess;
@@ -580,6 +940,26 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
   total_bytes_received_ += count;
   UpdateOverallProgress(false, "Completed ");
 
+  // The data received while the source is verified is kept until it's
+  // verified, see StartSourceVerification().
+  if (source_verification_) {
+    source_verification_data_.insert(
+        source_verification_data_.end(), c_bytes, c_bytes + count);
+    return true;
+  }
+  if (source_verification_error_ != ErrorCode::kSuccess) {
+    *error = source_verification_error_;
+    return false;
+  }
+  brillo::Blob verified_source_data;
+  if (!source_verification_data_.empty()) {
+    verified_source_data.swap(source_verification_data_);
+    verified_source_data.insert(
+        verified_source_data.end(), c_bytes, c_bytes + count);
+    c_bytes = reinterpret_cast<const char*>(verified_source_data.data());
+    count = verified_source_data.size();
+  }
+
   while (!manifest_valid_) {
     // Read data up to the needed limit; this is either maximium payload header
     // size, or the full metadata size (once it becomes known).
@@ -606,13 +986,18 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
       return false;
     manifest_valid_ = true;
 
+    // Keep the verified metadata so a resumed attempt doesn't download it
+    // again.
+    if (!metadata_loaded_ && !payload_->already_applied)
+      PersistMetadata();
+
     // Clear the download buffer.
     DiscardBuffer(false, metadata_size_);
 
-    block_size_ = manifest_.block_size();
+    block_size_ = manifest_->block_size();
 
-    // This populates |partitions_| and the |install_plan.partitions| with the
-    // list of partitions from the manifest.
+    // This populates |install_plan.partitions| with the list of partitions
+    // from the manifest.
     if (!ParseManifestPartitions(error))
       return false;
 
@@ -622,11 +1007,26 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
     if (payload_->already_applied)
       return false;
 
+    base::TimeTicks table_start_time = base::TimeTicks::Now();
+    if (!operation_table_.Build(manifest_->partitions())) {
+      LOG(ERROR) << "Unable to build the table of operations.";
+      *error = ErrorCode::kDownloadManifestParseError;
+      return false;
+    }
     num_total_operations_ = 0;
-    for (const auto& partition : partitions_) {
+    for (const PartitionUpdate& partition : manifest_->partitions()) {
       num_total_operations_ += partition.operations_size();
       acc_num_operations_.push_back(num_total_operations_);
     }
+    // The operations are only read from |operation_table_| from now on.
+    CompactManifest();
+    LOG(INFO) << "Built the table of " << num_total_operations_
+              << " operations in "
+              << utils::FormatTimeDelta(base::TimeTicks::Now() -
+                                        table_start_time)
+              << ", using " << operation_table_.MemoryUsage()
+              << " bytes. The rest of the manifest uses "
+              << manifest_arena_->SpaceAllocated() << " bytes.";
 
     LOG_IF(WARNING,
            !prefs_->SetInt64(kPrefsManifestMetadataSize, metadata_size_))
@@ -649,6 +1049,20 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
       }
     }
 
+    // A delta for another source would otherwise only fail at the first
+    // operation reading mismatching data, once all the data before it was
+    // downloaded.
+    bool verify_source = false;
+    if (next_operation_num_ == 0 &&
+        payload_->type == InstallPayloadType::kDelta &&
+        GetMinorVersion() != kInPlaceMinorPayloadVersion &&
+        prefs_->GetBoolean(kPrefsVerifySourceBeforeDownload, &verify_source) &&
+        verify_source) {
+      StartSourceVerification();
+      source_verification_data_.assign(c_bytes, c_bytes + count);
+      return true;
+    }
+
     if (next_operation_num_ > 0)
       UpdateOverallProgress(true, "Resuming after ");
     LOG(INFO) << "Starting to apply update payload operations";
@@ -674,19 +1088,26 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
         return false;
       }
     }
-    const size_t partition_operation_num =
-        next_operation_num_ -
-        (current_partition_ ? acc_num_operations_[current_partition_ - 1] : 0);
+    const OperationTable::Operation& table_op =
+        operation_table_.operation(next_operation_num_);
 
-    const InstallOperation& op =
-        partitions_[current_partition_].operations(partition_operation_num);
-
-    CopyDataToBuffer(&c_bytes, &count, op.data_length());
+    LOG_IF(WARNING,
+           buffer_.empty() &&
+               table_op.data_length > memory_budget_.operation_buffer_size())
+        << "Operation " << next_operation_num_ << " needs "
+        << table_op.data_length << " bytes of data, which exceeds the memory "
+        << "budget of " << memory_budget_.operation_buffer_size() << " bytes.";
+    CopyDataToBuffer(&c_bytes, &count, table_op.data_length);
 
     // Check whether we received all of the next operation's data payload.
-    if (!CanPerformInstallOperation(op))
+    if (!CanPerformInstallOperation(table_op))
       return true;
 
+    // Only decode the whole operation once it can be performed.
+    operation_table_.GetInstallOperation(next_operation_num_,
+                                         &current_operation_);
+    const InstallOperation& op = current_operation_;
+
     // Validate the operation only if the metadata signature is present.
     // Otherwise, keep the old behavior. This serves as a knob to disable
     // the validation logic in case we find some regression after rollout.
@@ -721,6 +1142,7 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
       case InstallOperation::REPLACE:
       case InstallOperation::REPLACE_BZ:
       case InstallOperation::REPLACE_XZ:
+      case InstallOperation::REPLACE_ZSTD:
         op_result = PerformReplaceOperation(op);
         OP_DURATION_HISTOGRAM("REPLACE", op_start_time);
         break;
@@ -750,15 +1172,33 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
         op_result = PerformPuffDiffOperation(op, error);
         OP_DURATION_HISTOGRAM("PUFFDIFF", op_start_time);
         break;
+      case InstallOperation::ZSTD_DIFF:
+        op_result = PerformZstdDiffOperation(op, error);
+        OP_DURATION_HISTOGRAM("ZSTD_DIFF", op_start_time);
+        break;
+      case InstallOperation::LZ4DIFF:
+        op_result = PerformLz4DiffOperation(op, error);
+        OP_DURATION_HISTOGRAM("LZ4DIFF", op_start_time);
+        break;
       default:
         op_result = false;
     }
+    base::TimeTicks op_end_time = base::TimeTicks::Now();
+    PerfCounters::Get()->AddOperation(
+        op.type(), table_op.data_length, op_end_time - op_start_time);
+    PerfCounters::Get()->AddStage(PerfCounters::Stage::kDecode,
+                                  table_op.data_length,
+                                  op_end_time - op_start_time);
     if (!HandleOpResult(op_result, InstallOperationTypeName(op.type()), error))
       return false;
 
     if (!target_fd_->Flush()) {
       return false;
     }
+    PerfCounters::Get()->AddStage(
+        PerfCounters::Stage::kWrite,
+        utils::BlocksInExtents(op.dst_extents()) * block_size_,
+        base::TimeTicks::Now() - op_end_time);
 
     next_operation_num_++;
     UpdateOverallProgress(false, "Completed ");
@@ -768,18 +1208,18 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
   // In major version 2, we don't add dummy operation to the payload.
   // If we already extracted the signature we should skip this step.
   if (major_payload_version_ == kBrilloMajorPayloadVersion &&
-      manifest_.has_signatures_offset() && manifest_.has_signatures_size() &&
+      manifest_->has_signatures_offset() && manifest_->has_signatures_size() &&
       signatures_message_data_.empty()) {
-    if (manifest_.signatures_offset() != buffer_offset_) {
+    if (manifest_->signatures_offset() != buffer_offset_) {
       LOG(ERROR) << "Payload signatures offset points to blob offset "
-                 << manifest_.signatures_offset()
+                 << manifest_->signatures_offset()
                  << " but signatures are expected at offset " << buffer_offset_;
       *error = ErrorCode::kDownloadPayloadVerificationError;
       return false;
     }
-    CopyDataToBuffer(&c_bytes, &count, manifest_.signatures_size());
+    CopyDataToBuffer(&c_bytes, &count, manifest_->signatures_size());
     // Needs more data to cover entire signature.
-    if (buffer_.size() < manifest_.signatures_size())
+    if (buffer_.size() < manifest_->signatures_size())
       return true;
     if (!ExtractSignatureMessage()) {
       LOG(ERROR) << "Extract payload signature failed.";
@@ -803,55 +1243,54 @@ bool DeltaPerformer::IsManifestValid() {
 }
 
 bool DeltaPerformer::ParseManifestPartitions(ErrorCode* error) {
-  if (major_payload_version_ == kBrilloMajorPayloadVersion) {
-    partitions_.clear();
-    for (const PartitionUpdate& partition : manifest_.partitions()) {
-      partitions_.push_back(partition);
-    }
-    manifest_.clear_partitions();
-  } else if (major_payload_version_ == kChromeOSMajorPayloadVersion) {
+  // Payloads of major version 2 already list their partitions.
+  if (major_payload_version_ == kChromeOSMajorPayloadVersion) {
     LOG(INFO) << "Converting update information from old format.";
-    PartitionUpdate root_part;
-    root_part.set_partition_name(kPartitionNameRoot);
+    // The new partitions are on the same arena as the manifest, so swapping
+    // its fields into them doesn't copy anything.
+    PartitionUpdate* root_part = manifest_->add_partitions();
+    root_part->set_partition_name(kPartitionNameRoot);
 #ifdef __ANDROID__
     LOG(WARNING) << "Legacy payload major version provided to an Android "
                     "build. Assuming no post-install. Please use major version "
                     "2 or newer.";
-    root_part.set_run_postinstall(false);
+    root_part->set_run_postinstall(false);
 #else
-    root_part.set_run_postinstall(true);
+    root_part->set_run_postinstall(true);
 #endif  // __ANDROID__
-    if (manifest_.has_old_rootfs_info()) {
-      *root_part.mutable_old_partition_info() = manifest_.old_rootfs_info();
-      manifest_.clear_old_rootfs_info();
+    if (manifest_->has_old_rootfs_info()) {
+      root_part->mutable_old_partition_info()->Swap(
+          manifest_->mutable_old_rootfs_info());
+      manifest_->clear_old_rootfs_info();
     }
-    if (manifest_.has_new_rootfs_info()) {
-      *root_part.mutable_new_partition_info() = manifest_.new_rootfs_info();
-      manifest_.clear_new_rootfs_info();
+    if (manifest_->has_new_rootfs_info()) {
+      root_part->mutable_new_partition_info()->Swap(
+          manifest_->mutable_new_rootfs_info());
+      manifest_->clear_new_rootfs_info();
     }
-    *root_part.mutable_operations() = manifest_.install_operations();
-    manifest_.clear_install_operations();
-    partitions_.push_back(std::move(root_part));
-
-    PartitionUpdate kern_part;
-    kern_part.set_partition_name(kPartitionNameKernel);
-    kern_part.set_run_postinstall(false);
-    if (manifest_.has_old_kernel_info()) {
-      *kern_part.mutable_old_partition_info() = manifest_.old_kernel_info();
-      manifest_.clear_old_kernel_info();
+    root_part->mutable_operations()->Swap(
+        manifest_->mutable_install_operations());
+
+    PartitionUpdate* kern_part = manifest_->add_partitions();
+    kern_part->set_partition_name(kPartitionNameKernel);
+    kern_part->set_run_postinstall(false);
+    if (manifest_->has_old_kernel_info()) {
+      kern_part->mutable_old_partition_info()->Swap(
+          manifest_->mutable_old_kernel_info());
+      manifest_->clear_old_kernel_info();
     }
-    if (manifest_.has_new_kernel_info()) {
-      *kern_part.mutable_new_partition_info() = manifest_.new_kernel_info();
-      manifest_.clear_new_kernel_info();
+    if (manifest_->has_new_kernel_info()) {
+      kern_part->mutable_new_partition_info()->Swap(
+          manifest_->mutable_new_kernel_info());
+      manifest_->clear_new_kernel_info();
     }
-    *kern_part.mutable_operations() = manifest_.kernel_install_operations();
-    manifest_.clear_kernel_install_operations();
-    partitions_.push_back(std::move(kern_part));
+    kern_part->mutable_operations()->Swap(
+        manifest_->mutable_kernel_install_operations());
   }
 
   // Fill in the InstallPlan::partitions based on the partitions from the
   // payload.
-  for (const auto& partition : partitions_) {
+  for (const auto& partition : manifest_->partitions()) {
     InstallPlan::Partition install_part;
     install_part.name = partition.partition_name();
     install_part.run_postinstall =
@@ -862,6 +1301,8 @@ bool DeltaPerformer::ParseManifestPartitions(ErrorCode* error) {
                                             : kPostinstallDefaultScript);
       install_part.filesystem_type = partition.filesystem_type();
       install_part.postinstall_optional = partition.postinstall_optional();
+      install_part.postinstall_independent =
+          partition.postinstall_independent();
     }
 
     if (partition.has_old_partition_info()) {
@@ -934,18 +1375,37 @@ bool DeltaPerformer::ParseManifestPartitions(ErrorCode* error) {
     *error = ErrorCode::kInstallDeviceOpenError;
     return false;
   }
-  LogPartitionInfo(partitions_);
+  LogPartitionInfo(manifest_->partitions());
   return true;
 }
 
+// static
+std::unique_ptr<google::protobuf::Arena> DeltaPerformer::NewManifestArena() {
+  google::protobuf::ArenaOptions options;
+  options.max_block_size = kMaxManifestArenaBlockSize;
+  return std::make_unique<google::protobuf::Arena>(options);
+}
+
+void DeltaPerformer::CompactManifest() {
+  for (PartitionUpdate& partition : *manifest_->mutable_partitions())
+    partition.clear_operations();
+  std::unique_ptr<google::protobuf::Arena> arena = NewManifestArena();
+  DeltaArchiveManifest* manifest =
+      google::protobuf::Arena::CreateMessage<DeltaArchiveManifest>(arena.get());
+  manifest->CopyFrom(*manifest_);
+  manifest_ = manifest;
+  // Destroying the previous arena frees all the parsed operations at once.
+  manifest_arena_ = std::move(arena);
+}
+
 bool DeltaPerformer::InitPartitionMetadata() {
   BootControlInterface::PartitionMetadata partition_metadata;
-  if (manifest_.has_dynamic_partition_metadata()) {
+  if (manifest_->has_dynamic_partition_metadata()) {
     std::map<string, uint64_t> partition_sizes;
     for (const auto& partition : install_plan_->partitions) {
       partition_sizes.emplace(partition.name, partition.target_size);
     }
-    for (const auto& group : manifest_.dynamic_partition_metadata().groups()) {
+    for (const auto& group : manifest_->dynamic_partition_metadata().groups()) {
       BootControlInterface::PartitionMetadata::Group e;
       e.name = group.name();
       e.size = group.size();
@@ -982,18 +1442,19 @@ bool DeltaPerformer::InitPartitionMetadata() {
 }
 
 bool DeltaPerformer::CanPerformInstallOperation(
-    const chromeos_update_engine::InstallOperation& operation) {
+    const OperationTable::Operation& operation) {
   // If we don't have a data blob we can apply it right away.
-  if (!operation.has_data_offset() && !operation.has_data_length())
+  if (!(operation.flags & (OperationTable::kHasDataOffset |
+                           OperationTable::kHasDataLength)))
     return true;
 
   // See if we have the entire data blob in the buffer
-  if (operation.data_offset() < buffer_offset_) {
+  if (operation.data_offset < buffer_offset_) {
     LOG(ERROR) << "we threw away data it seems?";
     return false;
   }
 
-  return (operation.data_offset() + operation.data_length() <=
+  return (operation.data_offset + operation.data_length <=
           buffer_offset_ + buffer_.size());
 }
 
@@ -1001,7 +1462,8 @@ bool DeltaPerformer::PerformReplaceOperation(
     const InstallOperation& operation) {
   CHECK(operation.type() == InstallOperation::REPLACE ||
         operation.type() == InstallOperation::REPLACE_BZ ||
-        operation.type() == InstallOperation::REPLACE_XZ);
+        operation.type() == InstallOperation::REPLACE_XZ ||
+        operation.type() == InstallOperation::REPLACE_ZSTD);
 
   // Since we delete data off the beginning of the buffer as we use it,
   // the data we need should be exactly at the beginning of the buffer.
@@ -1020,9 +1482,14 @@ bool DeltaPerformer::PerformReplaceOperation(
   std::unique_ptr<ExtentWriter> writer = std::make_unique<DirectExtentWriter>();
 
   if (operation.type() == InstallOperation::REPLACE_BZ) {
-    writer.reset(new BzipExtentWriter(std::move(writer)));
+    writer.reset(new BzipExtentWriter(std::move(writer),
+                                      memory_budget_.decoder_buffer_size()));
   } else if (operation.type() == InstallOperation::REPLACE_XZ) {
-    writer.reset(new XzExtentWriter(std::move(writer)));
+    writer.reset(new XzExtentWriter(std::move(writer),
+                                    memory_budget_.decoder_buffer_size()));
+  } else if (operation.type() == InstallOperation::REPLACE_ZSTD) {
+    writer.reset(new ZstdExtentWriter(std::move(writer),
+                                      memory_budget_.decoder_buffer_size()));
   }
 
   TEST_AND_RETURN_FALSE(
@@ -1181,12 +1648,14 @@ bool DeltaPerformer::PerformSourceCopyOperation(
     // device doesn't match or there was an error reading the source partition.
     // Note that this code will also fall back if writing the target partition
     // fails.
-    bool read_ok = fd_utils::CopyAndHashExtents(source_fd_,
-                                                operation.src_extents(),
-                                                target_fd_,
-                                                operation.dst_extents(),
-                                                block_size_,
-                                                &source_hash);
+    bool read_ok =
+        fd_utils::CopyAndHashExtents(source_fd_,
+                                     operation.src_extents(),
+                                     target_fd_,
+                                     operation.dst_extents(),
+                                     block_size_,
+                                     &source_hash,
+                                     memory_budget_.copy_buffer_size());
     if (read_ok && expected_source_hash == source_hash)
       return true;
 
@@ -1203,18 +1672,38 @@ bool DeltaPerformer::PerformSourceCopyOperation(
                  << base::HexEncode(expected_source_hash.data(),
                                     expected_source_hash.size());
 
-    TEST_AND_RETURN_FALSE(fd_utils::CopyAndHashExtents(source_ecc_fd_,
-                                                       operation.src_extents(),
-                                                       target_fd_,
-                                                       operation.dst_extents(),
-                                                       block_size_,
-                                                       &source_hash));
+    uint64_t repaired_blocks = 0;
+    FileDescriptorPtr repaired_fd =
+        RepairSourceBlocks(operation, &repaired_blocks);
+    if (repaired_fd &&
+        fd_utils::CopyAndHashExtents(repaired_fd,
+                                     operation.src_extents(),
+                                     target_fd_,
+                                     operation.dst_extents(),
+                                     block_size_,
+                                     &source_hash,
+                                     memory_budget_.copy_buffer_size()) &&
+        source_hash == expected_source_hash) {
+      source_ecc_recovered_failures_++;
+      PerfCounters::Get()->AddEccRecovery(repaired_blocks);
+      return true;
+    }
+
+    TEST_AND_RETURN_FALSE(
+        fd_utils::CopyAndHashExtents(source_ecc_fd_,
+                                     operation.src_extents(),
+                                     target_fd_,
+                                     operation.dst_extents(),
+                                     block_size_,
+                                     &source_hash,
+                                     memory_budget_.copy_buffer_size()));
     TEST_AND_RETURN_FALSE(
         ValidateSourceHash(source_hash, operation, source_ecc_fd_, error));
     // At this point reading from the the error corrected device worked, but
     // reading from the raw device failed, so this is considered a recovered
     // failure.
     source_ecc_recovered_failures_++;
+    PerfCounters::Get()->AddEccRecovery(0);
   } else {
     // When the operation doesn't include a source hash, we attempt the error
     // corrected device first since we can't verify the block in the raw device
@@ -1226,15 +1715,18 @@ bool DeltaPerformer::PerformSourceCopyOperation(
                                      target_fd_,
                                      operation.dst_extents(),
                                      block_size_,
-                                     nullptr)) {
+                                     nullptr,
+                                     memory_budget_.copy_buffer_size())) {
       return true;
     }
-    TEST_AND_RETURN_FALSE(fd_utils::CopyAndHashExtents(source_fd_,
-                                                       operation.src_extents(),
-                                                       target_fd_,
-                                                       operation.dst_extents(),
-                                                       block_size_,
-                                                       nullptr));
+    TEST_AND_RETURN_FALSE(
+        fd_utils::CopyAndHashExtents(source_fd_,
+                                     operation.src_extents(),
+                                     target_fd_,
+                                     operation.dst_extents(),
+                                     block_size_,
+                                     nullptr,
+                                     memory_budget_.copy_buffer_size()));
   }
   return true;
 }
@@ -1252,8 +1744,11 @@ FileDescriptorPtr DeltaPerformer::ChooseSourceFD(
     // at this point, but we first need to make sure all extents are readable
     // since the error corrected device can be shorter or not available.
     if (OpenCurrentECCPartition() &&
-        fd_utils::ReadAndHashExtents(
-            source_ecc_fd_, operation.src_extents(), block_size_, nullptr)) {
+        fd_utils::ReadAndHashExtents(source_ecc_fd_,
+                                     operation.src_extents(),
+                                     block_size_,
+                                     nullptr,
+                                     memory_budget_.copy_buffer_size())) {
       return source_ecc_fd_;
     }
     return source_fd_;
@@ -1262,8 +1757,11 @@ FileDescriptorPtr DeltaPerformer::ChooseSourceFD(
   brillo::Blob source_hash;
   brillo::Blob expected_source_hash(operation.src_sha256_hash().begin(),
                                     operation.src_sha256_hash().end());
-  if (fd_utils::ReadAndHashExtents(
-          source_fd_, operation.src_extents(), block_size_, &source_hash) &&
+  if (fd_utils::ReadAndHashExtents(source_fd_,
+                                   operation.src_extents(),
+                                   block_size_,
+                                   &source_hash,
+                                   memory_budget_.copy_buffer_size()) &&
       source_hash == expected_source_hash) {
     return source_fd_;
   }
@@ -1282,18 +1780,59 @@ FileDescriptorPtr DeltaPerformer::ChooseSourceFD(
                << base::HexEncode(expected_source_hash.data(),
                                   expected_source_hash.size());
 
-  if (fd_utils::ReadAndHashExtents(
-          source_ecc_fd_, operation.src_extents(), block_size_, &source_hash) &&
+  uint64_t repaired_blocks = 0;
+  FileDescriptorPtr repaired_fd =
+      RepairSourceBlocks(operation, &repaired_blocks);
+  if (repaired_fd &&
+      fd_utils::ReadAndHashExtents(repaired_fd,
+                                   operation.src_extents(),
+                                   block_size_,
+                                   &source_hash,
+                                   memory_budget_.copy_buffer_size()) &&
+      source_hash == expected_source_hash) {
+    source_ecc_recovered_failures_++;
+    PerfCounters::Get()->AddEccRecovery(repaired_blocks);
+    return repaired_fd;
+  }
+
+  if (fd_utils::ReadAndHashExtents(source_ecc_fd_,
+                                   operation.src_extents(),
+                                   block_size_,
+                                   &source_hash,
+                                   memory_budget_.copy_buffer_size()) &&
       ValidateSourceHash(source_hash, operation, source_ecc_fd_, error)) {
     // At this point reading from the the error corrected device worked, but
     // reading from the raw device failed, so this is considered a recovered
     // failure.
     source_ecc_recovered_failures_++;
+    PerfCounters::Get()->AddEccRecovery(0);
     return source_ecc_fd_;
   }
   return nullptr;
 }
 
+FileDescriptorPtr DeltaPerformer::RepairSourceBlocks(
+    const InstallOperation& operation, uint64_t* repaired_blocks) {
+  *repaired_blocks = 0;
+  if (!source_ecc_repairer_)
+    return nullptr;
+  base::TimeTicks start_time = base::TimeTicks::Now();
+  FileDescriptorPtr repaired_fd = source_ecc_repairer_->Repair(
+      operation.src_extents(), block_size_, repaired_blocks);
+  base::TimeDelta duration = base::TimeTicks::Now() - start_time;
+  if (!repaired_fd) {
+    LOG(WARNING) << "Unable to repair the source blocks individually, "
+                 << "falling back to reading them all with error correction.";
+    return nullptr;
+  }
+  LOG(INFO) << "Repaired " << *repaired_blocks << " out of "
+            << utils::BlocksInExtents(operation.src_extents())
+            << " source blocks in " << utils::FormatTimeDelta(duration);
+  source_ecc_repaired_blocks_ += *repaired_blocks;
+  source_ecc_repair_duration_ += duration;
+  return repaired_fd;
+}
+
 bool DeltaPerformer::ExtentsToBsdiffPositionsString(
     const RepeatedPtrField<Extent>& extents,
     uint64_t block_size,
@@ -1357,69 +1896,6 @@ bool DeltaPerformer::PerformBsdiffOperation(const InstallOperation& operation) {
   return true;
 }
 
-namespace {
-
-class BsdiffExtentFile : public bsdiff::FileInterface {
- public:
-  BsdiffExtentFile(std::unique_ptr<ExtentReader> reader, size_t size)
-      : BsdiffExtentFile(std::move(reader), nullptr, size) {}
-  BsdiffExtentFile(std::unique_ptr<ExtentWriter> writer, size_t size)
-      : BsdiffExtentFile(nullptr, std::move(writer), size) {}
-
-  ~BsdiffExtentFile() override = default;
-
-  bool Read(void* buf, size_t count, size_t* bytes_read) override {
-    TEST_AND_RETURN_FALSE(reader_->Read(buf, count));
-    *bytes_read = count;
-    offset_ += count;
-    return true;
-  }
-
-  bool Write(const void* buf, size_t count, size_t* bytes_written) override {
-    TEST_AND_RETURN_FALSE(writer_->Write(buf, count));
-    *bytes_written = count;
-    offset_ += count;
-    return true;
-  }
-
-  bool Seek(off_t pos) override {
-    if (reader_ != nullptr) {
-      TEST_AND_RETURN_FALSE(reader_->Seek(pos));
-      offset_ = pos;
-    } else {
-      // For writes technically there should be no change of position, or it
-      // should be equivalent of current offset.
-      TEST_AND_RETURN_FALSE(offset_ == static_cast<uint64_t>(pos));
-    }
-    return true;
-  }
-
-  bool Close() override { return true; }
-
-  bool GetSize(uint64_t* size) override {
-    *size = size_;
-    return true;
-  }
-
- private:
-  BsdiffExtentFile(std::unique_ptr<ExtentReader> reader,
-                   std::unique_ptr<ExtentWriter> writer,
-                   size_t size)
-      : reader_(std::move(reader)),
-        writer_(std::move(writer)),
-        size_(size),
-        offset_(0) {}
-
-  std::unique_ptr<ExtentReader> reader_;
-  std::unique_ptr<ExtentWriter> writer_;
-  uint64_t size_;
-  uint64_t offset_;
-
-  DISALLOW_COPY_AND_ASSIGN(BsdiffExtentFile);
-};
-
-}  // namespace
-
 bool DeltaPerformer::PerformSourceBsdiffOperation(
     const InstallOperation& operation, ErrorCode* error) {
   // Since we delete data off the beginning of the buffer as we use it,
@@ -1434,7 +1910,8 @@ bool DeltaPerformer::PerformSourceBsdiffOperation(
   FileDescriptorPtr source_fd = ChooseSourceFD(operation, error);
   TEST_AND_RETURN_FALSE(source_fd != nullptr);
 
-  auto reader = std::make_unique<DirectExtentReader>();
+  auto reader = std::make_unique<CachedExtentReader>(
+      memory_budget_.source_read_cache_size());
   TEST_AND_RETURN_FALSE(
       reader->Init(source_fd, operation.src_extents(), block_size_));
   auto src_file = std::make_unique<BsdiffExtentFile>(
@@ -1456,83 +1933,86 @@ bool DeltaPerformer::PerformSourceBsdiffOperation(
   return true;
 }
 
-namespace {
-
-// A class to be passed to |puffpatch| for reading from |source_fd_| and writing
-// into |target_fd_|.
-class PuffinExtentStream : public puffin::StreamInterface {
- public:
-  // Constructor for creating a stream for reading from an |ExtentReader|.
-  PuffinExtentStream(std::unique_ptr<ExtentReader> reader, uint64_t size)
-      : PuffinExtentStream(std::move(reader), nullptr, size) {}
-
-  // Constructor for creating a stream for writing to an |ExtentWriter|.
-  PuffinExtentStream(std::unique_ptr<ExtentWriter> writer, uint64_t size)
-      : PuffinExtentStream(nullptr, std::move(writer), size) {}
+bool DeltaPerformer::PerformPuffDiffOperation(const InstallOperation& operation,
+                                              ErrorCode* error) {
+  // Since we delete data off the beginning of the buffer as we use it,
+  // the data we need should be exactly at the beginning of the buffer.
+  TEST_AND_RETURN_FALSE(buffer_offset_ == operation.data_offset());
+  TEST_AND_RETURN_FALSE(buffer_.size() >= operation.data_length());
 
-  ~PuffinExtentStream() override = default;
+  FileDescriptorPtr source_fd = ChooseSourceFD(operation, error);
+  TEST_AND_RETURN_FALSE(source_fd != nullptr);
 
-  bool GetSize(uint64_t* size) const override {
-    *size = size_;
-    return true;
-  }
+  auto reader = std::make_unique<CachedExtentReader>(
+      memory_budget_.source_read_cache_size());
+  TEST_AND_RETURN_FALSE(
+      reader->Init(source_fd, operation.src_extents(), block_size_));
+  puffin::UniqueStreamPtr src_stream(new PuffinExtentStream(
+      std::move(reader),
+      utils::BlocksInExtents(operation.src_extents()) * block_size_));
 
-  bool GetOffset(uint64_t* offset) const override {
-    *offset = offset_;
-    return true;
-  }
+  auto writer = std::make_unique<DirectExtentWriter>();
+  TEST_AND_RETURN_FALSE(
+      writer->Init(target_fd_, operation.dst_extents(), block_size_));
+  puffin::UniqueStreamPtr dst_stream(new PuffinExtentStream(
+      std::move(writer),
+      utils::BlocksInExtents(operation.dst_extents()) * block_size_));
 
-  bool Seek(uint64_t offset) override {
-    if (is_read_) {
-      TEST_AND_RETURN_FALSE(reader_->Seek(offset));
-      offset_ = offset;
-    } else {
-      // For writes technically there should be no change of position, or it
-      // should equivalent of current offset.
-      TEST_AND_RETURN_FALSE(offset_ == offset);
-    }
-    return true;
-  }
+  TEST_AND_RETURN_FALSE(
+      puffin::PuffPatch(std::move(src_stream),
+                        std::move(dst_stream),
+                        buffer_.data(),
+                        buffer_.size(),
+                        memory_budget_.puffpatch_cache_size()));
+  DiscardBuffer(true, buffer_.size());
+  return true;
+}
 
-  bool Read(void* buffer, size_t count) override {
-    TEST_AND_RETURN_FALSE(is_read_);
-    TEST_AND_RETURN_FALSE(reader_->Read(buffer, count));
-    offset_ += count;
-    return true;
-  }
+bool DeltaPerformer::PerformZstdDiffOperation(const InstallOperation& operation,
+                                              ErrorCode* error) {
+  // Since we delete data off the beginning of the buffer as we use it,
+  // the data we need should be exactly at the beginning of the buffer.
+  TEST_AND_RETURN_FALSE(buffer_offset_ == operation.data_offset());
+  TEST_AND_RETURN_FALSE(buffer_.size() >= operation.data_length());
 
-  bool Write(const void* buffer, size_t count) override {
-    TEST_AND_RETURN_FALSE(!is_read_);
-    TEST_AND_RETURN_FALSE(writer_->Write(buffer, count));
-    offset_ += count;
-    return true;
+  // The decompressor references the whole source data as its prefix, and
+  // keeps at most the target data as its window. Both are held in memory, so
+  // their size is bounded by the window the decompressor accepts.
+  uint64_t src_size = utils::BlocksInExtents(operation.src_extents()) *
+                      block_size_;
+  uint64_t dst_size = utils::BlocksInExtents(operation.dst_extents()) *
+                      block_size_;
+  if (src_size + dst_size > (1ULL << ZstdExtentWriter::kMaxPrefixWindowLog)) {
+    LOG(ERROR) << "ZSTD_DIFF operation with " << src_size
+               << " bytes of source and " << dst_size
+               << " bytes of target data exceeds the maximum of "
+               << (1ULL << ZstdExtentWriter::kMaxPrefixWindowLog) << " bytes.";
+    *error = ErrorCode::kDownloadOperationExecutionError;
+    return false;
   }
 
-  bool Close() override { return true; }
+  FileDescriptorPtr source_fd = ChooseSourceFD(operation, error);
+  TEST_AND_RETURN_FALSE(source_fd != nullptr);
 
- private:
-  PuffinExtentStream(std::unique_ptr<ExtentReader> reader,
-                     std::unique_ptr<ExtentWriter> writer,
-                     uint64_t size)
-      : reader_(std::move(reader)),
-        writer_(std::move(writer)),
-        size_(size),
-        offset_(0),
-        is_read_(reader_ ? true : false) {}
-
-  std::unique_ptr<ExtentReader> reader_;
-  std::unique_ptr<ExtentWriter> writer_;
-  uint64_t size_;
-  uint64_t offset_;
-  bool is_read_;
-
-  DISALLOW_COPY_AND_ASSIGN(PuffinExtentStream);
-};
+  brillo::Blob prefix(src_size);
+  DirectExtentReader reader;
+  TEST_AND_RETURN_FALSE(
+      reader.Init(source_fd, operation.src_extents(), block_size_));
+  TEST_AND_RETURN_FALSE(reader.Read(prefix.data(), prefix.size()));
 
-}  // namespace
+  std::unique_ptr<ExtentWriter> writer = std::make_unique<ZstdExtentWriter>(
+      std::make_unique<DirectExtentWriter>(),
+      memory_budget_.decoder_buffer_size(),
+      std::move(prefix));
+  TEST_AND_RETURN_FALSE(
+      writer->Init(target_fd_, operation.dst_extents(), block_size_));
+  TEST_AND_RETURN_FALSE(writer->Write(buffer_.data(), operation.data_length()));
+  DiscardBuffer(true, buffer_.size());
+  return true;
+}
 
-bool DeltaPerformer::PerformPuffDiffOperation(const InstallOperation& operation,
-                                              ErrorCode* error) {
+bool DeltaPerformer::PerformLz4DiffOperation(const InstallOperation& operation,
+                                             ErrorCode* error) {
   // Since we delete data off the beginning of the buffer as we use it,
   // the data we need should be exactly at the beginning of the buffer.
   TEST_AND_RETURN_FALSE(buffer_offset_ == operation.data_offset());
@@ -1541,26 +2021,37 @@ bool DeltaPerformer::PerformPuffDiffOperation(const InstallOperation& operation,
   FileDescriptorPtr source_fd = ChooseSourceFD(operation, error);
   TEST_AND_RETURN_FALSE(source_fd != nullptr);
 
-  auto reader = std::make_unique<DirectExtentReader>();
+  Lz4diffHeader header;
+  TEST_AND_RETURN_FALSE(ParseLz4diffHeader(
+      buffer_.data(), operation.data_length(), &header));
+
+  // The source stream is decompressed and the target stream compressed one
+  // block at a time, keeping as many decompressed source blocks as the
+  // puffpatch cache would hold.
+  auto reader = std::make_unique<Lz4DecompressingExtentReader>(
+      std::make_unique<CachedExtentReader>(
+          memory_budget_.source_read_cache_size()),
+      header,
+      memory_budget_.puffpatch_cache_size() / kLz4LegacyBlockSize);
   TEST_AND_RETURN_FALSE(
       reader->Init(source_fd, operation.src_extents(), block_size_));
-  puffin::UniqueStreamPtr src_stream(new PuffinExtentStream(
-      std::move(reader),
-      utils::BlocksInExtents(operation.src_extents()) * block_size_));
+  uint64_t src_size = reader->size();
+  auto src_file =
+      std::make_unique<BsdiffExtentFile>(std::move(reader), src_size);
 
-  auto writer = std::make_unique<DirectExtentWriter>();
+  auto writer = std::make_unique<Lz4CompressingExtentWriter>(
+      std::make_unique<DirectExtentWriter>(), header);
   TEST_AND_RETURN_FALSE(
       writer->Init(target_fd_, operation.dst_extents(), block_size_));
-  puffin::UniqueStreamPtr dst_stream(new PuffinExtentStream(
-      std::move(writer),
-      utils::BlocksInExtents(operation.dst_extents()) * block_size_));
+  uint64_t dst_size = writer->size();
+  auto dst_file =
+      std::make_unique<BsdiffExtentFile>(std::move(writer), dst_size);
 
-  const size_t kMaxCacheSize = 5 * 1024 * 1024;  // Total 5MB cache.
-  TEST_AND_RETURN_FALSE(puffin::PuffPatch(std::move(src_stream),
-                                          std::move(dst_stream),
-                                          buffer_.data(),
-                                          buffer_.size(),
-                                          kMaxCacheSize));
+  TEST_AND_RETURN_FALSE(
+      bsdiff::bspatch(std::move(src_file),
+                      std::move(dst_file),
+                      buffer_.data() + kLz4diffHeaderSize,
+                      operation.data_length() - kLz4diffHeaderSize) == 0);
   DiscardBuffer(true, buffer_.size());
   return true;
 }
@@ -1568,22 +2059,23 @@ bool DeltaPerformer::PerformPuffDiffOperation(const InstallOperation& operation,
 bool DeltaPerformer::ExtractSignatureMessageFromOperation(
     const InstallOperation& operation) {
   if (operation.type() != InstallOperation::REPLACE ||
-      !manifest_.has_signatures_offset() ||
-      manifest_.signatures_offset() != operation.data_offset()) {
+      !manifest_->has_signatures_offset() ||
+      manifest_->signatures_offset() != operation.data_offset()) {
     return false;
   }
-  TEST_AND_RETURN_FALSE(manifest_.has_signatures_size() &&
-                        manifest_.signatures_size() == operation.data_length());
+  TEST_AND_RETURN_FALSE(
+      manifest_->has_signatures_size() &&
+      manifest_->signatures_size() == operation.data_length());
   TEST_AND_RETURN_FALSE(ExtractSignatureMessage());
   return true;
 }
 
 bool DeltaPerformer::ExtractSignatureMessage() {
   TEST_AND_RETURN_FALSE(signatures_message_data_.empty());
-  TEST_AND_RETURN_FALSE(buffer_offset_ == manifest_.signatures_offset());
-  TEST_AND_RETURN_FALSE(buffer_.size() >= manifest_.signatures_size());
+  TEST_AND_RETURN_FALSE(buffer_offset_ == manifest_->signatures_offset());
+  TEST_AND_RETURN_FALSE(buffer_.size() >= manifest_->signatures_size());
   signatures_message_data_.assign(
-      buffer_.begin(), buffer_.begin() + manifest_.signatures_size());
+      buffer_.begin(), buffer_.begin() + manifest_->signatures_size());
 
   // Save the signature blob because if the update is interrupted after the
   // download phase we don't go through this path anymore. Some alternatives to
@@ -1600,8 +2092,8 @@ bool DeltaPerformer::ExtractSignatureMessage() {
       << "Unable to store the signature blob.";
 
   LOG(INFO) << "Extracted signature data of size "
-            << manifest_.signatures_size() << " at "
-            << manifest_.signatures_offset();
+            << manifest_->signatures_size() << " at "
+            << manifest_->signatures_offset();
   return true;
 }
 
@@ -1629,8 +2121,8 @@ ErrorCode DeltaPerformer::ValidateManifest() {
   // matches data from other sources, and that it is a supported version.
 
   bool has_old_fields =
-      (manifest_.has_old_kernel_info() || manifest_.has_old_rootfs_info());
-  for (const PartitionUpdate& partition : manifest_.partitions()) {
+      (manifest_->has_old_kernel_info() || manifest_->has_old_rootfs_info());
+  for (const PartitionUpdate& partition : manifest_->partitions()) {
     has_old_fields = has_old_fields || partition.has_old_partition_info();
   }
 
@@ -1655,18 +2147,18 @@ ErrorCode DeltaPerformer::ValidateManifest() {
 
   // Check that the minor version is compatible.
   if (actual_payload_type == InstallPayloadType::kFull) {
-    if (manifest_.minor_version() != kFullPayloadMinorVersion) {
+    if (manifest_->minor_version() != kFullPayloadMinorVersion) {
       LOG(ERROR) << "Manifest contains minor version "
-                 << manifest_.minor_version()
+                 << manifest_->minor_version()
                  << ", but all full payloads should have version "
                  << kFullPayloadMinorVersion << ".";
       return ErrorCode::kUnsupportedMinorPayloadVersion;
     }
   } else {
-    if (manifest_.minor_version() < kMinSupportedMinorPayloadVersion ||
-        manifest_.minor_version() > kMaxSupportedMinorPayloadVersion) {
+    if (manifest_->minor_version() < kMinSupportedMinorPayloadVersion ||
+        manifest_->minor_version() > kMaxSupportedMinorPayloadVersion) {
       LOG(ERROR) << "Manifest contains minor version "
-                 << manifest_.minor_version()
+                 << manifest_->minor_version()
                  << " not in the range of supported minor versions ["
                  << kMinSupportedMinorPayloadVersion << ", "
                  << kMaxSupportedMinorPayloadVersion << "].";
@@ -1674,11 +2166,32 @@ ErrorCode DeltaPerformer::ValidateManifest() {
     }
   }
 
+  // Full payloads can't require REPLACE_ZSTD with their minor version, so
+  // they must declare it in the manifest.
+  if (actual_payload_type == InstallPayloadType::kFull &&
+      !manifest_->full_payload_zstd()) {
+    auto has_zstd = [](const RepeatedPtrField<InstallOperation>& ops) {
+      return std::any_of(
+          ops.begin(), ops.end(), [](const InstallOperation& op) {
+            return op.type() == InstallOperation::REPLACE_ZSTD;
+          });
+    };
+    bool zstd_found = has_zstd(manifest_->install_operations()) ||
+                      has_zstd(manifest_->kernel_install_operations());
+    for (const PartitionUpdate& partition : manifest_->partitions())
+      zstd_found = zstd_found || has_zstd(partition.operations());
+    if (zstd_found) {
+      LOG(ERROR) << "Manifest contains REPLACE_ZSTD operations in a full "
+                 << "payload without the full_payload_zstd field.";
+      return ErrorCode::kPayloadMismatchedType;
+    }
+  }
+
   if (major_payload_version_ != kChromeOSMajorPayloadVersion) {
-    if (manifest_.has_old_rootfs_info() || manifest_.has_new_rootfs_info() ||
-        manifest_.has_old_kernel_info() || manifest_.has_new_kernel_info() ||
-        manifest_.install_operations_size() != 0 ||
-        manifest_.kernel_install_operations_size() != 0) {
+    if (manifest_->has_old_rootfs_info() || manifest_->has_new_rootfs_info() ||
+        manifest_->has_old_kernel_info() || manifest_->has_new_kernel_info() ||
+        manifest_->install_operations_size() != 0 ||
+        manifest_->kernel_install_operations_size() != 0) {
       LOG(ERROR) << "Manifest contains deprecated field only supported in "
                  << "major payload version 1, but the payload major version is "
                  << major_payload_version_;
@@ -1686,16 +2199,16 @@ ErrorCode DeltaPerformer::ValidateManifest() {
     }
   }
 
-  if (manifest_.max_timestamp() < hardware_->GetBuildTimestamp()) {
+  if (manifest_->max_timestamp() < hardware_->GetBuildTimestamp()) {
     LOG(ERROR) << "The current OS build timestamp ("
                << hardware_->GetBuildTimestamp()
                << ") is newer than the maximum timestamp in the manifest ("
-               << manifest_.max_timestamp() << ")";
+               << manifest_->max_timestamp() << ")";
     return ErrorCode::kPayloadTimestampError;
   }
 
   if (major_payload_version_ == kChromeOSMajorPayloadVersion) {
-    if (manifest_.has_dynamic_partition_metadata()) {
+    if (manifest_->has_dynamic_partition_metadata()) {
       LOG(ERROR)
           << "Should not contain dynamic_partition_metadata for major version "
           << kChromeOSMajorPayloadVersion
@@ -1730,8 +2243,8 @@ ErrorCode DeltaPerformer::ValidateOperationHash(
     // that doesn't have a hash at the time the manifest is created. So we
     // should not complaint about that operation. This operation can be
     // recognized by the fact that it's offset is mentioned in the manifest.
-    if (manifest_.signatures_offset() &&
-        manifest_.signatures_offset() == operation.data_offset()) {
+    if (manifest_->signatures_offset() &&
+        manifest_->signatures_offset() == operation.data_offset()) {
       LOG(INFO) << "Skipping hash verification for signature operation "
                 << next_operation_num_ + 1;
     } else {
@@ -1837,8 +2350,12 @@ void DeltaPerformer::DiscardBuffer(bool do_advance_offset,
     buffer_offset_ += buffer_.size();
 
   // Hash the content.
+  base::TimeTicks hash_start_time = base::TimeTicks::Now();
   payload_hash_calculator_.Update(buffer_.data(), buffer_.size());
   signed_hash_calculator_.Update(buffer_.data(), signed_hash_buffer_size);
+  PerfCounters::Get()->AddStage(PerfCounters::Stage::kHash,
+                                buffer_.size(),
+                                base::TimeTicks::Now() - hash_start_time);
 
   // Swap content with an empty vector to ensure that all memory is released.
   brillo::Blob().swap(buffer_);
@@ -1900,6 +2417,8 @@ bool DeltaPerformer::ResetUpdateProgress(PrefsInterface* prefs, bool quick) {
     prefs->SetString(kPrefsUpdateStateSignatureBlob, "");
     prefs->SetInt64(kPrefsManifestMetadataSize, -1);
     prefs->SetInt64(kPrefsManifestSignatureSize, -1);
+    prefs->Delete(kPrefsManifestMetadata);
+    prefs->Delete(kPrefsManifestMetadataHash);
     prefs->SetInt64(kPrefsResumedUpdateFailures, 0);
     prefs->Delete(kPrefsPostInstallSucceeded);
     prefs->Delete(kPrefsVerityWritten);
@@ -1930,16 +2449,10 @@ bool DeltaPerformer::CheckpointUpdateProgress(bool force) {
     last_updated_buffer_offset_ = buffer_offset_;
 
     if (next_operation_num_ < num_total_operations_) {
-      size_t partition_index = current_partition_;
-      while (next_operation_num_ >= acc_num_operations_[partition_index])
-        partition_index++;
-      const size_t partition_operation_num =
-          next_operation_num_ -
-          (partition_index ? acc_num_operations_[partition_index - 1] : 0);
-      const InstallOperation& op =
-          partitions_[partition_index].operations(partition_operation_num);
+      const OperationTable::Operation& op =
+          operation_table_.operation(next_operation_num_);
       TEST_AND_RETURN_FALSE(
-          prefs_->SetInt64(kPrefsUpdateStateNextDataLength, op.data_length()));
+          prefs_->SetInt64(kPrefsUpdateStateNextDataLength, op.data_length));
     } else {
       TEST_AND_RETURN_FALSE(
           prefs_->SetInt64(kPrefsUpdateStateNextDataLength, 0));
@@ -1947,9 +2460,166 @@ bool DeltaPerformer::CheckpointUpdateProgress(bool force) {
   }
   TEST_AND_RETURN_FALSE(
       prefs_->SetInt64(kPrefsUpdateStateNextOperation, next_operation_num_));
+  PerfCounters::Get()->AddCheckpoint(base::TimeTicks::Now() - curr_time);
+  return true;
+}
+
+bool DeltaPerformer::LoadPersistedMetadata() {
+  CHECK(buffer_.empty() && !IsHeaderParsed());
+  int64_t manifest_metadata_size = 0;
+  int64_t manifest_signature_size = 0;
+  string metadata, expected_hash;
+  if (!prefs_->GetInt64(kPrefsManifestMetadataSize, &manifest_metadata_size) ||
+      !prefs_->GetInt64(kPrefsManifestSignatureSize,
+                        &manifest_signature_size) ||
+      manifest_metadata_size <= 0 || manifest_signature_size < 0 ||
+      !prefs_->GetString(kPrefsManifestMetadata, &metadata) ||
+      !prefs_->GetString(kPrefsManifestMetadataHash, &expected_hash)) {
+    return false;
+  }
+  const uint64_t size = manifest_metadata_size + manifest_signature_size;
+  brillo::Blob hash;
+  if (metadata.size() != size ||
+      !HashCalculator::RawHashOfBytes(metadata.data(), size, &hash) ||
+      string(hash.begin(), hash.end()) != expected_hash) {
+    LOG(WARNING) << "The persisted metadata is corrupted, downloading it "
+                 << "again.";
+    return false;
+  }
+  buffer_.assign(metadata.begin(), metadata.end());
+  metadata_loaded_ = true;
+  // The metadata counts as received for the progress.
+  total_bytes_received_ += buffer_.size();
+  LOG(INFO) << "Loaded " << buffer_.size() << " bytes of persisted metadata.";
   return true;
 }
 
+void DeltaPerformer::PersistMetadata() {
+  const size_t size = metadata_size_ + metadata_signature_size_;
+  brillo::Blob hash;
+  if (buffer_.size() < size ||
+      !HashCalculator::RawHashOfBytes(buffer_.data(), size, &hash) ||
+      !prefs_->SetString(kPrefsManifestMetadata,
+                         string(buffer_.begin(), buffer_.begin() + size)) ||
+      !prefs_->SetString(kPrefsManifestMetadataHash,
+                         string(hash.begin(), hash.end()))) {
+    LOG(WARNING) << "Unable to persist the metadata, a resumed update will "
+                 << "download it again.";
+    prefs_->Delete(kPrefsManifestMetadataHash);
+  }
+}
+
+void DeltaPerformer::StartSourceVerification() {
+  size_t num_previous_partitions =
+      install_plan_->partitions.size() - manifest_->partitions_size();
+  vector<SourceVerification::Partition> partitions;
+  for (size_t i = 0; i < acc_num_operations_.size(); i++) {
+    const InstallPlan::Partition& install_part =
+        install_plan_->partitions[num_previous_partitions + i];
+    if (install_part.source_size == 0)
+      continue;
+    partitions.push_back({install_part.name,
+                          install_part.source_path,
+                          i ? acc_num_operations_[i - 1] : 0,
+                          acc_num_operations_[i]});
+  }
+  source_verification_.reset(
+      new SourceVerification(operation_table_,
+                             std::move(partitions),
+                             block_size_,
+                             memory_budget_.copy_buffer_size()));
+  LOG(INFO) << "Verifying the source data of "
+            << source_verification_->total_ops()
+            << " operations before downloading their data.";
+  source_verification_start_time_ = base::TimeTicks::Now();
+  source_verification_logged_percent_ = 0;
+  source_verification_->Start();
+  source_verification_task_id_ =
+      brillo::MessageLoop::current()->PostDelayedTask(
+          FROM_HERE,
+          base::Bind(&DeltaPerformer::CheckSourceVerification,
+                     base::Unretained(this)),
+          base::TimeDelta::FromMilliseconds(
+              kSourceVerificationCheckIntervalMs));
+}
+
+void DeltaPerformer::CheckSourceVerification() {
+  source_verification_task_id_ = brillo::MessageLoop::kTaskIdNull;
+  ErrorCode error = ErrorCode::kSuccess;
+  if (!source_verification_->done()) {
+    if (download_delegate_ && download_delegate_->ShouldCancel(&error)) {
+      LOG(INFO) << "Canceling the source verification.";
+      CancelSourceVerification();
+      FinishSourceVerification(error);
+      return;
+    }
+    uint64_t verified_ops = source_verification_->verified_ops();
+    uint64_t total_ops = source_verification_->total_ops();
+    unsigned percent = 100;
+    if (total_ops > 0)
+      percent = IntRatio(verified_ops, total_ops, 100);
+    if (percent / 10 > source_verification_logged_percent_ / 10) {
+      LOG(INFO) << "Verified the source data of " << verified_ops << "/"
+                << total_ops << " operations (" << percent << "%)";
+      source_verification_logged_percent_ = percent;
+    }
+    source_verification_task_id_ =
+        brillo::MessageLoop::current()->PostDelayedTask(
+            FROM_HERE,
+            base::Bind(&DeltaPerformer::CheckSourceVerification,
+                       base::Unretained(this)),
+            base::TimeDelta::FromMilliseconds(
+                kSourceVerificationCheckIntervalMs));
+    return;
+  }
+
+  // The failed worker, if any, still has its source file open.
+  const SourceHashVerifier* verifier = source_verification_->failed_verifier();
+  if (!verifier) {
+    LOG(INFO) << "Verified the source data of the update in "
+              << utils::FormatTimeDelta(base::TimeTicks::Now() -
+                                        source_verification_start_time_)
+              << ", " << source_verification_->ecc_recovered_ops()
+              << " operations need error correction.";
+  } else if (verifier->open_failed()) {
+    const SourceVerification::Partition* partition =
+        source_verification_->failed_partition();
+    LOG(ERROR) << "Unable to open source partition " << partition->name
+               << ", file " << partition->source_path;
+    error = ErrorCode::kInstallDeviceOpenError;
+  } else {
+    LOG(ERROR) << "The source data of operation "
+               << verifier->mismatched_op_num() << " of partition "
+               << source_verification_->failed_partition()->name
+               << " doesn't match, stopping before downloading the "
+               << "operations data.";
+    InstallOperation operation;
+    operation_table_.GetInstallOperation(verifier->mismatched_op_num(),
+                                         &operation);
+    ValidateSourceHash(
+        verifier->mismatched_hash(), operation, verifier->source_fd(), &error);
+  }
+  source_verification_.reset();
+  FinishSourceVerification(error);
+}
+
+void DeltaPerformer::FinishSourceVerification(ErrorCode error) {
+  source_verification_error_ = error;
+  // The callback may destroy this object.
+  base::Closure callback = source_verified_callback_;
+  if (!callback.is_null())
+    callback.Run();
+}
+
+void DeltaPerformer::CancelSourceVerification() {
+  if (source_verification_task_id_ != brillo::MessageLoop::kTaskIdNull) {
+    brillo::MessageLoop::current()->CancelTask(source_verification_task_id_);
+    source_verification_task_id_ = brillo::MessageLoop::kTaskIdNull;
+  }
+  // Waits for the workers to stop.
+  source_verification_.reset();
+}
+
 bool DeltaPerformer::PrimeUpdateState() {
   CHECK(manifest_valid_);
 
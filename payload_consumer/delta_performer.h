@@ -20,11 +20,15 @@
 #include <inttypes.h>
 
 #include <limits>
+#include <memory>
 #include <string>
 #include <vector>
 
+#include <base/callback.h>
 #include <base/time/time.h>
+#include <brillo/message_loops/message_loop.h>
 #include <brillo/secure_blob.h>
+#include <google/protobuf/arena.h>
 #include <google/protobuf/repeated_field.h>
 #include <gtest/gtest_prod.h>  // for FRIEND_TEST
 
@@ -32,8 +36,13 @@
 #include "update_engine/common/platform_constants.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/file_writer.h"
+#include "update_engine/payload_consumer/hashing_file_descriptor.h"
 #include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/memory_budget.h"
+#include "update_engine/payload_consumer/operation_table.h"
 #include "update_engine/payload_consumer/payload_metadata.h"
+#include "update_engine/payload_consumer/verity_block_repairer.h"
+#include "update_engine/payload_consumer/verity_writer_interface.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
@@ -75,7 +84,12 @@ class DeltaPerformer : public FileWriter {
         download_delegate_(download_delegate),
         install_plan_(install_plan),
         payload_(payload),
-        interactive_(interactive) {}
+        manifest_arena_(NewManifestArena()),
+        manifest_(google::protobuf::Arena::CreateMessage<DeltaArchiveManifest>(
+            manifest_arena_.get())),
+        interactive_(interactive),
+        memory_budget_(MemoryBudget::ForDevice(prefs)) {}
+  ~DeltaPerformer() override;
 
   // FileWriter's Write implementation where caller doesn't care about
   // error codes.
@@ -105,9 +119,26 @@ class DeltaPerformer : public FileWriter {
   // or -errno on error.
   int CloseCurrentPartition();
 
+  // Stores the hash of the current target partition computed while applying
+  // it in the install plan. Failures only make the hash unavailable.
+  void FinishTargetHash();
+
   // Returns |true| only if the manifest has been processed and it's valid.
   bool IsManifestValid();
 
+  // Returns whether the source data of a new delta update is being verified
+  // on other threads. Write() keeps the data it receives meanwhile and applies
+  // it once called again after the verification finished, so the caller
+  // should stop downloading until then.
+  bool IsVerifyingSource() const { return source_verification_ != nullptr; }
+
+  // Sets the |callback| run from the message loop when the source verification
+  // finishes, after which Write() either applies the data it kept or fails
+  // with the verification error.
+  void set_source_verified_callback(const base::Closure& callback) {
+    source_verified_callback_ = callback;
+  }
+
   // Verifies the downloaded payload against the signed hash included in the
   // payload, against the update check hash and size using the public key and
   // returns ErrorCode::kSuccess on success, an error code on failure.
@@ -144,6 +175,12 @@ class DeltaPerformer : public FileWriter {
   // success, false otherwise.
   static bool ResetUpdateProgress(PrefsInterface* prefs, bool quick);
 
+  // Loads the payload metadata and its signature, verified and persisted by
+  // the interrupted attempt of this update, so that the resumed download can
+  // skip them. Must be called before the first Write(). Returns false if no
+  // intact metadata was persisted, in which case it must be downloaded again.
+  bool LoadPersistedMetadata();
+
   // Attempts to parse the update metadata starting from the beginning of
   // |payload|. On success, returns kMetadataParseSuccess. Returns
   // kMetadataParseInsufficientData if more data is needed to parse the complete
@@ -156,6 +193,13 @@ class DeltaPerformer : public FileWriter {
     public_key_path_ = public_key_path;
   }
 
+  // Replaces the memory budget of the device with |memory_budget|, for
+  // example a share of it when several payloads are applied at once. Must be
+  // called before writing any data.
+  void set_memory_budget(const MemoryBudget& memory_budget) {
+    memory_budget_ = memory_budget;
+  }
+
   // Return true if header parsing is finished and no errors occurred.
   bool IsHeaderParsed() const;
 
@@ -177,13 +221,23 @@ class DeltaPerformer : public FileWriter {
   FRIEND_TEST(DeltaPerformerTest, BrilloMetadataSignatureSizeTest);
   FRIEND_TEST(DeltaPerformerTest, BrilloParsePayloadMetadataTest);
   FRIEND_TEST(DeltaPerformerTest, ChooseSourceFDTest);
+  FRIEND_TEST(DeltaPerformerTest, ManifestArenaTest);
   FRIEND_TEST(DeltaPerformerTest, UsePublicKeyFromResponse);
 
-  // Parse and move the update instructions of all partitions into our local
-  // |partitions_| variable based on the version of the payload. Requires the
-  // manifest to be parsed and valid.
+  // Converts the update instructions of all partitions to the partitions of
+  // the manifest based on the version of the payload. Requires the manifest to
+  // be parsed and valid.
   bool ParseManifestPartitions(ErrorCode* error);
 
+  // Returns a new arena for the manifest, with blocks large enough that a
+  // manifest of tens of MiB only takes a few of them.
+  static std::unique_ptr<google::protobuf::Arena> NewManifestArena();
+
+  // Copies the manifest without its operations to a new arena and frees the
+  // arena it was parsed on. Called once the operations are in
+  // |operation_table_|.
+  void CompactManifest();
+
   // Appends up to |*count_p| bytes from |*bytes_p| to |buffer_|, but only to
   // the extent that the size of |buffer_| does not exceed |max|. Advances
   // |*cbytes_p| and decreases |*count_p| by the actual number of bytes copied,
@@ -204,7 +258,7 @@ class DeltaPerformer : public FileWriter {
 
   // Returns true if enough of the delta file has been passed via Write()
   // to be able to perform a given install operation.
-  bool CanPerformInstallOperation(const InstallOperation& operation);
+  bool CanPerformInstallOperation(const OperationTable::Operation& operation);
 
   // Checks the integrity of the payload manifest. Returns true upon success,
   // false otherwise.
@@ -231,6 +285,10 @@ class DeltaPerformer : public FileWriter {
                                     ErrorCode* error);
   bool PerformPuffDiffOperation(const InstallOperation& operation,
                                 ErrorCode* error);
+  bool PerformZstdDiffOperation(const InstallOperation& operation,
+                                ErrorCode* error);
+  bool PerformLz4DiffOperation(const InstallOperation& operation,
+                               ErrorCode* error);
 
   // For a given operation, choose the source fd to be used (raw device or error
   // correction device) based on the source operation hash.
@@ -239,6 +297,14 @@ class DeltaPerformer : public FileWriter {
   FileDescriptorPtr ChooseSourceFD(const InstallOperation& operation,
                                    ErrorCode* error);
 
+  // Attempts to recover the source data of |operation| by re-reading through
+  // the error corrected device only the blocks that don't match the verity
+  // hash tree. Returns a file descriptor reading the repaired source, or
+  // nullptr if the blocks can't be repaired this way. The number of blocks
+  // repaired is stored in |repaired_blocks|.
+  FileDescriptorPtr RepairSourceBlocks(const InstallOperation& operation,
+                                       uint64_t* repaired_blocks);
+
   // Extracts the payload signature message from the blob on the |operation| if
   // the offset matches the one specified by the manifest. Returns whether the
   // signature was extracted.
@@ -266,6 +332,28 @@ class DeltaPerformer : public FileWriter {
   // update. Returns false otherwise.
   bool PrimeUpdateState();
 
+  // Persists the verified metadata and its signature at the beginning of
+  // |buffer_|, see LoadPersistedMetadata().
+  void PersistMetadata();
+
+  // Starts reading and hashing the source data of all the operations of a new
+  // delta update that have a source hash, on a few threads, before any
+  // operation data is downloaded. The verification fails at the first
+  // operation whose source data doesn't match its hash, even with error
+  // correction.
+  void StartSourceVerification();
+
+  // Checks from the message loop whether the source verification finished,
+  // logging its progress until then.
+  void CheckSourceVerification();
+
+  // Records the result of the source verification, see
+  // set_source_verified_callback().
+  void FinishSourceVerification(ErrorCode error);
+
+  // Stops the source verification, if any, without a result.
+  void CancelSourceVerification();
+
   // Get the public key to be used to verify metadata signature or payload
   // signature. Always use |public_key_path_| if exists, otherwise if the Omaha
   // response contains a public RSA key and we're allowed to use it (e.g. if
@@ -309,6 +397,17 @@ class DeltaPerformer : public FileWriter {
   // passed after falling back to the error-corrected |source_ecc_fd_| device.
   uint64_t source_ecc_recovered_failures_{0};
 
+  // Repairs individual source blocks using the verity hash tree of the source
+  // partition. Only set while |source_ecc_fd_| is open and the partition has
+  // verity metadata.
+  std::unique_ptr<VerityBlockRepairer> source_ecc_repairer_;
+
+  // The number of blocks repaired by |source_ecc_repairer_| and the time spent
+  // repairing them, for the operations counted in
+  // |source_ecc_recovered_failures_|.
+  uint64_t source_ecc_repaired_blocks_{0};
+  base::TimeDelta source_ecc_repair_duration_;
+
   // Whether opening the current partition as an error-corrected device failed.
   // Used to avoid re-opening the same source partition if it is not actually
   // error corrected.
@@ -318,17 +417,34 @@ class DeltaPerformer : public FileWriter {
   // operations of a given partition.
   FileDescriptorPtr target_fd_{nullptr};
 
+  // Hashes the data written to the target partition so it doesn't have to be
+  // read back by FilesystemVerifierAction. Only set while performing the
+  // operations of a partition when all of them run in this attempt. Wrapped
+  // by |target_fd_|.
+  std::shared_ptr<HashingFileDescriptor> target_hashing_fd_;
+
+  // Writes the verity data of the target partition as |target_hashing_fd_|
+  // hashes it, if the install plan asks to write verity.
+  std::unique_ptr<VerityWriterInterface> target_verity_writer_;
+
   // Paths the |source_fd_| and |target_fd_| refer to.
   std::string source_path_;
   std::string target_path_;
 
   PayloadMetadata payload_metadata_;
 
+  // The arena owning |manifest_| and all its messages. They are freed at once
+  // when the arena is destroyed, at the end of the update attempt.
+  std::unique_ptr<google::protobuf::Arena> manifest_arena_;
+
   // Parsed manifest. Set after enough bytes to parse the manifest were
-  // downloaded.
-  DeltaArchiveManifest manifest_;
+  // downloaded. Allocated on |manifest_arena_|.
+  DeltaArchiveManifest* manifest_;
   bool manifest_parsed_{false};
   bool manifest_valid_{false};
+  // Whether |buffer_| was filled by LoadPersistedMetadata(), so the signature
+  // of the metadata was already verified.
+  bool metadata_loaded_{false};
   uint64_t metadata_size_{0};
   uint32_t metadata_signature_size_{0};
   uint64_t major_payload_version_{0};
@@ -342,13 +458,15 @@ class DeltaPerformer : public FileWriter {
   // otherwise 0.
   size_t num_total_operations_{0};
 
-  // The list of partitions to update as found in the manifest major version 2.
-  // When parsing an older manifest format, the information is converted over to
-  // this format instead.
-  std::vector<PartitionUpdate> partitions_;
+  // The operations of all the partitions, in the order they are applied.
+  OperationTable operation_table_;
 
-  // Index in the list of partitions (|partitions_| member) of the current
-  // partition being processed.
+  // The operation being performed, decoded from |operation_table_|. It is
+  // reused for every operation to avoid allocating its extents each time.
+  InstallOperation current_operation_;
+
+  // Index in the list of partitions of the manifest of the current partition
+  // being processed.
   size_t current_partition_{0};
 
   // Index of the next operation to perform in the manifest. The index is linear
@@ -396,6 +514,24 @@ class DeltaPerformer : public FileWriter {
   // If |true|, the update is user initiated (vs. periodic update checks).
   bool interactive_{false};
 
+  // The memory cap for applying this payload, which sizes the caches and
+  // buffers used by the operations.
+  MemoryBudget memory_budget_;
+
+  // The verification of the source data in progress, see
+  // StartSourceVerification(), the task checking it, and the payload data
+  // received meanwhile.
+  class SourceVerification;
+  std::unique_ptr<SourceVerification> source_verification_;
+  brillo::MessageLoop::TaskId source_verification_task_id_{
+      brillo::MessageLoop::kTaskIdNull};
+  brillo::Blob source_verification_data_;
+  base::TimeTicks source_verification_start_time_;
+  unsigned source_verification_logged_percent_{0};
+  base::Closure source_verified_callback_;
+  // The error the verification failed with, returned by Write() from then on.
+  ErrorCode source_verification_error_{ErrorCode::kSuccess};
+
   // The timeout after which we should force emitting a progress log (constant),
   // and the actual point in time for the next forced log to be emitted.
   const base::TimeDelta forced_progress_log_wait_{
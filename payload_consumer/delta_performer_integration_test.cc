@@ -678,6 +678,8 @@ static void ApplyDeltaFile(bool full_kernel,
       .WillRepeatedly(Return(true));
   EXPECT_CALL(prefs, GetInt64(kPrefsUpdateStateNextOperation, _))
       .WillOnce(Return(false));
+  EXPECT_CALL(prefs, GetInt64(kPrefsApplyMemoryBudget, _))
+      .WillRepeatedly(Return(false));
   EXPECT_CALL(prefs, SetInt64(kPrefsUpdateStateNextDataOffset, _))
       .WillRepeatedly(Return(true));
   EXPECT_CALL(prefs, SetInt64(kPrefsUpdateStateNextDataLength, _))
@@ -874,6 +876,15 @@ void VerifyPayloadResult(DeltaPerformer* performer,
             HashCalculator::RawHashOfFile(
                 state->b_img, state->image_size, &expected_new_rootfs_hash));
   EXPECT_EQ(expected_new_rootfs_hash, partitions[0].target_hash);
+
+  // The target partitions are hashed while applying them, unless the
+  // operations overwrite the data they read.
+  if (minor_version != kInPlaceMinorPayloadVersion) {
+    EXPECT_EQ(expected_new_kernel_hash, partitions[1].applied_target_hash);
+    EXPECT_EQ(expected_new_rootfs_hash, partitions[0].applied_target_hash);
+  } else {
+    EXPECT_TRUE(partitions[0].applied_target_hash.empty());
+  }
 }
 
 void VerifyPayload(DeltaPerformer* performer,
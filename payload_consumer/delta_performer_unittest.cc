@@ -30,7 +30,10 @@
 #include <base/strings/string_number_conversions.h>
 #include <base/strings/string_util.h>
 #include <base/strings/stringprintf.h>
+#include <base/time/time.h>
+#include <brillo/message_loops/fake_message_loop.h>
 #include <gmock/gmock.h>
+#include <google/protobuf/arena.h>
 #include <google/protobuf/repeated_field.h>
 #include <gtest/gtest.h>
 
@@ -43,10 +46,14 @@
 #include "update_engine/payload_consumer/fake_file_descriptor.h"
 #include "update_engine/payload_consumer/mock_download_action.h"
 #include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_consumer/payload_metadata.h"
+#include "update_engine/payload_consumer/zstd_extent_writer.h"
 #include "update_engine/payload_generator/bzip.h"
+#include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/payload_file.h"
 #include "update_engine/payload_generator/payload_signer.h"
+#include "update_engine/payload_generator/zstd.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
@@ -169,7 +176,7 @@ class DeltaPerformerTest : public ::testing::Test {
     payload_.type = payload_type;
 
     // The Manifest we are validating.
-    performer_.manifest_.CopyFrom(manifest);
+    performer_.manifest_->CopyFrom(manifest);
     performer_.major_payload_version_ = major_version;
 
     EXPECT_EQ(expected, performer_.ValidateManifest());
@@ -462,6 +469,138 @@ TEST_F(DeltaPerformerTest, FullPayloadWriteTest) {
   EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
 }
 
+// Generates a full payload of the delta_generator binary without and with
+// --full_payload_zstd, applies both and logs their size and apply time. Run it
+// with --gtest_also_run_disabled_tests.
+TEST_F(DeltaPerformerTest, DISABLED_FullPayloadXzVersusZstdBenchmark) {
+  brillo::Blob image;
+  ASSERT_TRUE(
+      utils::ReadFile(GetBuildArtifactsPath("delta_generator"), &image));
+  image.resize(utils::RoundUp(image.size(), kBlockSize));
+  test_utils::ScopedTempFile image_file("Image-XXXXXX");
+  ASSERT_TRUE(test_utils::WriteFileVector(image_file.path(), image));
+
+  for (bool full_payload_zstd : {false, true}) {
+    PayloadGenerationConfig config;
+    config.is_delta = false;
+    config.version.major = kBrilloMajorPayloadVersion;
+    config.version.minor = kFullPayloadMinorVersion;
+    config.version.full_payload_zstd = full_payload_zstd;
+    config.target.partitions.emplace_back(kPartitionNameRoot);
+    config.target.partitions.back().path = image_file.path();
+    config.target.partitions.back().size = image.size();
+
+    test_utils::ScopedTempFile payload_file("Payload-XXXXXX");
+    ASSERT_TRUE(GenerateUpdatePayloadFile(
+        config, payload_file.path(), "", &payload_.metadata_size));
+    brillo::Blob payload_data;
+    ASSERT_TRUE(utils::ReadFile(payload_file.path(), &payload_data));
+
+    PayloadMetadata payload_metadata;
+    ASSERT_TRUE(payload_metadata.ParsePayloadHeader(payload_data));
+    DeltaArchiveManifest manifest;
+    ASSERT_TRUE(payload_metadata.GetManifest(payload_data, &manifest));
+    EXPECT_EQ(full_payload_zstd, manifest.full_payload_zstd());
+    int zstd_ops = 0;
+    for (const InstallOperation& op : manifest.partitions(0).operations())
+      zstd_ops += op.type() == InstallOperation::REPLACE_ZSTD;
+
+    test_utils::ScopedTempFile new_part("Partition-XXXXXX");
+    fake_boot_control_.SetPartitionDevice(
+        kPartitionNameRoot, install_plan_.target_slot, new_part.path());
+    payload_.type = InstallPayloadType::kFull;
+    DeltaPerformer performer(&prefs_,
+                             &fake_boot_control_,
+                             &fake_hardware_,
+                             &mock_delegate_,
+                             &install_plan_,
+                             &payload_,
+                             false /* interactive */);
+    base::TimeTicks start = base::TimeTicks::Now();
+    EXPECT_TRUE(performer.Write(payload_data.data(), payload_data.size()));
+    EXPECT_EQ(0, performer.Close());
+    base::TimeDelta apply_time = base::TimeTicks::Now() - start;
+
+    brillo::Blob partition_data;
+    EXPECT_TRUE(utils::ReadFile(new_part.path(), &partition_data));
+    EXPECT_EQ(image, partition_data);
+    LOG(INFO) << "Full payload of " << image.size() << " bytes"
+              << (full_payload_zstd ? " with" : " without")
+              << " --full_payload_zstd: " << payload_data.size() << " bytes, "
+              << zstd_ops << " of " << manifest.partitions(0).operations_size()
+              << " operations REPLACE_ZSTD, applied in "
+              << apply_time.InMilliseconds() << " ms.";
+  }
+}
+
+TEST_F(DeltaPerformerTest, PersistedMetadataTest) {
+  payload_.type = InstallPayloadType::kFull;
+  brillo::Blob expected_data =
+      brillo::Blob(std::begin(kRandomString), std::end(kRandomString));
+  expected_data.resize(4096);  // block size
+  vector<AnnotatedOperation> aops;
+  AnnotatedOperation aop;
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 1);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(expected_data.size());
+  aop.op.set_type(InstallOperation::REPLACE);
+  aops.push_back(aop);
+
+  brillo::Blob payload_data = GeneratePayload(expected_data,
+                                              aops,
+                                              false,
+                                              kChromeOSMajorPayloadVersion,
+                                              kFullPayloadMinorVersion);
+  test_utils::ScopedTempFile new_part("Partition-XXXXXX");
+  fake_boot_control_.SetPartitionDevice(
+      kPartitionNameRoot, install_plan_.target_slot, new_part.path());
+  fake_boot_control_.SetPartitionDevice(
+      kPartitionNameKernel, install_plan_.target_slot, "/dev/null");
+
+  // Nothing was persisted yet.
+  EXPECT_FALSE(performer_.LoadPersistedMetadata());
+
+  // The metadata is persisted once verified.
+  EXPECT_TRUE(performer_.Write(payload_data.data(), payload_.metadata_size));
+  performer_.Close();
+  string metadata;
+  EXPECT_TRUE(prefs_.GetString(kPrefsManifestMetadata, &metadata));
+  EXPECT_EQ(payload_.metadata_size, metadata.size());
+
+  // A new attempt applies the payload without the metadata.
+  const brillo::Blob data(payload_data.begin() + payload_.metadata_size,
+                          payload_data.end());
+  DeltaPerformer performer(&prefs_,
+                           &fake_boot_control_,
+                           &fake_hardware_,
+                           &mock_delegate_,
+                           &install_plan_,
+                           &payload_,
+                           false /* interactive*/);
+  EXPECT_TRUE(performer.LoadPersistedMetadata());
+  EXPECT_TRUE(performer.Write(data.data(), data.size()));
+  EXPECT_EQ(0, performer.Close());
+  brillo::Blob partition_data;
+  EXPECT_TRUE(utils::ReadFile(new_part.path(), &partition_data));
+  EXPECT_EQ(expected_data, partition_data);
+
+  // Corrupted metadata isn't loaded.
+  metadata[metadata.size() / 2] ^= 1;
+  EXPECT_TRUE(prefs_.SetString(kPrefsManifestMetadata, metadata));
+  DeltaPerformer corrupted_performer(&prefs_,
+                                     &fake_boot_control_,
+                                     &fake_hardware_,
+                                     &mock_delegate_,
+                                     &install_plan_,
+                                     &payload_,
+                                     false /* interactive*/);
+  EXPECT_FALSE(corrupted_performer.LoadPersistedMetadata());
+
+  // Nor once the update progress is reset.
+  EXPECT_TRUE(DeltaPerformer::ResetUpdateProgress(&prefs_, false));
+  EXPECT_FALSE(prefs_.Exists(kPrefsManifestMetadata));
+}
+
 TEST_F(DeltaPerformerTest, ShouldCancelTest) {
   payload_.type = InstallPayloadType::kFull;
   brillo::Blob expected_data =
@@ -546,6 +685,24 @@ TEST_F(DeltaPerformerTest, ReplaceXzOperationTest) {
   EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
 }
 
+TEST_F(DeltaPerformerTest, ReplaceZstdOperationTest) {
+  brillo::Blob expected_data = brillo::Blob(4096, 0);
+  expected_data[0] = 'a';
+  brillo::Blob zstd_data;
+  EXPECT_TRUE(ZstdCompress(expected_data, &zstd_data));
+
+  AnnotatedOperation aop;
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 1);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(zstd_data.size());
+  aop.op.set_type(InstallOperation::REPLACE_ZSTD);
+  vector<AnnotatedOperation> aops = {aop};
+
+  brillo::Blob payload_data = GeneratePayload(zstd_data, aops, false);
+
+  EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
+}
+
 TEST_F(DeltaPerformerTest, ZeroOperationTest) {
   brillo::Blob existing_data = brillo::Blob(4096 * 10, 'a');
   brillo::Blob expected_data = existing_data;
@@ -622,6 +779,53 @@ TEST_F(DeltaPerformerTest, PuffdiffOperationTest) {
   EXPECT_EQ(dst, ApplyPayload(payload_data, source.path(), true));
 }
 
+TEST_F(DeltaPerformerTest, ZstdDiffOperationTest) {
+  brillo::Blob src(4096);
+  test_utils::FillWithData(&src);
+  brillo::Blob dst = src;
+  std::fill(dst.begin() + 100, dst.begin() + 200, 0);
+  brillo::Blob zstd_diff;
+  EXPECT_TRUE(ZstdCompressWithPrefix(dst, src, &zstd_diff));
+
+  AnnotatedOperation aop;
+  *(aop.op.add_src_extents()) = ExtentForRange(0, 1);
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 1);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(zstd_diff.size());
+  aop.op.set_type(InstallOperation::ZSTD_DIFF);
+  brillo::Blob src_hash;
+  EXPECT_TRUE(HashCalculator::RawHashOfData(src, &src_hash));
+  aop.op.set_src_sha256_hash(src_hash.data(), src_hash.size());
+
+  test_utils::ScopedTempFile source("Source-XXXXXX");
+  EXPECT_TRUE(test_utils::WriteFileVector(source.path(), src));
+
+  PartitionConfig old_part(kPartitionNameRoot);
+  old_part.path = source.path();
+  old_part.size = src.size();
+
+  brillo::Blob payload_data =
+      GeneratePayload(zstd_diff, {aop}, false, &old_part);
+
+  EXPECT_EQ(dst, ApplyPayload(payload_data, source.path(), true));
+}
+
+TEST_F(DeltaPerformerTest, ZstdDiffOperationTooBigTest) {
+  // The source and target data don't fit in the window, so the operation is
+  // rejected before reading the source.
+  AnnotatedOperation aop;
+  uint64_t max_blocks = (1ULL << ZstdExtentWriter::kMaxPrefixWindowLog) / 4096;
+  *(aop.op.add_src_extents()) = ExtentForRange(0, max_blocks);
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 1);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(1);
+  aop.op.set_type(InstallOperation::ZSTD_DIFF);
+
+  brillo::Blob payload_data = GeneratePayload({0}, {aop}, false);
+
+  EXPECT_TRUE(ApplyPayload(payload_data, "/dev/zero", false).empty());
+}
+
 TEST_F(DeltaPerformerTest, SourceHashMismatchTest) {
   brillo::Blob expected_data = {'f', 'o', 'o'};
   brillo::Blob actual_data = {'b', 'a', 'r'};
@@ -649,6 +853,87 @@ TEST_F(DeltaPerformerTest, SourceHashMismatchTest) {
   EXPECT_EQ(actual_data, ApplyPayload(payload_data, source.path(), false));
 }
 
+TEST_F(DeltaPerformerTest, VerifySourceBeforeDownloadTest) {
+  brillo::Blob expected_data(4 * 4096);
+  test_utils::FillWithData(&expected_data);
+  brillo::Blob actual_data = expected_data;
+  actual_data[3 * 4096] ^= 1;
+
+  // One operation per block, so the mismatch isn't in the first one.
+  vector<AnnotatedOperation> aops;
+  for (uint64_t block = 0; block < 4; block++) {
+    AnnotatedOperation aop;
+    *(aop.op.add_src_extents()) = ExtentForRange(block, 1);
+    *(aop.op.add_dst_extents()) = ExtentForRange(block, 1);
+    aop.op.set_type(InstallOperation::SOURCE_COPY);
+    brillo::Blob src_hash;
+    EXPECT_TRUE(HashCalculator::RawHashOfBytes(
+        expected_data.data() + block * 4096, 4096, &src_hash));
+    aop.op.set_src_sha256_hash(src_hash.data(), src_hash.size());
+    aops.push_back(aop);
+  }
+
+  test_utils::ScopedTempFile source("Source-XXXXXX");
+  EXPECT_TRUE(test_utils::WriteFileVector(source.path(), actual_data));
+  PartitionConfig old_part(kPartitionNameRoot);
+  old_part.path = source.path();
+  old_part.size = actual_data.size();
+  brillo::Blob payload_data =
+      GeneratePayload(brillo::Blob(), aops, false, &old_part);
+
+  test_utils::ScopedTempFile new_part("Partition-XXXXXX");
+  fake_boot_control_.SetPartitionDevice(
+      kPartitionNameRoot, install_plan_.target_slot, new_part.path());
+  fake_boot_control_.SetPartitionDevice(
+      kPartitionNameRoot, install_plan_.source_slot, source.path());
+  fake_boot_control_.SetPartitionDevice(
+      kPartitionNameKernel, install_plan_.target_slot, "/dev/null");
+  fake_boot_control_.SetPartitionDevice(
+      kPartitionNameKernel, install_plan_.source_slot, "/dev/null");
+  EXPECT_TRUE(prefs_.SetBoolean(kPrefsVerifySourceBeforeDownload, true));
+
+  brillo::FakeMessageLoop loop(nullptr);
+  loop.SetAsCurrent();
+  bool verified = false;
+  auto callback = base::Bind([](bool* verified) { *verified = true; },
+                             base::Unretained(&verified));
+
+  // The verification starts once the metadata is parsed, before any operation
+  // is applied, and the mismatch is reported by the next write.
+  ErrorCode error;
+  performer_.set_source_verified_callback(callback);
+  EXPECT_TRUE(
+      performer_.Write(payload_data.data(), payload_.metadata_size, &error));
+  EXPECT_TRUE(performer_.IsVerifyingSource());
+  while (!verified)
+    loop.RunOnce(true);
+  EXPECT_FALSE(performer_.IsVerifyingSource());
+  EXPECT_FALSE(performer_.Write(nullptr, 0, &error));
+  EXPECT_EQ(ErrorCode::kDownloadStateInitializationError, error);
+  performer_.Close();
+
+  // A matching source is applied as usual.
+  EXPECT_TRUE(test_utils::WriteFileVector(source.path(), expected_data));
+  DeltaPerformer performer(&prefs_,
+                           &fake_boot_control_,
+                           &fake_hardware_,
+                           &mock_delegate_,
+                           &install_plan_,
+                           &payload_,
+                           false /* interactive*/);
+  verified = false;
+  performer.set_source_verified_callback(callback);
+  EXPECT_TRUE(performer.Write(payload_data.data(), payload_data.size()));
+  while (!verified)
+    loop.RunOnce(true);
+  // The data received during the verification is applied by the next write.
+  EXPECT_TRUE(performer.Write(nullptr, 0));
+  EXPECT_EQ(0, performer.Close());
+  brillo::Blob partition_data;
+  EXPECT_TRUE(utils::ReadFile(new_part.path(), &partition_data));
+  EXPECT_EQ(expected_data, partition_data);
+}
+
 // Test that the error-corrected file descriptor is used to read the partition
 // since the source partition doesn't match the operation hash.
 TEST_F(DeltaPerformerTest, ErrorCorrectionSourceCopyFallbackTest) {
@@ -893,6 +1178,28 @@ TEST_F(DeltaPerformerTest, ValidateManifestDowngrade) {
                         ErrorCode::kPayloadTimestampError);
 }
 
+TEST_F(DeltaPerformerTest, ValidateManifestFullZstdTest) {
+  // The Manifest we are validating.
+  DeltaArchiveManifest manifest;
+  manifest.set_minor_version(kFullPayloadMinorVersion);
+  PartitionUpdate* partition = manifest.add_partitions();
+  partition->mutable_new_partition_info();
+  partition->add_operations()->set_type(InstallOperation::REPLACE_XZ);
+  partition->add_operations()->set_type(InstallOperation::REPLACE_ZSTD);
+
+  // REPLACE_ZSTD is only allowed in full payloads declaring it.
+  RunManifestValidation(manifest,
+                        kBrilloMajorPayloadVersion,
+                        InstallPayloadType::kFull,
+                        ErrorCode::kPayloadMismatchedType);
+
+  manifest.set_full_payload_zstd(true);
+  RunManifestValidation(manifest,
+                        kBrilloMajorPayloadVersion,
+                        InstallPayloadType::kFull,
+                        ErrorCode::kSuccess);
+}
+
 TEST_F(DeltaPerformerTest, BrilloMetadataSignatureSizeTest) {
   unsigned int seed = time(nullptr);
   EXPECT_TRUE(performer_.Write(kDeltaMagic, sizeof(kDeltaMagic)));
@@ -927,6 +1234,72 @@ TEST_F(DeltaPerformerTest, BrilloParsePayloadMetadataTest) {
   EXPECT_EQ(ErrorCode::kSuccess, error);
 }
 
+TEST_F(DeltaPerformerTest, ManifestArenaTest) {
+  const size_t kNumOperations = 100000;
+  DeltaArchiveManifest manifest;
+  PartitionUpdate* partition = manifest.add_partitions();
+  partition->set_partition_name("system");
+  for (size_t i = 0; i < kNumOperations; i++) {
+    InstallOperation* op = partition->add_operations();
+    op->set_type(InstallOperation::SOURCE_COPY);
+    *op->add_src_extents() = ExtentForRange(2 * i, 1);
+    *op->add_dst_extents() = ExtentForRange(2 * i + 1, 1);
+    op->set_src_sha256_hash(string(32, 'x'));
+  }
+  string manifest_data;
+  ASSERT_TRUE(manifest.SerializeToString(&manifest_data));
+
+  brillo::Blob payload;
+  auto append = [&payload](const void* data, size_t size) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    payload.insert(payload.end(), bytes, bytes + size);
+  };
+  uint64_t major_version = htobe64(kBrilloMajorPayloadVersion);
+  uint64_t manifest_size = htobe64(manifest_data.size());
+  uint32_t metadata_signature_size = 0;
+  append(kDeltaMagic, sizeof(kDeltaMagic));
+  append(&major_version, sizeof(major_version));
+  append(&manifest_size, sizeof(manifest_size));
+  append(&metadata_signature_size, sizeof(metadata_signature_size));
+  append(manifest_data.data(), manifest_data.size());
+
+  PayloadMetadata payload_metadata;
+  ASSERT_TRUE(payload_metadata.ParsePayloadHeader(payload));
+
+  base::TimeTicks start = base::TimeTicks::Now();
+  DeltaArchiveManifest heap_manifest;
+  EXPECT_TRUE(payload_metadata.GetManifest(payload, &heap_manifest));
+  base::TimeDelta heap_duration = base::TimeTicks::Now() - start;
+
+  start = base::TimeTicks::Now();
+  EXPECT_TRUE(payload_metadata.GetManifest(payload, performer_.manifest_));
+  base::TimeDelta arena_duration = base::TimeTicks::Now() - start;
+  LOG(INFO) << "Parsed a manifest of " << manifest_data.size() << " bytes in "
+            << utils::FormatTimeDelta(heap_duration) << " on the heap and in "
+            << utils::FormatTimeDelta(arena_duration) << " on an arena using "
+            << performer_.manifest_arena_->SpaceUsed() << " of "
+            << performer_.manifest_arena_->SpaceAllocated() << " bytes.";
+
+  // All the messages of the manifest are allocated on its arena.
+  ASSERT_EQ(1, performer_.manifest_->partitions_size());
+  const PartitionUpdate& arena_partition = performer_.manifest_->partitions(0);
+  ASSERT_EQ(static_cast<int>(kNumOperations),
+            arena_partition.operations_size());
+  EXPECT_EQ(performer_.manifest_arena_.get(), arena_partition.GetArena());
+  EXPECT_EQ(performer_.manifest_arena_.get(),
+            arena_partition.operations(kNumOperations - 1).GetArena());
+
+  // Compacting keeps everything but the operations on a much smaller arena.
+  performer_.CompactManifest();
+  ASSERT_EQ(1, performer_.manifest_->partitions_size());
+  EXPECT_EQ("system", performer_.manifest_->partitions(0).partition_name());
+  EXPECT_EQ(0, performer_.manifest_->partitions(0).operations_size());
+  EXPECT_EQ(performer_.manifest_arena_.get(),
+            performer_.manifest_->GetArena());
+  EXPECT_LT(performer_.manifest_arena_->SpaceAllocated(),
+            static_cast<uint64_t>(manifest_data.size()));
+}
+
 TEST_F(DeltaPerformerTest, BadDeltaMagicTest) {
   EXPECT_TRUE(performer_.Write("junk", 4));
   EXPECT_FALSE(performer_.Write("morejunk", 8));
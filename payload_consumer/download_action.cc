@@ -21,6 +21,7 @@
 #include <algorithm>
 #include <string>
 
+#include <base/bind.h>
 #include <base/files/file_path.h>
 #include <base/metrics/statistics_recorder.h>
 #include <base/strings/stringprintf.h>
@@ -29,9 +30,11 @@
 #include "update_engine/common/boot_control_interface.h"
 #include "update_engine/common/error_code_utils.h"
 #include "update_engine/common/multi_range_http_fetcher.h"
+#include "update_engine/common/prefs.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/omaha_request_params.h"
 #include "update_engine/p2p_manager.h"
+#include "update_engine/payload_consumer/perf_counters.h"
 #include "update_engine/payload_state_interface.h"
 
 using base::FilePath;
@@ -39,6 +42,135 @@ using std::string;
 
 namespace chromeos_update_engine {
 
+// Downloads and applies one payload with its own fetcher. The payload is
+// applied to a copy of the install plan, since the DeltaPerformer adds the
+// partitions of its payload at the end of it, and its progress is kept in
+// memory: an update interrupted while downloading payloads concurrently
+// starts over.
+class DownloadAction::PayloadDownload : public HttpFetcherDelegate {
+ public:
+  PayloadDownload(DownloadAction* action, size_t index, HttpFetcher* fetcher)
+      : action_(action),
+        index_(index),
+        install_plan_(action->install_plan_),
+        http_fetcher_(new MultiRangeHttpFetcher(fetcher)) {
+    install_plan_.partitions.clear();
+    payload_ = &install_plan_.payloads[index_];
+  }
+
+  void Start(const string& url) {
+    http_fetcher_->set_delegate(this);
+    http_fetcher_->ClearRanges();
+    if (payload_->size)
+      http_fetcher_->AddRange(action_->base_offset_, payload_->size);
+    else
+      http_fetcher_->AddRange(action_->base_offset_);
+
+    if (!action_->test_payload_writers_.empty()) {
+      writer_ = action_->test_payload_writers_[index_];
+    } else {
+      delta_performer_.reset(new DeltaPerformer(&prefs_,
+                                                action_->boot_control_,
+                                                action_->hardware_,
+                                                action_->delegate_,
+                                                &install_plan_,
+                                                payload_,
+                                                action_->interactive_));
+      delta_performer_->set_memory_budget(action_->payload_memory_budget_);
+      writer_ = delta_performer_.get();
+    }
+    active_ = true;
+    LOG(INFO) << "Downloading payload " << index_ << " from " << url;
+    http_fetcher_->BeginTransfer(url);
+  }
+
+  // Terminates the download, without reporting it to the action.
+  void Terminate() {
+    if (writer_) {
+      writer_->Close();
+      writer_ = nullptr;
+    }
+    active_ = false;
+    http_fetcher_->TerminateTransfer();
+  }
+
+  void Pause() { http_fetcher_->Pause(); }
+  void Unpause() { http_fetcher_->Unpause(); }
+
+  // HttpFetcherDelegate overrides.
+  bool ReceivedBytes(HttpFetcher* fetcher,
+                     const void* bytes,
+                     size_t length) override {
+    // All the downloads run on the same message loop, so the time since any
+    // of them last received data is the wall-clock time spent waiting for
+    // the network, counted once however many downloads are waiting.
+    PerfCounters::Get()->AddStage(
+        PerfCounters::Stage::kFetch,
+        length,
+        base::TimeTicks::Now() - action_->fetch_start_time_);
+    // The progress is reported for all the payloads together.
+    action_->bytes_received_ += length;
+    if (action_->delegate_ && action_->download_active_) {
+      action_->delegate_->BytesReceived(
+          length, action_->bytes_received_, action_->bytes_total_);
+    }
+    if (writer_ && !writer_->Write(bytes, length, &code_)) {
+      if (code_ == ErrorCode::kSuccess)
+        code_ = ErrorCode::kDownloadWriteError;
+      LOG(ERROR) << "Error " << utils::ErrorCodeToString(code_) << " ("
+                 << code_ << ") when processing payload " << index_
+                 << " -- Terminating processing";
+      // The failure is reported from TransferTerminated().
+      Terminate();
+      return false;
+    }
+    action_->fetch_start_time_ = base::TimeTicks::Now();
+    return true;
+  }
+
+  void TransferComplete(HttpFetcher* fetcher, bool successful) override {
+    if (writer_) {
+      LOG_IF(WARNING, writer_->Close() != 0) << "Error closing the writer.";
+      writer_ = nullptr;
+    }
+    active_ = false;
+    ErrorCode code =
+        successful ? ErrorCode::kSuccess : ErrorCode::kDownloadTransferError;
+    if (code == ErrorCode::kSuccess && delta_performer_)
+      code = delta_performer_->VerifyPayload(payload_->hash, payload_->size);
+    // The action may destroy this object.
+    action_->PayloadDownloadDone(this, code);
+  }
+
+  void TransferTerminated(HttpFetcher* fetcher) override {
+    if (code_ != ErrorCode::kSuccess)
+      action_->PayloadDownloadDone(this, code_);
+  }
+
+  size_t index() const { return index_; }
+  bool active() const { return active_; }
+  int http_response_code() const {
+    return http_fetcher_->http_response_code();
+  }
+  const InstallPlan& install_plan() const { return install_plan_; }
+
+ private:
+  DownloadAction* action_;
+  size_t index_;
+
+  InstallPlan install_plan_;
+  InstallPlan::Payload* payload_;
+  MemoryPrefs prefs_;
+
+  std::unique_ptr<MultiRangeHttpFetcher> http_fetcher_;
+  std::unique_ptr<DeltaPerformer> delta_performer_;
+  FileWriter* writer_{nullptr};
+  ErrorCode code_{ErrorCode::kSuccess};
+  bool active_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(PayloadDownload);
+};
+
 DownloadAction::DownloadAction(PrefsInterface* prefs,
                                BootControlInterface* boot_control,
                                HardwareInterface* hardware,
@@ -61,7 +193,10 @@ DownloadAction::DownloadAction(PrefsInterface* prefs,
 #endif
 }
 
-DownloadAction::~DownloadAction() {}
+DownloadAction::~DownloadAction() {
+  if (complete_task_id_ != brillo::MessageLoop::kTaskIdNull)
+    brillo::MessageLoop::current()->CancelTask(complete_task_id_);
+}
 
 void DownloadAction::CloseP2PSharingFd(bool delete_p2p_file) {
   if (p2p_sharing_fd_ != -1) {
@@ -203,28 +338,167 @@ void DownloadAction::PerformAction() {
                  << ". Proceeding with the update anyway.";
   }
 
+  if (CanDownloadConcurrently()) {
+    // The payloads applied at the same time share the memory budget of the
+    // device.
+    size_t concurrent_payloads =
+        std::min(max_concurrent_payloads_, install_plan_.payloads.size());
+    payload_memory_budget_ = MemoryBudget(
+        MemoryBudget::ForDevice(prefs_).total() / concurrent_payloads);
+    LOG(INFO) << "Downloading " << install_plan_.payloads.size()
+              << " payloads, up to " << concurrent_payloads
+              << " at the same time with a memory budget of "
+              << payload_memory_budget_.total() << " bytes each.";
+    download_active_ = true;
+    fetch_start_time_ = base::TimeTicks::Now();
+    while (payload_downloads_.size() < max_concurrent_payloads_ &&
+           StartNextPayloadDownload()) {
+    }
+    return;
+  }
+
   StartDownloading();
 }
 
+bool DownloadAction::CanDownloadConcurrently() {
+  if (max_concurrent_payloads_ <= 1 || fetcher_factory_.is_null() ||
+      install_plan_.payloads.size() <= 1 || install_plan_.is_resume ||
+      !system_state_) {
+    return false;
+  }
+  PayloadStateInterface* payload_state = system_state_->payload_state();
+  if (payload_state->GetUsingP2PForSharing() ||
+      payload_state->GetUsingP2PForDownloading()) {
+    return false;
+  }
+  for (size_t i = 0; i < install_plan_.payloads.size(); i++) {
+    if (payload_state->GetPayloadUrl(i).empty()) {
+      LOG(WARNING) << "No URL for payload " << i
+                   << ", downloading the payloads in sequence.";
+      return false;
+    }
+  }
+  return true;
+}
+
+bool DownloadAction::StartNextPayloadDownload() {
+  size_t index = payload_downloads_.size();
+  if (index >= install_plan_.payloads.size())
+    return false;
+  payload_downloads_.push_back(
+      std::make_unique<PayloadDownload>(this, index, fetcher_factory_.Run()));
+  payload_downloads_.back()->Start(
+      system_state_->payload_state()->GetPayloadUrl(index));
+  return true;
+}
+
+void DownloadAction::PayloadDownloadDone(PayloadDownload* download,
+                                         ErrorCode code) {
+  http_response_code_ = download->http_response_code();
+  if (!download_active_)
+    return;
+  if (code != ErrorCode::kSuccess) {
+    LOG(ERROR) << "Download of payload " << download->index()
+               << " failed, terminating the other payload downloads.";
+    TerminatePayloadDownloads();
+    PostCompletePayloadDownloads(code);
+    return;
+  }
+  LOG(INFO) << "Payload " << download->index() << " applied and verified.";
+  payloads_applied_++;
+  if (StartNextPayloadDownload())
+    return;
+  if (payloads_applied_ == install_plan_.payloads.size())
+    FinishPayloadDownloads();
+}
+
+void DownloadAction::TerminatePayloadDownloads() {
+  download_active_ = false;
+  for (auto& download : payload_downloads_) {
+    if (download->active())
+      download->Terminate();
+  }
+}
+
+void DownloadAction::FinishPayloadDownloads() {
+  download_active_ = false;
+  for (const auto& download : payload_downloads_) {
+    const InstallPlan& payload_plan = download->install_plan();
+    // The DeltaPerformer sets the type of payloads of unknown type.
+    install_plan_.payloads[download->index()] =
+        payload_plan.payloads[download->index()];
+    install_plan_.partitions.insert(install_plan_.partitions.end(),
+                                    payload_plan.partitions.begin(),
+                                    payload_plan.partitions.end());
+  }
+  // Leave the payload state on the last payload, as when the payloads are
+  // downloaded in sequence.
+  for (size_t i = 1; i < install_plan_.payloads.size(); i++)
+    system_state_->payload_state()->NextPayload();
+
+  // All payloads have been applied and verified.
+  if (delegate_)
+    delegate_->DownloadComplete();
+  LogPerformance();
+  if (HasOutputPipe())
+    SetOutputObject(install_plan_);
+  PostCompletePayloadDownloads(ErrorCode::kSuccess);
+}
+
+void DownloadAction::PostCompletePayloadDownloads(ErrorCode code) {
+  complete_task_id_ = brillo::MessageLoop::current()->PostTask(
+      FROM_HERE,
+      base::Bind(&DownloadAction::CompletePayloadDownloads,
+                 base::Unretained(this),
+                 code));
+}
+
+void DownloadAction::CompletePayloadDownloads(ErrorCode code) {
+  complete_task_id_ = brillo::MessageLoop::kTaskIdNull;
+  processor_->ActionComplete(this, code);
+}
+
 void DownloadAction::StartDownloading() {
   download_active_ = true;
+  if (writer_ && writer_ != delta_performer_.get()) {
+    LOG(INFO) << "Using writer for test.";
+  } else {
+    delta_performer_.reset(new DeltaPerformer(prefs_,
+                                              boot_control_,
+                                              hardware_,
+                                              delegate_,
+                                              &install_plan_,
+                                              payload_,
+                                              interactive_));
+    delta_performer_->set_source_verified_callback(base::Bind(
+        &DownloadAction::SourceVerified, base::Unretained(this)));
+    writer_ = delta_performer_.get();
+  }
+
   http_fetcher_->ClearRanges();
   if (install_plan_.is_resume &&
       payload_ == &install_plan_.payloads[resume_payload_index_]) {
-    // Resuming an update so fetch the update manifest metadata first.
     int64_t manifest_metadata_size = 0;
     int64_t manifest_signature_size = 0;
     prefs_->GetInt64(kPrefsManifestMetadataSize, &manifest_metadata_size);
     prefs_->GetInt64(kPrefsManifestSignatureSize, &manifest_signature_size);
-    http_fetcher_->AddRange(base_offset_,
-                            manifest_metadata_size + manifest_signature_size);
-    // If there're remaining unprocessed data blobs, fetch them. Be careful not
-    // to request data beyond the end of the payload to avoid 416 HTTP response
-    // error codes.
     int64_t next_data_offset = 0;
     prefs_->GetInt64(kPrefsUpdateStateNextDataOffset, &next_data_offset);
     uint64_t resume_offset =
         manifest_metadata_size + manifest_signature_size + next_data_offset;
+    // Resuming an update so reload the update manifest metadata verified by
+    // the interrupted attempt, or fetch it first if it can't be reloaded. The
+    // metadata is always fetched when there is no data left to fetch, since
+    // the download needs at least one range.
+    bool fetch_data = !payload_->size || resume_offset < payload_->size;
+    if (!fetch_data || writer_ != delta_performer_.get() ||
+        !delta_performer_->LoadPersistedMetadata()) {
+      http_fetcher_->AddRange(base_offset_,
+                              manifest_metadata_size + manifest_signature_size);
+    }
+    // If there're remaining unprocessed data blobs, fetch them. Be careful not
+    // to request data beyond the end of the payload to avoid 416 HTTP response
+    // error codes.
     if (!payload_->size) {
       http_fetcher_->AddRange(base_offset_ + resume_offset);
     } else if (resume_offset < payload_->size) {
@@ -241,18 +515,6 @@ void DownloadAction::StartDownloading() {
     }
   }
 
-  if (writer_ && writer_ != delta_performer_.get()) {
-    LOG(INFO) << "Using writer for test.";
-  } else {
-    delta_performer_.reset(new DeltaPerformer(prefs_,
-                                              boot_control_,
-                                              hardware_,
-                                              delegate_,
-                                              &install_plan_,
-                                              payload_,
-                                              interactive_));
-    writer_ = delta_performer_.get();
-  }
   if (system_state_ != nullptr) {
     const PayloadStateInterface* payload_state = system_state_->payload_state();
     string file_id = utils::CalculateP2PFileId(payload_->hash, payload_->size);
@@ -290,29 +552,66 @@ void DownloadAction::StartDownloading() {
     }
   }
 
+  fetch_start_time_ = base::TimeTicks::Now();
   http_fetcher_->BeginTransfer(install_plan_.download_url);
 }
 
 void DownloadAction::SuspendAction() {
-  http_fetcher_->Pause();
+  if (!payload_downloads_.empty()) {
+    for (auto& download : payload_downloads_) {
+      if (download->active())
+        download->Pause();
+    }
+    return;
+  }
+  suspended_ = true;
+  if (!source_verification_paused_)
+    http_fetcher_->Pause();
 }
 
 void DownloadAction::ResumeAction() {
-  http_fetcher_->Unpause();
+  // The time suspended is not spent fetching.
+  fetch_start_time_ = base::TimeTicks::Now();
+  if (!payload_downloads_.empty()) {
+    for (auto& download : payload_downloads_) {
+      if (download->active())
+        download->Unpause();
+    }
+    return;
+  }
+  suspended_ = false;
+  if (!source_verification_paused_)
+    http_fetcher_->Unpause();
 }
 
 void DownloadAction::TerminateProcessing() {
+  if (!payload_downloads_.empty()) {
+    TerminatePayloadDownloads();
+    return;
+  }
   if (writer_) {
     writer_->Close();
     writer_ = nullptr;
   }
   download_active_ = false;
+  source_verification_paused_ = false;
   CloseP2PSharingFd(false);  // Keep p2p file.
   // Terminates the transfer. The action is terminated, if necessary, when the
   // TransferTerminated callback is received.
   http_fetcher_->TerminateTransfer();
 }
 
+void DownloadAction::LogPerformance() {
+  // Log UpdateEngine.DownloadAction.* histograms to help diagnose
+  // long-blocking operations.
+  std::string histogram_output;
+  base::StatisticsRecorder::WriteGraph("UpdateEngine.DownloadAction.",
+                                       &histogram_output);
+  LOG(INFO) << histogram_output;
+  LOG(INFO) << "Update performance counters:\n"
+            << PerfCounters::Get()->ToString();
+}
+
 void DownloadAction::SeekToOffset(off_t offset) {
   bytes_received_ = offset;
 }
@@ -320,6 +619,9 @@ void DownloadAction::SeekToOffset(off_t offset) {
 bool DownloadAction::ReceivedBytes(HttpFetcher* fetcher,
                                    const void* bytes,
                                    size_t length) {
+  PerfCounters::Get()->AddStage(PerfCounters::Stage::kFetch,
+                                length,
+                                base::TimeTicks::Now() - fetch_start_time_);
   // Note that bytes_received_ is the current offset.
   if (!p2p_file_id_.empty()) {
     WriteToP2PFile(bytes, length, bytes_received_);
@@ -347,6 +649,15 @@ bool DownloadAction::ReceivedBytes(HttpFetcher* fetcher,
     return false;
   }
 
+  // No more data is needed until the source is verified.
+  if (!source_verification_paused_ && delta_performer_ &&
+      delta_performer_->IsVerifyingSource()) {
+    LOG(INFO) << "Pausing the download until the source is verified.";
+    source_verification_paused_ = true;
+    if (!suspended_)
+      http_fetcher_->Pause();
+  }
+
   // Call p2p_manager_->FileMakeVisible() when we've successfully
   // verified the manifest!
   if (!p2p_visible_ && system_state_ && delta_performer_.get() &&
@@ -355,10 +666,54 @@ bool DownloadAction::ReceivedBytes(HttpFetcher* fetcher,
     system_state_->p2p_manager()->FileMakeVisible(p2p_file_id_);
     p2p_visible_ = true;
   }
+  fetch_start_time_ = base::TimeTicks::Now();
   return true;
 }
 
+void DownloadAction::SourceVerified() {
+  // Applies the data received during the verification, or fails with the
+  // verification error.
+  if (writer_ && !writer_->Write(nullptr, 0, &code_)) {
+    LOG(ERROR) << "Error " << utils::ErrorCodeToString(code_) << " (" << code_
+               << ") verifying the source of the payload -- Terminating "
+               << "processing";
+    if (!p2p_file_id_.empty())
+      CloseP2PSharingFd(true);
+    if (transfer_complete_pending_) {
+      // The fetcher is done, so the action can complete from this task.
+      transfer_complete_pending_ = false;
+      writer_->Close();
+      writer_ = nullptr;
+      download_active_ = false;
+      processor_->ActionComplete(this, code_);
+      return;
+    }
+    TerminateProcessing();
+    return;
+  }
+  if (transfer_complete_pending_) {
+    transfer_complete_pending_ = false;
+    TransferComplete(http_fetcher_.get(), transfer_successful_);
+    return;
+  }
+  if (source_verification_paused_) {
+    LOG(INFO) << "Resuming the download after verifying the source.";
+    source_verification_paused_ = false;
+    if (!suspended_)
+      http_fetcher_->Unpause();
+  }
+}
+
 void DownloadAction::TransferComplete(HttpFetcher* fetcher, bool successful) {
+  if (delta_performer_ && writer_ == delta_performer_.get() &&
+      delta_performer_->IsVerifyingSource()) {
+    // The data received during the verification is applied first, see
+    // SourceVerified().
+    transfer_complete_pending_ = true;
+    transfer_successful_ = successful;
+    return;
+  }
+  source_verification_paused_ = false;
   if (writer_) {
     LOG_IF(WARNING, writer_->Close() != 0) << "Error closing the writer.";
     if (delta_performer_.get() == writer_) {
@@ -391,13 +746,7 @@ void DownloadAction::TransferComplete(HttpFetcher* fetcher, bool successful) {
       // All payloads have been applied and verified.
       if (delegate_)
         delegate_->DownloadComplete();
-
-      // Log UpdateEngine.DownloadAction.* histograms to help diagnose
-      // long-blocking operations.
-      std::string histogram_output;
-      base::StatisticsRecorder::WriteGraph("UpdateEngine.DownloadAction.",
-                                           &histogram_output);
-      LOG(INFO) << histogram_output;
+      LogPerformance();
     } else {
       LOG(ERROR) << "Download of " << install_plan_.download_url
                  << " failed due to payload verification error.";
@@ -23,6 +23,11 @@
 
 #include <memory>
 #include <string>
+#include <vector>
+
+#include <base/callback.h>
+#include <base/time/time.h>
+#include <brillo/message_loops/message_loop.h>
 
 #include "update_engine/common/action.h"
 #include "update_engine/common/boot_control_interface.h"
@@ -30,6 +35,7 @@
 #include "update_engine/common/multi_range_http_fetcher.h"
 #include "update_engine/payload_consumer/delta_performer.h"
 #include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/memory_budget.h"
 #include "update_engine/system_state.h"
 
 // The Download Action downloads a specified url to disk. The url should point
@@ -69,6 +75,9 @@ class DownloadAction : public InstallPlanAction, public HttpFetcherDelegate {
   // Debugging/logging
   static std::string StaticType() { return "DownloadAction"; }
 
+  // Creates a new HttpFetcher, owned by the caller.
+  using HttpFetcherFactory = base::Callback<HttpFetcher*()>;
+
   // Takes ownership of the passed in HttpFetcher. Useful for testing.
   // A good calling pattern is:
   // DownloadAction(prefs, boot_contol, hardware, system_state,
@@ -90,8 +99,16 @@ class DownloadAction : public InstallPlanAction, public HttpFetcherDelegate {
 
   // Testing
   void SetTestFileWriter(FileWriter* writer) { writer_ = writer; }
+  // Sets the writers the payloads are written to when they are downloaded
+  // concurrently, one per payload.
+  void SetTestPayloadWriters(const std::vector<FileWriter*>& writers) {
+    test_payload_writers_ = writers;
+  }
 
-  int GetHTTPResponseCode() { return http_fetcher_->http_response_code(); }
+  int GetHTTPResponseCode() {
+    return payload_downloads_.empty() ? http_fetcher_->http_response_code()
+                                      : http_response_code_;
+  }
 
   // HttpFetcherDelegate methods (see http_fetcher.h)
   bool ReceivedBytes(HttpFetcher* fetcher,
@@ -106,6 +123,16 @@ class DownloadAction : public InstallPlanAction, public HttpFetcherDelegate {
 
   void set_base_offset(int64_t base_offset) { base_offset_ = base_offset; }
 
+  // Downloads and applies up to |max_concurrent_payloads| payloads at the same
+  // time, each with its own fetcher created by |fetcher_factory|. This is only
+  // done when all the payloads of an update are downloaded from the beginning
+  // without p2p; otherwise, they are downloaded in sequence.
+  void set_concurrent_payloads(size_t max_concurrent_payloads,
+                               const HttpFetcherFactory& fetcher_factory) {
+    max_concurrent_payloads_ = max_concurrent_payloads;
+    fetcher_factory_ = fetcher_factory;
+  }
+
   HttpFetcher* http_fetcher() { return http_fetcher_.get(); }
 
   // Returns the p2p file id for the file being written or the empty
@@ -134,6 +161,42 @@ class DownloadAction : public InstallPlanAction, public HttpFetcherDelegate {
   // Start downloading the current payload using delta_performer.
   void StartDownloading();
 
+  // Called by |delta_performer_| once it verified the source, to apply the
+  // data received meanwhile and resume the download, or fail.
+  void SourceVerified();
+
+  // Logs the performance of the download once all the payloads were applied.
+  void LogPerformance();
+
+  // The download and application of one payload when the payloads are
+  // downloaded concurrently.
+  class PayloadDownload;
+
+  // Returns whether the payloads of |install_plan_| can be downloaded
+  // concurrently.
+  bool CanDownloadConcurrently();
+
+  // Starts downloading the next payload that wasn't started yet, if any.
+  // Returns whether a download was started.
+  bool StartNextPayloadDownload();
+
+  // Called by a PayloadDownload when its payload was applied and verified, or
+  // failed with |code|.
+  void PayloadDownloadDone(PayloadDownload* download, ErrorCode code);
+
+  // Terminates the payload downloads still in progress.
+  void TerminatePayloadDownloads();
+
+  // Adds the partitions of the payloads downloaded concurrently to
+  // |install_plan_|, in the order of the payloads, and completes the action.
+  void FinishPayloadDownloads();
+
+  // Completes the action with |code| from a task posted to the message loop,
+  // since the payload downloads are destroyed with the action and it is
+  // completed from the callback of one of their fetchers.
+  void PostCompletePayloadDownloads(ErrorCode code);
+  void CompletePayloadDownloads(ErrorCode code);
+
   // The InstallPlan passed in
   InstallPlan install_plan_;
 
@@ -173,6 +236,11 @@ class DownloadAction : public InstallPlanAction, public HttpFetcherDelegate {
   uint64_t bytes_total_{0};
   bool download_active_{false};
 
+  // The time since which the received data has been waited for, used to
+  // measure the fetch throughput. The concurrent payload downloads share it,
+  // so the time they wait together is only counted once.
+  base::TimeTicks fetch_start_time_;
+
   // The file-id for the file we're sharing or the empty string
   // if we're not using p2p to share.
   std::string p2p_file_id_;
@@ -184,12 +252,42 @@ class DownloadAction : public InstallPlanAction, public HttpFetcherDelegate {
   // Set to |false| if p2p file is not visible.
   bool p2p_visible_;
 
+  // Whether the action is suspended, and whether the download is paused while
+  // |delta_performer_| verifies the source. The fetcher is paused while either
+  // is set.
+  bool suspended_{false};
+  bool source_verification_paused_{false};
+  // Whether the transfer completed during the source verification, and how,
+  // so it's handled once the data received meanwhile is applied.
+  bool transfer_complete_pending_{false};
+  bool transfer_successful_{false};
+
   // Loaded from prefs before downloading any payload.
   size_t resume_payload_index_{0};
 
   // Offset of the payload in the download URL, used by UpdateAttempterAndroid.
   int64_t base_offset_{0};
 
+  // The maximum number of payloads downloaded at the same time, and the
+  // factory of the fetchers used to download them.
+  size_t max_concurrent_payloads_{1};
+  HttpFetcherFactory fetcher_factory_;
+
+  // The downloads of the payloads started so far, in the order of the
+  // payloads, when they are downloaded concurrently.
+  std::vector<std::unique_ptr<PayloadDownload>> payload_downloads_;
+  size_t payloads_applied_{0};
+  // The memory budget of each payload download, a share of the budget of the
+  // device.
+  MemoryBudget payload_memory_budget_{MemoryBudget::kDefaultBudget};
+  // The task completing the action once the payload downloads are done.
+  brillo::MessageLoop::TaskId complete_task_id_{
+      brillo::MessageLoop::kTaskIdNull};
+  // The writers replacing the DeltaPerformer of each payload in tests.
+  std::vector<FileWriter*> test_payload_writers_;
+  // The HTTP response code of the last payload download that finished.
+  int http_response_code_{0};
+
   DISALLOW_COPY_AND_ASSIGN(DownloadAction);
 };
 
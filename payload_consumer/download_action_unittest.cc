@@ -510,6 +510,135 @@ TEST(DownloadActionTest, PassObjectOutTest) {
   EXPECT_EQ(true, delegate.did_test_action_run_);
 }
 
+namespace {
+// An ActionProcessorDelegate that records the result of the DownloadAction
+// and terminates the run loop when the processing is done.
+class ConcurrentPayloadsTestProcessorDelegate : public ActionProcessorDelegate {
+ public:
+  void ProcessingDone(const ActionProcessor* processor,
+                      ErrorCode code) override {
+    brillo::MessageLoop::current()->BreakLoop();
+  }
+  void ActionCompleted(ActionProcessor* processor,
+                       AbstractAction* action,
+                       ErrorCode code) override {
+    if (action->Type() == DownloadAction::StaticType())
+      download_code_ = code;
+  }
+
+  ErrorCode download_code_{ErrorCode::kError};
+};
+
+// Returns a fetcher of the next payload in |payload_datas|.
+HttpFetcher* NewPayloadFetcher(const std::vector<brillo::Blob>* payload_datas,
+                               size_t* next_payload) {
+  const brillo::Blob& data = (*payload_datas)[(*next_payload)++];
+  return new MockHttpFetcher(data.data(), data.size(), nullptr);
+}
+
+// Downloads |payload_datas| concurrently, each one to the writer at the same
+// index of |writers|, and returns the result of the DownloadAction.
+ErrorCode DownloadConcurrentPayloads(
+    const std::vector<brillo::Blob>& payload_datas,
+    const std::vector<FileWriter*>& writers,
+    bool expect_success) {
+  brillo::FakeMessageLoop loop(nullptr);
+  loop.SetAsCurrent();
+  FakeSystemState fake_system_state;
+  EXPECT_CALL(*fake_system_state.mock_payload_state(), GetPayloadUrl(_))
+      .WillRepeatedly(Return("http://fake/payload"));
+  EXPECT_CALL(*fake_system_state.mock_payload_state(), NextPayload())
+      .Times(expect_success ? payload_datas.size() - 1 : 0)
+      .WillRepeatedly(Return(true));
+
+  InstallPlan install_plan;
+  uint64_t total_size = 0;
+  for (const auto& data : payload_datas) {
+    uint64_t size = data.size();
+    install_plan.payloads.push_back(
+        {.size = size, .type = InstallPayloadType::kFull});
+    total_size += size;
+  }
+  auto feeder_action = std::make_unique<ObjectFeederAction<InstallPlan>>();
+  feeder_action->set_obj(install_plan);
+  MockPrefs prefs;
+  // The payloads are only downloaded with the fetchers of the factory.
+  MockHttpFetcher* http_fetcher = new MockHttpFetcher("", 0, nullptr);
+  http_fetcher->set_never_use(true);
+  auto download_action =
+      std::make_unique<DownloadAction>(&prefs,
+                                       fake_system_state.boot_control(),
+                                       fake_system_state.hardware(),
+                                       &fake_system_state,
+                                       http_fetcher,
+                                       false /* interactive */);
+  download_action->SetTestPayloadWriters(writers);
+  size_t next_payload = 0;
+  download_action->set_concurrent_payloads(
+      2, base::Bind(&NewPayloadFetcher, &payload_datas, &next_payload));
+  BondActions(feeder_action.get(), download_action.get());
+
+  MockDownloadActionDelegate download_delegate;
+  download_action->set_delegate(&download_delegate);
+  EXPECT_CALL(download_delegate, BytesReceived(_, _, total_size))
+      .Times(AtLeast(1));
+  // The progress of all the payloads is reported together.
+  EXPECT_CALL(download_delegate, BytesReceived(_, total_size, total_size))
+      .Times(expect_success ? 1 : 0);
+  EXPECT_CALL(download_delegate, DownloadComplete())
+      .Times(expect_success ? 1 : 0);
+
+  ActionProcessor processor;
+  ConcurrentPayloadsTestProcessorDelegate delegate;
+  processor.set_delegate(&delegate);
+  processor.EnqueueAction(std::move(feeder_action));
+  processor.EnqueueAction(std::move(download_action));
+
+  loop.PostTask(
+      FROM_HERE,
+      base::Bind(
+          [](ActionProcessor* processor) { processor->StartProcessing(); },
+          base::Unretained(&processor)));
+  loop.Run();
+  EXPECT_FALSE(loop.PendingTasks());
+  if (expect_success)
+    EXPECT_EQ(payload_datas.size(), next_payload);
+  return delegate.download_code_;
+}
+}  // namespace
+
+TEST(DownloadActionTest, ConcurrentPayloadsTest) {
+  std::vector<brillo::Blob> payload_datas;
+  payload_datas.emplace_back(3 * kMockHttpFetcherChunkSize + 10, 'a');
+  payload_datas.emplace_back(kMockHttpFetcherChunkSize, 'b');
+  payload_datas.emplace_back(2 * kMockHttpFetcherChunkSize, 'c');
+
+  MockFileWriter writers[3];
+  for (MockFileWriter& writer : writers) {
+    EXPECT_CALL(writer, Close()).WillOnce(Return(0));
+    EXPECT_CALL(writer, Write(_, _, _))
+        .WillRepeatedly(
+            DoAll(SetArgPointee<2>(ErrorCode::kSuccess), Return(true)));
+  }
+  EXPECT_EQ(ErrorCode::kSuccess,
+            DownloadConcurrentPayloads(
+                payload_datas, {&writers[0], &writers[1], &writers[2]}, true));
+}
+
+TEST(DownloadActionTest, ConcurrentPayloadsFailWriteTest) {
+  std::vector<brillo::Blob> payload_datas;
+  payload_datas.emplace_back(3 * kMockHttpFetcherChunkSize, 'a');
+  payload_datas.emplace_back(3 * kMockHttpFetcherChunkSize, 'b');
+
+  TestDirectFileWriter writers[2];
+  for (TestDirectFileWriter& writer : writers)
+    EXPECT_EQ(0, writer.Open("/dev/null", O_WRONLY | O_CREAT, 0));
+  writers[0].set_fail_write(3);
+  EXPECT_EQ(ErrorCode::kDownloadWriteError,
+            DownloadConcurrentPayloads(
+                payload_datas, {&writers[0], &writers[1]}, false));
+}
+
 // Test fixture for P2P tests.
 class P2PDownloadActionTest : public testing::Test {
  protected:
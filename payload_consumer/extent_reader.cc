@@ -18,11 +18,13 @@
 
 #include <algorithm>
 
+#include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_consumer/perf_counters.h"
 
 using google::protobuf::RepeatedPtrField;
 
@@ -98,4 +100,94 @@ bool DirectExtentReader::Read(void* buffer, size_t count) {
   return true;
 }
 
+namespace {
+// The minimum readahead is this fraction of the cache size, so a random miss
+// does not pay for a full window read.
+const size_t kMinReadaheadDivisor = 16;
+}  // namespace
+
+bool CachedExtentReader::Init(FileDescriptorPtr fd,
+                              const RepeatedPtrField<Extent>& extents,
+                              uint32_t block_size) {
+  TEST_AND_RETURN_FALSE(block_size > 0);
+  TEST_AND_RETURN_FALSE(reader_.Init(fd, extents, block_size));
+  block_size_ = block_size;
+  offset_ = 0;
+  total_size_ = utils::BlocksInExtents(extents) * block_size_;
+
+  // Keep at least one block in the window and never allocate more than what
+  // the extents can hold.
+  uint64_t cache_blocks = std::max<uint64_t>(cache_size_ / block_size_, 1);
+  cache_blocks = std::min(cache_blocks, total_size_ / block_size_);
+  cache_.resize(cache_blocks * block_size_);
+  cache_start_ = 0;
+  cache_bytes_ = 0;
+
+  uint64_t min_blocks = std::max<uint64_t>(
+      cache_blocks / kMinReadaheadDivisor, std::min<uint64_t>(cache_blocks, 1));
+  min_readahead_ = min_blocks * block_size_;
+  readahead_ = min_readahead_;
+  cache_misses_ = 0;
+  return true;
+}
+
+bool CachedExtentReader::Seek(uint64_t offset) {
+  TEST_AND_RETURN_FALSE(offset <= total_size_);
+  offset_ = offset;
+  return true;
+}
+
+bool CachedExtentReader::Read(void* buffer, size_t count) {
+  TEST_AND_RETURN_FALSE(offset_ <= total_size_ &&
+                        count <= total_size_ - offset_);
+  auto bytes = reinterpret_cast<uint8_t*>(buffer);
+  // Whether the whole read was served from the window.
+  bool hit = true;
+  while (count > 0) {
+    if (offset_ >= cache_start_ && offset_ < cache_start_ + cache_bytes_) {
+      uint64_t cache_offset = offset_ - cache_start_;
+      size_t bytes_to_copy =
+          std::min<uint64_t>(count, cache_bytes_ - cache_offset);
+      memcpy(bytes, cache_.data() + cache_offset, bytes_to_copy);
+      bytes += bytes_to_copy;
+      count -= bytes_to_copy;
+      offset_ += bytes_to_copy;
+      continue;
+    }
+    hit = false;
+    if (count >= cache_.size()) {
+      // Large reads gain nothing from the window; read them directly.
+      TEST_AND_RETURN_FALSE(reader_.Seek(offset_));
+      TEST_AND_RETURN_FALSE(reader_.Read(bytes, count));
+      offset_ += count;
+      break;
+    }
+    TEST_AND_RETURN_FALSE(FillCache());
+  }
+  PerfCounters::Get()->AddCacheLookup(PerfCounters::Cache::kSourceRead, hit);
+  return true;
+}
+
+bool CachedExtentReader::FillCache() {
+  uint64_t cache_end = cache_start_ + cache_bytes_;
+  // A miss that lands at, or within one readahead past, the end of the
+  // previous window is treated as a sequential stream.
+  bool sequential = cache_bytes_ > 0 && offset_ >= cache_end &&
+                    offset_ - cache_end < readahead_;
+  if (sequential) {
+    readahead_ = std::min(readahead_ * 2, cache_.size());
+  } else {
+    readahead_ = min_readahead_;
+  }
+
+  uint64_t start = offset_ / block_size_ * block_size_;
+  uint64_t size = std::min<uint64_t>(readahead_, total_size_ - start);
+  TEST_AND_RETURN_FALSE(reader_.Seek(start));
+  TEST_AND_RETURN_FALSE(reader_.Read(cache_.data(), size));
+  cache_start_ = start;
+  cache_bytes_ = size;
+  cache_misses_++;
+  return true;
+}
+
 }  // namespace chromeos_update_engine
@@ -19,6 +19,8 @@
 
 #include <vector>
 
+#include <brillo/secure_blob.h>
+
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/update_metadata.pb.h"
 
@@ -77,6 +79,56 @@ class DirectExtentReader : public ExtentReader {
   DISALLOW_COPY_AND_ASSIGN(DirectExtentReader);
 };
 
+// CachedExtentReader serves reads from an in-memory window over the
+// concatenated extents and only goes to the underlying file descriptor when a
+// read falls outside of it. It is meant for consumers like bspatch and
+// puffpatch that issue many small, mostly forward reads with occasional
+// back-seeks. The window is always block aligned and its size adapts to the
+// access pattern: consecutive misses that continue where the previous window
+// ended double the readahead up to |cache_size|, while a random miss resets it
+// to the minimum. Reads larger than the cache bypass it entirely.
+class CachedExtentReader : public ExtentReader {
+ public:
+  explicit CachedExtentReader(size_t cache_size) : cache_size_(cache_size) {}
+  ~CachedExtentReader() override = default;
+
+  bool Init(FileDescriptorPtr fd,
+            const google::protobuf::RepeatedPtrField<Extent>& extents,
+            uint32_t block_size) override;
+  bool Seek(uint64_t offset) override;
+  bool Read(void* bytes, size_t count) override;
+
+  // Returns the number of times the window had to be refilled from the
+  // underlying file descriptor.
+  uint64_t cache_misses() const { return cache_misses_; }
+
+ private:
+  // Refills the window so it contains |offset_|.
+  bool FillCache();
+
+  DirectExtentReader reader_;
+  size_t cache_size_;
+  size_t block_size_{0};
+
+  // Offset assuming all extents are concatenated.
+  uint64_t offset_{0};
+  uint64_t total_size_{0};
+
+  // The window of data currently cached, starting at |cache_start_| in the
+  // concatenated extents and holding |cache_bytes_| valid bytes of |cache_|.
+  brillo::Blob cache_;
+  uint64_t cache_start_{0};
+  uint64_t cache_bytes_{0};
+
+  // Bounds and current value of the adaptive readahead size.
+  size_t min_readahead_{0};
+  size_t readahead_{0};
+
+  uint64_t cache_misses_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(CachedExtentReader);
+};
+
 }  // namespace chromeos_update_engine
 
 #endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_EXTENT_READER_H_
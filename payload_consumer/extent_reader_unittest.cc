@@ -20,13 +20,16 @@
 
 #include <algorithm>
 #include <string>
+#include <utility>
 #include <vector>
 
+#include <base/logging.h>
 #include <brillo/secure_blob.h>
 #include <gtest/gtest.h>
 
 #include "update_engine/common/test_utils.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/fake_file_descriptor.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_generator/extent_ranges.h"
@@ -34,6 +37,7 @@
 
 using chromeos_update_engine::test_utils::ExpectVectorsEq;
 using std::min;
+using std::pair;
 using std::string;
 using std::vector;
 
@@ -167,4 +171,111 @@ TEST_F(ExtentReaderTest, RandomReadTest) {
   }
 }
 
+TEST_F(ExtentReaderTest, CachedRandomReadTest) {
+  vector<Extent> extents = {ExtentForRange(0, 0),
+                            ExtentForRange(1, 1),
+                            ExtentForRange(3, 0),
+                            ExtentForRange(4, 2),
+                            ExtentForRange(7, 1)};
+  // Use a cache smaller than the extents so both hits, misses and bypassed
+  // reads are exercised.
+  CachedExtentReader reader(2 * kBlockSize);
+  EXPECT_TRUE(reader.Init(fd_, {extents.begin(), extents.end()}, kBlockSize));
+
+  brillo::Blob result;
+  ReadExtents(extents, &result);
+
+  brillo::Blob blob(utils::BlocksInExtents(extents) * kBlockSize);
+  srand(time(nullptr));
+  uint32_t rand_seed;
+  for (size_t idx = 0; idx < kRandomIterations; idx++) {
+    size_t start = rand_r(&rand_seed) % blob.size();
+    size_t size = rand_r(&rand_seed) % (blob.size() - start);
+    EXPECT_TRUE(reader.Seek(start));
+    EXPECT_TRUE(reader.Read(blob.data(), size));
+    for (size_t i = 0; i < size; i++) {
+      ASSERT_EQ(blob[i], result[start + i]);
+    }
+  }
+}
+
+TEST_F(ExtentReaderTest, CachedOverflowTest) {
+  vector<Extent> extents = {ExtentForRange(1, 1)};
+  CachedExtentReader reader(4 * kBlockSize);
+  EXPECT_TRUE(reader.Init(fd_, {extents.begin(), extents.end()}, kBlockSize));
+  brillo::Blob blob(kBlockSize + 1);
+  EXPECT_TRUE(reader.Seek(kBlockSize));
+  EXPECT_TRUE(reader.Read(blob.data(), 0));
+  EXPECT_FALSE(reader.Read(blob.data(), 1));
+  EXPECT_FALSE(reader.Seek(kBlockSize + 1));
+  EXPECT_TRUE(reader.Seek(0));
+  EXPECT_FALSE(reader.Read(blob.data(), blob.size()));
+}
+
+// Replays the access pattern bspatch produces on its old file: small reads
+// walking forward through each diff region, with a back-seek every few
+// regions. Checks the data and that the number of reads reaching the file
+// descriptor drops by orders of magnitude compared to DirectExtentReader.
+TEST_F(ExtentReaderTest, CachedBspatchAccessPatternTest) {
+  const size_t kFakeBlockSize = 4096;
+  const size_t kReadSize = 64;
+  vector<Extent> extents = {ExtentForRange(10, 300),
+                            ExtentForRange(500, 200),
+                            ExtentForRange(1000, 12)};
+  uint64_t total_size = utils::BlocksInExtents(extents) * kFakeBlockSize;
+
+  vector<pair<uint64_t, uint64_t>> accesses;
+  uint64_t pos = 0;
+  for (size_t region = 0; pos < total_size; region++) {
+    uint64_t region_size = std::min<uint64_t>(8192 + (region % 5) * 4096,
+                                              total_size - pos);
+    for (uint64_t offset = 0; offset < region_size; offset += kReadSize) {
+      accesses.emplace_back(
+          pos + offset, std::min<uint64_t>(kReadSize, region_size - offset));
+    }
+    pos += region_size;
+    // Every fourth region bspatch jumps back to re-read older data.
+    if (region % 4 == 3 && pos > 3 * 4096)
+      pos -= 3 * 4096;
+    else
+      pos += 1024;
+  }
+
+  brillo::Blob expected_data = FakeFileDescriptorData(1100 * kFakeBlockSize);
+  auto replay = [&](ExtentReader* reader) -> size_t {
+    FakeFileDescriptor* fake_fd = new FakeFileDescriptor();
+    FileDescriptorPtr fd(fake_fd);
+    EXPECT_TRUE(
+        reader->Init(fd, {extents.begin(), extents.end()}, kFakeBlockSize));
+    brillo::Blob expected;
+    for (const auto& extent : extents) {
+      expected.insert(
+          expected.end(),
+          expected_data.begin() + extent.start_block() * kFakeBlockSize,
+          expected_data.begin() +
+              (extent.start_block() + extent.num_blocks()) * kFakeBlockSize);
+    }
+    brillo::Blob buf(kReadSize);
+    for (const auto& access : accesses) {
+      EXPECT_TRUE(reader->Seek(access.first));
+      EXPECT_TRUE(reader->Read(buf.data(), access.second));
+      EXPECT_TRUE(std::equal(buf.begin(),
+                             buf.begin() + access.second,
+                             expected.begin() + access.first));
+    }
+    return fake_fd->GetReadOps().size();
+  };
+
+  DirectExtentReader direct_reader;
+  size_t direct_reads = replay(&direct_reader);
+  CachedExtentReader cached_reader(1024 * 1024);
+  size_t cached_reads = replay(&cached_reader);
+  LOG(INFO) << "Replayed " << accesses.size() << " bspatch reads: "
+            << direct_reads << " fd reads direct, " << cached_reads
+            << " fd reads cached (" << cached_reader.cache_misses()
+            << " cache misses).";
+  EXPECT_GE(direct_reads, accesses.size());
+  EXPECT_LT(cached_reads * 50, direct_reads);
+}
+
 }  // namespace chromeos_update_engine
@@ -19,6 +19,7 @@
 
 #include <memory>
 #include <utility>
+#include <vector>
 
 #include <base/logging.h>
 #include <brillo/secure_blob.h>
@@ -59,7 +60,12 @@ class DirectExtentWriter : public ExtentWriter {
             uint32_t block_size) override {
     fd_ = fd;
     block_size_ = block_size;
-    extents_ = extents;
+    // Copy only the block numbers into a single array, instead of allocating
+    // a protobuf message for every extent.
+    extents_.clear();
+    extents_.reserve(extents.size());
+    for (const Extent& extent : extents)
+      extents_.emplace_back(extent.start_block(), extent.num_blocks());
     cur_extent_ = extents_.begin();
     return true;
   }
@@ -71,9 +77,10 @@ class DirectExtentWriter : public ExtentWriter {
   size_t block_size_{0};
   // Bytes written into |cur_extent_| thus far.
   uint64_t extent_bytes_written_{0};
-  google::protobuf::RepeatedPtrField<Extent> extents_;
+  // The extents to write to, as pairs of start block and number of blocks.
+  std::vector<std::pair<uint64_t, uint64_t>> extents_;
   // The next call to write should correspond to |cur_extents_|.
-  google::protobuf::RepeatedPtrField<Extent>::iterator cur_extent_;
+  std::vector<std::pair<uint64_t, uint64_t>>::const_iterator cur_extent_;
 };
 
 }  // namespace chromeos_update_engine
@@ -16,6 +16,10 @@
 
 #include "update_engine/payload_consumer/fec_file_descriptor.h"
 
+#include <string>
+
+using std::string;
+
 namespace chromeos_update_engine {
 
 bool FecFileDescriptor::Open(const char* path, int flags) {
@@ -71,6 +75,18 @@ bool FecFileDescriptor::BlkIoctl(int request,
   return false;
 }
 
+bool FecFileDescriptor::GetVerityHashTreeInfo(VerityHashTreeInfo* info) {
+  if (!fh_.has_verity())
+    return false;
+  fec_verity_metadata metadata;
+  if (!fh_.get_verity_metadata(metadata) || metadata.disabled ||
+      metadata.table == nullptr) {
+    LOG(WARNING) << "Couldn't load the verity metadata";
+    return false;
+  }
+  return ParseVerityTable(string(metadata.table, metadata.table_length), info);
+}
+
 bool FecFileDescriptor::Close() {
   return fh_.close();
 }
@@ -20,6 +20,7 @@
 #include <fec/io.h>
 
 #include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_consumer/verity_block_repairer.h"
 
 // A FileDescriptor implementation with error correction based on the "libfec"
 // library. The libfec on the running system allows to parse the error
@@ -55,6 +56,10 @@ class FecFileDescriptor : public FileDescriptor {
     return static_cast<bool>(fh_);
   }
 
+  // Loads the location of the verity hash tree of the open file into |info|.
+  // Returns false if the file has no usable verity metadata.
+  bool GetVerityHashTreeInfo(VerityHashTreeInfo* info);
+
  protected:
   fec::io fh_;
   uint64_t dev_size_{0};
@@ -32,16 +32,17 @@ namespace chromeos_update_engine {
 
 namespace {
 
-// Size of the buffer used to copy blocks.
+// Default size of the buffer used to copy blocks.
 const uint64_t kMaxCopyBufferSize = 1024 * 1024;
 
 bool CommonHashExtents(FileDescriptorPtr source,
                        const RepeatedPtrField<Extent>& src_extents,
                        DirectExtentWriter* writer,
                        uint64_t block_size,
-                       brillo::Blob* hash_out) {
+                       brillo::Blob* hash_out,
+                       uint64_t buffer_size) {
   auto total_blocks = utils::BlocksInExtents(src_extents);
-  auto buffer_blocks = kMaxCopyBufferSize / block_size;
+  auto buffer_blocks = buffer_size / block_size;
   // Ensure we copy at least one block at a time.
   if (buffer_blocks < 1)
     buffer_blocks = 1;
@@ -82,12 +83,28 @@ bool CopyAndHashExtents(FileDescriptorPtr source,
                         const RepeatedPtrField<Extent>& tgt_extents,
                         uint64_t block_size,
                         brillo::Blob* hash_out) {
+  return CopyAndHashExtents(source,
+                            src_extents,
+                            target,
+                            tgt_extents,
+                            block_size,
+                            hash_out,
+                            kMaxCopyBufferSize);
+}
+
+bool CopyAndHashExtents(FileDescriptorPtr source,
+                        const RepeatedPtrField<Extent>& src_extents,
+                        FileDescriptorPtr target,
+                        const RepeatedPtrField<Extent>& tgt_extents,
+                        uint64_t block_size,
+                        brillo::Blob* hash_out,
+                        uint64_t buffer_size) {
   DirectExtentWriter writer;
   TEST_AND_RETURN_FALSE(writer.Init(target, tgt_extents, block_size));
   TEST_AND_RETURN_FALSE(utils::BlocksInExtents(src_extents) ==
                         utils::BlocksInExtents(tgt_extents));
-  TEST_AND_RETURN_FALSE(
-      CommonHashExtents(source, src_extents, &writer, block_size, hash_out));
+  TEST_AND_RETURN_FALSE(CommonHashExtents(
+      source, src_extents, &writer, block_size, hash_out, buffer_size));
   return true;
 }
 
@@ -95,7 +112,17 @@ bool ReadAndHashExtents(FileDescriptorPtr source,
                         const RepeatedPtrField<Extent>& extents,
                         uint64_t block_size,
                         brillo::Blob* hash_out) {
-  return CommonHashExtents(source, extents, nullptr, block_size, hash_out);
+  return ReadAndHashExtents(
+      source, extents, block_size, hash_out, kMaxCopyBufferSize);
+}
+
+bool ReadAndHashExtents(FileDescriptorPtr source,
+                        const RepeatedPtrField<Extent>& extents,
+                        uint64_t block_size,
+                        brillo::Blob* hash_out,
+                        uint64_t buffer_size) {
+  return CommonHashExtents(
+      source, extents, nullptr, block_size, hash_out, buffer_size);
 }
 
 }  // namespace fd_utils
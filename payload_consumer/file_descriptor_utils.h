@@ -42,6 +42,17 @@ bool CopyAndHashExtents(
     uint64_t block_size,
     brillo::Blob* hash_out);
 
+// Same as above, but copies through a buffer of at most |buffer_size| bytes
+// instead of the default one.
+bool CopyAndHashExtents(
+    FileDescriptorPtr source,
+    const google::protobuf::RepeatedPtrField<Extent>& src_extents,
+    FileDescriptorPtr target,
+    const google::protobuf::RepeatedPtrField<Extent>& tgt_extents,
+    uint64_t block_size,
+    brillo::Blob* hash_out,
+    uint64_t buffer_size);
+
 // Reads blocks from |source| and calculates the hash. The blocks to read are
 // specified by |extents|. Stores the hash in |hash_out| if it is not null. The
 // block sizes are passed as |block_size|. In case of error reading, it returns
@@ -52,6 +63,15 @@ bool ReadAndHashExtents(
     uint64_t block_size,
     brillo::Blob* hash_out);
 
+// Same as above, but reads through a buffer of at most |buffer_size| bytes
+// instead of the default one.
+bool ReadAndHashExtents(
+    FileDescriptorPtr source,
+    const google::protobuf::RepeatedPtrField<Extent>& extents,
+    uint64_t block_size,
+    brillo::Blob* hash_out,
+    uint64_t buffer_size);
+
 }  // namespace fd_utils
 }  // namespace chromeos_update_engine
 
@@ -30,6 +30,7 @@
 #include <brillo/streams/file_stream.h>
 
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/perf_counters.h"
 
 using brillo::data_encoding::Base64Encode;
 using std::string;
@@ -99,6 +100,18 @@ void FilesystemVerifierAction::StartPartitionHashing() {
       break;
   }
 
+  // The verity data was also written when the hash was computed. On mismatch
+  // the partition is read back, to also check the source partition.
+  if (verifier_step_ == VerifierStep::kVerifyTargetHash &&
+      !partition.applied_target_hash.empty() &&
+      partition.applied_target_hash == partition.target_hash) {
+    LOG(INFO) << "Partition " << partition_index_ << " (" << partition.name
+              << ") was verified while applying the update.";
+    partition_index_++;
+    StartPartitionHashing();
+    return;
+  }
+
   if (part_path.empty()) {
     if (partition_size_ == 0) {
       LOG(INFO) << "Skip hashing partition " << partition_index_ << " ("
@@ -134,6 +147,7 @@ void FilesystemVerifierAction::StartPartitionHashing() {
   hasher_ = std::make_unique<HashCalculator>();
 
   offset_ = 0;
+  start_time_ = base::TimeTicks::Now();
   if (verifier_step_ == VerifierStep::kVerifyTargetHash &&
       install_plan_.write_verity) {
     if (!verity_writer_->Init(partition)) {
@@ -232,6 +246,9 @@ void FilesystemVerifierAction::FinishPartitionHashing() {
     Cleanup(ErrorCode::kError);
     return;
   }
+  PerfCounters::Get()->AddStage(PerfCounters::Stage::kVerify,
+                                offset_,
+                                base::TimeTicks::Now() - start_time_);
   InstallPlan::Partition& partition =
       install_plan_.partitions[partition_index_];
   LOG(INFO) << "Hash of " << partition.name << ": "
@@ -24,6 +24,7 @@
 #include <string>
 #include <vector>
 
+#include <base/time/time.h>
 #include <brillo/streams/stream.h>
 
 #include "update_engine/common/action.h"
@@ -119,6 +120,9 @@ class FilesystemVerifierAction : public InstallPlanAction {
   // The byte offset that we are reading in the current partition.
   uint64_t offset_{0};
 
+  // The time the hashing of the current partition started.
+  base::TimeTicks start_time_;
+
   DISALLOW_COPY_AND_ASSIGN(FilesystemVerifierAction);
 };
 
@@ -254,6 +254,50 @@ TEST_F(FilesystemVerifierActionTest, NonExistentDriveTest) {
   EXPECT_EQ(ErrorCode::kFilesystemVerifierError, delegate.code_);
 }
 
+TEST_F(FilesystemVerifierActionTest, AppliedTargetHashTest) {
+  InstallPlan install_plan;
+  InstallPlan::Partition part;
+  part.name = "part";
+  part.target_path = "/no/such/file";
+  part.target_size = 4096;
+  part.target_hash = {1, 2, 3};
+  part.applied_target_hash = part.target_hash;
+  install_plan.partitions = {part};
+
+  BuildActions(install_plan);
+
+  FilesystemVerifierActionTest2Delegate delegate;
+  processor_.set_delegate(&delegate);
+
+  // The partition isn't read back.
+  processor_.StartProcessing();
+  EXPECT_FALSE(processor_.IsRunning());
+  EXPECT_TRUE(delegate.ran_);
+  EXPECT_EQ(ErrorCode::kSuccess, delegate.code_);
+}
+
+TEST_F(FilesystemVerifierActionTest, AppliedTargetHashMismatchTest) {
+  InstallPlan install_plan;
+  InstallPlan::Partition part;
+  part.name = "part";
+  part.target_path = "/no/such/file";
+  part.target_size = 4096;
+  part.target_hash = {1, 2, 3};
+  part.applied_target_hash = {4, 5, 6};
+  install_plan.partitions = {part};
+
+  BuildActions(install_plan);
+
+  FilesystemVerifierActionTest2Delegate delegate;
+  processor_.set_delegate(&delegate);
+
+  // The partition is read back.
+  processor_.StartProcessing();
+  EXPECT_FALSE(processor_.IsRunning());
+  EXPECT_TRUE(delegate.ran_);
+  EXPECT_EQ(ErrorCode::kFilesystemVerifierError, delegate.code_);
+}
+
 TEST_F(FilesystemVerifierActionTest, RunAsRootVerifyHashTest) {
   ASSERT_EQ(0U, getuid());
   EXPECT_TRUE(DoTest(false, false));
@@ -0,0 +1,175 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/hashing_file_descriptor.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <iterator>
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+// Size of the reads of the data that wasn't hashed when it was written, the
+// same FilesystemVerifierAction uses.
+const size_t kReadBackBufferSize = 128 * 1024;
+}  // namespace
+
+ssize_t HashingFileDescriptor::Read(void* buf, size_t count) {
+  ssize_t bytes_read = fd_->Read(buf, count);
+  if (bytes_read > 0)
+    offset_ += bytes_read;
+  return bytes_read;
+}
+
+ssize_t HashingFileDescriptor::Write(const void* buf, size_t count) {
+  ssize_t bytes_written = fd_->Write(buf, count);
+  if (bytes_written <= 0)
+    return bytes_written;
+  uint64_t start = offset_;
+  uint64_t end = start + bytes_written;
+  offset_ = end;
+  if (!valid_)
+    return bytes_written;
+
+  if (start < hashed_end_) {
+    LOG(WARNING) << "Offset " << start << " was written after being hashed.";
+    valid_ = false;
+  } else if (start == hashed_end_ && end < inline_end_) {
+    if (HashData(static_cast<const uint8_t*>(buf), bytes_written)) {
+      bytes_hashed_inline_ += bytes_written;
+      DropHashedPending();
+    }
+  } else {
+    AddPending(start, end);
+  }
+  return bytes_written;
+}
+
+off64_t HashingFileDescriptor::Seek(off64_t offset, int whence) {
+  off64_t result = fd_->Seek(offset, whence);
+  if (result >= 0)
+    offset_ = result;
+  return result;
+}
+
+bool HashingFileDescriptor::BlkIoctl(int request,
+                                     uint64_t start,
+                                     uint64_t length,
+                                     int* result) {
+  bool success = fd_->BlkIoctl(request, start, length, result);
+  // Whatever the ioctl did, the content of the range is only known after
+  // reading it back.
+  if (valid_ && length > 0) {
+    if (start < hashed_end_) {
+      LOG(WARNING) << "Offset " << start << " was changed after being hashed.";
+      valid_ = false;
+    } else {
+      AddPending(start, start + length);
+    }
+  }
+  return success;
+}
+
+bool HashingFileDescriptor::Flush() {
+  if (!fd_->Flush())
+    return false;
+  // Once flushed, the data written right after the hashed end can be read
+  // back. Failures only make the hash unavailable.
+  if (valid_ && !pending_.empty() && pending_.begin()->first == hashed_end_)
+    ReadBackAndHash(pending_.begin()->second);
+  return true;
+}
+
+bool HashingFileDescriptor::Finish(uint64_t size, brillo::Blob* out_hash) {
+  TEST_AND_RETURN_FALSE(Flush());
+  TEST_AND_RETURN_FALSE(valid_);
+  TEST_AND_RETURN_FALSE(hashed_end_ <= size);
+  TEST_AND_RETURN_FALSE(ReadBackAndHash(size));
+  TEST_AND_RETURN_FALSE(hasher_.Finalize());
+  *out_hash = hasher_.raw_hash();
+  // Nothing else can be hashed.
+  valid_ = false;
+  return true;
+}
+
+bool HashingFileDescriptor::HashData(const uint8_t* data, size_t count) {
+  if (!hasher_.Update(data, count) ||
+      (verity_writer_ && !verity_writer_->Update(hashed_end_, data, count))) {
+    LOG(ERROR) << "Unable to hash the data at offset " << hashed_end_;
+    valid_ = false;
+    return false;
+  }
+  hashed_end_ += count;
+  return true;
+}
+
+bool HashingFileDescriptor::ReadBackAndHash(uint64_t end) {
+  brillo::Blob buffer(kReadBackBufferSize);
+  while (hashed_end_ < end) {
+    size_t bytes_to_read =
+        std::min(static_cast<uint64_t>(buffer.size()), end - hashed_end_);
+    ssize_t bytes_read;
+    if (!utils::PReadAll(
+            fd_, buffer.data(), bytes_to_read, hashed_end_, &bytes_read) ||
+        bytes_read != static_cast<ssize_t>(bytes_to_read)) {
+      LOG(ERROR) << "Unable to read back " << bytes_to_read
+                 << " bytes at offset " << hashed_end_;
+      valid_ = false;
+      return false;
+    }
+    TEST_AND_RETURN_FALSE(HashData(buffer.data(), bytes_read));
+    bytes_read_back_ += bytes_read;
+  }
+  DropHashedPending();
+  // Restore the offset the reads moved.
+  TEST_AND_RETURN_FALSE(fd_->Seek(offset_, SEEK_SET) == offset_);
+  return true;
+}
+
+void HashingFileDescriptor::AddPending(uint64_t start, uint64_t end) {
+  // Merge with the ranges overlapping or adjacent to [start, end).
+  auto it = pending_.upper_bound(start);
+  if (it != pending_.begin() && std::prev(it)->second >= start) {
+    --it;
+    start = it->first;
+    end = std::max(end, it->second);
+    it = pending_.erase(it);
+  }
+  while (it != pending_.end() && it->first <= end) {
+    end = std::max(end, it->second);
+    it = pending_.erase(it);
+  }
+  pending_[start] = end;
+}
+
+void HashingFileDescriptor::DropHashedPending() {
+  while (!pending_.empty() && pending_.begin()->first < hashed_end_) {
+    uint64_t end = pending_.begin()->second;
+    pending_.erase(pending_.begin());
+    if (end > hashed_end_) {
+      pending_[hashed_end_] = end;
+      break;
+    }
+  }
+}
+
+}  // namespace chromeos_update_engine
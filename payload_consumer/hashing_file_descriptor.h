@@ -0,0 +1,115 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_HASHING_FILE_DESCRIPTOR_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_HASHING_FILE_DESCRIPTOR_H_
+
+#include <sys/types.h>
+
+#include <map>
+
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_consumer/verity_writer_interface.h"
+
+namespace chromeos_update_engine {
+
+// A FileDescriptor that hashes the data written to the underlying |fd_| from
+// the beginning of the file, so the hash of a partition is known once it is
+// written without reading it all back. The data is hashed as it is written as
+// long as it continues the hashed data; data written ahead of it is read back
+// once the data before it is written, and the blocks never written are read
+// back by Finish(). The hashed data is also passed to |verity_writer| in the
+// same order, if not null.
+class HashingFileDescriptor : public FileDescriptor {
+ public:
+  // Data that would reach |inline_end| is only hashed after the next Flush(),
+  // since the verity writer reads the data back from the partition at that
+  // point.
+  HashingFileDescriptor(FileDescriptorPtr fd,
+                        VerityWriterInterface* verity_writer,
+                        uint64_t inline_end)
+      : fd_(fd), verity_writer_(verity_writer), inline_end_(inline_end) {}
+  ~HashingFileDescriptor() override = default;
+
+  bool Open(const char* path, int flags, mode_t mode) override {
+    return fd_->Open(path, flags, mode);
+  }
+  bool Open(const char* path, int flags) override {
+    return fd_->Open(path, flags);
+  }
+  ssize_t Read(void* buf, size_t count) override;
+  ssize_t Write(const void* buf, size_t count) override;
+  off64_t Seek(off64_t offset, int whence) override;
+  uint64_t BlockDevSize() override { return fd_->BlockDevSize(); }
+  bool BlkIoctl(int request,
+                uint64_t start,
+                uint64_t length,
+                int* result) override;
+  bool Flush() override;
+  bool Close() override { return fd_->Close(); }
+  bool IsSettingErrno() override { return fd_->IsSettingErrno(); }
+  bool IsOpen() override { return fd_->IsOpen(); }
+
+  // Hashes the rest of the first |size| bytes of the file, reading back what
+  // wasn't hashed yet, and stores the hash in |out_hash|. Returns false if the
+  // hash can't be computed, for example because data before the hashed end was
+  // overwritten.
+  bool Finish(uint64_t size, brillo::Blob* out_hash);
+
+  // Number of bytes hashed from the written data and read back from |fd_|.
+  uint64_t bytes_hashed_inline() const { return bytes_hashed_inline_; }
+  uint64_t bytes_read_back() const { return bytes_read_back_; }
+
+ private:
+  // Hashes |count| bytes of |data|, which are at the hashed end of the file.
+  bool HashData(const uint8_t* data, size_t count);
+
+  // Reads back and hashes the data of the file in [|hashed_end_|, |end|).
+  bool ReadBackAndHash(uint64_t end);
+
+  // Records that [|start|, |end|) was written but not hashed.
+  void AddPending(uint64_t start, uint64_t end);
+
+  // Drops the parts of the pending ranges before |hashed_end_|.
+  void DropHashedPending();
+
+  FileDescriptorPtr fd_;
+  VerityWriterInterface* verity_writer_;
+  uint64_t inline_end_;
+
+  // The offset of |fd_|.
+  off64_t offset_{0};
+
+  HashCalculator hasher_;
+  // The data of the file in [0, |hashed_end_|) was passed to |hasher_|.
+  uint64_t hashed_end_{0};
+  // The ranges written after |hashed_end_|, from start to end offset.
+  std::map<uint64_t, uint64_t> pending_;
+  // Whether the hash still matches the data in the file.
+  bool valid_{true};
+
+  uint64_t bytes_hashed_inline_{0};
+  uint64_t bytes_read_back_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(HashingFileDescriptor);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_HASHING_FILE_DESCRIPTOR_H_
@@ -0,0 +1,145 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/hashing_file_descriptor.h"
+
+#include <fcntl.h>
+
+#include <limits>
+#include <memory>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+const size_t kChunkSize = 4096;
+const size_t kFileSize = 4 * kChunkSize;
+const uint64_t kNoInlineEnd = std::numeric_limits<uint64_t>::max();
+
+// A verity writer checking that the data is passed in order.
+class FakeVerityWriter : public VerityWriterInterface {
+ public:
+  bool Init(const InstallPlan::Partition& partition) override { return true; }
+  bool Update(uint64_t offset, const uint8_t* buffer, size_t size) override {
+    EXPECT_EQ(next_offset_, offset);
+    next_offset_ += size;
+    return true;
+  }
+
+  uint64_t next_offset_{0};
+};
+}  // namespace
+
+class HashingFileDescriptorTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    brillo::Blob data(kFileSize);
+    test_utils::FillWithData(&data);
+    ASSERT_TRUE(test_utils::WriteFileVector(temp_file_.path(), data));
+    chunk_.resize(kChunkSize);
+    for (size_t i = 0; i < chunk_.size(); i++)
+      chunk_[i] = i % 251;
+  }
+
+  void Open(VerityWriterInterface* verity_writer, uint64_t inline_end) {
+    FileDescriptorPtr fd(new EintrSafeFileDescriptor());
+    hfd_.reset(new HashingFileDescriptor(fd, verity_writer, inline_end));
+    ASSERT_TRUE(hfd_->Open(temp_file_.path().c_str(), O_RDWR));
+  }
+
+  // Writes |chunk_| at |offset|.
+  void WriteChunk(uint64_t offset) {
+    EXPECT_TRUE(utils::PWriteAll(hfd_, chunk_.data(), chunk_.size(), offset));
+  }
+
+  // Returns the hash of the content of the file.
+  brillo::Blob FileHash() {
+    brillo::Blob data, hash;
+    EXPECT_TRUE(utils::ReadFile(temp_file_.path(), &data));
+    EXPECT_TRUE(HashCalculator::RawHashOfData(data, &hash));
+    return hash;
+  }
+
+  test_utils::ScopedTempFile temp_file_{"HashingFileDescriptor-XXXXXX"};
+  brillo::Blob chunk_;
+  std::shared_ptr<HashingFileDescriptor> hfd_;
+};
+
+TEST_F(HashingFileDescriptorTest, SequentialWritesTest) {
+  Open(nullptr, kNoInlineEnd);
+  WriteChunk(0);
+  WriteChunk(kChunkSize);
+  EXPECT_TRUE(hfd_->Flush());
+
+  brillo::Blob hash;
+  EXPECT_TRUE(hfd_->Finish(kFileSize, &hash));
+  EXPECT_EQ(FileHash(), hash);
+  EXPECT_EQ(2 * kChunkSize, hfd_->bytes_hashed_inline());
+  // Only the blocks never written are read back.
+  EXPECT_EQ(2 * kChunkSize, hfd_->bytes_read_back());
+  EXPECT_TRUE(hfd_->Close());
+}
+
+TEST_F(HashingFileDescriptorTest, OutOfOrderWritesTest) {
+  Open(nullptr, kNoInlineEnd);
+  WriteChunk(kChunkSize);
+  WriteChunk(3 * kChunkSize);
+  WriteChunk(0);
+  // The chunk after the hashed data is read back once flushed.
+  EXPECT_TRUE(hfd_->Flush());
+  EXPECT_EQ(kChunkSize, hfd_->bytes_hashed_inline());
+  EXPECT_EQ(kChunkSize, hfd_->bytes_read_back());
+  WriteChunk(2 * kChunkSize);
+
+  brillo::Blob hash;
+  EXPECT_TRUE(hfd_->Finish(kFileSize, &hash));
+  EXPECT_EQ(FileHash(), hash);
+  EXPECT_EQ(2 * kChunkSize, hfd_->bytes_hashed_inline());
+  EXPECT_EQ(2 * kChunkSize, hfd_->bytes_read_back());
+}
+
+TEST_F(HashingFileDescriptorTest, OverwriteHashedDataTest) {
+  Open(nullptr, kNoInlineEnd);
+  WriteChunk(0);
+  WriteChunk(kChunkSize / 2);
+
+  brillo::Blob hash;
+  EXPECT_FALSE(hfd_->Finish(kFileSize, &hash));
+}
+
+TEST_F(HashingFileDescriptorTest, VerityWriterTest) {
+  FakeVerityWriter verity_writer;
+  Open(&verity_writer, 2 * kChunkSize);
+  WriteChunk(0);
+  // Reaching |inline_end| waits for the flush.
+  WriteChunk(kChunkSize);
+  EXPECT_EQ(kChunkSize, verity_writer.next_offset_);
+  EXPECT_TRUE(hfd_->Flush());
+  EXPECT_EQ(2 * kChunkSize, verity_writer.next_offset_);
+
+  brillo::Blob hash;
+  EXPECT_TRUE(hfd_->Finish(kFileSize, &hash));
+  EXPECT_EQ(FileHash(), hash);
+  EXPECT_EQ(kFileSize, verity_writer.next_offset_);
+  EXPECT_EQ(kChunkSize, hfd_->bytes_hashed_inline());
+}
+
+}  // namespace chromeos_update_engine
@@ -125,10 +125,12 @@ bool InstallPlan::Partition::operator==(
           source_size == that.source_size && source_hash == that.source_hash &&
           target_path == that.target_path && target_size == that.target_size &&
           target_hash == that.target_hash &&
+          applied_target_hash == that.applied_target_hash &&
           run_postinstall == that.run_postinstall &&
           postinstall_path == that.postinstall_path &&
           filesystem_type == that.filesystem_type &&
-          postinstall_optional == that.postinstall_optional);
+          postinstall_optional == that.postinstall_optional &&
+          postinstall_independent == that.postinstall_independent);
 }
 
 }  // namespace chromeos_update_engine
@@ -87,7 +87,8 @@ struct InstallPlan {
   // and hashes based on the manifest.
   //
   // 2. FilesystemVerifierAction computes and verifies the partition sizes and
-  // hashes against the expected values.
+  // hashes against the expected values, unless DeltaPerformer already computed
+  // the target hash while writing the partition.
   struct Partition {
     bool operator==(const Partition& that) const;
 
@@ -103,12 +104,19 @@ struct InstallPlan {
     brillo::Blob target_hash;
     uint32_t block_size{0};
 
+    // The hash of the first |target_size| bytes of the target partition,
+    // computed by DeltaPerformer while applying the payload and after writing
+    // the verity data if needed. Empty if it wasn't computed, for example when
+    // the update was resumed in the middle of the partition.
+    brillo::Blob applied_target_hash;
+
     // Whether we should run the postinstall script from this partition and the
     // postinstall parameters.
     bool run_postinstall{false};
     std::string postinstall_path;
     std::string filesystem_type;
     bool postinstall_optional{false};
+    bool postinstall_independent{false};
 
     // Verity hash tree and FEC config. See update_metadata.proto for details.
     // All offsets and sizes are in bytes.
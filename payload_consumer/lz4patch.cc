@@ -0,0 +1,477 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/lz4patch.h"
+
+#include <endian.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+#include <bsdiff/bspatch.h>
+#include <lz4.h>
+#include <lz4hc.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+const uint32_t kLz4LegacyMagic = 0x184C2102;
+const size_t kLz4LegacyBlockSize = 8 * 1024 * 1024;
+const size_t kMaxLz4DecompressedSize = 128 * 1024 * 1024;
+const char kLz4diffMagic[8] = {'L', 'Z', '4', 'D', 'I', 'F', 'F', '1'};
+const size_t kLz4diffHeaderSize = sizeof(kLz4diffMagic) + 6 * 8 + 2 * 4 + 32;
+
+namespace {
+
+// The size of the SHA-256 hash of the target stream.
+const size_t kLz4diffHashSize = 32;
+
+uint32_t ReadLE32(const uint8_t* data) {
+  uint32_t value;
+  memcpy(&value, data, sizeof(value));
+  return le32toh(value);
+}
+
+uint64_t ReadLE64(const uint8_t* data) {
+  uint64_t value;
+  memcpy(&value, data, sizeof(value));
+  return le64toh(value);
+}
+
+void AppendLE32(uint32_t value, brillo::Blob* out) {
+  value = htole32(value);
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+  out->insert(out->end(), bytes, bytes + sizeof(value));
+}
+
+void AppendLE64(uint64_t value, brillo::Blob* out) {
+  value = htole64(value);
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+  out->insert(out->end(), bytes, bytes + sizeof(value));
+}
+
+// Compresses the |size| bytes at |data| into a block of the stream at |out|,
+// which has room for LZ4_compressBound(kLz4LegacyBlockSize) bytes. Returns the
+// size of the block, or 0 on failure.
+int CompressBlock(const uint8_t* data, size_t size, int level, uint8_t* out) {
+  const char* src = reinterpret_cast<const char*>(data);
+  char* dst = reinterpret_cast<char*>(out);
+  const int max_block_size = LZ4_compressBound(kLz4LegacyBlockSize);
+  int block_size =
+      level < LZ4HC_CLEVEL_MIN
+          ? LZ4_compress_fast(src, dst, size, max_block_size, 1)
+          : LZ4_compress_HC(src, dst, size, max_block_size, level);
+  return std::max(block_size, 0);
+}
+
+// Logs the mismatch of the target stream reproduced by the client with the
+// one of the header.
+void LogStreamMismatch(const Lz4diffHeader& header, uint64_t stream_size) {
+  LOG(ERROR) << "The LZ4 stream compressed at level "
+             << header.dst_compression_level << " with LZ4 "
+             << LZ4_versionNumber() << " has " << stream_size
+             << " bytes, but the target stream of " << header.dst_stream_size
+             << " bytes was compressed with LZ4 " << header.lz4_version
+             << " and has a different hash.";
+}
+
+}  // namespace
+
+bool Lz4LegacyDecompress(const uint8_t* data,
+                         size_t size,
+                         brillo::Blob* out,
+                         size_t* stream_size) {
+  TEST_AND_RETURN_FALSE(size >= 4 && ReadLE32(data) == kLz4LegacyMagic);
+  const size_t max_block_size = LZ4_compressBound(kLz4LegacyBlockSize);
+  const size_t out_start = out->size();
+  size_t offset = 4;
+  while (size - offset >= 4) {
+    size_t block_size = ReadLE32(data + offset);
+    if (block_size == 0 || block_size > max_block_size ||
+        block_size > size - offset - 4) {
+      break;
+    }
+    size_t content_size = out->size() - out_start;
+    if (content_size + kLz4LegacyBlockSize > kMaxLz4DecompressedSize) {
+      LOG(ERROR) << "LZ4 stream content bigger than "
+                 << kMaxLz4DecompressedSize << " bytes.";
+      out->resize(out_start);
+      return false;
+    }
+    size_t out_offset = out->size();
+    out->resize(out_offset + kLz4LegacyBlockSize);
+    int decompressed =
+        LZ4_decompress_safe(reinterpret_cast<const char*>(data + offset + 4),
+                            reinterpret_cast<char*>(out->data() + out_offset),
+                            block_size,
+                            kLz4LegacyBlockSize);
+    if (decompressed <= 0) {
+      out->resize(out_offset);
+      break;
+    }
+    out->resize(out_offset + decompressed);
+    offset += 4 + block_size;
+    if (static_cast<size_t>(decompressed) < kLz4LegacyBlockSize)
+      break;
+  }
+  if (out->size() == out_start) {
+    LOG(ERROR) << "No valid block in the LZ4 stream.";
+    return false;
+  }
+  *stream_size = offset;
+  return true;
+}
+
+bool Lz4LegacyCompress(const uint8_t* data,
+                       size_t size,
+                       int level,
+                       brillo::Blob* out) {
+  TEST_AND_RETURN_FALSE(level >= 1 && level <= LZ4HC_CLEVEL_MAX);
+  AppendLE32(kLz4LegacyMagic, out);
+  const size_t max_block_size = LZ4_compressBound(kLz4LegacyBlockSize);
+  for (size_t offset = 0; offset < size; offset += kLz4LegacyBlockSize) {
+    size_t content_size = std::min(size - offset, kLz4LegacyBlockSize);
+    size_t out_offset = out->size();
+    out->resize(out_offset + 4 + max_block_size);
+    int block_size = CompressBlock(
+        data + offset, content_size, level, out->data() + out_offset + 4);
+    TEST_AND_RETURN_FALSE(block_size > 0);
+    uint32_t block_size_le = htole32(block_size);
+    memcpy(out->data() + out_offset, &block_size_le, sizeof(block_size_le));
+    out->resize(out_offset + 4 + block_size);
+  }
+  return true;
+}
+
+void WriteLz4diffHeader(const Lz4diffHeader& header, brillo::Blob* out) {
+  out->assign(std::begin(kLz4diffMagic), std::end(kLz4diffMagic));
+  AppendLE64(header.src_stream_offset, out);
+  AppendLE64(header.src_stream_size, out);
+  AppendLE64(header.src_content_size, out);
+  AppendLE64(header.dst_stream_offset, out);
+  AppendLE64(header.dst_stream_size, out);
+  AppendLE64(header.dst_content_size, out);
+  AppendLE32(header.dst_compression_level, out);
+  AppendLE32(header.lz4_version, out);
+  DCHECK_EQ(header.dst_stream_hash.size(), kLz4diffHashSize);
+  brillo::Blob hash = header.dst_stream_hash;
+  hash.resize(kLz4diffHashSize);
+  out->insert(out->end(), hash.begin(), hash.end());
+}
+
+bool ParseLz4diffHeader(const uint8_t* data,
+                        size_t size,
+                        Lz4diffHeader* header) {
+  TEST_AND_RETURN_FALSE(size >= kLz4diffHeaderSize);
+  TEST_AND_RETURN_FALSE(
+      memcmp(data, kLz4diffMagic, sizeof(kLz4diffMagic)) == 0);
+  const uint8_t* fields = data + sizeof(kLz4diffMagic);
+  header->src_stream_offset = ReadLE64(fields);
+  header->src_stream_size = ReadLE64(fields + 8);
+  header->src_content_size = ReadLE64(fields + 16);
+  header->dst_stream_offset = ReadLE64(fields + 24);
+  header->dst_stream_size = ReadLE64(fields + 32);
+  header->dst_content_size = ReadLE64(fields + 40);
+  header->dst_compression_level = ReadLE32(fields + 48);
+  header->lz4_version = ReadLE32(fields + 52);
+  header->dst_stream_hash.assign(fields + 56, fields + 56 + kLz4diffHashSize);
+  if (header->lz4_version != static_cast<uint32_t>(LZ4_versionNumber())) {
+    LOG(WARNING) << "LZ4DIFF generated with LZ4 " << header->lz4_version
+                 << ", compressing with LZ4 " << LZ4_versionNumber()
+                 << " may not reproduce the target stream.";
+  }
+  return true;
+}
+
+bool Lz4Patch(const brillo::Blob& src,
+              const uint8_t* patch,
+              size_t patch_size,
+              brillo::Blob* dst) {
+  Lz4diffHeader header;
+  TEST_AND_RETURN_FALSE(ParseLz4diffHeader(patch, patch_size, &header));
+  TEST_AND_RETURN_FALSE(header.src_stream_offset <= src.size() &&
+                        header.src_stream_size <=
+                            src.size() - header.src_stream_offset);
+  TEST_AND_RETURN_FALSE(header.dst_content_size <= kMaxLz4DecompressedSize);
+
+  // Replace the source stream by its content.
+  brillo::Blob decompressed_src(src.begin(),
+                                src.begin() + header.src_stream_offset);
+  size_t stream_size;
+  TEST_AND_RETURN_FALSE(
+      Lz4LegacyDecompress(src.data() + header.src_stream_offset,
+                          header.src_stream_size,
+                          &decompressed_src,
+                          &stream_size));
+  TEST_AND_RETURN_FALSE(stream_size == header.src_stream_size);
+  TEST_AND_RETURN_FALSE(decompressed_src.size() - header.src_stream_offset ==
+                        header.src_content_size);
+  decompressed_src.insert(
+      decompressed_src.end(),
+      src.begin() + header.src_stream_offset + header.src_stream_size,
+      src.end());
+
+  brillo::Blob decompressed_dst;
+  auto sink = [&decompressed_dst](const uint8_t* data, size_t count) {
+    decompressed_dst.insert(decompressed_dst.end(), data, data + count);
+    return count;
+  };
+  TEST_AND_RETURN_FALSE(bsdiff::bspatch(decompressed_src.data(),
+                                        decompressed_src.size(),
+                                        patch + kLz4diffHeaderSize,
+                                        patch_size - kLz4diffHeaderSize,
+                                        sink) == 0);
+  brillo::Blob().swap(decompressed_src);
+  TEST_AND_RETURN_FALSE(header.dst_stream_offset <= decompressed_dst.size() &&
+                        header.dst_content_size <=
+                            decompressed_dst.size() - header.dst_stream_offset);
+
+  // Compress the target content back into its stream.
+  dst->assign(decompressed_dst.begin(),
+              decompressed_dst.begin() + header.dst_stream_offset);
+  TEST_AND_RETURN_FALSE(Lz4LegacyCompress(
+      decompressed_dst.data() + header.dst_stream_offset,
+      header.dst_content_size,
+      header.dst_compression_level,
+      dst));
+  brillo::Blob stream_hash;
+  TEST_AND_RETURN_FALSE(
+      HashCalculator::RawHashOfBytes(dst->data() + header.dst_stream_offset,
+                                     dst->size() - header.dst_stream_offset,
+                                     &stream_hash));
+  if (dst->size() != header.dst_stream_offset + header.dst_stream_size ||
+      stream_hash != header.dst_stream_hash) {
+    LogStreamMismatch(header, dst->size() - header.dst_stream_offset);
+    return false;
+  }
+  dst->insert(dst->end(),
+              decompressed_dst.begin() + header.dst_stream_offset +
+                  header.dst_content_size,
+              decompressed_dst.end());
+  return true;
+}
+
+bool Lz4DecompressingExtentReader::Init(
+    FileDescriptorPtr fd,
+    const google::protobuf::RepeatedPtrField<Extent>& extents,
+    uint32_t block_size) {
+  TEST_AND_RETURN_FALSE(underlying_reader_->Init(fd, extents, block_size));
+  uint64_t src_size = utils::BlocksInExtents(extents) * block_size;
+  TEST_AND_RETURN_FALSE(header_.src_stream_offset <= src_size &&
+                        header_.src_stream_size <=
+                            src_size - header_.src_stream_offset);
+  size_ = src_size - header_.src_stream_size + header_.src_content_size;
+
+  // Index the blocks of the stream, which must hold all of its content.
+  const uint64_t stream_end =
+      header_.src_stream_offset + header_.src_stream_size;
+  const size_t max_block_size = LZ4_compressBound(kLz4LegacyBlockSize);
+  uint8_t field[4];
+  uint64_t offset = header_.src_stream_offset;
+  blocks_.clear();
+  while (offset < stream_end) {
+    TEST_AND_RETURN_FALSE(stream_end - offset >= sizeof(field));
+    TEST_AND_RETURN_FALSE(underlying_reader_->Seek(offset));
+    TEST_AND_RETURN_FALSE(underlying_reader_->Read(field, sizeof(field)));
+    offset += sizeof(field);
+    if (offset == header_.src_stream_offset + sizeof(field)) {
+      TEST_AND_RETURN_FALSE(ReadLE32(field) == kLz4LegacyMagic);
+      continue;
+    }
+    uint32_t compressed_size = ReadLE32(field);
+    TEST_AND_RETURN_FALSE(compressed_size > 0 &&
+                          compressed_size <= max_block_size &&
+                          compressed_size <= stream_end - offset);
+    blocks_.emplace_back(offset, compressed_size);
+    offset += compressed_size;
+  }
+  TEST_AND_RETURN_FALSE(
+      !blocks_.empty() &&
+      header_.src_content_size > (blocks_.size() - 1) * kLz4LegacyBlockSize &&
+      header_.src_content_size <= blocks_.size() * kLz4LegacyBlockSize);
+  offset_ = 0;
+  return true;
+}
+
+bool Lz4DecompressingExtentReader::Seek(uint64_t offset) {
+  TEST_AND_RETURN_FALSE(offset <= size_);
+  offset_ = offset;
+  return true;
+}
+
+bool Lz4DecompressingExtentReader::Read(void* buffer, size_t count) {
+  TEST_AND_RETURN_FALSE(count <= size_ - offset_);
+  uint8_t* out = static_cast<uint8_t*>(buffer);
+  const uint64_t content_start = header_.src_stream_offset;
+  const uint64_t content_end = content_start + header_.src_content_size;
+  while (count > 0) {
+    size_t chunk = count;
+    if (offset_ >= content_start && offset_ < content_end) {
+      uint64_t content_offset = offset_ - content_start;
+      const brillo::Blob* block;
+      TEST_AND_RETURN_FALSE(
+          GetBlock(content_offset / kLz4LegacyBlockSize, &block));
+      size_t block_offset = content_offset % kLz4LegacyBlockSize;
+      chunk = std::min(count, block->size() - block_offset);
+      memcpy(out, block->data() + block_offset, chunk);
+    } else {
+      // The data around the stream is read as is.
+      uint64_t underlying_offset = offset_;
+      if (offset_ < content_start) {
+        chunk = std::min<uint64_t>(count, content_start - offset_);
+      } else {
+        underlying_offset += header_.src_stream_size;
+        underlying_offset -= header_.src_content_size;
+      }
+      TEST_AND_RETURN_FALSE(underlying_reader_->Seek(underlying_offset));
+      TEST_AND_RETURN_FALSE(underlying_reader_->Read(out, chunk));
+    }
+    out += chunk;
+    count -= chunk;
+    offset_ += chunk;
+  }
+  return true;
+}
+
+bool Lz4DecompressingExtentReader::GetBlock(size_t index,
+                                            const brillo::Blob** content) {
+  TEST_AND_RETURN_FALSE(index < blocks_.size());
+  auto entry = std::find_if(
+      cache_.begin(),
+      cache_.end(),
+      [index](const std::pair<size_t, brillo::Blob>& cached) {
+        return cached.first == index;
+      });
+  if (entry == cache_.end()) {
+    brillo::Blob block;
+    if (cache_.size() >= cache_blocks_) {
+      // Reuse the buffer of the least recently used block.
+      block = std::move(cache_.front().second);
+      cache_.erase(cache_.begin());
+    }
+    // Every block but the last one holds kLz4LegacyBlockSize bytes.
+    size_t block_size = index + 1 < blocks_.size()
+                            ? kLz4LegacyBlockSize
+                            : header_.src_content_size -
+                                  index * kLz4LegacyBlockSize;
+    uint32_t compressed_size = blocks_[index].second;
+    compressed_block_.resize(compressed_size);
+    TEST_AND_RETURN_FALSE(underlying_reader_->Seek(blocks_[index].first));
+    TEST_AND_RETURN_FALSE(
+        underlying_reader_->Read(compressed_block_.data(), compressed_size));
+    block.resize(block_size);
+    int decompressed = LZ4_decompress_safe(
+        reinterpret_cast<const char*>(compressed_block_.data()),
+        reinterpret_cast<char*>(block.data()),
+        compressed_size,
+        block_size);
+    TEST_AND_RETURN_FALSE(decompressed >= 0 &&
+                          static_cast<size_t>(decompressed) == block_size);
+    cache_.emplace_back(index, std::move(block));
+  } else {
+    std::rotate(entry, entry + 1, cache_.end());
+  }
+  *content = &cache_.back().second;
+  return true;
+}
+
+bool Lz4CompressingExtentWriter::Init(
+    FileDescriptorPtr fd,
+    const google::protobuf::RepeatedPtrField<Extent>& extents,
+    uint32_t block_size) {
+  TEST_AND_RETURN_FALSE(underlying_writer_->Init(fd, extents, block_size));
+  uint64_t dst_size = utils::BlocksInExtents(extents) * block_size;
+  TEST_AND_RETURN_FALSE(header_.dst_stream_offset <= dst_size &&
+                        header_.dst_stream_size <=
+                            dst_size - header_.dst_stream_offset);
+  TEST_AND_RETURN_FALSE(header_.dst_content_size > 0);
+  TEST_AND_RETURN_FALSE(header_.dst_compression_level >= 1 &&
+                        header_.dst_compression_level <= LZ4HC_CLEVEL_MAX);
+  size_ = dst_size - header_.dst_stream_size + header_.dst_content_size;
+  return true;
+}
+
+bool Lz4CompressingExtentWriter::Write(const void* bytes, size_t count) {
+  TEST_AND_RETURN_FALSE(count <= size_ - offset_);
+  const uint8_t* data = static_cast<const uint8_t*>(bytes);
+  const uint64_t content_start = header_.dst_stream_offset;
+  const uint64_t content_end = content_start + header_.dst_content_size;
+  while (count > 0) {
+    size_t chunk = count;
+    if (offset_ < content_start || offset_ >= content_end) {
+      // The data around the stream is written as is.
+      if (offset_ < content_start)
+        chunk = std::min<uint64_t>(count, content_start - offset_);
+      TEST_AND_RETURN_FALSE(underlying_writer_->Write(data, chunk));
+    } else {
+      if (offset_ == content_start) {
+        brillo::Blob magic;
+        AppendLE32(kLz4LegacyMagic, &magic);
+        TEST_AND_RETURN_FALSE(stream_hash_.Update(magic.data(), magic.size()));
+        TEST_AND_RETURN_FALSE(
+            underlying_writer_->Write(magic.data(), magic.size()));
+        stream_size_ = magic.size();
+      }
+      uint64_t block_start = offset_ - content_.size();
+      size_t block_size =
+          std::min<uint64_t>(kLz4LegacyBlockSize, content_end - block_start);
+      chunk = std::min(count, block_size - content_.size());
+      content_.insert(content_.end(), data, data + chunk);
+      if (content_.size() == block_size)
+        TEST_AND_RETURN_FALSE(FlushBlock(block_start + block_size));
+    }
+    data += chunk;
+    count -= chunk;
+    offset_ += chunk;
+  }
+  return true;
+}
+
+bool Lz4CompressingExtentWriter::FlushBlock(uint64_t block_end) {
+  compressed_block_.resize(4 + LZ4_compressBound(kLz4LegacyBlockSize));
+  int block_size = CompressBlock(content_.data(),
+                                 content_.size(),
+                                 header_.dst_compression_level,
+                                 compressed_block_.data() + 4);
+  TEST_AND_RETURN_FALSE(block_size > 0);
+  uint32_t block_size_le = htole32(block_size);
+  memcpy(compressed_block_.data(), &block_size_le, sizeof(block_size_le));
+  compressed_block_.resize(4 + block_size);
+  content_.clear();
+
+  stream_size_ += compressed_block_.size();
+  if (stream_size_ > header_.dst_stream_size) {
+    LogStreamMismatch(header_, stream_size_);
+    return false;
+  }
+  TEST_AND_RETURN_FALSE(stream_hash_.Update(compressed_block_.data(),
+                                            compressed_block_.size()));
+  TEST_AND_RETURN_FALSE(underlying_writer_->Write(compressed_block_.data(),
+                                                  compressed_block_.size()));
+  if (block_end == header_.dst_stream_offset + header_.dst_content_size) {
+    TEST_AND_RETURN_FALSE(stream_hash_.Finalize());
+    if (stream_size_ != header_.dst_stream_size ||
+        stream_hash_.raw_hash() != header_.dst_stream_hash) {
+      LogStreamMismatch(header_, stream_size_);
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,215 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_LZ4PATCH_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_LZ4PATCH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/payload_consumer/extent_reader.h"
+#include "update_engine/payload_consumer/extent_writer.h"
+
+// The LZ4DIFF operation diffs data holding an LZ4 stream in the legacy format,
+// the one of the LZ4 compressed kernels and ramdisks ("lz4 -l"), over the
+// decompressed content of the stream instead of over the compressed bytes.
+// The client decompresses the source stream, patches it and compresses the
+// patched content back with the same settings that produced the target
+// stream. That results in the exact same bytes only with the LZ4 version the
+// generator used, so the header records it along with the hash of the target
+// stream, which the client checks.
+//
+// The data of the operation is a header followed by a BSDF2 patch. The
+// header is kLz4diffMagic followed by these little-endian fields:
+//   uint64 src_stream_offset: offset of the LZ4 stream in the source data.
+//   uint64 src_stream_size: size of the LZ4 stream in the source data.
+//   uint64 src_content_size: decompressed size of the source stream.
+//   uint64 dst_stream_offset: offset of the LZ4 stream in the target data.
+//   uint64 dst_stream_size: size of the LZ4 stream in the target data.
+//   uint64 dst_content_size: decompressed size of the target stream.
+//   uint32 dst_compression_level: the level to compress the target with.
+//   uint32 lz4_version: the LZ4_versionNumber() of the generator.
+//   uint8[32] dst_stream_hash: the SHA-256 of the target stream.
+// The patch applies to the source data with its stream replaced by the
+// decompressed content, and results in the target data with its stream
+// replaced by the decompressed content. The data before and after the
+// streams, like the kernel size appended by the kernel build and the page
+// padding of the boot images, is diffed as is.
+
+namespace chromeos_update_engine {
+
+// The magic number at the beginning of the LZ4 legacy streams.
+extern const uint32_t kLz4LegacyMagic;
+
+// The decompressed size of every block of the LZ4 legacy streams but the last.
+extern const size_t kLz4LegacyBlockSize;
+
+// The maximum decompressed size of the streams the generator handles, which
+// keeps them in memory.
+extern const size_t kMaxLz4DecompressedSize;
+
+// The magic at the beginning of the LZ4DIFF data.
+extern const char kLz4diffMagic[8];
+
+// The size of the header of the LZ4DIFF data.
+extern const size_t kLz4diffHeaderSize;
+
+struct Lz4diffHeader {
+  uint64_t src_stream_offset;
+  uint64_t src_stream_size;
+  uint64_t src_content_size;
+  uint64_t dst_stream_offset;
+  uint64_t dst_stream_size;
+  uint64_t dst_content_size;
+  uint32_t dst_compression_level;
+  uint32_t lz4_version;
+  brillo::Blob dst_stream_hash;
+};
+
+// Decompresses the LZ4 legacy stream at the beginning of the |size| bytes at
+// |data|, appending the content to |out|. The stream ends at the end of the
+// data, before the first bytes that are not a valid block, or after the first
+// block smaller than kLz4LegacyBlockSize. The size of the stream is stored in
+// |stream_size|. Returns false if there isn't any valid block or the content
+// exceeds kMaxLz4DecompressedSize.
+bool Lz4LegacyDecompress(const uint8_t* data,
+                         size_t size,
+                         brillo::Blob* out,
+                         size_t* stream_size);
+
+// Compresses the |size| bytes at |data| in an LZ4 legacy stream appended to
+// |out|, like "lz4 -l -<level>" does: with the LZ4 HC compressor at |level|
+// for levels 3 and higher and with the fast compressor otherwise.
+bool Lz4LegacyCompress(const uint8_t* data,
+                       size_t size,
+                       int level,
+                       brillo::Blob* out);
+
+// Serializes |header| as the beginning of the LZ4DIFF data in |out|.
+void WriteLz4diffHeader(const Lz4diffHeader& header, brillo::Blob* out);
+
+// Parses the header at the beginning of the |size| bytes of LZ4DIFF data at
+// |data|. Logs a warning if it was generated with a different LZ4 version.
+bool ParseLz4diffHeader(const uint8_t* data,
+                        size_t size,
+                        Lz4diffHeader* header);
+
+// Applies the LZ4DIFF data of |patch_size| bytes at |patch| to |src|, storing
+// the target data in |dst|. It keeps the decompressed source and target in
+// memory, see the classes below to apply it on the extents of a partition.
+bool Lz4Patch(const brillo::Blob& src,
+              const uint8_t* patch,
+              size_t patch_size,
+              brillo::Blob* dst);
+
+// Lz4DecompressingExtentReader is an ExtentReader decorator reading the source
+// data of an LZ4DIFF operation from an underlying ExtentReader with the LZ4
+// stream replaced by its content, which is what the patch applies to. The
+// blocks of the stream are decompressed on demand and up to |cache_blocks| of
+// them are kept in memory.
+class Lz4DecompressingExtentReader : public ExtentReader {
+ public:
+  Lz4DecompressingExtentReader(std::unique_ptr<ExtentReader> underlying_reader,
+                               const Lz4diffHeader& header,
+                               size_t cache_blocks)
+      : underlying_reader_(std::move(underlying_reader)),
+        header_(header),
+        cache_blocks_(std::max<size_t>(cache_blocks, 1)) {}
+  ~Lz4DecompressingExtentReader() override = default;
+
+  bool Init(FileDescriptorPtr fd,
+            const google::protobuf::RepeatedPtrField<Extent>& extents,
+            uint32_t block_size) override;
+  bool Seek(uint64_t offset) override;
+  bool Read(void* buffer, size_t count) override;
+
+  // The size of the data read, valid after Init().
+  uint64_t size() const { return size_; }
+
+ private:
+  // Points |content| to the decompressed block |index| of the stream.
+  bool GetBlock(size_t index, const brillo::Blob** content);
+
+  std::unique_ptr<ExtentReader> underlying_reader_;
+  Lz4diffHeader header_;
+  size_t cache_blocks_;
+  uint64_t size_{0};
+  uint64_t offset_{0};
+
+  // The offset of the compressed data of each block of the stream in the
+  // underlying data, and its size.
+  std::vector<std::pair<uint64_t, uint32_t>> blocks_;
+
+  // The decompressed blocks, most recently used last.
+  std::vector<std::pair<size_t, brillo::Blob>> cache_;
+  brillo::Blob compressed_block_;
+
+  DISALLOW_COPY_AND_ASSIGN(Lz4DecompressingExtentReader);
+};
+
+// Lz4CompressingExtentWriter is an ExtentWriter decorator taking the target
+// data of an LZ4DIFF operation with the LZ4 stream replaced by its content,
+// as the patch produces it, and writing it to an underlying ExtentWriter with
+// the content compressed back into the stream one block at a time. The
+// stream written must match the size and hash in the header.
+class Lz4CompressingExtentWriter : public ExtentWriter {
+ public:
+  Lz4CompressingExtentWriter(std::unique_ptr<ExtentWriter> underlying_writer,
+                             const Lz4diffHeader& header)
+      : underlying_writer_(std::move(underlying_writer)), header_(header) {}
+  ~Lz4CompressingExtentWriter() override = default;
+
+  bool Init(FileDescriptorPtr fd,
+            const google::protobuf::RepeatedPtrField<Extent>& extents,
+            uint32_t block_size) override;
+  bool Write(const void* bytes, size_t count) override;
+
+  // The size of the data to write, valid after Init().
+  uint64_t size() const { return size_; }
+
+ private:
+  // Compresses |content_| into the next block of the stream, which ends at
+  // |block_end| in the data written, and checks the stream once complete.
+  bool FlushBlock(uint64_t block_end);
+
+  std::unique_ptr<ExtentWriter> underlying_writer_;
+  Lz4diffHeader header_;
+  uint64_t size_{0};
+  uint64_t offset_{0};
+
+  // The content of the block being written, and the block once compressed.
+  brillo::Blob content_;
+  brillo::Blob compressed_block_;
+
+  // The size and hash of the stream written so far.
+  uint64_t stream_size_{0};
+  HashCalculator stream_hash_;
+
+  DISALLOW_COPY_AND_ASSIGN(Lz4CompressingExtentWriter);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_LZ4PATCH_H_
@@ -0,0 +1,208 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/lz4patch.h"
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/fake_extent_writer.h"
+#include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const size_t kBlockSize = 4096;
+
+// Returns |size| bytes of compressible data.
+brillo::Blob CompressibleData(size_t size) {
+  brillo::Blob data(size);
+  for (size_t i = 0; i < size; i++)
+    data[i] = (i / 7) % 13 + (i % 1000 == 0 ? i / 1000 : 0);
+  return data;
+}
+
+}  // namespace
+
+class Lz4PatchTest : public ::testing::Test {};
+
+TEST_F(Lz4PatchTest, CompressDecompressTest) {
+  for (int level : {1, 9, 12}) {
+    // Spans several blocks, the last one partial.
+    brillo::Blob content = CompressibleData(2 * kLz4LegacyBlockSize + 12345);
+    brillo::Blob stream;
+    EXPECT_TRUE(Lz4LegacyCompress(
+        content.data(), content.size(), level, &stream));
+    EXPECT_LT(stream.size(), content.size());
+
+    // The data after the stream is not part of it.
+    size_t compressed_size = stream.size();
+    stream.insert(stream.end(), {0x00, 0x00, 0x80, 0x02, 0, 0, 0, 0});
+    brillo::Blob decompressed = {1, 2, 3};
+    size_t stream_size;
+    EXPECT_TRUE(Lz4LegacyDecompress(
+        stream.data(), stream.size(), &decompressed, &stream_size));
+    EXPECT_EQ(compressed_size, stream_size);
+    brillo::Blob expected = {1, 2, 3};
+    expected.insert(expected.end(), content.begin(), content.end());
+    EXPECT_EQ(expected, decompressed);
+  }
+}
+
+TEST_F(Lz4PatchTest, DecompressInvalidStreamTest) {
+  brillo::Blob content = CompressibleData(1000);
+  brillo::Blob stream;
+  EXPECT_TRUE(Lz4LegacyCompress(content.data(), content.size(), 9, &stream));
+  brillo::Blob decompressed;
+  size_t stream_size;
+  // No block at all.
+  EXPECT_FALSE(
+      Lz4LegacyDecompress(stream.data(), 4, &decompressed, &stream_size));
+  // Not an LZ4 legacy stream.
+  stream[0]++;
+  EXPECT_FALSE(Lz4LegacyDecompress(
+      stream.data(), stream.size(), &decompressed, &stream_size));
+  EXPECT_TRUE(decompressed.empty());
+}
+
+TEST_F(Lz4PatchTest, HeaderTest) {
+  Lz4diffHeader header = {1, 2, 3, 4, 5, 6, 12, 10904, brillo::Blob(32, 7)};
+  brillo::Blob data;
+  WriteLz4diffHeader(header, &data);
+  EXPECT_EQ(kLz4diffHeaderSize, data.size());
+
+  Lz4diffHeader parsed;
+  EXPECT_TRUE(ParseLz4diffHeader(data.data(), data.size(), &parsed));
+  EXPECT_EQ(header.src_stream_offset, parsed.src_stream_offset);
+  EXPECT_EQ(header.src_stream_size, parsed.src_stream_size);
+  EXPECT_EQ(header.src_content_size, parsed.src_content_size);
+  EXPECT_EQ(header.dst_stream_offset, parsed.dst_stream_offset);
+  EXPECT_EQ(header.dst_stream_size, parsed.dst_stream_size);
+  EXPECT_EQ(header.dst_content_size, parsed.dst_content_size);
+  EXPECT_EQ(header.dst_compression_level, parsed.dst_compression_level);
+  EXPECT_EQ(header.lz4_version, parsed.lz4_version);
+  EXPECT_EQ(header.dst_stream_hash, parsed.dst_stream_hash);
+
+  EXPECT_FALSE(ParseLz4diffHeader(data.data(), data.size() - 1, &parsed));
+  data[0] = 'X';
+  EXPECT_FALSE(ParseLz4diffHeader(data.data(), data.size(), &parsed));
+}
+
+TEST_F(Lz4PatchTest, InvalidPatchTest) {
+  brillo::Blob content = CompressibleData(1000);
+  brillo::Blob src;
+  EXPECT_TRUE(Lz4LegacyCompress(content.data(), content.size(), 9, &src));
+
+  // The source stream is past the end of the source data.
+  Lz4diffHeader header = {
+      0, src.size() + 1, content.size(), 0, 0, 0, 9, 0, brillo::Blob(32)};
+  brillo::Blob patch;
+  WriteLz4diffHeader(header, &patch);
+  brillo::Blob dst;
+  EXPECT_FALSE(Lz4Patch(src, patch.data(), patch.size(), &dst));
+
+  // The source stream doesn't end where the header says.
+  header.src_stream_size = src.size() - 1;
+  WriteLz4diffHeader(header, &patch);
+  EXPECT_FALSE(Lz4Patch(src, patch.data(), patch.size(), &dst));
+
+  // The source stream doesn't hold the content size the header says.
+  header.src_stream_size = src.size();
+  header.src_content_size = content.size() + 1;
+  WriteLz4diffHeader(header, &patch);
+  EXPECT_FALSE(Lz4Patch(src, patch.data(), patch.size(), &dst));
+}
+
+TEST_F(Lz4PatchTest, ExtentReaderWriterTest) {
+  // The same data as source and target, with a stream of several blocks
+  // that doesn't start on a block boundary.
+  brillo::Blob content = CompressibleData(2 * kLz4LegacyBlockSize + 12345);
+  brillo::Blob stream;
+  ASSERT_TRUE(Lz4LegacyCompress(content.data(), content.size(), 9, &stream));
+  brillo::Blob data(2048, 0xff);
+  data.insert(data.end(), stream.begin(), stream.end());
+  data.resize((data.size() / kBlockSize + 1) * kBlockSize);
+  brillo::Blob decompressed(data.begin(), data.begin() + 2048);
+  decompressed.insert(decompressed.end(), content.begin(), content.end());
+  decompressed.insert(
+      decompressed.end(), data.begin() + 2048 + stream.size(), data.end());
+
+  Lz4diffHeader header = {2048,
+                          stream.size(),
+                          content.size(),
+                          2048,
+                          stream.size(),
+                          content.size(),
+                          9,
+                          0,
+                          {}};
+  ASSERT_TRUE(HashCalculator::RawHashOfData(stream, &header.dst_stream_hash));
+
+  test_utils::ScopedTempFile file("Lz4PatchTest-data.XXXXXX");
+  ASSERT_TRUE(utils::WriteFile(file.path().c_str(), data.data(), data.size()));
+  FileDescriptorPtr fd(new EintrSafeFileDescriptor());
+  ASSERT_TRUE(fd->Open(file.path().c_str(), O_RDONLY, 0600));
+  vector<Extent> extents = {ExtentForRange(0, data.size() / kBlockSize)};
+
+  // Read the second half first, so the single cached block gets replaced.
+  Lz4DecompressingExtentReader reader(
+      std::make_unique<DirectExtentReader>(), header, 1);
+  ASSERT_TRUE(reader.Init(fd, {extents.begin(), extents.end()}, kBlockSize));
+  EXPECT_EQ(decompressed.size(), reader.size());
+  brillo::Blob read(decompressed.size());
+  size_t half = read.size() / 2;
+  EXPECT_TRUE(reader.Seek(half));
+  EXPECT_TRUE(reader.Read(read.data() + half, read.size() - half));
+  EXPECT_TRUE(reader.Seek(0));
+  EXPECT_TRUE(reader.Read(read.data(), half));
+  EXPECT_EQ(decompressed, read);
+  EXPECT_FALSE(reader.Read(read.data(), read.size()));
+
+  // Write it back in pieces that don't match the blocks of the stream.
+  auto fake_writer = std::make_unique<FakeExtentWriter>();
+  FakeExtentWriter* written = fake_writer.get();
+  Lz4CompressingExtentWriter writer(std::move(fake_writer), header);
+  ASSERT_TRUE(writer.Init(fd, {extents.begin(), extents.end()}, kBlockSize));
+  EXPECT_EQ(decompressed.size(), writer.size());
+  for (size_t offset = 0; offset < decompressed.size(); offset += 1000000) {
+    size_t count = std::min<size_t>(1000000, decompressed.size() - offset);
+    EXPECT_TRUE(writer.Write(decompressed.data() + offset, count));
+  }
+  EXPECT_EQ(data, written->WrittenData());
+
+  // The stream doesn't match the hash of the header.
+  header.dst_stream_hash[0] ^= 1;
+  Lz4CompressingExtentWriter mismatch_writer(
+      std::make_unique<FakeExtentWriter>(), header);
+  ASSERT_TRUE(
+      mismatch_writer.Init(fd, {extents.begin(), extents.end()}, kBlockSize));
+  EXPECT_FALSE(
+      mismatch_writer.Write(decompressed.data(), decompressed.size()));
+}
+
+}  // namespace chromeos_update_engine
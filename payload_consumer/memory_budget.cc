@@ -0,0 +1,138 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/memory_budget.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <base/files/file_util.h>
+#include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
+#include <base/strings/string_util.h>
+
+#include "update_engine/common/constants.h"
+#include "update_engine/common/prefs_interface.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const char kMemInfoPath[] = "/proc/meminfo";
+
+// The fraction of the available memory used by default for applying an update.
+const uint64_t kAvailableMemoryDivisor = 16;
+
+// The budget is split in shares of 1/kShares. With the default budget of 32 MiB
+// one share is 1 MiB.
+const uint64_t kShares = 32;
+const uint64_t kWriteCacheShares = 1;
+const uint64_t kSourceReadCacheShares = 1;
+const uint64_t kPuffpatchCacheShares = 5;
+const uint64_t kCopyBufferShares = 1;
+
+// The decompressors only need a small output buffer.
+const uint64_t kDecoderBufferDivisor = 2048;
+
+// All sizes are non-zero multiples of this to keep them block aligned.
+const uint64_t kAlignment = 4096;
+
+uint64_t AlignDown(uint64_t value) {
+  return std::max(value / kAlignment * kAlignment, kAlignment);
+}
+
+}  // namespace
+
+const uint64_t MemoryBudget::kMinBudget = 8 * 1024 * 1024;
+const uint64_t MemoryBudget::kMaxBudget = 512 * 1024 * 1024;
+const uint64_t MemoryBudget::kDefaultBudget = 32 * 1024 * 1024;
+
+MemoryBudget::MemoryBudget(uint64_t total_bytes)
+    : total_(std::min(std::max(total_bytes, kMinBudget), kMaxBudget)) {}
+
+MemoryBudget MemoryBudget::ForDevice(PrefsInterface* prefs) {
+  int64_t budget;
+  if (prefs && prefs->GetInt64(kPrefsApplyMemoryBudget, &budget) &&
+      budget > 0) {
+    LOG(INFO) << "Using the configured memory budget of " << budget
+              << " bytes.";
+    return MemoryBudget(budget);
+  }
+
+  string meminfo;
+  uint64_t available = 0;
+  if (base::ReadFileToString(base::FilePath(kMemInfoPath), &meminfo))
+    available = ParseMemAvailable(meminfo);
+  if (available == 0) {
+    LOG(WARNING) << "Unable to determine the available memory, using the "
+                 << "default memory budget.";
+    return MemoryBudget(kDefaultBudget);
+  }
+  MemoryBudget result(available / kAvailableMemoryDivisor);
+  LOG(INFO) << "Using a memory budget of " << result.total() << " bytes out of "
+            << available << " bytes available.";
+  return result;
+}
+
+uint64_t MemoryBudget::ParseMemAvailable(const string& meminfo) {
+  for (const string& line : base::SplitString(
+           meminfo, "\n", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY)) {
+    // The line format is "MemAvailable:    1234567 kB".
+    if (!base::StartsWith(line, "MemAvailable:", base::CompareCase::SENSITIVE))
+      continue;
+    std::vector<string> fields = base::SplitString(
+        line, " \t", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY);
+    uint64_t value;
+    if (fields.size() != 3 || fields[2] != "kB" ||
+        !base::StringToUint64(fields[1], &value)) {
+      return 0;
+    }
+    return value * 1024;
+  }
+  return 0;
+}
+
+size_t MemoryBudget::write_cache_size() const {
+  return AlignDown(total_ * kWriteCacheShares / kShares);
+}
+
+size_t MemoryBudget::source_read_cache_size() const {
+  return AlignDown(total_ * kSourceReadCacheShares / kShares);
+}
+
+size_t MemoryBudget::puffpatch_cache_size() const {
+  return AlignDown(total_ * kPuffpatchCacheShares / kShares);
+}
+
+size_t MemoryBudget::copy_buffer_size() const {
+  return AlignDown(total_ * kCopyBufferShares / kShares);
+}
+
+size_t MemoryBudget::decoder_buffer_size() const {
+  return AlignDown(total_ / kDecoderBufferDivisor);
+}
+
+uint64_t MemoryBudget::operation_buffer_size() const {
+  uint64_t used = write_cache_size() + source_read_cache_size() +
+                  puffpatch_cache_size() + copy_buffer_size() +
+                  2 * decoder_buffer_size();
+  return total_ > used ? total_ - used : 0;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,84 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_MEMORY_BUDGET_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_MEMORY_BUDGET_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+namespace chromeos_update_engine {
+
+class PrefsInterface;
+
+// MemoryBudget is the single memory cap for applying a payload. The caches and
+// buffers used by DeltaPerformer, the extent readers and writers and the
+// decompressors size themselves from it instead of using fixed constants, so
+// devices with plenty of RAM get bigger caches while low-RAM devices stay below
+// the cap.
+class MemoryBudget {
+ public:
+  // Bounds of the total budget, regardless of how it was sized.
+  static const uint64_t kMinBudget;
+  static const uint64_t kMaxBudget;
+
+  // The budget used when the available memory can't be determined. It
+  // reproduces the sizes update_engine used before the budget existed.
+  static const uint64_t kDefaultBudget;
+
+  // Creates a budget of |total_bytes|, clamped to [kMinBudget, kMaxBudget].
+  explicit MemoryBudget(uint64_t total_bytes);
+
+  // Returns the budget for this device: the value of the
+  // kPrefsApplyMemoryBudget pref when set, or a fraction of the available
+  // memory otherwise.
+  static MemoryBudget ForDevice(PrefsInterface* prefs);
+
+  // Returns the value of the "MemAvailable" entry in |meminfo|, the contents
+  // of /proc/meminfo, in bytes. Returns 0 if it can't be parsed.
+  static uint64_t ParseMemAvailable(const std::string& meminfo);
+
+  uint64_t total() const { return total_; }
+
+  // Size of the write cache in front of the target partition.
+  size_t write_cache_size() const;
+
+  // Size of the window caching source reads for bspatch and puffpatch.
+  size_t source_read_cache_size() const;
+
+  // Size of the cache puffpatch uses for the inflated source, also used by the
+  // LZ4DIFF operations for the decompressed source blocks.
+  size_t puffpatch_cache_size() const;
+
+  // Size of the buffer used to copy and hash source extents.
+  size_t copy_buffer_size() const;
+
+  // Size of the output buffer of the bzip and xz decompressors.
+  size_t decoder_buffer_size() const;
+
+  // What is left of the budget for the data of a single operation once all the
+  // caches above are accounted for.
+  uint64_t operation_buffer_size() const;
+
+ private:
+  uint64_t total_;
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_MEMORY_BUDGET_H_
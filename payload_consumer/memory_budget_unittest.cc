@@ -0,0 +1,77 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#include "update_engine/payload_consumer/memory_budget.h"
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/constants.h"
+#include "update_engine/common/fake_prefs.h"
+
+namespace chromeos_update_engine {
+
+class MemoryBudgetTest : public ::testing::Test {};
+
+TEST_F(MemoryBudgetTest, DefaultBudgetKeepsLegacySizesTest) {
+  MemoryBudget budget(MemoryBudget::kDefaultBudget);
+  EXPECT_EQ(1024u * 1024, budget.write_cache_size());
+  EXPECT_EQ(1024u * 1024, budget.source_read_cache_size());
+  EXPECT_EQ(5u * 1024 * 1024, budget.puffpatch_cache_size());
+  EXPECT_EQ(1024u * 1024, budget.copy_buffer_size());
+  EXPECT_EQ(16u * 1024, budget.decoder_buffer_size());
+  EXPECT_GT(budget.operation_buffer_size(), 0u);
+}
+
+TEST_F(MemoryBudgetTest, BudgetIsClampedTest) {
+  EXPECT_EQ(MemoryBudget::kMinBudget, MemoryBudget(0).total());
+  EXPECT_EQ(MemoryBudget::kMaxBudget,
+            MemoryBudget(MemoryBudget::kMaxBudget * 2).total());
+}
+
+TEST_F(MemoryBudgetTest, ConsumersFitInBudgetTest) {
+  for (uint64_t total : {MemoryBudget::kMinBudget,
+                         MemoryBudget::kDefaultBudget,
+                         MemoryBudget::kMaxBudget}) {
+    MemoryBudget budget(total);
+    uint64_t used = budget.write_cache_size() +
+                    budget.source_read_cache_size() +
+                    budget.puffpatch_cache_size() + budget.copy_buffer_size() +
+                    2 * budget.decoder_buffer_size() +
+                    budget.operation_buffer_size();
+    EXPECT_EQ(total, used);
+    EXPECT_EQ(0u, budget.write_cache_size() % 4096);
+    EXPECT_EQ(0u, budget.decoder_buffer_size() % 4096);
+  }
+}
+
+TEST_F(MemoryBudgetTest, ParseMemAvailableTest) {
+  EXPECT_EQ(2048u * 1024,
+            MemoryBudget::ParseMemAvailable("MemTotal:        4096 kB\n"
+                                            "MemFree:         1024 kB\n"
+                                            "MemAvailable:    2048 kB\n"));
+  EXPECT_EQ(0u, MemoryBudget::ParseMemAvailable("MemTotal:  4096 kB\n"));
+  EXPECT_EQ(0u, MemoryBudget::ParseMemAvailable("MemAvailable: 1 MB\n"));
+  EXPECT_EQ(0u, MemoryBudget::ParseMemAvailable(""));
+}
+
+TEST_F(MemoryBudgetTest, ForDeviceUsesPrefTest) {
+  FakePrefs prefs;
+  EXPECT_TRUE(prefs.SetInt64(kPrefsApplyMemoryBudget, 64 * 1024 * 1024));
+  EXPECT_EQ(64u * 1024 * 1024, MemoryBudget::ForDevice(&prefs).total());
+}
+
+}  // namespace chromeos_update_engine
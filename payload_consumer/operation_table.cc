@@ -0,0 +1,140 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/operation_table.h"
+
+#include <limits>
+
+#include "update_engine/common/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The largest index of an extent or hash byte an Operation can refer to.
+const uint64_t kMaxIndex = std::numeric_limits<uint32_t>::max();
+
+}  // namespace
+
+bool OperationTable::Build(
+    const google::protobuf::RepeatedPtrField<PartitionUpdate>& partitions) {
+  // Count everything first so each array is allocated only once.
+  uint64_t num_operations = 0, num_extents = 0, hashes_size = 0;
+  for (const PartitionUpdate& partition : partitions) {
+    num_operations += partition.operations_size();
+    for (const InstallOperation& op : partition.operations()) {
+      num_extents += op.src_extents_size() + op.dst_extents_size();
+      hashes_size += op.src_sha256_hash().size() + op.data_sha256_hash().size();
+    }
+  }
+  TEST_AND_RETURN_FALSE(num_extents <= kMaxIndex);
+  TEST_AND_RETURN_FALSE(hashes_size <= kMaxIndex);
+
+  vector<Operation> operations;
+  vector<uint64_t> extent_start_blocks, extent_num_blocks;
+  string hashes;
+  operations.reserve(num_operations);
+  extent_start_blocks.reserve(num_extents);
+  extent_num_blocks.reserve(num_extents);
+  hashes.reserve(hashes_size);
+  for (const PartitionUpdate& partition : partitions) {
+    for (const InstallOperation& op : partition.operations()) {
+      Operation entry;
+      entry.type = op.type();
+      entry.flags = (op.has_data_offset() ? kHasDataOffset : 0) |
+                    (op.has_data_length() ? kHasDataLength : 0) |
+                    (op.has_src_length() ? kHasSrcLength : 0) |
+                    (op.has_dst_length() ? kHasDstLength : 0) |
+                    (op.has_src_sha256_hash() ? kHasSrcHash : 0) |
+                    (op.has_data_sha256_hash() ? kHasDataHash : 0);
+      entry.data_offset = op.data_offset();
+      entry.data_length = op.data_length();
+      entry.src_length = op.src_length();
+      entry.dst_length = op.dst_length();
+
+      entry.extents_begin = extent_start_blocks.size();
+      entry.num_src_extents = op.src_extents_size();
+      entry.num_dst_extents = op.dst_extents_size();
+      for (const Extent& extent : op.src_extents()) {
+        extent_start_blocks.push_back(extent.start_block());
+        extent_num_blocks.push_back(extent.num_blocks());
+      }
+      for (const Extent& extent : op.dst_extents()) {
+        extent_start_blocks.push_back(extent.start_block());
+        extent_num_blocks.push_back(extent.num_blocks());
+      }
+
+      entry.hashes_begin = hashes.size();
+      entry.src_hash_size = op.src_sha256_hash().size();
+      entry.data_hash_size = op.data_sha256_hash().size();
+      hashes.append(op.src_sha256_hash());
+      hashes.append(op.data_sha256_hash());
+      operations.push_back(entry);
+    }
+  }
+
+  operations_.swap(operations);
+  extent_start_blocks_.swap(extent_start_blocks);
+  extent_num_blocks_.swap(extent_num_blocks);
+  hashes_.swap(hashes);
+  return true;
+}
+
+void OperationTable::GetInstallOperation(
+    size_t index, InstallOperation* out_operation) const {
+  const Operation& entry = operations_[index];
+  out_operation->Clear();
+  out_operation->set_type(entry.type);
+  if (entry.flags & kHasDataOffset)
+    out_operation->set_data_offset(entry.data_offset);
+  if (entry.flags & kHasDataLength)
+    out_operation->set_data_length(entry.data_length);
+  if (entry.flags & kHasSrcLength)
+    out_operation->set_src_length(entry.src_length);
+  if (entry.flags & kHasDstLength)
+    out_operation->set_dst_length(entry.dst_length);
+
+  size_t extent_index = entry.extents_begin;
+  for (uint32_t i = 0; i < entry.num_src_extents; i++, extent_index++) {
+    Extent* extent = out_operation->add_src_extents();
+    extent->set_start_block(extent_start_blocks_[extent_index]);
+    extent->set_num_blocks(extent_num_blocks_[extent_index]);
+  }
+  for (uint32_t i = 0; i < entry.num_dst_extents; i++, extent_index++) {
+    Extent* extent = out_operation->add_dst_extents();
+    extent->set_start_block(extent_start_blocks_[extent_index]);
+    extent->set_num_blocks(extent_num_blocks_[extent_index]);
+  }
+
+  const char* hash = hashes_.data() + entry.hashes_begin;
+  if (entry.flags & kHasSrcHash)
+    out_operation->set_src_sha256_hash(hash, entry.src_hash_size);
+  if (entry.flags & kHasDataHash) {
+    out_operation->set_data_sha256_hash(hash + entry.src_hash_size,
+                                        entry.data_hash_size);
+  }
+}
+
+size_t OperationTable::MemoryUsage() const {
+  return operations_.capacity() * sizeof(Operation) +
+         extent_start_blocks_.capacity() * sizeof(uint64_t) +
+         extent_num_blocks_.capacity() * sizeof(uint64_t) + hashes_.capacity();
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,105 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_OPERATION_TABLE_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_OPERATION_TABLE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+#include <google/protobuf/repeated_field.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// OperationTable is a compact, read-only copy of the install operations of all
+// the partitions of a manifest, in the order they are applied. Each operation
+// is a fixed-size record, and the extents and hashes of all the operations are
+// stored in a few flat arrays, so the table uses a fraction of the memory of
+// the parsed protobuf messages and walking it doesn't chase pointers.
+class OperationTable {
+ public:
+  // Bits of Operation::flags telling which optional fields are set.
+  enum Flags : uint32_t {
+    kHasDataOffset = 1 << 0,
+    kHasDataLength = 1 << 1,
+    kHasSrcLength = 1 << 2,
+    kHasDstLength = 1 << 3,
+    kHasSrcHash = 1 << 4,
+    kHasDataHash = 1 << 5,
+  };
+
+  struct Operation {
+    InstallOperation::Type type;
+    uint32_t flags;
+    uint64_t data_offset;
+    uint64_t data_length;
+    uint64_t src_length;
+    uint64_t dst_length;
+    // The source extents start at |extents_begin| in the extent arrays and
+    // the destination extents follow them.
+    uint32_t extents_begin;
+    uint32_t num_src_extents;
+    uint32_t num_dst_extents;
+    // The source hash starts at |hashes_begin| in the hash array and the data
+    // hash follows it.
+    uint32_t hashes_begin;
+    uint32_t src_hash_size;
+    uint32_t data_hash_size;
+  };
+
+  OperationTable() = default;
+
+  // Replaces the contents of the table with the operations of |partitions|.
+  // Returns false if there are too many extents or hashes to index them.
+  bool Build(
+      const google::protobuf::RepeatedPtrField<PartitionUpdate>& partitions);
+
+  // The number of operations in the table.
+  size_t size() const { return operations_.size(); }
+
+  const Operation& operation(size_t index) const { return operations_[index]; }
+
+  // Fills |out_operation| with the operation at |index|. The message is
+  // cleared first, but protobuf keeps the extents it already allocated, so
+  // decoding every operation into the same message stops allocating memory
+  // once it held the largest one.
+  void GetInstallOperation(size_t index, InstallOperation* out_operation) const;
+
+  // Returns the number of bytes allocated by the table.
+  size_t MemoryUsage() const;
+
+ private:
+  std::vector<Operation> operations_;
+
+  // The extents of all the operations, as two parallel arrays.
+  std::vector<uint64_t> extent_start_blocks_;
+  std::vector<uint64_t> extent_num_blocks_;
+
+  // The source and data hashes of all the operations.
+  std::string hashes_;
+
+  DISALLOW_COPY_AND_ASSIGN(OperationTable);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_OPERATION_TABLE_H_
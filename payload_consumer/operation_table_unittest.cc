@@ -0,0 +1,149 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/operation_table.h"
+
+#include <string>
+
+#include <base/logging.h>
+#include <base/time/time.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+namespace chromeos_update_engine {
+
+class OperationTableTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    partitions_.Add();
+    partitions_.Add();
+    // A full operation with all the optional fields.
+    InstallOperation* op = partitions_.Mutable(0)->add_operations();
+    op->set_type(InstallOperation::SOURCE_BSDIFF);
+    op->set_data_offset(10);
+    op->set_data_length(20);
+    op->set_src_length(8192);
+    op->set_dst_length(4096);
+    *op->add_src_extents() = ExtentForRange(5, 1);
+    *op->add_src_extents() = ExtentForRange(1, 1);
+    *op->add_dst_extents() = ExtentForRange(7, 1);
+    op->set_src_sha256_hash(std::string(32, 'a'));
+    op->set_data_sha256_hash(std::string(32, 'b'));
+    // An operation without data or hashes.
+    op = partitions_.Mutable(0)->add_operations();
+    op->set_type(InstallOperation::ZERO);
+    *op->add_dst_extents() = ExtentForRange(100, 50);
+    // An operation in the second partition.
+    op = partitions_.Mutable(1)->add_operations();
+    op->set_type(InstallOperation::REPLACE_BZ);
+    op->set_data_offset(30);
+    op->set_data_length(5);
+    *op->add_dst_extents() = ExtentForRange(0, 2);
+    *op->add_dst_extents() = ExtentForRange(kSparseHole, 1);
+    op->set_data_sha256_hash(std::string(32, 'c'));
+  }
+
+  google::protobuf::RepeatedPtrField<PartitionUpdate> partitions_;
+  OperationTable table_;
+};
+
+TEST_F(OperationTableTest, RoundTripTest) {
+  EXPECT_TRUE(table_.Build(partitions_));
+  ASSERT_EQ(3u, table_.size());
+
+  InstallOperation op;
+  size_t index = 0;
+  for (const PartitionUpdate& partition : partitions_) {
+    for (const InstallOperation& expected_op : partition.operations()) {
+      table_.GetInstallOperation(index++, &op);
+      EXPECT_EQ(expected_op.SerializeAsString(), op.SerializeAsString());
+    }
+  }
+}
+
+TEST_F(OperationTableTest, OperationRecordTest) {
+  EXPECT_TRUE(table_.Build(partitions_));
+
+  const OperationTable::Operation& zero_op = table_.operation(1);
+  EXPECT_EQ(InstallOperation::ZERO, zero_op.type);
+  EXPECT_EQ(0u, zero_op.flags);
+  EXPECT_EQ(0u, zero_op.num_src_extents);
+  EXPECT_EQ(1u, zero_op.num_dst_extents);
+
+  const OperationTable::Operation& replace_op = table_.operation(2);
+  EXPECT_EQ(OperationTable::kHasDataOffset | OperationTable::kHasDataLength |
+                OperationTable::kHasDataHash,
+            replace_op.flags);
+  EXPECT_EQ(30u, replace_op.data_offset);
+  EXPECT_EQ(5u, replace_op.data_length);
+  // The extents of the previous operations come first.
+  EXPECT_EQ(4u, replace_op.extents_begin);
+}
+
+TEST_F(OperationTableTest, ReuseInstallOperationTest) {
+  EXPECT_TRUE(table_.Build(partitions_));
+  InstallOperation op;
+  table_.GetInstallOperation(0, &op);
+  table_.GetInstallOperation(1, &op);
+  EXPECT_EQ(InstallOperation::ZERO, op.type());
+  EXPECT_FALSE(op.has_data_offset());
+  EXPECT_FALSE(op.has_src_sha256_hash());
+  EXPECT_EQ(0, op.src_extents_size());
+  ASSERT_EQ(1, op.dst_extents_size());
+  EXPECT_EQ(ExtentForRange(100, 50), op.dst_extents(0));
+}
+
+TEST_F(OperationTableTest, LargeManifestTest) {
+  const size_t kNumOperations = 200000;
+  google::protobuf::RepeatedPtrField<PartitionUpdate> partitions;
+  PartitionUpdate* partition = partitions.Add();
+  for (size_t i = 0; i < kNumOperations; i++) {
+    InstallOperation* op = partition->add_operations();
+    op->set_type(InstallOperation::SOURCE_COPY);
+    *op->add_src_extents() = ExtentForRange(2 * i, 1);
+    *op->add_dst_extents() = ExtentForRange(2 * i + 1, 1);
+    op->set_src_sha256_hash(std::string(32, 'x'));
+  }
+
+  base::TimeTicks start = base::TimeTicks::Now();
+  EXPECT_TRUE(table_.Build(partitions));
+  LOG(INFO) << "Built a table of " << kNumOperations << " operations in "
+            << utils::FormatTimeDelta(base::TimeTicks::Now() - start)
+            << " using " << table_.MemoryUsage() << " bytes.";
+  EXPECT_EQ(kNumOperations, table_.size());
+  // Each operation takes its record, two extents and the hash.
+  EXPECT_EQ(
+      kNumOperations * (sizeof(OperationTable::Operation) + 2 * 16 + 32),
+      table_.MemoryUsage());
+
+  InstallOperation op;
+  table_.GetInstallOperation(kNumOperations - 1, &op);
+  EXPECT_EQ(ExtentForRange(2 * kNumOperations - 1, 1), op.dst_extents(0));
+}
+
+TEST_F(OperationTableTest, RebuildReplacesContentsTest) {
+  EXPECT_TRUE(table_.Build(partitions_));
+  partitions_.RemoveLast();
+  EXPECT_TRUE(table_.Build(partitions_));
+  EXPECT_EQ(2u, table_.size());
+  EXPECT_TRUE(table_.Build({}));
+  EXPECT_EQ(0u, table_.size());
+}
+
+}  // namespace chromeos_update_engine
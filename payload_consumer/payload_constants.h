@@ -56,6 +56,12 @@ extern const uint32_t kPuffdiffMinorPayloadVersion;
 // The minor version that allows Verity hash tree and FEC generation.
 extern const uint32_t kVerityMinorPayloadVersion;
 
+// The minor version that allows REPLACE_ZSTD and ZSTD_DIFF operations.
+extern const uint32_t kZstdMinorPayloadVersion;
+
+// The minor version that allows LZ4DIFF operation.
+extern const uint32_t kLz4diffMinorPayloadVersion;
+
 // The minimum and maximum supported minor version.
 extern const uint32_t kMinSupportedMinorPayloadVersion;
 extern const uint32_t kMaxSupportedMinorPayloadVersion;
@@ -81,7 +81,8 @@ class PayloadMetadata {
   // yet parsed, returns zero.
   uint32_t GetMetadataSignatureSize() const { return metadata_signature_size_; }
 
-  // Set |*out_manifest| to the manifest in |payload|.
+  // Set |*out_manifest| to the manifest in |payload|. If |out_manifest| is
+  // allocated on an arena, all the parsed messages are allocated on it too.
   // Returns true on success.
   bool GetManifest(const brillo::Blob& payload,
                    DeltaArchiveManifest* out_manifest) const;
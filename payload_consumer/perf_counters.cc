@@ -0,0 +1,195 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/perf_counters.h"
+
+#include <inttypes.h>
+
+#include <base/strings/stringprintf.h>
+
+#include "update_engine/payload_consumer/payload_constants.h"
+
+using base::StringAppendF;
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const char* const kStageNames[PerfCounters::kNumStages] = {
+    "fetch", "hash", "decode", "write", "verify"};
+
+const char* const kCacheNames[PerfCounters::kNumCaches] = {"source_read"};
+
+// Returns the throughput of |bytes| in |duration| as a string.
+string FormatRate(uint64_t bytes, base::TimeDelta duration) {
+  if (duration <= base::TimeDelta())
+    return "n/a";
+  return base::StringPrintf(
+      "%.1f KiB/s", bytes / 1024.0 / duration.InSecondsF());
+}
+
+}  // namespace
+
+PerfCounters* PerfCounters::Get() {
+  static PerfCounters* perf_counters = new PerfCounters();
+  return perf_counters;
+}
+
+void PerfCounters::Counter::Add(uint64_t new_bytes,
+                                base::TimeDelta duration) {
+  count.fetch_add(1, std::memory_order_relaxed);
+  bytes.fetch_add(new_bytes, std::memory_order_relaxed);
+  time_us.fetch_add(duration.InMicroseconds(), std::memory_order_relaxed);
+}
+
+void PerfCounters::Counter::Reset() {
+  count.store(0, std::memory_order_relaxed);
+  bytes.store(0, std::memory_order_relaxed);
+  time_us.store(0, std::memory_order_relaxed);
+}
+
+base::TimeDelta PerfCounters::Counter::time() const {
+  return base::TimeDelta::FromMicroseconds(
+      time_us.load(std::memory_order_relaxed));
+}
+
+void PerfCounters::AddStage(Stage stage,
+                            uint64_t bytes,
+                            base::TimeDelta duration) {
+  stages_[static_cast<size_t>(stage)].Add(bytes, duration);
+}
+
+void PerfCounters::AddOperation(InstallOperation::Type type,
+                                uint64_t bytes,
+                                base::TimeDelta duration) {
+  if (type < 0 || type >= InstallOperation_Type_Type_ARRAYSIZE)
+    return;
+  operations_[type].Add(bytes, duration);
+}
+
+void PerfCounters::AddCheckpoint(base::TimeDelta duration) {
+  checkpoints_.Add(0, duration);
+}
+
+void PerfCounters::AddEccRecovery(uint64_t repaired_blocks) {
+  ecc_recoveries_.fetch_add(1, std::memory_order_relaxed);
+  ecc_repaired_blocks_.fetch_add(repaired_blocks, std::memory_order_relaxed);
+}
+
+void PerfCounters::AddCacheLookup(Cache cache, bool hit) {
+  std::atomic<uint64_t>* counters = hit ? cache_hits_ : cache_misses_;
+  counters[static_cast<size_t>(cache)].fetch_add(1, std::memory_order_relaxed);
+}
+
+void PerfCounters::Reset() {
+  for (Counter& counter : stages_)
+    counter.Reset();
+  for (Counter& counter : operations_)
+    counter.Reset();
+  checkpoints_.Reset();
+  ecc_recoveries_.store(0, std::memory_order_relaxed);
+  ecc_repaired_blocks_.store(0, std::memory_order_relaxed);
+  for (size_t i = 0; i < kNumCaches; i++) {
+    cache_hits_[i].store(0, std::memory_order_relaxed);
+    cache_misses_[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+string PerfCounters::ToString() const {
+  string result;
+  for (size_t i = 0; i < kNumStages; i++) {
+    uint64_t bytes = stages_[i].bytes.load(std::memory_order_relaxed);
+    base::TimeDelta time = stages_[i].time();
+    StringAppendF(&result,
+                  "stage %s: %" PRIu64 " bytes in %.3fs (%s)\n",
+                  kStageNames[i],
+                  bytes,
+                  time.InSecondsF(),
+                  FormatRate(bytes, time).c_str());
+  }
+  for (int type = 0; type < InstallOperation_Type_Type_ARRAYSIZE; type++) {
+    const Counter& counter = operations_[type];
+    uint64_t count = counter.count.load(std::memory_order_relaxed);
+    if (count == 0)
+      continue;
+    StringAppendF(
+        &result,
+        "operation %s: %" PRIu64 " operations, %" PRIu64 " bytes in %.3fs\n",
+        InstallOperationTypeName(static_cast<InstallOperation::Type>(type)),
+        count,
+        counter.bytes.load(std::memory_order_relaxed),
+        counter.time().InSecondsF());
+  }
+  StringAppendF(&result,
+                "checkpoints: %" PRIu64 " in %.3fs\n",
+                checkpoint_count(),
+                checkpoints_.time().InSecondsF());
+  StringAppendF(&result,
+                "ecc recoveries: %" PRIu64 " operations, %" PRIu64
+                " blocks repaired\n",
+                ecc_recoveries(),
+                ecc_repaired_blocks_.load(std::memory_order_relaxed));
+  for (size_t i = 0; i < kNumCaches; i++) {
+    Cache cache = static_cast<Cache>(i);
+    uint64_t hits = cache_hits(cache);
+    uint64_t lookups = hits + cache_misses(cache);
+    StringAppendF(&result,
+                  "cache %s: %" PRIu64 " hits out of %" PRIu64 " lookups",
+                  kCacheNames[i],
+                  hits,
+                  lookups);
+    if (lookups > 0)
+      StringAppendF(&result, " (%.1f%%)", 100.0 * hits / lookups);
+    result += "\n";
+  }
+  return result;
+}
+
+uint64_t PerfCounters::stage_bytes(Stage stage) const {
+  return stages_[static_cast<size_t>(stage)].bytes.load(
+      std::memory_order_relaxed);
+}
+
+base::TimeDelta PerfCounters::stage_time(Stage stage) const {
+  return stages_[static_cast<size_t>(stage)].time();
+}
+
+uint64_t PerfCounters::operation_count(InstallOperation::Type type) const {
+  if (type < 0 || type >= InstallOperation_Type_Type_ARRAYSIZE)
+    return 0;
+  return operations_[type].count.load(std::memory_order_relaxed);
+}
+
+uint64_t PerfCounters::checkpoint_count() const {
+  return checkpoints_.count.load(std::memory_order_relaxed);
+}
+
+uint64_t PerfCounters::ecc_recoveries() const {
+  return ecc_recoveries_.load(std::memory_order_relaxed);
+}
+
+uint64_t PerfCounters::cache_hits(Cache cache) const {
+  return cache_hits_[static_cast<size_t>(cache)].load(
+      std::memory_order_relaxed);
+}
+
+uint64_t PerfCounters::cache_misses(Cache cache) const {
+  return cache_misses_[static_cast<size_t>(cache)].load(
+      std::memory_order_relaxed);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,127 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_PERF_COUNTERS_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_PERF_COUNTERS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+
+#include <base/macros.h>
+#include <base/time/time.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// PerfCounters aggregates the performance of the updates applied by this
+// process, so the throughput of each stage can be queried on the device
+// instead of only through the UMA histograms. The counters are updated with
+// relaxed atomic operations, so they are cheap enough for the hot paths and
+// can be updated from any thread. They accumulate since the process started.
+class PerfCounters {
+ public:
+  // The stages the update data goes through.
+  enum class Stage {
+    // Waiting for the payload data from the network.
+    kFetch,
+    // Hashing the payload data.
+    kHash,
+    // Performing the install operations, from their payload data.
+    kDecode,
+    // Flushing the data written to the target partitions.
+    kWrite,
+    // Reading back and hashing the target partitions.
+    kVerify,
+  };
+  static const size_t kNumStages = 5;
+
+  // The caches whose hit rate is tracked.
+  enum class Cache {
+    // The window caching the source reads of the diff operations.
+    kSourceRead,
+  };
+  static const size_t kNumCaches = 1;
+
+  // Returns the counters of this process.
+  static PerfCounters* Get();
+
+  PerfCounters() = default;
+
+  // Records that |stage| processed |bytes| in |duration|.
+  void AddStage(Stage stage, uint64_t bytes, base::TimeDelta duration);
+
+  // Records an operation of |type| with |bytes| of payload data performed in
+  // |duration|.
+  void AddOperation(InstallOperation::Type type,
+                    uint64_t bytes,
+                    base::TimeDelta duration);
+
+  // Records a checkpoint of the update progress that took |duration| to be
+  // persisted.
+  void AddCheckpoint(base::TimeDelta duration);
+
+  // Records an operation whose corrupted source was recovered with error
+  // correction, repairing |repaired_blocks| blocks individually.
+  void AddEccRecovery(uint64_t repaired_blocks);
+
+  // Records a lookup in |cache|.
+  void AddCacheLookup(Cache cache, bool hit);
+
+  // Resets all the counters.
+  void Reset();
+
+  // Returns a human readable dump of the counters, one per line.
+  std::string ToString() const;
+
+  // Accessors of the counters. Unknown operation types have no operations.
+  uint64_t stage_bytes(Stage stage) const;
+  base::TimeDelta stage_time(Stage stage) const;
+  uint64_t operation_count(InstallOperation::Type type) const;
+  uint64_t checkpoint_count() const;
+  uint64_t ecc_recoveries() const;
+  uint64_t cache_hits(Cache cache) const;
+  uint64_t cache_misses(Cache cache) const;
+
+ private:
+  // A number of events, the bytes they processed and the time spent on them.
+  struct Counter {
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<int64_t> time_us{0};
+
+    void Add(uint64_t bytes, base::TimeDelta duration);
+    void Reset();
+    base::TimeDelta time() const;
+  };
+
+  Counter stages_[kNumStages];
+  Counter operations_[InstallOperation_Type_Type_ARRAYSIZE];
+  Counter checkpoints_;
+  std::atomic<uint64_t> ecc_recoveries_{0};
+  std::atomic<uint64_t> ecc_repaired_blocks_{0};
+  std::atomic<uint64_t> cache_hits_[kNumCaches]{};
+  std::atomic<uint64_t> cache_misses_[kNumCaches]{};
+
+  DISALLOW_COPY_AND_ASSIGN(PerfCounters);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_PERF_COUNTERS_H_
@@ -0,0 +1,125 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/perf_counters.h"
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+class PerfCountersTest : public ::testing::Test {
+ protected:
+  PerfCounters counters_;
+};
+
+TEST_F(PerfCountersTest, StagesTest) {
+  counters_.AddStage(PerfCounters::Stage::kFetch,
+                     1024 * 1024,
+                     base::TimeDelta::FromSeconds(2));
+  counters_.AddStage(PerfCounters::Stage::kFetch,
+                     1024 * 1024,
+                     base::TimeDelta::FromSeconds(2));
+  EXPECT_EQ(2U * 1024 * 1024,
+            counters_.stage_bytes(PerfCounters::Stage::kFetch));
+  EXPECT_EQ(base::TimeDelta::FromSeconds(4),
+            counters_.stage_time(PerfCounters::Stage::kFetch));
+  EXPECT_EQ(0U, counters_.stage_bytes(PerfCounters::Stage::kWrite));
+
+  string dump = counters_.ToString();
+  EXPECT_NE(string::npos,
+            dump.find("stage fetch: 2097152 bytes in 4.000s (512.0 KiB/s)"));
+  EXPECT_NE(string::npos, dump.find("stage write: 0 bytes in 0.000s (n/a)"));
+}
+
+TEST_F(PerfCountersTest, OperationsTest) {
+  counters_.AddOperation(
+      InstallOperation::SOURCE_COPY, 0, base::TimeDelta::FromMilliseconds(5));
+  counters_.AddOperation(InstallOperation::REPLACE_XZ,
+                         100,
+                         base::TimeDelta::FromMilliseconds(10));
+  counters_.AddOperation(InstallOperation::REPLACE_XZ,
+                         200,
+                         base::TimeDelta::FromMilliseconds(10));
+  EXPECT_EQ(1U, counters_.operation_count(InstallOperation::SOURCE_COPY));
+  EXPECT_EQ(2U, counters_.operation_count(InstallOperation::REPLACE_XZ));
+  EXPECT_EQ(0U, counters_.operation_count(InstallOperation::ZERO));
+  // Types out of range are ignored.
+  InstallOperation::Type unknown_type =
+      static_cast<InstallOperation::Type>(InstallOperation_Type_Type_ARRAYSIZE);
+  counters_.AddOperation(unknown_type, 1, base::TimeDelta());
+  EXPECT_EQ(0U, counters_.operation_count(unknown_type));
+
+  string dump = counters_.ToString();
+  EXPECT_NE(string::npos,
+            dump.find("operation REPLACE_XZ: 2 operations, 300 bytes"));
+  // Only the operation types performed are listed.
+  EXPECT_EQ(string::npos, dump.find("operation ZERO"));
+}
+
+TEST_F(PerfCountersTest, CheckpointsEccAndCachesTest) {
+  counters_.AddCheckpoint(base::TimeDelta::FromMilliseconds(3));
+  counters_.AddEccRecovery(4);
+  counters_.AddEccRecovery(0);
+  counters_.AddCacheLookup(PerfCounters::Cache::kSourceRead, true);
+  counters_.AddCacheLookup(PerfCounters::Cache::kSourceRead, true);
+  counters_.AddCacheLookup(PerfCounters::Cache::kSourceRead, true);
+  counters_.AddCacheLookup(PerfCounters::Cache::kSourceRead, false);
+  EXPECT_EQ(1U, counters_.checkpoint_count());
+  EXPECT_EQ(2U, counters_.ecc_recoveries());
+  EXPECT_EQ(3U, counters_.cache_hits(PerfCounters::Cache::kSourceRead));
+  EXPECT_EQ(1U, counters_.cache_misses(PerfCounters::Cache::kSourceRead));
+
+  string dump = counters_.ToString();
+  EXPECT_NE(string::npos, dump.find("checkpoints: 1 in 0.003s"));
+  EXPECT_NE(string::npos,
+            dump.find("ecc recoveries: 2 operations, 4 blocks repaired"));
+  EXPECT_NE(string::npos,
+            dump.find("cache source_read: 3 hits out of 4 lookups (75.0%)"));
+
+  counters_.Reset();
+  EXPECT_EQ(0U, counters_.checkpoint_count());
+  EXPECT_EQ(0U, counters_.ecc_recoveries());
+  EXPECT_EQ(0U, counters_.cache_hits(PerfCounters::Cache::kSourceRead));
+}
+
+TEST_F(PerfCountersTest, ConcurrentUpdatesTest) {
+  const int kNumThreads = 4;
+  const int kNumUpdates = 1000;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kNumThreads; i++) {
+    threads.emplace_back([this] {
+      for (int j = 0; j < kNumUpdates; j++) {
+        counters_.AddStage(PerfCounters::Stage::kHash,
+                           10,
+                           base::TimeDelta::FromMicroseconds(1));
+      }
+    });
+  }
+  for (std::thread& thread : threads)
+    thread.join();
+  EXPECT_EQ(10U * kNumThreads * kNumUpdates,
+            counters_.stage_bytes(PerfCounters::Stage::kHash));
+  EXPECT_EQ(base::TimeDelta::FromMicroseconds(kNumThreads * kNumUpdates),
+            counters_.stage_time(PerfCounters::Stage::kHash));
+}
+
+}  // namespace chromeos_update_engine
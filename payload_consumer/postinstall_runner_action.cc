@@ -45,6 +45,15 @@ namespace {
 // sample_images.sh file.
 const int kPostinstallStatusFd = 3;
 
+// The maximum number of postinstall programs of independent partitions running
+// at the same time. On Android, the partitions are mounted at the same
+// /postinstall directory, so they run one at a time.
+#ifdef __ANDROID__
+const size_t kMaxConcurrentPostinstalls = 1;
+#else   // __ANDROID__
+const size_t kMaxConcurrentPostinstalls = 4;
+#endif  // __ANDROID__
+
 }  // namespace
 
 namespace chromeos_update_engine {
@@ -77,12 +86,8 @@ void PostinstallRunnerAction::PerformAction() {
     total_weight_ += partition_weight_[i];
   }
   accumulated_weight_ = 0;
-  ReportProgress(0);
+  ReportProgress();
 
-  PerformPartitionPostinstall();
-}
-
-void PostinstallRunnerAction::PerformPartitionPostinstall() {
   if (!install_plan_.run_post_install) {
     LOG(INFO) << "Skipping post-install according to install plan.";
     return CompletePostinstall(ErrorCode::kSuccess);
@@ -93,245 +98,307 @@ void PostinstallRunnerAction::PerformPartitionPostinstall() {
     return CompletePostinstall(ErrorCode::kSuccess);
   }
 
-  // Skip all the partitions that don't have a post-install step.
-  while (current_partition_ < install_plan_.partitions.size() &&
-         !install_plan_.partitions[current_partition_].run_postinstall) {
-    VLOG(1) << "Skipping post-install on partition "
-            << install_plan_.partitions[current_partition_].name;
-    current_partition_++;
+  PerformPartitionPostinstall();
+}
+
+void PostinstallRunnerAction::PerformPartitionPostinstall() {
+  while (error_code_ == ErrorCode::kSuccess) {
+    // Skip all the partitions that don't have a post-install step.
+    while (current_partition_ < install_plan_.partitions.size() &&
+           !install_plan_.partitions[current_partition_].run_postinstall) {
+      VLOG(1) << "Skipping post-install on partition "
+              << install_plan_.partitions[current_partition_].name;
+      current_partition_++;
+    }
+    if (current_partition_ == install_plan_.partitions.size())
+      break;
+
+    // Partitions not marked independent run alone, after the ones before them
+    // are done and before the ones after them start.
+    if (!runs_.empty() &&
+        (runs_.size() >= kMaxConcurrentPostinstalls ||
+         !install_plan_.partitions[current_partition_]
+              .postinstall_independent ||
+         !install_plan_.partitions[runs_.begin()->first]
+              .postinstall_independent)) {
+      return;
+    }
+    StartPartitionPostinstall(current_partition_++);
   }
-  if (current_partition_ == install_plan_.partitions.size())
-    return CompletePostinstall(ErrorCode::kSuccess);
+  if (runs_.empty())
+    CompletePostinstall(error_code_);
+}
 
-  const InstallPlan::Partition& partition =
-      install_plan_.partitions[current_partition_];
+bool PostinstallRunnerAction::StartPartitionPostinstall(size_t index) {
+  const InstallPlan::Partition& partition = install_plan_.partitions[index];
 
   const string mountable_device =
       utils::MakePartitionNameForMount(partition.target_path);
   if (mountable_device.empty()) {
     LOG(ERROR) << "Cannot make mountable device from " << partition.target_path;
-    return CompletePostinstall(ErrorCode::kPostinstallRunnerError);
+    error_code_ = ErrorCode::kPostinstallRunnerError;
+    return false;
+  }
+
+  base::FilePath postinstall_path(partition.postinstall_path);
+  if (postinstall_path.IsAbsolute()) {
+    LOG(ERROR) << "Invalid absolute path passed to postinstall, use a relative"
+                  "path instead: "
+               << partition.postinstall_path;
+    error_code_ = ErrorCode::kPostinstallRunnerError;
+    return false;
   }
 
-  // Perform post-install for the current_partition_ partition. At this point we
-  // need to call CompletePartitionPostinstall to complete the operation and
-  // cleanup.
+  // Perform post-install for the partition at |index|. From this point, the
+  // run needs to be cleaned up.
+  PostinstallRun* run = &runs_[index];
 #ifdef __ANDROID__
-  fs_mount_dir_ = "/postinstall";
+  run->fs_mount_dir = "/postinstall";
 #else   // __ANDROID__
   base::FilePath temp_dir;
-  TEST_AND_RETURN(base::CreateNewTempDirectory("au_postint_mount", &temp_dir));
-  fs_mount_dir_ = temp_dir.value();
+  if (!base::CreateNewTempDirectory("au_postint_mount", &temp_dir)) {
+    LOG(ERROR) << "Unable to create a mountpoint for " << partition.name;
+    runs_.erase(index);
+    error_code_ = ErrorCode::kPostinstallRunnerError;
+    return false;
+  }
+  run->fs_mount_dir = temp_dir.value();
 #endif  // __ANDROID__
 
   // Double check that the fs_mount_dir is not busy with a previous mounted
   // filesystem from a previous crashed postinstall step.
-  if (utils::IsMountpoint(fs_mount_dir_)) {
-    LOG(INFO) << "Found previously mounted filesystem at " << fs_mount_dir_;
-    utils::UnmountFilesystem(fs_mount_dir_);
-  }
-
-  base::FilePath postinstall_path(partition.postinstall_path);
-  if (postinstall_path.IsAbsolute()) {
-    LOG(ERROR) << "Invalid absolute path passed to postinstall, use a relative"
-                  "path instead: "
-               << partition.postinstall_path;
-    return CompletePostinstall(ErrorCode::kPostinstallRunnerError);
+  if (utils::IsMountpoint(run->fs_mount_dir)) {
+    LOG(INFO) << "Found previously mounted filesystem at "
+              << run->fs_mount_dir;
+    utils::UnmountFilesystem(run->fs_mount_dir);
   }
 
   string abs_path =
-      base::FilePath(fs_mount_dir_).Append(postinstall_path).value();
+      base::FilePath(run->fs_mount_dir).Append(postinstall_path).value();
   if (!base::StartsWith(
-          abs_path, fs_mount_dir_, base::CompareCase::SENSITIVE)) {
+          abs_path, run->fs_mount_dir, base::CompareCase::SENSITIVE)) {
     LOG(ERROR) << "Invalid relative postinstall path: "
                << partition.postinstall_path;
-    return CompletePostinstall(ErrorCode::kPostinstallRunnerError);
+    Cleanup(run);
+    runs_.erase(index);
+    error_code_ = ErrorCode::kPostinstallRunnerError;
+    return false;
   }
 
+  string error;
 #ifdef __ANDROID__
   // In Chromium OS, the postinstall step is allowed to write to the block
   // device on the target image, so we don't mark it as read-only and should
   // be read-write since we just wrote to it during the update.
 
   // Mark the block device as read-only before mounting for post-install.
-  if (!utils::SetBlockDeviceReadOnly(mountable_device, true)) {
-    return CompletePartitionPostinstall(
-        1, "Error marking the device " + mountable_device + " read only.");
-  }
+  if (!utils::SetBlockDeviceReadOnly(mountable_device, true))
+    error = "Error marking the device " + mountable_device + " read only.";
 #endif  // __ANDROID__
 
-  if (!utils::MountFilesystem(mountable_device,
-                              fs_mount_dir_,
+  if (error.empty() &&
+      !utils::MountFilesystem(mountable_device,
+                              run->fs_mount_dir,
                               MS_RDONLY,
                               partition.filesystem_type,
                               constants::kPostinstallMountOptions)) {
-    return CompletePartitionPostinstall(
-        1, "Error mounting the device " + mountable_device);
+    error = "Error mounting the device " + mountable_device;
   }
 
-  LOG(INFO) << "Performing postinst (" << partition.postinstall_path << " at "
-            << abs_path << ") installed on device " << partition.target_path
-            << " and mountable device " << mountable_device;
-
-  // Logs the file format of the postinstall script we are about to run. This
-  // will help debug when the postinstall script doesn't match the architecture
-  // of our build.
-  LOG(INFO) << "Format file for new " << partition.postinstall_path
-            << " is: " << utils::GetFileFormat(abs_path);
-
-  // Runs the postinstall script asynchronously to free up the main loop while
-  // it's running.
-  vector<string> command = {abs_path};
+  if (error.empty()) {
+    LOG(INFO) << "Performing postinst (" << partition.postinstall_path
+              << " at " << abs_path << ") installed on device "
+              << partition.target_path << " and mountable device "
+              << mountable_device;
+
+    // Logs the file format of the postinstall script we are about to run. This
+    // will help debug when the postinstall script doesn't match the
+    // architecture of our build.
+    LOG(INFO) << "Format file for new " << partition.postinstall_path
+              << " is: " << utils::GetFileFormat(abs_path);
+
+    // Runs the postinstall script asynchronously to free up the main loop
+    // while it's running.
+    vector<string> command = {abs_path};
 #ifdef __ANDROID__
-  // In Brillo and Android, we pass the slot number and status fd.
-  command.push_back(std::to_string(install_plan_.target_slot));
-  command.push_back(std::to_string(kPostinstallStatusFd));
+    // In Brillo and Android, we pass the slot number and status fd.
+    command.push_back(std::to_string(install_plan_.target_slot));
+    command.push_back(std::to_string(kPostinstallStatusFd));
 #else
-  // Chrome OS postinstall expects the target rootfs as the first parameter.
-  command.push_back(partition.target_path);
+    // Chrome OS postinstall expects the target rootfs as the first parameter.
+    command.push_back(partition.target_path);
 #endif  // __ANDROID__
 
-  current_command_ = Subprocess::Get().ExecFlags(
-      command,
-      Subprocess::kRedirectStderrToStdout,
-      {kPostinstallStatusFd},
-      base::Bind(&PostinstallRunnerAction::CompletePartitionPostinstall,
-                 base::Unretained(this)));
-  // Subprocess::Exec should never return a negative process id.
-  CHECK_GE(current_command_, 0);
-
-  if (!current_command_) {
-    CompletePartitionPostinstall(1, "Postinstall didn't launch");
-    return;
+    run->command = Subprocess::Get().ExecFlags(
+        command,
+        Subprocess::kRedirectStderrToStdout,
+        {kPostinstallStatusFd},
+        base::Bind(&PostinstallRunnerAction::CompletePartitionPostinstall,
+                   base::Unretained(this),
+                   index));
+    // Subprocess::Exec should never return a negative process id.
+    CHECK_GE(run->command, 0);
+
+    if (!run->command)
+      error = "Postinstall didn't launch";
+  }
+
+  if (!error.empty()) {
+    LOG(ERROR) << error;
+    Cleanup(run);
+    runs_.erase(index);
+    RecordPartitionResult(index, 1);
+    return false;
   }
 
   // Monitor the status file descriptor.
-  progress_fd_ =
-      Subprocess::Get().GetPipeFd(current_command_, kPostinstallStatusFd);
-  int fd_flags = fcntl(progress_fd_, F_GETFL, 0) | O_NONBLOCK;
-  if (HANDLE_EINTR(fcntl(progress_fd_, F_SETFL, fd_flags)) < 0) {
-    PLOG(ERROR) << "Unable to set non-blocking I/O mode on fd " << progress_fd_;
+  run->progress_fd =
+      Subprocess::Get().GetPipeFd(run->command, kPostinstallStatusFd);
+  int fd_flags = fcntl(run->progress_fd, F_GETFL, 0) | O_NONBLOCK;
+  if (HANDLE_EINTR(fcntl(run->progress_fd, F_SETFL, fd_flags)) < 0) {
+    PLOG(ERROR) << "Unable to set non-blocking I/O mode on fd "
+                << run->progress_fd;
   }
 
-  progress_task_ = MessageLoop::current()->WatchFileDescriptor(
+  run->progress_task = MessageLoop::current()->WatchFileDescriptor(
       FROM_HERE,
-      progress_fd_,
+      run->progress_fd,
       MessageLoop::WatchMode::kWatchRead,
       true,
       base::Bind(&PostinstallRunnerAction::OnProgressFdReady,
-                 base::Unretained(this)));
+                 base::Unretained(this),
+                 index));
+  return true;
 }
 
-void PostinstallRunnerAction::OnProgressFdReady() {
+void PostinstallRunnerAction::OnProgressFdReady(size_t index) {
+  auto it = runs_.find(index);
+  if (it == runs_.end())
+    return;
+  PostinstallRun* run = &it->second;
   char buf[1024];
   size_t bytes_read;
   do {
     bytes_read = 0;
     bool eof;
-    bool ok =
-        utils::ReadAll(progress_fd_, buf, arraysize(buf), &bytes_read, &eof);
-    progress_buffer_.append(buf, bytes_read);
+    bool ok = utils::ReadAll(
+        run->progress_fd, buf, arraysize(buf), &bytes_read, &eof);
+    run->progress_buffer.append(buf, bytes_read);
     // Process every line.
-    vector<string> lines = base::SplitString(
-        progress_buffer_, "\n", base::KEEP_WHITESPACE, base::SPLIT_WANT_ALL);
+    vector<string> lines = base::SplitString(run->progress_buffer,
+                                             "\n",
+                                             base::KEEP_WHITESPACE,
+                                             base::SPLIT_WANT_ALL);
     if (!lines.empty()) {
-      progress_buffer_ = lines.back();
+      run->progress_buffer = lines.back();
       lines.pop_back();
       for (const auto& line : lines) {
-        ProcessProgressLine(line);
+        ProcessProgressLine(index, line);
       }
     }
     if (!ok || eof) {
       // There was either an error or an EOF condition, so we are done watching
       // the file descriptor.
-      MessageLoop::current()->CancelTask(progress_task_);
-      progress_task_ = MessageLoop::kTaskIdNull;
+      MessageLoop::current()->CancelTask(run->progress_task);
+      run->progress_task = MessageLoop::kTaskIdNull;
       return;
     }
   } while (bytes_read);
 }
 
-bool PostinstallRunnerAction::ProcessProgressLine(const string& line) {
+bool PostinstallRunnerAction::ProcessProgressLine(size_t index,
+                                                  const string& line) {
+  auto it = runs_.find(index);
   double frac = 0;
-  if (sscanf(line.c_str(), "global_progress %lf", &frac) == 1 &&
+  if (it != runs_.end() &&
+      sscanf(line.c_str(), "global_progress %lf", &frac) == 1 &&
       !std::isnan(frac)) {
-    ReportProgress(frac);
+    if (!std::isfinite(frac) || frac < 0)
+      frac = 0;
+    if (frac > 1)
+      frac = 1;
+    it->second.progress = frac;
+    ReportProgress();
     return true;
   }
 
   return false;
 }
 
-void PostinstallRunnerAction::ReportProgress(double frac) {
+void PostinstallRunnerAction::ReportProgress() {
   if (!delegate_)
     return;
-  if (current_partition_ >= partition_weight_.size() || total_weight_ == 0) {
+  if (total_weight_ == 0) {
     delegate_->ProgressUpdate(1.);
     return;
   }
-  if (!std::isfinite(frac) || frac < 0)
-    frac = 0;
-  if (frac > 1)
-    frac = 1;
-  double postinst_action_progress =
-      (accumulated_weight_ + partition_weight_[current_partition_] * frac) /
-      total_weight_;
-  delegate_->ProgressUpdate(postinst_action_progress);
+  double weight_done = accumulated_weight_;
+  for (const auto& index_run : runs_) {
+    weight_done +=
+        partition_weight_[index_run.first] * index_run.second.progress;
+  }
+  delegate_->ProgressUpdate(weight_done / total_weight_);
 }
 
-void PostinstallRunnerAction::Cleanup() {
-  utils::UnmountFilesystem(fs_mount_dir_);
+void PostinstallRunnerAction::Cleanup(PostinstallRun* run) {
+  utils::UnmountFilesystem(run->fs_mount_dir);
 #ifndef __ANDROID__
-  if (!base::DeleteFile(base::FilePath(fs_mount_dir_), false)) {
-    PLOG(WARNING) << "Not removing temporary mountpoint " << fs_mount_dir_;
+  if (!base::DeleteFile(base::FilePath(run->fs_mount_dir), false)) {
+    PLOG(WARNING) << "Not removing temporary mountpoint " << run->fs_mount_dir;
   }
 #endif  // !__ANDROID__
-  fs_mount_dir_.clear();
+  run->fs_mount_dir.clear();
 
-  progress_fd_ = -1;
-  if (progress_task_ != MessageLoop::kTaskIdNull) {
-    MessageLoop::current()->CancelTask(progress_task_);
-    progress_task_ = MessageLoop::kTaskIdNull;
+  run->progress_fd = -1;
+  if (run->progress_task != MessageLoop::kTaskIdNull) {
+    MessageLoop::current()->CancelTask(run->progress_task);
+    run->progress_task = MessageLoop::kTaskIdNull;
   }
-  progress_buffer_.clear();
+  run->progress_buffer.clear();
 }
 
 void PostinstallRunnerAction::CompletePartitionPostinstall(
-    int return_code, const string& output) {
-  current_command_ = 0;
-  Cleanup();
-
-  if (return_code != 0) {
-    LOG(ERROR) << "Postinst command failed with code: " << return_code;
-    ErrorCode error_code = ErrorCode::kPostinstallRunnerError;
-
-    if (return_code == 3) {
-      // This special return code means that we tried to update firmware,
-      // but couldn't because we booted from FW B, and we need to reboot
-      // to get back to FW A.
-      error_code = ErrorCode::kPostinstallBootedFromFirmwareB;
-    }
+    size_t index, int return_code, const string& output) {
+  Cleanup(&runs_[index]);
+  runs_.erase(index);
+  RecordPartitionResult(index, return_code);
+  ReportProgress();
 
-    if (return_code == 4) {
-      // This special return code means that we tried to update firmware,
-      // but couldn't because we booted from FW B, and we need to reboot
-      // to get back to FW A.
-      error_code = ErrorCode::kPostinstallFirmwareRONotUpdatable;
-    }
+  PerformPartitionPostinstall();
+}
 
-    // If postinstall script for this partition is optional we can ignore the
-    // result.
-    if (install_plan_.partitions[current_partition_].postinstall_optional) {
-      LOG(INFO) << "Ignoring postinstall failure since it is optional";
-    } else {
-      return CompletePostinstall(error_code);
-    }
+void PostinstallRunnerAction::RecordPartitionResult(size_t index,
+                                                    int return_code) {
+  accumulated_weight_ += partition_weight_[index];
+  if (return_code == 0)
+    return;
+
+  const InstallPlan::Partition& partition = install_plan_.partitions[index];
+  LOG(ERROR) << "Postinst command of " << partition.name
+             << " failed with code: " << return_code;
+  ErrorCode error_code = ErrorCode::kPostinstallRunnerError;
+
+  if (return_code == 3) {
+    // This special return code means that we tried to update firmware,
+    // but couldn't because we booted from FW B, and we need to reboot
+    // to get back to FW A.
+    error_code = ErrorCode::kPostinstallBootedFromFirmwareB;
   }
-  accumulated_weight_ += partition_weight_[current_partition_];
-  current_partition_++;
-  ReportProgress(0);
 
-  PerformPartitionPostinstall();
+  if (return_code == 4) {
+    // This special return code means that we tried to update firmware,
+    // but couldn't because we booted from FW B, and we need to reboot
+    // to get back to FW A.
+    error_code = ErrorCode::kPostinstallFirmwareRONotUpdatable;
+  }
+
+  // If postinstall script for this partition is optional we can ignore the
+  // result.
+  if (partition.postinstall_optional) {
+    LOG(INFO) << "Ignoring postinstall failure since it is optional";
+  } else if (error_code_ == ErrorCode::kSuccess) {
+    error_code_ = error_code;
+  }
 }
 
 void PostinstallRunnerAction::CompletePostinstall(ErrorCode error_code) {
@@ -368,40 +435,48 @@ void PostinstallRunnerAction::CompletePostinstall(ErrorCode error_code) {
 }
 
 void PostinstallRunnerAction::SuspendAction() {
-  if (!current_command_)
-    return;
-  if (kill(current_command_, SIGSTOP) != 0) {
-    PLOG(ERROR) << "Couldn't pause child process " << current_command_;
-  } else {
-    is_current_command_suspended_ = true;
+  for (auto& index_run : runs_) {
+    PostinstallRun* run = &index_run.second;
+    if (!run->command)
+      continue;
+    if (kill(run->command, SIGSTOP) != 0) {
+      PLOG(ERROR) << "Couldn't pause child process " << run->command;
+    } else {
+      run->suspended = true;
+    }
   }
 }
 
 void PostinstallRunnerAction::ResumeAction() {
-  if (!current_command_)
-    return;
-  if (kill(current_command_, SIGCONT) != 0) {
-    PLOG(ERROR) << "Couldn't resume child process " << current_command_;
-  } else {
-    is_current_command_suspended_ = false;
+  for (auto& index_run : runs_) {
+    PostinstallRun* run = &index_run.second;
+    if (!run->command)
+      continue;
+    if (kill(run->command, SIGCONT) != 0) {
+      PLOG(ERROR) << "Couldn't resume child process " << run->command;
+    } else {
+      run->suspended = false;
+    }
   }
 }
 
 void PostinstallRunnerAction::TerminateProcessing() {
-  if (!current_command_)
-    return;
-  // Calling KillExec() will discard the callback we registered and therefore
-  // the unretained reference to this object.
-  Subprocess::Get().KillExec(current_command_);
-
-  // If the command has been suspended, resume it after KillExec() so that the
-  // process can process the SIGTERM sent by KillExec().
-  if (is_current_command_suspended_) {
-    ResumeAction();
+  for (auto& index_run : runs_) {
+    PostinstallRun* run = &index_run.second;
+    if (!run->command)
+      continue;
+    // Calling KillExec() will discard the callback we registered and therefore
+    // the unretained reference to this object.
+    Subprocess::Get().KillExec(run->command);
+
+    // If the command has been suspended, resume it after KillExec() so that
+    // the process can process the SIGTERM sent by KillExec().
+    if (run->suspended && kill(run->command, SIGCONT) != 0)
+      PLOG(ERROR) << "Couldn't resume child process " << run->command;
+
+    Cleanup(run);
   }
-
-  current_command_ = 0;
-  Cleanup();
+  runs_.clear();
 }
 
 }  // namespace chromeos_update_engine
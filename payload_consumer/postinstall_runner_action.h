@@ -17,6 +17,7 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_POSTINSTALL_RUNNER_ACTION_H_
 #define UPDATE_ENGINE_PAYLOAD_CONSUMER_POSTINSTALL_RUNNER_ACTION_H_
 
+#include <map>
 #include <string>
 #include <vector>
 
@@ -66,30 +67,67 @@ class PostinstallRunnerAction : public InstallPlanAction {
   friend class PostinstallRunnerActionTest;
   FRIEND_TEST(PostinstallRunnerActionTest, ProcessProgressLineTest);
 
+  // The postinstall program running for a partition.
+  struct PostinstallRun {
+    // The path where the filesystem is mounted during post-install.
+    std::string fs_mount_dir;
+
+    // Postinstall command running, or 0 if it wasn't started.
+    pid_t command{0};
+
+    // True if |command| has been suspended by SuspendAction().
+    bool suspended{false};
+
+    // The parent progress file descriptor used to watch for progress reports
+    // from the postinstall program and the task watching for them.
+    int progress_fd{-1};
+    brillo::MessageLoop::TaskId progress_task{brillo::MessageLoop::kTaskIdNull};
+
+    // A buffer of a partial read line from the progress file descriptor.
+    std::string progress_buffer;
+
+    // The progress reported by the program, between 0 and 1.
+    double progress{0};
+  };
+
+  // Starts the postinstall programs of the partitions from
+  // |current_partition_| on, as long as they can run at the same time as the
+  // ones already running. Completes the action once all of them ran.
   void PerformPartitionPostinstall();
 
-  // Called whenever the |progress_fd_| has data available to read.
-  void OnProgressFdReady();
+  // Mounts the partition at |index| and starts its postinstall program.
+  // Returns whether it was started. Otherwise, the failure is recorded as
+  // done by RecordPartitionResult().
+  bool StartPartitionPostinstall(size_t index);
+
+  // Called whenever the progress file descriptor of the postinstall program
+  // of the partition at |index| has data available to read.
+  void OnProgressFdReady(size_t index);
 
-  // Updates the action progress according to the |line| passed from the
-  // postinstall program. Valid lines are:
+  // Updates the progress of the partition at |index| according to the |line|
+  // passed from its postinstall program. Valid lines are:
   //     global_progress <frac>
   //         <frac> should be between 0.0 and 1.0; sets the progress to the
   //         <frac> value.
-  bool ProcessProgressLine(const std::string& line);
+  bool ProcessProgressLine(size_t index, const std::string& line);
 
-  // Report the progress to the delegate given that the postinstall operation
-  // for |current_partition_| has a current progress of |frac|, a value between
-  // 0 and 1 for that step.
-  void ReportProgress(double frac);
+  // Report the overall progress to the delegate, from the weights of the
+  // partitions done and the progress of the running ones.
+  void ReportProgress();
 
   // Cleanup the setup made when running postinstall for a given partition.
   // Unmount and remove the mountpoint directory if needed and cleanup the
   // status file descriptor and message loop task watching for it.
-  void Cleanup();
+  void Cleanup(PostinstallRun* run);
 
-  // Subprocess::Exec callback.
-  void CompletePartitionPostinstall(int return_code, const std::string& output);
+  // Subprocess::Exec callback for the partition at |index|.
+  void CompletePartitionPostinstall(size_t index,
+                                    int return_code,
+                                    const std::string& output);
+
+  // Records the |return_code| of the postinstall program of the partition at
+  // |index|, and sets |error_code_| if it failed and isn't optional.
+  void RecordPartitionResult(size_t index, int return_code);
 
   // Complete the Action with the passed |error_code| and mark the new slot as
   // ready. Called when the post-install script was run for all the partitions.
@@ -97,13 +135,18 @@ class PostinstallRunnerAction : public InstallPlanAction {
 
   InstallPlan install_plan_;
 
-  // The path where the filesystem will be mounted during post-install.
-  std::string fs_mount_dir_;
-
-  // The partition being processed on the list of partitions specified in the
+  // The next partition to process on the list of partitions specified in the
   // InstallPlan.
   size_t current_partition_{0};
 
+  // The postinstall programs running, by index of their partition. Only
+  // partitions marked independent run at the same time.
+  std::map<size_t, PostinstallRun> runs_;
+
+  // The error of the first postinstall step that failed. No other step is
+  // started after it, and the action completes once the running ones exit.
+  ErrorCode error_code_{ErrorCode::kSuccess};
+
   // A non-negative value representing the estimated weight of each partition
   // passed in the install plan. The weight is used to predict the overall
   // progress from the individual progress of each partition and should
@@ -113,8 +156,7 @@ class PostinstallRunnerAction : public InstallPlanAction {
   // The sum of all the weights in |partition_weight_|.
   double total_weight_{0};
 
-  // The sum of all the weights in |partition_weight_| up to but not including
-  // the |current_partition_|.
+  // The sum of the weights in |partition_weight_| of the partitions done.
   double accumulated_weight_{0};
 
   // The delegate used to notify of progress updates, if any.
@@ -130,20 +172,6 @@ class PostinstallRunnerAction : public InstallPlanAction {
   // Used for cleaning up if post-install fails.
   bool powerwash_scheduled_{false};
 
-  // Postinstall command currently running, or 0 if no program running.
-  pid_t current_command_{0};
-
-  // True if |current_command_| has been suspended by SuspendAction().
-  bool is_current_command_suspended_{false};
-
-  // The parent progress file descriptor used to watch for progress reports from
-  // the postinstall program and the task watching for them.
-  int progress_fd_{-1};
-  brillo::MessageLoop::TaskId progress_task_{brillo::MessageLoop::kTaskIdNull};
-
-  // A buffer of a partial read line from the progress file descriptor.
-  std::string progress_buffer_;
-
   DISALLOW_COPY_AND_ASSIGN(PostinstallRunnerAction);
 };
 
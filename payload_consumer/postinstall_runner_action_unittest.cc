@@ -23,6 +23,7 @@
 #include <memory>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include <base/bind.h>
 #include <base/files/file_util.h>
@@ -102,6 +103,20 @@ class PostinstallRunnerActionTest : public ::testing::Test {
                             bool powerwash_required,
                             bool is_rollback);
 
+  // Setup an action processor and run the PostinstallRunnerAction with the
+  // |partitions| of the install plan.
+  void RunPostinstallActionWithPartitions(
+      const std::vector<InstallPlan::Partition>& partitions,
+      bool powerwash_required,
+      bool is_rollback);
+
+  // Returns the command running for the first running partition, or 0.
+  pid_t RunningCommand() {
+    if (!postinstall_action_ || postinstall_action_->runs_.empty())
+      return 0;
+    return postinstall_action_->runs_.begin()->second.command;
+  }
+
  public:
   void ResumeRunningAction() {
     ASSERT_NE(nullptr, postinstall_action_);
@@ -109,9 +124,9 @@ class PostinstallRunnerActionTest : public ::testing::Test {
   }
 
   void SuspendRunningAction() {
-    if (!postinstall_action_ || !postinstall_action_->current_command_ ||
-        test_utils::Readlink(base::StringPrintf(
-            "/proc/%d/fd/0", postinstall_action_->current_command_)) !=
+    if (!RunningCommand() ||
+        test_utils::Readlink(base::StringPrintf("/proc/%d/fd/0",
+                                                RunningCommand())) !=
             "/dev/zero") {
       // We need to wait for the postinstall command to start and flag that it
       // is ready by redirecting its input to /dev/zero.
@@ -132,7 +147,7 @@ class PostinstallRunnerActionTest : public ::testing::Test {
   }
 
   void CancelWhenStarted() {
-    if (!postinstall_action_ || !postinstall_action_->current_command_) {
+    if (!RunningCommand()) {
       // Wait for the postinstall command to run.
       loop_.PostDelayedTask(
           FROM_HERE,
@@ -171,16 +186,23 @@ void PostinstallRunnerActionTest::RunPostinstallAction(
     const string& postinstall_program,
     bool powerwash_required,
     bool is_rollback) {
-  ActionProcessor processor;
-  processor_ = &processor;
-  auto feeder_action = std::make_unique<ObjectFeederAction<InstallPlan>>();
   InstallPlan::Partition part;
   part.name = "part";
   part.target_path = device_path;
   part.run_postinstall = true;
   part.postinstall_path = postinstall_program;
+  RunPostinstallActionWithPartitions({part}, powerwash_required, is_rollback);
+}
+
+void PostinstallRunnerActionTest::RunPostinstallActionWithPartitions(
+    const std::vector<InstallPlan::Partition>& partitions,
+    bool powerwash_required,
+    bool is_rollback) {
+  ActionProcessor processor;
+  processor_ = &processor;
+  auto feeder_action = std::make_unique<ObjectFeederAction<InstallPlan>>();
   InstallPlan install_plan;
-  install_plan.partitions = {part};
+  install_plan.partitions = partitions;
   install_plan.download_url = "http://127.0.0.1:8080/update";
   install_plan.powerwash_required = powerwash_required;
   install_plan.is_rollback = is_rollback;
@@ -220,28 +242,37 @@ TEST_F(PostinstallRunnerActionTest, ProcessProgressLineTest) {
   testing::StrictMock<MockPostinstallRunnerActionDelegate> mock_delegate_;
   action.set_delegate(&mock_delegate_);
 
-  action.current_partition_ = 1;
+  action.runs_[1];
   action.partition_weight_ = {1, 2, 5};
   action.accumulated_weight_ = 1;
   action.total_weight_ = 8;
 
   // 50% of the second action is 2/8 = 0.25 of the total.
   EXPECT_CALL(mock_delegate_, ProgressUpdate(0.25));
-  action.ProcessProgressLine("global_progress 0.5");
+  action.ProcessProgressLine(1, "global_progress 0.5");
   testing::Mock::VerifyAndClearExpectations(&mock_delegate_);
 
   // 1.5 should be read as 100%, to catch rounding error cases like 1.000001.
   // 100% of the second is 3/8 of the total.
   EXPECT_CALL(mock_delegate_, ProgressUpdate(0.375));
-  action.ProcessProgressLine("global_progress 1.5");
+  action.ProcessProgressLine(1, "global_progress 1.5");
+  testing::Mock::VerifyAndClearExpectations(&mock_delegate_);
+
+  // The progress of the partitions running at the same time is added: 50% of
+  // the third action adds 2.5/8 of the total.
+  action.runs_[2];
+  EXPECT_CALL(mock_delegate_, ProgressUpdate(0.6875));
+  action.ProcessProgressLine(2, "global_progress 0.5");
   testing::Mock::VerifyAndClearExpectations(&mock_delegate_);
 
   // None of these should trigger a progress update.
-  action.ProcessProgressLine("foo_bar");
-  action.ProcessProgressLine("global_progress");
-  action.ProcessProgressLine("global_progress ");
-  action.ProcessProgressLine("global_progress NaN");
-  action.ProcessProgressLine("global_progress Exception in ... :)");
+  action.ProcessProgressLine(1, "foo_bar");
+  action.ProcessProgressLine(1, "global_progress");
+  action.ProcessProgressLine(1, "global_progress ");
+  action.ProcessProgressLine(1, "global_progress NaN");
+  action.ProcessProgressLine(1, "global_progress Exception in ... :)");
+  // Nor the progress of a partition not running.
+  action.ProcessProgressLine(0, "global_progress 0.5");
 }
 
 // Test that postinstall succeeds in the simple case of running the default
@@ -307,6 +338,27 @@ TEST_F(PostinstallRunnerActionTest, RunAsRootCantMountTest) {
 
 // Check that the failures from the postinstall script cause the action to
 // fail.
+// Test that the postinstall programs of independent partitions run, and that
+// the failure of one of them fails the action.
+TEST_F(PostinstallRunnerActionTest, RunAsRootIndependentPartitionsTest) {
+  ScopedLoopbackDeviceBinder loop(postinstall_image_, false, nullptr);
+  InstallPlan::Partition part;
+  part.target_path = loop.dev();
+  part.run_postinstall = true;
+  part.postinstall_path = kPostinstallDefaultScript;
+  part.postinstall_independent = true;
+  std::vector<InstallPlan::Partition> partitions(3, part);
+  partitions[0].name = "first";
+  partitions[1].name = "second";
+  partitions[2].name = "third";
+  RunPostinstallActionWithPartitions(partitions, false, false);
+  EXPECT_EQ(ErrorCode::kSuccess, processor_delegate_.code_);
+
+  partitions[1].postinstall_path = "bin/postinst_fail1";
+  RunPostinstallActionWithPartitions(partitions, false, false);
+  EXPECT_EQ(ErrorCode::kPostinstallRunnerError, processor_delegate_.code_);
+}
+
 TEST_F(PostinstallRunnerActionTest, RunAsRootErrScriptTest) {
   ScopedLoopbackDeviceBinder loop(postinstall_image_, false, nullptr);
   RunPostinstallAction(loop.dev(), "bin/postinst_fail1", false, false);
@@ -0,0 +1,259 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/verity_block_repairer.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/utils.h"
+
+using google::protobuf::RepeatedPtrField;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Size of a SHA-256 digest in the hash tree.
+const uint64_t kDigestSize = 32;
+
+// Number of blocks read from the raw device at once while checking them.
+const uint64_t kMaxBlocksPerRead = 256;
+
+// A read-only file descriptor reading from |fd| with the blocks in |blocks|,
+// indexed by block number, replacing the data read from |fd|.
+class RepairedFileDescriptor : public FileDescriptor {
+ public:
+  RepairedFileDescriptor(FileDescriptorPtr fd,
+                         uint64_t block_size,
+                         std::map<uint64_t, brillo::Blob> blocks)
+      : fd_(fd), block_size_(block_size), blocks_(std::move(blocks)) {}
+  ~RepairedFileDescriptor() override = default;
+
+  bool Open(const char* path, int flags, mode_t mode) override { return false; }
+  bool Open(const char* path, int flags) override { return false; }
+
+  ssize_t Read(void* buf, size_t count) override {
+    ssize_t bytes_read;
+    if (!utils::PReadAll(fd_, buf, count, offset_, &bytes_read))
+      return -1;
+    uint8_t* bytes = static_cast<uint8_t*>(buf);
+    uint64_t end = offset_ + bytes_read;
+    for (auto it = blocks_.lower_bound(offset_ / block_size_);
+         it != blocks_.end() && it->first * block_size_ < end;
+         ++it) {
+      uint64_t block_start = it->first * block_size_;
+      uint64_t copy_start = std::max<uint64_t>(block_start, offset_);
+      uint64_t copy_end = std::min(block_start + block_size_, end);
+      memcpy(bytes + (copy_start - offset_),
+             it->second.data() + (copy_start - block_start),
+             copy_end - copy_start);
+    }
+    offset_ = end;
+    return bytes_read;
+  }
+
+  ssize_t Write(const void* buf, size_t count) override {
+    errno = EROFS;
+    return -1;
+  }
+
+  off64_t Seek(off64_t offset, int whence) override {
+    if (whence != SEEK_SET) {
+      errno = EINVAL;
+      return -1;
+    }
+    offset_ = offset;
+    return offset_;
+  }
+
+  uint64_t BlockDevSize() override { return fd_->BlockDevSize(); }
+  bool BlkIoctl(int request,
+                uint64_t start,
+                uint64_t length,
+                int* result) override {
+    return false;
+  }
+  bool Flush() override { return true; }
+  // The underlying file descriptor is owned by the caller.
+  bool Close() override { return true; }
+  bool IsSettingErrno() override { return fd_->IsSettingErrno(); }
+  bool IsOpen() override { return fd_->IsOpen(); }
+
+ private:
+  FileDescriptorPtr fd_;
+  uint64_t block_size_;
+  std::map<uint64_t, brillo::Blob> blocks_;
+  uint64_t offset_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(RepairedFileDescriptor);
+};
+
+}  // namespace
+
+bool ParseVerityTable(const string& table, VerityHashTreeInfo* info) {
+  // The table format is:
+  //   <version> <data_dev> <hash_dev> <data_block_size> <hash_block_size>
+  //   <num_data_blocks> <hash_start_block> <algorithm> <digest> <salt> [...]
+  vector<string> fields = base::SplitString(
+      table, " \t\n", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY);
+  if (fields.size() < 10) {
+    LOG(ERROR) << "Malformed verity table: " << table;
+    return false;
+  }
+  unsigned version;
+  TEST_AND_RETURN_FALSE(base::StringToUint(fields[0], &version));
+  TEST_AND_RETURN_FALSE(version == 1);
+  if (fields[7] != "sha256") {
+    LOG(ERROR) << "Unsupported verity hash algorithm: " << fields[7];
+    return false;
+  }
+  VerityHashTreeInfo result;
+  TEST_AND_RETURN_FALSE(
+      base::StringToUint(fields[3], &result.data_block_size));
+  TEST_AND_RETURN_FALSE(
+      base::StringToUint(fields[4], &result.hash_block_size));
+  TEST_AND_RETURN_FALSE(
+      base::StringToUint64(fields[5], &result.num_data_blocks));
+  TEST_AND_RETURN_FALSE(
+      base::StringToUint64(fields[6], &result.hash_start_block));
+  TEST_AND_RETURN_FALSE(result.data_block_size > 0);
+  TEST_AND_RETURN_FALSE(result.hash_block_size >= kDigestSize);
+  if (fields[9] != "-") {
+    vector<uint8_t> salt;
+    TEST_AND_RETURN_FALSE(base::HexStringToBytes(fields[9], &salt));
+    result.salt.assign(salt.begin(), salt.end());
+  }
+  *info = std::move(result);
+  return true;
+}
+
+VerityBlockRepairer::VerityBlockRepairer(FileDescriptorPtr raw_fd,
+                                         FileDescriptorPtr ecc_fd,
+                                         const VerityHashTreeInfo& info)
+    : raw_fd_(raw_fd), ecc_fd_(ecc_fd), info_(info) {}
+
+uint64_t VerityBlockRepairer::Level0HashOffset(
+    const VerityHashTreeInfo& info) {
+  // The levels are stored from the top of the tree down, so level 0 comes
+  // after all the levels above it.
+  uint64_t hashes_per_block = info.hash_block_size / kDigestSize;
+  uint64_t level_blocks = info.num_data_blocks;
+  uint64_t upper_levels_blocks = 0;
+  bool first_level = true;
+  do {
+    level_blocks = (level_blocks + hashes_per_block - 1) / hashes_per_block;
+    if (!first_level)
+      upper_levels_blocks += level_blocks;
+    first_level = false;
+  } while (level_blocks > 1);
+  return (info.hash_start_block + upper_levels_blocks) * info.hash_block_size;
+}
+
+FileDescriptorPtr VerityBlockRepairer::Repair(
+    const RepeatedPtrField<Extent>& extents,
+    uint64_t block_size,
+    uint64_t* repaired_blocks) {
+  if (block_size != info_.data_block_size) {
+    LOG(ERROR) << "Operation block size " << block_size
+               << " doesn't match the verity data block size "
+               << info_.data_block_size;
+    return nullptr;
+  }
+  uint64_t level0_offset = Level0HashOffset(info_);
+
+  std::map<uint64_t, brillo::Blob> repaired;
+  brillo::Blob data;
+  brillo::Blob hashes;
+  for (const Extent& extent : extents) {
+    if (extent.start_block() + extent.num_blocks() > info_.num_data_blocks) {
+      LOG(ERROR) << "Extent (" << extent.start_block() << ", "
+                 << extent.num_blocks()
+                 << ") is outside of the verity protected data.";
+      return nullptr;
+    }
+    for (uint64_t done = 0; done < extent.num_blocks();) {
+      uint64_t start_block = extent.start_block() + done;
+      uint64_t num_blocks =
+          std::min(extent.num_blocks() - done, kMaxBlocksPerRead);
+      ssize_t bytes_read;
+      data.resize(num_blocks * block_size);
+      if (!utils::PReadAll(raw_fd_,
+                           data.data(),
+                           data.size(),
+                           start_block * block_size,
+                           &bytes_read) ||
+          bytes_read != static_cast<ssize_t>(data.size())) {
+        LOG(ERROR) << "Unable to read blocks from the raw device.";
+        return nullptr;
+      }
+      hashes.resize(num_blocks * kDigestSize);
+      if (!utils::PReadAll(raw_fd_,
+                           hashes.data(),
+                           hashes.size(),
+                           level0_offset + start_block * kDigestSize,
+                           &bytes_read) ||
+          bytes_read != static_cast<ssize_t>(hashes.size())) {
+        LOG(ERROR) << "Unable to read the verity hash tree.";
+        return nullptr;
+      }
+
+      for (uint64_t i = 0; i < num_blocks; i++) {
+        const uint8_t* block = data.data() + i * block_size;
+        HashCalculator hasher;
+        if (!hasher.Update(info_.salt.data(), info_.salt.size()) ||
+            !hasher.Update(block, block_size) || !hasher.Finalize()) {
+          return nullptr;
+        }
+        if (memcmp(hasher.raw_hash().data(),
+                   hashes.data() + i * kDigestSize,
+                   kDigestSize) == 0) {
+          continue;
+        }
+        brillo::Blob fixed(block_size);
+        if (!utils::PReadAll(ecc_fd_,
+                             fixed.data(),
+                             fixed.size(),
+                             (start_block + i) * block_size,
+                             &bytes_read) ||
+            bytes_read != static_cast<ssize_t>(fixed.size())) {
+          LOG(ERROR) << "Unable to read block " << start_block + i
+                     << " from the error corrected device.";
+          return nullptr;
+        }
+        repaired.emplace(start_block + i, std::move(fixed));
+      }
+      done += num_blocks;
+    }
+  }
+
+  *repaired_blocks = repaired.size();
+  return FileDescriptorPtr(
+      new RepairedFileDescriptor(raw_fd_, block_size, std::move(repaired)));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,79 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_VERITY_BLOCK_REPAIRER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_VERITY_BLOCK_REPAIRER_H_
+
+#include <string>
+
+#include <brillo/secure_blob.h>
+
+#include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// Location and parameters of the dm-verity hash tree of a partition, needed to
+// check individual data blocks against it. Only SHA-256 trees are supported.
+struct VerityHashTreeInfo {
+  uint32_t data_block_size{0};
+  uint32_t hash_block_size{0};
+  uint64_t num_data_blocks{0};
+  // Offset of the hash tree in the partition, in |hash_block_size| units.
+  uint64_t hash_start_block{0};
+  brillo::Blob salt;
+};
+
+// Parses a dm-verity |table| as stored in the verity metadata of a partition.
+// Returns false if the table is malformed or uses an unsupported algorithm.
+bool ParseVerityTable(const std::string& table, VerityHashTreeInfo* info);
+
+// VerityBlockRepairer recovers the source data of an operation whose hash
+// didn't match on the raw device. Instead of re-reading everything through
+// the slow error corrected device, it checks each block read from the raw
+// device against the level 0 hashes of the verity hash tree and only reads the
+// mismatching blocks through the error corrected device.
+class VerityBlockRepairer {
+ public:
+  // |raw_fd| is the raw source partition, which also holds the hash tree
+  // described by |info|, and |ecc_fd| the error corrected view of it.
+  VerityBlockRepairer(FileDescriptorPtr raw_fd,
+                      FileDescriptorPtr ecc_fd,
+                      const VerityHashTreeInfo& info);
+
+  // Returns the offset in bytes of the level 0 hashes in the partition.
+  static uint64_t Level0HashOffset(const VerityHashTreeInfo& info);
+
+  // Repairs the blocks in |extents|, of |block_size| bytes. On success returns
+  // a read-only file descriptor that reads the raw device with the repaired
+  // blocks patched in, and stores the number of repaired blocks in
+  // |repaired_blocks|. Returns nullptr on error.
+  FileDescriptorPtr Repair(
+      const google::protobuf::RepeatedPtrField<Extent>& extents,
+      uint64_t block_size,
+      uint64_t* repaired_blocks);
+
+ private:
+  FileDescriptorPtr raw_fd_;
+  FileDescriptorPtr ecc_fd_;
+  VerityHashTreeInfo info_;
+
+  DISALLOW_COPY_AND_ASSIGN(VerityBlockRepairer);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_VERITY_BLOCK_REPAIRER_H_
@@ -0,0 +1,172 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/verity_block_repairer.h"
+
+#include <fcntl.h>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/fake_file_descriptor.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+const uint64_t kBlockSize = 4096;
+const uint64_t kNumDataBlocks = 8;
+}  // namespace
+
+class VerityBlockRepairerTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    info_.data_block_size = kBlockSize;
+    info_.hash_block_size = kBlockSize;
+    info_.num_data_blocks = kNumDataBlocks;
+    info_.hash_start_block = kNumDataBlocks;
+    info_.salt = {0x12, 0x34};
+
+    // The expected data is what the FakeFileDescriptor used as the error
+    // corrected device returns. The hash tree fits in a single level 0 block
+    // right after the data.
+    expected_data_ = FakeFileDescriptorData(kNumDataBlocks * kBlockSize);
+    brillo::Blob image = expected_data_;
+    for (uint64_t block = 0; block < kNumDataBlocks; block++) {
+      HashCalculator hasher;
+      ASSERT_TRUE(hasher.Update(info_.salt.data(), info_.salt.size()));
+      ASSERT_TRUE(hasher.Update(expected_data_.data() + block * kBlockSize,
+                                kBlockSize));
+      ASSERT_TRUE(hasher.Finalize());
+      image.insert(
+          image.end(), hasher.raw_hash().begin(), hasher.raw_hash().end());
+    }
+    image.resize((kNumDataBlocks + 1) * kBlockSize);
+    // Corrupt block 5 on the raw device.
+    image[5 * kBlockSize + 10] ^= 0xff;
+    ASSERT_TRUE(test_utils::WriteFileVector(temp_file_.path(), image));
+
+    raw_fd_.reset(new EintrSafeFileDescriptor());
+    ASSERT_TRUE(raw_fd_->Open(temp_file_.path().c_str(), O_RDONLY));
+    fake_ecc_fd_ = new FakeFileDescriptor();
+    ecc_fd_.reset(fake_ecc_fd_);
+  }
+
+  void TearDown() override { raw_fd_->Close(); }
+
+  test_utils::ScopedTempFile temp_file_{"VerityBlockRepairerTest.XXXXXX"};
+  VerityHashTreeInfo info_;
+  brillo::Blob expected_data_;
+  FileDescriptorPtr raw_fd_;
+  FileDescriptorPtr ecc_fd_;
+  FakeFileDescriptor* fake_ecc_fd_;
+};
+
+TEST_F(VerityBlockRepairerTest, ParseVerityTableTest) {
+  VerityHashTreeInfo info;
+  EXPECT_TRUE(ParseVerityTable(
+      "1 /dev/sda1 /dev/sda1 4096 4096 1000 1000 sha256 "
+      "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef "
+      "aabb 1 ignore_zero_blocks",
+      &info));
+  EXPECT_EQ(4096u, info.data_block_size);
+  EXPECT_EQ(4096u, info.hash_block_size);
+  EXPECT_EQ(1000u, info.num_data_blocks);
+  EXPECT_EQ(1000u, info.hash_start_block);
+  EXPECT_EQ((brillo::Blob{0xaa, 0xbb}), info.salt);
+
+  EXPECT_TRUE(ParseVerityTable(
+      "1 /dev/sda1 /dev/sda1 4096 4096 1000 1000 sha256 00 -", &info));
+  EXPECT_TRUE(info.salt.empty());
+}
+
+TEST_F(VerityBlockRepairerTest, ParseVerityTableInvalidTest) {
+  VerityHashTreeInfo info;
+  EXPECT_FALSE(ParseVerityTable("", &info));
+  EXPECT_FALSE(ParseVerityTable("1 /dev/sda1 /dev/sda1 4096 4096", &info));
+  EXPECT_FALSE(ParseVerityTable(
+      "1 /dev/sda1 /dev/sda1 4096 4096 1000 1000 sha1 00 -", &info));
+  EXPECT_FALSE(ParseVerityTable(
+      "0 /dev/sda1 /dev/sda1 4096 4096 1000 1000 sha256 00 -", &info));
+  EXPECT_FALSE(ParseVerityTable(
+      "1 /dev/sda1 /dev/sda1 4096 abc 1000 1000 sha256 00 -", &info));
+  EXPECT_FALSE(ParseVerityTable(
+      "1 /dev/sda1 /dev/sda1 4096 4096 1000 1000 sha256 00 xyz", &info));
+}
+
+TEST_F(VerityBlockRepairerTest, Level0HashOffsetTest) {
+  EXPECT_EQ(kNumDataBlocks * kBlockSize,
+            VerityBlockRepairer::Level0HashOffset(info_));
+
+  // 300 blocks need 3 level 0 hash blocks and a single level 1 block on top.
+  VerityHashTreeInfo info = info_;
+  info.num_data_blocks = 300;
+  info.hash_start_block = 300;
+  EXPECT_EQ(301 * kBlockSize, VerityBlockRepairer::Level0HashOffset(info));
+}
+
+TEST_F(VerityBlockRepairerTest, RepairOnlyCorruptedBlockTest) {
+  VerityBlockRepairer repairer(raw_fd_, ecc_fd_, info_);
+  google::protobuf::RepeatedPtrField<Extent> extents;
+  *extents.Add() = ExtentForRange(1, 2);
+  *extents.Add() = ExtentForRange(4, 3);
+
+  uint64_t repaired_blocks = 0;
+  FileDescriptorPtr fd = repairer.Repair(extents, kBlockSize, &repaired_blocks);
+  ASSERT_NE(nullptr, fd);
+  EXPECT_EQ(1u, repaired_blocks);
+
+  // Only the corrupted block was read from the error corrected device.
+  auto read_ops = fake_ecc_fd_->GetReadOps();
+  ASSERT_EQ(1u, read_ops.size());
+  EXPECT_EQ(5 * kBlockSize, read_ops[0].first);
+  EXPECT_EQ(kBlockSize, read_ops[0].second);
+
+  // Reads crossing the repaired block return the corrected data.
+  brillo::Blob buf(3 * kBlockSize);
+  ASSERT_EQ(4 * kBlockSize, fd->Seek(4 * kBlockSize, SEEK_SET));
+  ASSERT_EQ(static_cast<ssize_t>(buf.size()), fd->Read(buf.data(), buf.size()));
+  EXPECT_EQ(brillo::Blob(expected_data_.begin() + 4 * kBlockSize,
+                         expected_data_.begin() + 7 * kBlockSize),
+            buf);
+}
+
+TEST_F(VerityBlockRepairerTest, RepairNothingTest) {
+  VerityBlockRepairer repairer(raw_fd_, ecc_fd_, info_);
+  google::protobuf::RepeatedPtrField<Extent> extents;
+  *extents.Add() = ExtentForRange(0, 5);
+
+  uint64_t repaired_blocks = 0;
+  EXPECT_NE(nullptr, repairer.Repair(extents, kBlockSize, &repaired_blocks));
+  EXPECT_EQ(0u, repaired_blocks);
+  EXPECT_TRUE(fake_ecc_fd_->GetReadOps().empty());
+}
+
+TEST_F(VerityBlockRepairerTest, RepairInvalidExtentsTest) {
+  VerityBlockRepairer repairer(raw_fd_, ecc_fd_, info_);
+  google::protobuf::RepeatedPtrField<Extent> extents;
+  *extents.Add() = ExtentForRange(6, 3);
+
+  uint64_t repaired_blocks = 0;
+  EXPECT_EQ(nullptr, repairer.Repair(extents, kBlockSize, &repaired_blocks));
+  // The block size must match the verity data block size.
+  EXPECT_EQ(nullptr, repairer.Repair(extents, 512, &repaired_blocks));
+}
+
+}  // namespace chromeos_update_engine
@@ -21,8 +21,6 @@ using google::protobuf::RepeatedPtrField;
 namespace chromeos_update_engine {
 
 namespace {
-const brillo::Blob::size_type kOutputBufferLength = 16 * 1024;
-
 // xz uses a variable dictionary size which impacts on the compression ratio
 // and is required to be reconstructed in RAM during decompression. While we
 // control the required memory from the compressor side, the decompressor allows
@@ -52,6 +50,8 @@ const char* XzErrorString(enum xz_ret error) {
 }
 }  // namespace
 
+const size_t XzExtentWriter::kDefaultOutputBufferSize = 16 * 1024;
+
 XzExtentWriter::~XzExtentWriter() {
   xz_dec_end(stream_);
   TEST_AND_RETURN(input_buffer_.empty());
@@ -81,7 +81,7 @@ bool XzExtentWriter::Write(const void* bytes, size_t count) {
   request.in_pos = 0;
   request.in_size = count;
 
-  brillo::Blob output_buffer(kOutputBufferLength);
+  brillo::Blob output_buffer(output_buffer_size_);
   request.out = output_buffer.data();
   request.out_size = output_buffer.size();
   for (;;) {
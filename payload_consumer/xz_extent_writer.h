@@ -35,8 +35,16 @@ namespace chromeos_update_engine {
 
 class XzExtentWriter : public ExtentWriter {
  public:
+  // The default size of the buffer holding the decompressed data.
+  static const size_t kDefaultOutputBufferSize;
+
   explicit XzExtentWriter(std::unique_ptr<ExtentWriter> underlying_writer)
-      : underlying_writer_(std::move(underlying_writer)) {}
+      : XzExtentWriter(std::move(underlying_writer),
+                       kDefaultOutputBufferSize) {}
+  XzExtentWriter(std::unique_ptr<ExtentWriter> underlying_writer,
+                 size_t output_buffer_size)
+      : underlying_writer_(std::move(underlying_writer)),
+        output_buffer_size_(output_buffer_size) {}
   ~XzExtentWriter() override;
 
   bool Init(FileDescriptorPtr fd,
@@ -47,6 +55,8 @@ class XzExtentWriter : public ExtentWriter {
  private:
   // The underlying ExtentWriter.
   std::unique_ptr<ExtentWriter> underlying_writer_;
+  // The size of the buffer holding the decompressed data.
+  size_t output_buffer_size_;
   // The opaque xz decompressor struct.
   xz_dec* stream_{nullptr};
   brillo::Blob input_buffer_;
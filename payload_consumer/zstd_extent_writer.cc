@@ -0,0 +1,79 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/zstd_extent_writer.h"
+
+using google::protobuf::RepeatedPtrField;
+
+namespace chromeos_update_engine {
+
+const size_t ZstdExtentWriter::kDefaultOutputBufferSize = 16 * 1024;
+// 64 MiB, the same limit XzExtentWriter accepts for the xz dictionary.
+const int ZstdExtentWriter::kMaxWindowLog = 26;
+// 64 MiB as well, since the source data of a ZSTD_DIFF operation is also kept
+// in memory as the prefix.
+const int ZstdExtentWriter::kMaxPrefixWindowLog = 26;
+
+ZstdExtentWriter::~ZstdExtentWriter() {
+  ZSTD_freeDStream(stream_);
+  TEST_AND_RETURN(last_hint_ == 0);
+}
+
+bool ZstdExtentWriter::Init(FileDescriptorPtr fd,
+                            const RepeatedPtrField<Extent>& extents,
+                            uint32_t block_size) {
+  stream_ = ZSTD_createDStream();
+  TEST_AND_RETURN_FALSE(stream_ != nullptr);
+  TEST_AND_RETURN_FALSE(!ZSTD_isError(ZSTD_DCtx_setParameter(
+      stream_,
+      ZSTD_d_windowLogMax,
+      prefix_.empty() ? kMaxWindowLog : kMaxPrefixWindowLog)));
+  if (!prefix_.empty()) {
+    TEST_AND_RETURN_FALSE(!ZSTD_isError(
+        ZSTD_DCtx_refPrefix(stream_, prefix_.data(), prefix_.size())));
+  }
+  last_hint_ = 0;
+  return underlying_writer_->Init(fd, extents, block_size);
+}
+
+bool ZstdExtentWriter::Write(const void* bytes, size_t count) {
+  if (count == 0)
+    return true;
+  ZSTD_inBuffer input = {bytes, count, 0};
+  for (;;) {
+    ZSTD_outBuffer output = {output_buffer_.data(), output_buffer_.size(), 0};
+    size_t ret = ZSTD_decompressStream(stream_, &output, &input);
+    if (ZSTD_isError(ret)) {
+      LOG(ERROR) << "ZSTD_decompressStream returned "
+                 << ZSTD_getErrorName(ret);
+      return false;
+    }
+    last_hint_ = ret;
+
+    if (output.pos > 0) {
+      TEST_AND_RETURN_FALSE(
+          underlying_writer_->Write(output_buffer_.data(), output.pos));
+    }
+    // Once all the input is consumed, the decompressor may only hold more
+    // output if it filled the buffer, unless the frame is complete. Calling it
+    // again after the end of the frame would start a new frame.
+    if (input.pos == input.size && (output.pos < output.size || ret == 0))
+      break;
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
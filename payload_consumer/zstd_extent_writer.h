@@ -0,0 +1,90 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_ZSTD_EXTENT_WRITER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_ZSTD_EXTENT_WRITER_H_
+
+#include <zstd.h>
+
+#include <memory>
+#include <utility>
+
+#include <brillo/secure_blob.h>
+
+#include "update_engine/payload_consumer/extent_writer.h"
+
+// ZstdExtentWriter is a concrete ExtentWriter subclass that zstd-decompresses
+// what it's given in Write using the streaming zstd API. It passes the
+// decompressed data to an underlying ExtentWriter. The data may be compressed
+// after a raw prefix, like the source data of a ZSTD_DIFF operation, that
+// the decompressor references.
+
+namespace chromeos_update_engine {
+
+class ZstdExtentWriter : public ExtentWriter {
+ public:
+  // The default size of the buffer holding the decompressed data.
+  static const size_t kDefaultOutputBufferSize;
+
+  // The maximum window size log accepted, without and with a prefix. The zstd
+  // window has to be kept in RAM during decompression, so the frames requiring
+  // more than that are rejected. With a prefix the window has to cover both
+  // the prefix and the decompressed data, so the prefix and decompressed data
+  // larger than the window are rejected too.
+  static const int kMaxWindowLog;
+  static const int kMaxPrefixWindowLog;
+
+  explicit ZstdExtentWriter(std::unique_ptr<ExtentWriter> underlying_writer)
+      : ZstdExtentWriter(std::move(underlying_writer),
+                         kDefaultOutputBufferSize) {}
+  ZstdExtentWriter(std::unique_ptr<ExtentWriter> underlying_writer,
+                   size_t output_buffer_size)
+      : underlying_writer_(std::move(underlying_writer)),
+        output_buffer_(output_buffer_size) {}
+  ZstdExtentWriter(std::unique_ptr<ExtentWriter> underlying_writer,
+                   size_t output_buffer_size,
+                   brillo::Blob prefix)
+      : underlying_writer_(std::move(underlying_writer)),
+        output_buffer_(output_buffer_size),
+        prefix_(std::move(prefix)) {}
+  ~ZstdExtentWriter() override;
+
+  bool Init(FileDescriptorPtr fd,
+            const google::protobuf::RepeatedPtrField<Extent>& extents,
+            uint32_t block_size) override;
+  bool Write(const void* bytes, size_t count) override;
+
+ private:
+  // The underlying ExtentWriter.
+  std::unique_ptr<ExtentWriter> underlying_writer_;
+  // The buffer holding the decompressed data.
+  brillo::Blob output_buffer_;
+  // The raw prefix the data was compressed after, if any. It must outlive
+  // |stream_|, which references it.
+  brillo::Blob prefix_;
+  // The zstd decompression stream. Unlike xz-embedded, it keeps the unconsumed
+  // input internally, so no input buffer is needed here.
+  ZSTD_DStream* stream_{nullptr};
+  // The last value returned by ZSTD_decompressStream(), which is 0 once a
+  // frame is completely decoded.
+  size_t last_hint_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(ZstdExtentWriter);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_ZSTD_EXTENT_WRITER_H_
@@ -0,0 +1,140 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/zstd_extent_writer.h"
+
+#include <string.h>
+
+#include <base/memory/ptr_util.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/payload_consumer/fake_extent_writer.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const char kSampleData[] = "Redundaaaaaaaaaaaaaant\n";
+
+// Compresses |data| into a single zstd frame with the given |level|.
+brillo::Blob ZstdCompressForTest(const brillo::Blob& data, int level) {
+  brillo::Blob compressed(ZSTD_compressBound(data.size()));
+  size_t size = ZSTD_compress(
+      compressed.data(), compressed.size(), data.data(), data.size(), level);
+  EXPECT_FALSE(ZSTD_isError(size));
+  compressed.resize(ZSTD_isError(size) ? 0 : size);
+  return compressed;
+}
+
+}  // namespace
+
+class ZstdExtentWriterTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    fake_extent_writer_ = new FakeExtentWriter();
+    zstd_writer_.reset(
+        new ZstdExtentWriter(base::WrapUnique(fake_extent_writer_)));
+  }
+
+  void WriteAll(const brillo::Blob& compressed) {
+    EXPECT_TRUE(zstd_writer_->Init(fd_, {}, 1024));
+    EXPECT_TRUE(zstd_writer_->Write(compressed.data(), compressed.size()));
+
+    EXPECT_TRUE(fake_extent_writer_->InitCalled());
+  }
+
+  // Owned by |zstd_writer_|. This object is invalidated after |zstd_writer_|
+  // is deleted.
+  FakeExtentWriter* fake_extent_writer_{nullptr};
+  std::unique_ptr<ZstdExtentWriter> zstd_writer_;
+
+  const brillo::Blob sample_data_{
+      std::begin(kSampleData), std::begin(kSampleData) + strlen(kSampleData)};
+  FileDescriptorPtr fd_;
+};
+
+TEST_F(ZstdExtentWriterTest, CreateAndDestroy) {
+  // Test that no Init() or End() called doesn't crash the program.
+  EXPECT_FALSE(fake_extent_writer_->InitCalled());
+}
+
+TEST_F(ZstdExtentWriterTest, CompressedSampleData) {
+  WriteAll(ZstdCompressForTest(sample_data_, 19));
+  EXPECT_EQ(sample_data_, fake_extent_writer_->WrittenData());
+}
+
+TEST_F(ZstdExtentWriterTest, CompressedDataBiggerThanTheBuffer) {
+  // Test that even if the output data is bigger than the internal buffer, all
+  // the data is written.
+  brillo::Blob expected_data(30 * 1024, 'a');
+  WriteAll(ZstdCompressForTest(expected_data, 19));
+  EXPECT_EQ(expected_data, fake_extent_writer_->WrittenData());
+}
+
+TEST_F(ZstdExtentWriterTest, GarbageDataRejected) {
+  EXPECT_TRUE(zstd_writer_->Init(fd_, {}, 1024));
+  // The sample_data_ is an uncompressed string.
+  EXPECT_FALSE(zstd_writer_->Write(sample_data_.data(), sample_data_.size()));
+}
+
+TEST_F(ZstdExtentWriterTest, PartialDataIsKept) {
+  brillo::Blob expected_data(30 * 1024, 'a');
+  brillo::Blob compressed = ZstdCompressForTest(expected_data, 19);
+  EXPECT_TRUE(zstd_writer_->Init(fd_, {}, 1024));
+  for (uint8_t byte : compressed) {
+    EXPECT_TRUE(zstd_writer_->Write(&byte, 1));
+  }
+  EXPECT_EQ(expected_data, fake_extent_writer_->WrittenData());
+}
+
+TEST_F(ZstdExtentWriterTest, CompressedWithPrefix) {
+  // Incompressible data, changed in one byte.
+  brillo::Blob prefix(30 * 1024);
+  uint32_t seed = 1;
+  for (uint8_t& byte : prefix) {
+    seed = seed * 1103515245 + 12345;
+    byte = seed >> 24;
+  }
+  brillo::Blob expected_data = prefix;
+  expected_data[1000] ^= 0xff;
+
+  // Compress |expected_data| as the continuation of |prefix|.
+  ZSTD_CCtx* cctx = ZSTD_createCCtx();
+  ASSERT_NE(nullptr, cctx);
+  ASSERT_FALSE(
+      ZSTD_isError(ZSTD_CCtx_refPrefix(cctx, prefix.data(), prefix.size())));
+  brillo::Blob compressed(ZSTD_compressBound(expected_data.size()));
+  size_t size = ZSTD_compress2(cctx,
+                               compressed.data(),
+                               compressed.size(),
+                               expected_data.data(),
+                               expected_data.size());
+  ZSTD_freeCCtx(cctx);
+  ASSERT_FALSE(ZSTD_isError(size));
+  compressed.resize(size);
+  // The data is encoded as matches in the prefix.
+  EXPECT_LT(compressed.size(), 1024U);
+
+  fake_extent_writer_ = new FakeExtentWriter();
+  zstd_writer_.reset(
+      new ZstdExtentWriter(base::WrapUnique(fake_extent_writer_),
+                           ZstdExtentWriter::kDefaultOutputBufferSize,
+                           prefix));
+  WriteAll(compressed);
+  EXPECT_EQ(expected_data, fake_extent_writer_->WrittenData());
+}
+
+}  // namespace chromeos_update_engine
@@ -17,9 +17,11 @@
 #include "update_engine/payload_generator/ab_generator.h"
 
 #include <algorithm>
+#include <memory>
 #include <utility>
 
 #include <base/strings/stringprintf.h>
+#include <base/threading/simple_thread.h>
 
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/utils.h"
@@ -28,6 +30,8 @@
 #include "update_engine/payload_generator/bzip.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/partition_reader.h"
 
 using chromeos_update_engine::diff_utils::IsAReplaceOperation;
 using std::string;
@@ -35,11 +39,193 @@ using std::vector;
 
 namespace chromeos_update_engine {
 
+namespace {
+
+// Number of merged operations per thread recompressed in a batch. The blobs of
+// a batch are kept in memory until they are written to the blob file.
+const size_t kMergeBatchOpsPerThread = 4;
+
+// Number of target blocks whose writes OptimizeApplyOrder() may reorder to
+// read the source partition sequentially. Writes this close to each other are
+// absorbed by the write cache of the storage devices we target.
+const size_t kApplyOrderWindowBlocks = 256;
+
+// Counts in |*seeks| and |*seek_blocks| the accesses to |extents| not starting
+// within |near_blocks| of |*next_block|, where the previous access ended.
+void SimulateExtentsIO(
+    const google::protobuf::RepeatedPtrField<Extent>& extents,
+    uint64_t near_blocks,
+    uint64_t* next_block,
+    uint64_t* seeks,
+    uint64_t* seek_blocks) {
+  for (const Extent& extent : extents) {
+    if (extent.start_block() == kSparseHole)
+      continue;
+    uint64_t distance = extent.start_block() > *next_block
+                            ? extent.start_block() - *next_block
+                            : *next_block - extent.start_block();
+    if (distance > near_blocks) {
+      (*seeks)++;
+      *seek_blocks += distance;
+    }
+    *next_block = extent.start_block() + extent.num_blocks();
+  }
+}
+
+// Splits the SOURCE_COPY operation |aop|, which has a single destination
+// extent, into one operation per source extent, and adds them to |result_aops|.
+void SplitSourceCopyBySource(const AnnotatedOperation& aop,
+                             vector<AnnotatedOperation>* result_aops) {
+  uint64_t dst_block = aop.op.dst_extents(0).start_block();
+  for (int i = 0; i < aop.op.src_extents_size(); i++) {
+    const Extent& src_ext = aop.op.src_extents(i);
+    AnnotatedOperation new_aop;
+    new_aop.name = base::StringPrintf("%s:%d", aop.name.c_str(), i);
+    new_aop.op.set_type(InstallOperation::SOURCE_COPY);
+    *new_aop.op.add_src_extents() = src_ext;
+    *new_aop.op.add_dst_extents() =
+        ExtentForRange(dst_block, src_ext.num_blocks());
+    dst_block += src_ext.num_blocks();
+    result_aops->push_back(std::move(new_aop));
+  }
+}
+
+// Reads the destination extents of the REPLACE/REPLACE_BZ/REPLACE_XZ operation
+// |aop| from |target_reader| and stores in |blob| and |op_type| the best full
+// operation for that data.
+bool GenerateReplaceBlob(const AnnotatedOperation& aop,
+                         const PayloadVersion& version,
+                         const PartitionReader& target_reader,
+                         brillo::Blob* blob,
+                         InstallOperation::Type* op_type) {
+  TEST_AND_RETURN_FALSE(IsAReplaceOperation(aop.op.type()));
+
+  vector<Extent> dst_extents;
+  ExtentsToVector(aop.op.dst_extents(), &dst_extents);
+  brillo::Blob data(utils::BlocksInExtents(dst_extents) * kBlockSize);
+  TEST_AND_RETURN_FALSE(ReadPartitionExtents(
+      target_reader, dst_extents, &data, data.size(), kBlockSize));
+
+  TEST_AND_RETURN_FALSE(
+      diff_utils::GenerateBestFullOperation(data, version, blob, op_type));
+  return true;
+}
+
+// Sets the type of |aop| to |op_type| and stores |blob| for it, unless |aop|
+// already points to a blob of that type and size.
+bool SetReplaceBlob(const brillo::Blob& blob,
+                    InstallOperation::Type op_type,
+                    AnnotatedOperation* aop,
+                    BlobFileWriter* blob_file) {
+  // If the operation doesn't point to a data blob or points to a data blob of
+  // a different type then we add it.
+  if (aop->op.type() != op_type || aop->op.data_length() != blob.size()) {
+    aop->op.set_type(op_type);
+    TEST_AND_RETURN_FALSE(aop->SetOperationBlob(blob, blob_file));
+  }
+  return true;
+}
+
+// Computes the blob of a merged REPLACE/REPLACE_BZ/REPLACE_XZ operation in a
+// worker thread. The blob is kept in memory so it can be written to the blob
+// file later in the order of the operations, which keeps the output
+// deterministic regardless of the number of threads.
+class ReplaceBlobProcessor : public base::DelegateSimpleThread::Delegate {
+ public:
+  ReplaceBlobProcessor(const PayloadVersion& version,
+                       const PartitionReader& target_reader,
+                       AnnotatedOperation* aop)
+      : version_(version), target_reader_(target_reader), aop_(aop) {}
+  ReplaceBlobProcessor(ReplaceBlobProcessor&&) = default;
+  ~ReplaceBlobProcessor() override = default;
+
+  // Overrides DelegateSimpleThread::Delegate.
+  void Run() override {
+    failed_ = !GenerateReplaceBlob(
+        *aop_, version_, target_reader_, &blob_, &op_type_);
+    if (failed_)
+      LOG(ERROR) << "Failed to generate the blob for " << aop_->name;
+  }
+
+  // Stores the computed blob in |blob_file| and releases it.
+  bool WriteBlob(BlobFileWriter* blob_file) {
+    TEST_AND_RETURN_FALSE(!failed_);
+    TEST_AND_RETURN_FALSE(SetReplaceBlob(blob_, op_type_, aop_, blob_file));
+    brillo::Blob().swap(blob_);
+    return true;
+  }
+
+ private:
+  const PayloadVersion& version_;
+  const PartitionReader& target_reader_;
+  AnnotatedOperation* aop_;
+
+  brillo::Blob blob_;
+  InstallOperation::Type op_type_{InstallOperation::REPLACE};
+  bool failed_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(ReplaceBlobProcessor);
+};
+
+// Reads the source extents of an operation and sets its source hash in a
+// worker thread.
+class SourceHashProcessor : public base::DelegateSimpleThread::Delegate {
+ public:
+  SourceHashProcessor(const PartitionReader& source_reader,
+                      AnnotatedOperation* aop)
+      : source_reader_(source_reader), aop_(aop) {}
+  SourceHashProcessor(SourceHashProcessor&&) = default;
+  ~SourceHashProcessor() override = default;
+
+  // Overrides DelegateSimpleThread::Delegate.
+  void Run() override {
+    failed_ = !AddSourceHash();
+    if (failed_)
+      LOG(ERROR) << "Failed to hash the source data of " << aop_->name;
+  }
+
+  bool failed() const { return failed_; }
+
+ private:
+  bool AddSourceHash() {
+    vector<Extent> src_extents;
+    ExtentsToVector(aop_->op.src_extents(), &src_extents);
+    brillo::Blob src_data, src_hash;
+    uint64_t src_length =
+        aop_->op.has_src_length()
+            ? aop_->op.src_length()
+            : utils::BlocksInExtents(aop_->op.src_extents()) * kBlockSize;
+    TEST_AND_RETURN_FALSE(ReadPartitionExtents(
+        source_reader_, src_extents, &src_data, src_length, kBlockSize));
+    TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfData(src_data, &src_hash));
+    aop_->op.set_src_sha256_hash(src_hash.data(), src_hash.size());
+    return true;
+  }
+
+  const PartitionReader& source_reader_;
+  AnnotatedOperation* aop_;
+  bool failed_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(SourceHashProcessor);
+};
+
+}  // namespace
+
 bool ABGenerator::GenerateOperations(const PayloadGenerationConfig& config,
                                      const PartitionConfig& old_part,
                                      const PartitionConfig& new_part,
                                      BlobFileWriter* blob_file,
                                      vector<AnnotatedOperation>* aops) {
+  TEST_AND_RETURN_FALSE(
+      GenerateShardOperations(config, old_part, new_part, blob_file, aops));
+  return FinalizeOperations(config, old_part, new_part, blob_file, aops);
+}
+
+bool ABGenerator::GenerateShardOperations(const PayloadGenerationConfig& config,
+                                          const PartitionConfig& old_part,
+                                          const PartitionConfig& new_part,
+                                          BlobFileWriter* blob_file,
+                                          vector<AnnotatedOperation>* aops) {
   TEST_AND_RETURN_FALSE(old_part.name == new_part.name);
 
   ssize_t hard_chunk_blocks =
@@ -55,8 +241,22 @@ bool ABGenerator::GenerateOperations(const PayloadGenerationConfig& config,
                                                        hard_chunk_blocks,
                                                        soft_chunk_blocks,
                                                        config.version,
+                                                       config.shard,
                                                        blob_file));
   LOG(INFO) << "done reading " << new_part.name;
+  return true;
+}
+
+bool ABGenerator::FinalizeOperations(const PayloadGenerationConfig& config,
+                                     const PartitionConfig& old_part,
+                                     const PartitionConfig& new_part,
+                                     BlobFileWriter* blob_file,
+                                     vector<AnnotatedOperation>* aops) {
+  ssize_t hard_chunk_blocks =
+      (config.hard_chunk_size == -1
+           ? -1
+           : config.hard_chunk_size / config.block_size);
+  size_t soft_chunk_blocks = config.soft_chunk_size / config.block_size;
 
   SortOperationsByDestination(aops);
 
@@ -73,6 +273,15 @@ bool ABGenerator::GenerateOperations(const PayloadGenerationConfig& config,
       aops, config.version, merge_chunk_blocks, new_part.path, blob_file));
   LOG(INFO) << aops->size() << " operations after merge.";
 
+  if (config.optimize_apply_order) {
+    TEST_AND_RETURN_FALSE(OptimizeApplyOrder(aops,
+                                             config.version,
+                                             kApplyOrderWindowBlocks,
+                                             merge_chunk_blocks,
+                                             new_part.path,
+                                             blob_file));
+  }
+
   if (config.version.minor >= kOpSrcHashMinorPayloadVersion)
     TEST_AND_RETURN_FALSE(AddSourceHash(aops, old_part.path));
 
@@ -84,9 +293,104 @@ void ABGenerator::SortOperationsByDestination(
   sort(aops->begin(), aops->end(), diff_utils::CompareAopsByDestination);
 }
 
+bool ApplyOrderIOCost::operator<(const ApplyOrderIOCost& other) const {
+  uint64_t seeks = source_seeks + target_seeks;
+  uint64_t other_seeks = other.source_seeks + other.target_seeks;
+  if (seeks != other_seeks)
+    return seeks < other_seeks;
+  return source_seek_blocks + target_seek_blocks <
+         other.source_seek_blocks + other.target_seek_blocks;
+}
+
+ApplyOrderIOCost ABGenerator::SimulateApplyIO(
+    const vector<AnnotatedOperation>& aops, uint64_t near_blocks) {
+  ApplyOrderIOCost cost;
+  uint64_t next_source_block = 0;
+  uint64_t next_target_block = 0;
+  for (const AnnotatedOperation& aop : aops) {
+    SimulateExtentsIO(aop.op.src_extents(),
+                      near_blocks,
+                      &next_source_block,
+                      &cost.source_seeks,
+                      &cost.source_seek_blocks);
+    SimulateExtentsIO(aop.op.dst_extents(),
+                      near_blocks,
+                      &next_target_block,
+                      &cost.target_seeks,
+                      &cost.target_seek_blocks);
+  }
+  return cost;
+}
+
+bool ABGenerator::OptimizeApplyOrder(vector<AnnotatedOperation>* aops,
+                                     const PayloadVersion& version,
+                                     size_t window_blocks,
+                                     size_t chunk_blocks,
+                                     const string& target_part_path,
+                                     BlobFileWriter* blob_file) {
+  TEST_AND_RETURN_FALSE(window_blocks > 0);
+  vector<AnnotatedOperation> new_aops;
+  for (const AnnotatedOperation& aop : *aops) {
+    if (aop.op.type() == InstallOperation::SOURCE_COPY &&
+        aop.op.dst_extents_size() == 1 && aop.op.src_extents_size() > 1) {
+      SplitSourceCopyBySource(aop, &new_aops);
+    } else {
+      new_aops.push_back(aop);
+    }
+  }
+  SortOperationsByDestination(&new_aops);
+
+  // Within every window of target blocks write first the operations that
+  // don't read the source partition, then the rest in source order.
+  auto window_of = [window_blocks](const AnnotatedOperation& aop) -> uint64_t {
+    if (aop.op.dst_extents_size() == 0)
+      return kSparseHole;
+    return aop.op.dst_extents(0).start_block() / window_blocks;
+  };
+  auto source_order = [](const AnnotatedOperation& a,
+                         const AnnotatedOperation& b) {
+    bool a_reads = a.op.src_extents_size() > 0;
+    bool b_reads = b.op.src_extents_size() > 0;
+    if (a_reads != b_reads)
+      return b_reads;
+    if (!a_reads)
+      return false;
+    return a.op.src_extents(0).start_block() <
+           b.op.src_extents(0).start_block();
+  };
+  auto window_begin = new_aops.begin();
+  while (window_begin != new_aops.end()) {
+    uint64_t window = window_of(*window_begin);
+    auto window_end = window_begin;
+    while (window_end != new_aops.end() && window_of(*window_end) == window)
+      window_end++;
+    std::stable_sort(window_begin, window_end, source_order);
+    window_begin = window_end;
+  }
+
+  // Merging only joins operations writing contiguous target blocks, which
+  // doesn't change the sequence of extents accessed, so the cost is compared
+  // before merging. This way the blobs of the merged operations are only
+  // stored if the new order is used.
+  ApplyOrderIOCost old_cost = SimulateApplyIO(*aops, window_blocks);
+  ApplyOrderIOCost new_cost = SimulateApplyIO(new_aops, window_blocks);
+  LOG(INFO) << "Apply order seeks (source, target): destination order ("
+            << old_cost.source_seeks << ", " << old_cost.target_seeks
+            << "), optimized order (" << new_cost.source_seeks << ", "
+            << new_cost.target_seeks << ").";
+  if (!(new_cost < old_cost))
+    return true;
+
+  TEST_AND_RETURN_FALSE(MergeOperations(
+      &new_aops, version, chunk_blocks, target_part_path, blob_file));
+  LOG(INFO) << new_aops.size() << " operations in the optimized order.";
+  *aops = std::move(new_aops);
+  return true;
+}
+
 bool ABGenerator::FragmentOperations(const PayloadVersion& version,
                                      vector<AnnotatedOperation>* aops,
-                                     const string& target_part_path,
+                                     const PartitionReader& target_reader,
                                      BlobFileWriter* blob_file) {
   vector<AnnotatedOperation> fragmented_aops;
   for (const AnnotatedOperation& aop : *aops) {
@@ -98,7 +402,7 @@ bool ABGenerator::FragmentOperations(const PayloadVersion& version,
       }
       if (IsAReplaceOperation(aop.op.type())) {
         TEST_AND_RETURN_FALSE(SplitAReplaceOp(
-            version, aop, target_part_path, &fragmented_aops, blob_file));
+            version, aop, target_reader, &fragmented_aops, blob_file));
         continue;
       }
     }
@@ -163,6 +467,18 @@ bool ABGenerator::SplitAReplaceOp(const PayloadVersion& version,
                                   const string& target_part_path,
                                   vector<AnnotatedOperation>* result_aops,
                                   BlobFileWriter* blob_file) {
+  std::unique_ptr<PartitionReader> target_reader =
+      PartitionReader::Open(target_part_path);
+  TEST_AND_RETURN_FALSE(target_reader);
+  return SplitAReplaceOp(
+      version, original_aop, *target_reader, result_aops, blob_file);
+}
+
+bool ABGenerator::SplitAReplaceOp(const PayloadVersion& version,
+                                  const AnnotatedOperation& original_aop,
+                                  const PartitionReader& target_reader,
+                                  vector<AnnotatedOperation>* result_aops,
+                                  BlobFileWriter* blob_file) {
   InstallOperation original_op = original_aop.op;
   TEST_AND_RETURN_FALSE(IsAReplaceOperation(original_op.type()));
   const bool is_replace = original_op.type() == InstallOperation::REPLACE;
@@ -186,7 +502,7 @@ bool ABGenerator::SplitAReplaceOp(const PayloadVersion& version,
     new_aop.op = new_op;
     new_aop.name = base::StringPrintf("%s:%d", original_aop.name.c_str(), i);
     TEST_AND_RETURN_FALSE(
-        AddDataAndSetType(&new_aop, version, target_part_path, blob_file));
+        AddDataAndSetType(&new_aop, version, target_reader, blob_file));
 
     result_aops->push_back(new_aop);
   }
@@ -199,9 +515,12 @@ bool ABGenerator::MergeOperations(vector<AnnotatedOperation>* aops,
                                   const string& target_part_path,
                                   BlobFileWriter* blob_file) {
   vector<AnnotatedOperation> new_aops;
-  for (const AnnotatedOperation& curr_aop : *aops) {
+  // Indexes in |new_aops| of the REPLACE/REPLACE_BZ/REPLACE_XZ operations
+  // that were merged and need a new blob.
+  vector<size_t> merged_replace_ops;
+  for (AnnotatedOperation& curr_aop : *aops) {
     if (new_aops.empty()) {
-      new_aops.push_back(curr_aop);
+      new_aops.push_back(std::move(curr_aop));
       continue;
     }
     AnnotatedOperation& last_aop = new_aops.back();
@@ -209,7 +528,7 @@ bool ABGenerator::MergeOperations(vector<AnnotatedOperation>* aops,
 
     if (last_aop.op.dst_extents_size() <= 0 ||
         curr_aop.op.dst_extents_size() <= 0) {
-      new_aops.push_back(curr_aop);
+      new_aops.push_back(std::move(curr_aop));
       continue;
     }
     uint32_t last_dst_idx = last_aop.op.dst_extents_size() - 1;
@@ -231,8 +550,7 @@ bool ABGenerator::MergeOperations(vector<AnnotatedOperation>* aops,
       // merge), are contiguous, are fragmented to have one destination extent,
       // and their combined block count would be less than chunk size, merge
       // them.
-      last_aop.name = base::StringPrintf(
-          "%s,%s", last_aop.name.c_str(), curr_aop.name.c_str());
+      last_aop.name.append(",").append(curr_aop.name);
 
       if (is_delta_op) {
         ExtendExtents(last_aop.op.mutable_src_extents(),
@@ -240,74 +558,103 @@ bool ABGenerator::MergeOperations(vector<AnnotatedOperation>* aops,
       }
       ExtendExtents(last_aop.op.mutable_dst_extents(),
                     curr_aop.op.dst_extents());
-      // Set the data length to zero so we know to add the blob later.
-      if (is_a_replace)
-        last_aop.op.set_data_length(0);
+      if (is_a_replace) {
+        if (merged_replace_ops.empty() ||
+            merged_replace_ops.back() != new_aops.size() - 1) {
+          merged_replace_ops.push_back(new_aops.size() - 1);
+        }
+        // Uncompressed blobs stored back to back in the blob file already
+        // hold the data of the merged operation, so keep pointing to them in
+        // case compression doesn't help. Otherwise set the data length to
+        // zero so we know to add the blob later.
+        if (last_aop.op.type() == InstallOperation::REPLACE &&
+            curr_aop.op.type() == InstallOperation::REPLACE &&
+            last_aop.op.data_length() > 0 &&
+            last_aop.op.data_offset() + last_aop.op.data_length() ==
+                curr_aop.op.data_offset()) {
+          last_aop.op.set_data_length(last_aop.op.data_length() +
+                                      curr_aop.op.data_length());
+        } else {
+          last_aop.op.set_data_length(0);
+        }
+      }
     } else {
       // Otherwise just include the extent as is.
-      new_aops.push_back(curr_aop);
+      new_aops.push_back(std::move(curr_aop));
     }
   }
 
   // Set the blobs for REPLACE/REPLACE_BZ/REPLACE_XZ operations that have been
-  // merged.
-  for (AnnotatedOperation& curr_aop : new_aops) {
-    if (curr_aop.op.data_length() == 0 &&
-        IsAReplaceOperation(curr_aop.op.type())) {
-      TEST_AND_RETURN_FALSE(
-          AddDataAndSetType(&curr_aop, version, target_part_path, blob_file));
+  // merged. The data is read and compressed in parallel in batches, and the
+  // blobs are written in the order of the operations.
+  std::unique_ptr<PartitionReader> target_reader;
+  if (!merged_replace_ops.empty()) {
+    target_reader = PartitionReader::Open(target_part_path);
+    TEST_AND_RETURN_FALSE(target_reader);
+  }
+  size_t max_threads = diff_utils::GetMaxThreads();
+  size_t batch_size = max_threads * kMergeBatchOpsPerThread;
+  for (size_t batch_start = 0; batch_start < merged_replace_ops.size();
+       batch_start += batch_size) {
+    size_t batch_end =
+        std::min(batch_start + batch_size, merged_replace_ops.size());
+    vector<ReplaceBlobProcessor> processors;
+    processors.reserve(batch_end - batch_start);
+    for (size_t i = batch_start; i < batch_end; i++) {
+      processors.emplace_back(
+          version, *target_reader, &new_aops[merged_replace_ops[i]]);
     }
+
+    base::DelegateSimpleThreadPool thread_pool("merge-operations",
+                                               max_threads);
+    thread_pool.Start();
+    for (ReplaceBlobProcessor& processor : processors)
+      thread_pool.AddWork(&processor);
+    thread_pool.JoinAll();
+
+    for (ReplaceBlobProcessor& processor : processors)
+      TEST_AND_RETURN_FALSE(processor.WriteBlob(blob_file));
   }
 
-  *aops = new_aops;
+  *aops = std::move(new_aops);
   return true;
 }
 
 bool ABGenerator::AddDataAndSetType(AnnotatedOperation* aop,
                                     const PayloadVersion& version,
-                                    const string& target_part_path,
+                                    const PartitionReader& target_reader,
                                     BlobFileWriter* blob_file) {
-  TEST_AND_RETURN_FALSE(IsAReplaceOperation(aop->op.type()));
-
-  vector<Extent> dst_extents;
-  ExtentsToVector(aop->op.dst_extents(), &dst_extents);
-  brillo::Blob data(utils::BlocksInExtents(dst_extents) * kBlockSize);
-  TEST_AND_RETURN_FALSE(utils::ReadExtents(
-      target_part_path, dst_extents, &data, data.size(), kBlockSize));
-
   brillo::Blob blob;
   InstallOperation::Type op_type;
   TEST_AND_RETURN_FALSE(
-      diff_utils::GenerateBestFullOperation(data, version, &blob, &op_type));
-
-  // If the operation doesn't point to a data blob or points to a data blob of
-  // a different type then we add it.
-  if (aop->op.type() != op_type || aop->op.data_length() != blob.size()) {
-    aop->op.set_type(op_type);
-    aop->SetOperationBlob(blob, blob_file);
-  }
-
-  return true;
+      GenerateReplaceBlob(*aop, version, target_reader, &blob, &op_type));
+  return SetReplaceBlob(blob, op_type, aop, blob_file);
 }
 
 bool ABGenerator::AddSourceHash(vector<AnnotatedOperation>* aops,
                                 const string& source_part_path) {
+  // The source image is opened once for all the operations.
+  std::unique_ptr<PartitionReader> source_reader;
+  vector<SourceHashProcessor> processors;
   for (AnnotatedOperation& aop : *aops) {
     if (aop.op.src_extents_size() == 0)
       continue;
-
-    vector<Extent> src_extents;
-    ExtentsToVector(aop.op.src_extents(), &src_extents);
-    brillo::Blob src_data, src_hash;
-    uint64_t src_length =
-        aop.op.has_src_length()
-            ? aop.op.src_length()
-            : utils::BlocksInExtents(aop.op.src_extents()) * kBlockSize;
-    TEST_AND_RETURN_FALSE(utils::ReadExtents(
-        source_part_path, src_extents, &src_data, src_length, kBlockSize));
-    TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfData(src_data, &src_hash));
-    aop.op.set_src_sha256_hash(src_hash.data(), src_hash.size());
+    if (!source_reader) {
+      source_reader = PartitionReader::Open(source_part_path);
+      TEST_AND_RETURN_FALSE(source_reader);
+    }
+    processors.emplace_back(*source_reader, &aop);
   }
+
+  base::DelegateSimpleThreadPool thread_pool("add-source-hash",
+                                             diff_utils::GetMaxThreads());
+  thread_pool.Start();
+  for (SourceHashProcessor& processor : processors)
+    thread_pool.AddWork(&processor);
+  thread_pool.JoinAll();
+
+  for (const SourceHashProcessor& processor : processors)
+    TEST_AND_RETURN_FALSE(!processor.failed());
   return true;
 }
 
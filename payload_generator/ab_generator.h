@@ -28,11 +28,28 @@
 #include "update_engine/payload_generator/extent_utils.h"
 #include "update_engine/payload_generator/filesystem_interface.h"
 #include "update_engine/payload_generator/operations_generator.h"
+#include "update_engine/payload_generator/partition_reader.h"
 #include "update_engine/payload_generator/payload_generation_config.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
 
+// The simulated I/O of applying a list of operations in order, used to compare
+// orders of the same operations. An access to a partition is a seek when it
+// doesn't start near the block where the previous access to that partition
+// ended.
+struct ApplyOrderIOCost {
+  uint64_t source_seeks{0};
+  uint64_t target_seeks{0};
+  // The sum of the distances in blocks of the seeks.
+  uint64_t source_seek_blocks{0};
+  uint64_t target_seek_blocks{0};
+
+  // Whether this order is cheaper than |other|: it has fewer seeks or, with
+  // the same number of seeks, a shorter total seek distance.
+  bool operator<(const ApplyOrderIOCost& other) const;
+};
+
 // The ABGenerator is an operations generator that generates payloads using the
 // A-to-B operations SOURCE_COPY and SOURCE_BSDIFF introduced in the payload
 // minor version 2 format.
@@ -54,16 +71,35 @@ class ABGenerator : public OperationsGenerator {
                           BlobFileWriter* blob_file,
                           std::vector<AnnotatedOperation>* aops) override;
 
+  // Generates the operations of the files and chunks of the partition assigned
+  // to |config.shard| in |aops|, in no particular order. These are the
+  // operations of GenerateOperations() before FinalizeOperations(), which
+  // needs the operations of all the shards.
+  static bool GenerateShardOperations(const PayloadGenerationConfig& config,
+                                      const PartitionConfig& old_part,
+                                      const PartitionConfig& new_part,
+                                      BlobFileWriter* blob_file,
+                                      std::vector<AnnotatedOperation>* aops);
+
+  // Sorts the operations |aops| generated by all the shards by destination,
+  // merges them, optionally optimizes their apply order and adds the hashes
+  // of their source data, as needed by |config|.
+  static bool FinalizeOperations(const PayloadGenerationConfig& config,
+                                 const PartitionConfig& old_part,
+                                 const PartitionConfig& new_part,
+                                 BlobFileWriter* blob_file,
+                                 std::vector<AnnotatedOperation>* aops);
+
   // Split the operations in the vector of AnnotatedOperations |aops| such that
   // for every operation there is only one dst extent and updates |aops| with
   // the new list of operations. All kinds of operations are fragmented except
   // BSDIFF and SOURCE_BSDIFF, PUFFDIFF and BROTLI_BSDIFF operations.  The
-  // |target_part_path| is the filename of the new image, where the destination
-  // extents refer to. The blobs of the operations in |aops| should reference
-  // |blob_file|. |blob_file| are updated if needed.
+  // |target_reader| reads the new image, where the destination extents refer
+  // to. The blobs of the operations in |aops| should reference |blob_file|.
+  // |blob_file| are updated if needed.
   static bool FragmentOperations(const PayloadVersion& version,
                                  std::vector<AnnotatedOperation>* aops,
-                                 const std::string& target_part_path,
+                                 const PartitionReader& target_reader,
                                  BlobFileWriter* blob_file);
 
   // Takes a vector of AnnotatedOperations |aops| and sorts them by the first
@@ -72,6 +108,30 @@ class ABGenerator : public OperationsGenerator {
   static void SortOperationsByDestination(
       std::vector<AnnotatedOperation>* aops);
 
+  // Simulates applying the operations |aops| in order and returns the seeks on
+  // the source and target partitions. Accesses starting within |near_blocks|
+  // blocks of the end of the previous access to the same partition are
+  // considered sequential.
+  static ApplyOrderIOCost SimulateApplyIO(
+      const std::vector<AnnotatedOperation>& aops, uint64_t near_blocks);
+
+  // Reorders the operations |aops|, sorted by destination, to make the reads
+  // from the source partition more sequential while keeping the writes to the
+  // target partition near-sequential. SOURCE_COPY operations are split at
+  // their source extents, and the operations writing to the same window of
+  // |window_blocks| target blocks are sorted by their first source block. The
+  // operations are then merged again with |chunk_blocks| as in
+  // MergeOperations(). Since A/B operations never read the partition they
+  // write, any order applies the same update. |aops| is only replaced if the
+  // new order is cheaper according to SimulateApplyIO(), and nothing is
+  // stored to |blob_file| otherwise.
+  static bool OptimizeApplyOrder(std::vector<AnnotatedOperation>* aops,
+                                 const PayloadVersion& version,
+                                 size_t window_blocks,
+                                 size_t chunk_blocks,
+                                 const std::string& target_part_path,
+                                 BlobFileWriter* blob_file);
+
   // Takes an SOURCE_COPY install operation, |aop|, and adds one operation for
   // each dst extent in |aop| to |ops|. The new operations added to |ops| will
   // have only one dst extent. The src extents are split so the number of blocks
@@ -115,8 +175,16 @@ class ABGenerator : public OperationsGenerator {
                             const std::string& source_part_path);
 
  private:
+  // Same as the public SplitAReplaceOp(), reading the new image from
+  // |target_reader|.
+  static bool SplitAReplaceOp(const PayloadVersion& version,
+                              const AnnotatedOperation& original_aop,
+                              const PartitionReader& target_reader,
+                              std::vector<AnnotatedOperation>* result_aops,
+                              BlobFileWriter* blob_file);
+
   // Adds the data payload for a REPLACE/REPLACE_BZ/REPLACE_XZ operation |aop|
-  // by reading its output extents from |target_part_path| and appending a
+  // by reading its output extents from |target_reader| and appending a
   // corresponding data blob to |blob_file|. The blob will be compressed if this
   // is smaller than the uncompressed form, and the operation type will be set
   // accordingly. |*blob_file| will be updated as well. If the operation happens
@@ -124,7 +192,7 @@ class ABGenerator : public OperationsGenerator {
   // written. Caller should only set type and data blob if it's valid.
   static bool AddDataAndSetType(AnnotatedOperation* aop,
                                 const PayloadVersion& version,
-                                const std::string& target_part_path,
+                                const PartitionReader& target_reader,
                                 BlobFileWriter* blob_file);
 
   DISALLOW_COPY_AND_ASSIGN(ABGenerator);
@@ -32,6 +32,7 @@
 #include "update_engine/payload_generator/annotated_operation.h"
 #include "update_engine/payload_generator/bzip.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/delta_diff_utils.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
 
@@ -308,8 +309,14 @@ void TestMergeReplaceOrReplaceBzOperations(InstallOperation::Type orig_type,
     expected_blob = expected_data;
   }
   ASSERT_EQ(expected_blob.size(), new_op.data_length());
-  ASSERT_EQ(blob_data.size() + expected_blob.size(),
-            static_cast<size_t>(data_file_size));
+  if (orig_type == InstallOperation::REPLACE && !compressible) {
+    // The original blobs are reused, nothing new is written.
+    EXPECT_EQ(0U, new_op.data_offset());
+    ASSERT_EQ(blob_data.size(), static_cast<size_t>(data_file_size));
+  } else {
+    ASSERT_EQ(blob_data.size() + expected_blob.size(),
+              static_cast<size_t>(data_file_size));
+  }
   brillo::Blob new_op_blob(new_op.data_length());
   ssize_t bytes_read;
   ASSERT_TRUE(utils::PReadAll(data_fd,
@@ -432,6 +439,140 @@ TEST_F(ABGeneratorTest, SortOperationsByDestinationTest) {
   EXPECT_EQ(second_aop.name, aops[2].name);
 }
 
+TEST_F(ABGeneratorTest, SimulateApplyIOTest) {
+  vector<AnnotatedOperation> aops(3);
+  aops[0].op.set_type(InstallOperation::SOURCE_COPY);
+  *(aops[0].op.add_src_extents()) = ExtentForRange(10, 2);
+  *(aops[0].op.add_src_extents()) = ExtentForRange(13, 1);
+  *(aops[0].op.add_dst_extents()) = ExtentForRange(0, 3);
+  aops[1].op.set_type(InstallOperation::ZERO);
+  *(aops[1].op.add_dst_extents()) = ExtentForRange(3, 1);
+  *(aops[1].op.add_dst_extents()) = ExtentForRange(kSparseHole, 1);
+  aops[2].op.set_type(InstallOperation::SOURCE_COPY);
+  *(aops[2].op.add_src_extents()) = ExtentForRange(4, 1);
+  *(aops[2].op.add_dst_extents()) = ExtentForRange(8, 1);
+
+  ApplyOrderIOCost cost = ABGenerator::SimulateApplyIO(aops, 0);
+  EXPECT_EQ(3U, cost.source_seeks);
+  EXPECT_EQ(10U + 1 + 10, cost.source_seek_blocks);
+  EXPECT_EQ(1U, cost.target_seeks);
+  EXPECT_EQ(4U, cost.target_seek_blocks);
+
+  // Short jumps don't count as seeks.
+  cost = ABGenerator::SimulateApplyIO(aops, 4);
+  EXPECT_EQ(2U, cost.source_seeks);
+  EXPECT_EQ(0U, cost.target_seeks);
+  EXPECT_TRUE(cost < ABGenerator::SimulateApplyIO(aops, 0));
+}
+
+TEST_F(ABGeneratorTest, OptimizeApplyOrderTest) {
+  // Every target block is copied from one of two distant source regions,
+  // alternating between them.
+  vector<AnnotatedOperation> aops;
+  for (uint64_t i = 0; i < 8; i++) {
+    AnnotatedOperation aop;
+    aop.name = std::to_string(i);
+    aop.op.set_type(InstallOperation::SOURCE_COPY);
+    *(aop.op.add_src_extents()) =
+        ExtentForRange((i % 2 ? 30 : 10) + i / 2, 1);
+    *(aop.op.add_dst_extents()) = ExtentForRange(i, 1);
+    aops.push_back(aop);
+  }
+  ApplyOrderIOCost old_cost = ABGenerator::SimulateApplyIO(aops, 4);
+  EXPECT_EQ(8U, old_cost.source_seeks);
+
+  BlobFileWriter blob_file(0, nullptr);
+  PayloadVersion version(kChromeOSMajorPayloadVersion,
+                         kSourceMinorPayloadVersion);
+  EXPECT_TRUE(
+      ABGenerator::OptimizeApplyOrder(&aops, version, 4, 4, "", &blob_file));
+
+  // In every window of 4 target blocks the source is read in order, and the
+  // adjacent copies of blocks 3 and 4 are merged.
+  vector<string> names;
+  for (const AnnotatedOperation& aop : aops)
+    names.push_back(aop.name);
+  EXPECT_EQ((vector<string>{"0", "2", "1", "3,4", "6", "5", "7"}), names);
+  ApplyOrderIOCost new_cost = ABGenerator::SimulateApplyIO(aops, 4);
+  EXPECT_EQ(4U, new_cost.source_seeks);
+  EXPECT_EQ(0U, new_cost.target_seeks);
+  EXPECT_TRUE(new_cost < old_cost);
+}
+
+TEST_F(ABGeneratorTest, OptimizeApplyOrderSplitsSourceCopyTest) {
+  vector<AnnotatedOperation> aops(1);
+  aops[0].name = "copy";
+  aops[0].op.set_type(InstallOperation::SOURCE_COPY);
+  *(aops[0].op.add_src_extents()) = ExtentForRange(20, 1);
+  *(aops[0].op.add_src_extents()) = ExtentForRange(5, 1);
+  *(aops[0].op.add_src_extents()) = ExtentForRange(21, 1);
+  *(aops[0].op.add_src_extents()) = ExtentForRange(6, 1);
+  *(aops[0].op.add_dst_extents()) = ExtentForRange(0, 4);
+
+  BlobFileWriter blob_file(0, nullptr);
+  PayloadVersion version(kChromeOSMajorPayloadVersion,
+                         kSourceMinorPayloadVersion);
+  EXPECT_TRUE(
+      ABGenerator::OptimizeApplyOrder(&aops, version, 4, 4, "", &blob_file));
+
+  ASSERT_EQ(4U, aops.size());
+  EXPECT_EQ("copy:1", aops[0].name);
+  EXPECT_TRUE(ExtentEquals(aops[0].op.src_extents(0), 5, 1));
+  EXPECT_TRUE(ExtentEquals(aops[0].op.dst_extents(0), 1, 1));
+  EXPECT_EQ("copy:3", aops[1].name);
+  EXPECT_TRUE(ExtentEquals(aops[1].op.dst_extents(0), 3, 1));
+  EXPECT_EQ("copy:0", aops[2].name);
+  EXPECT_TRUE(ExtentEquals(aops[2].op.dst_extents(0), 0, 1));
+  EXPECT_EQ("copy:2", aops[3].name);
+  EXPECT_TRUE(ExtentEquals(aops[3].op.src_extents(0), 21, 1));
+  EXPECT_TRUE(ExtentEquals(aops[3].op.dst_extents(0), 2, 1));
+}
+
+TEST_F(ABGeneratorTest, OptimizeApplyOrderKeepsSequentialOrderTest) {
+  vector<AnnotatedOperation> aops(2);
+  aops[0].name = "replace";
+  aops[0].op.set_type(InstallOperation::REPLACE);
+  *(aops[0].op.add_dst_extents()) = ExtentForRange(0, 2);
+  aops[1].name = "copy";
+  aops[1].op.set_type(InstallOperation::SOURCE_COPY);
+  *(aops[1].op.add_src_extents()) = ExtentForRange(0, 1);
+  *(aops[1].op.add_src_extents()) = ExtentForRange(1, 1);
+  *(aops[1].op.add_dst_extents()) = ExtentForRange(2, 2);
+
+  BlobFileWriter blob_file(0, nullptr);
+  PayloadVersion version(kChromeOSMajorPayloadVersion,
+                         kSourceMinorPayloadVersion);
+  EXPECT_TRUE(
+      ABGenerator::OptimizeApplyOrder(&aops, version, 4, 4, "", &blob_file));
+
+  // Splitting the copy doesn't make the reads more sequential.
+  ASSERT_EQ(2U, aops.size());
+  EXPECT_EQ("replace", aops[0].name);
+  EXPECT_EQ("copy", aops[1].name);
+  EXPECT_EQ(2, aops[1].op.src_extents_size());
+}
+
+TEST_F(ABGeneratorTest, OptimizeApplyOrderRejectedStoresNoBlobTest) {
+  // Two adjacent REPLACE_BZ operations that would be merged in a new order.
+  vector<AnnotatedOperation> aops(2);
+  for (uint64_t i = 0; i < 2; i++) {
+    aops[i].name = std::to_string(i);
+    aops[i].op.set_type(InstallOperation::REPLACE_BZ);
+    *(aops[i].op.add_dst_extents()) = ExtentForRange(i, 1);
+  }
+
+  // Merging them would need to read the target partition and store a new
+  // blob, but the order is already the best one so they are left alone.
+  BlobFileWriter blob_file(0, nullptr);
+  PayloadVersion version(kChromeOSMajorPayloadVersion,
+                         kSourceMinorPayloadVersion);
+  EXPECT_TRUE(
+      ABGenerator::OptimizeApplyOrder(&aops, version, 4, 4, "", &blob_file));
+  ASSERT_EQ(2U, aops.size());
+  EXPECT_EQ("0", aops[0].name);
+  EXPECT_EQ("1", aops[1].name);
+}
+
 TEST_F(ABGeneratorTest, MergeSourceCopyOperationsTest) {
   vector<AnnotatedOperation> aops;
   InstallOperation first_op;
@@ -499,6 +640,65 @@ TEST_F(ABGeneratorTest, MergeReplaceBzOperationsToReplaceTest) {
   TestMergeReplaceOrReplaceBzOperations(InstallOperation::REPLACE_BZ, false);
 }
 
+TEST_F(ABGeneratorTest, MergeManyReplaceOperationsTest) {
+  // Enough operations to need several batches of recompression.
+  const size_t kNumOps = 64 * diff_utils::GetMaxThreads();
+  brillo::Blob part_data(kNumOps * kBlockSize);
+  test_utils::FillWithData(&part_data);
+  test_utils::ScopedTempFile part_file("MergeManyReplaceTest_part.XXXXXX");
+  ASSERT_TRUE(test_utils::WriteFileVector(part_file.path(), part_data));
+
+  vector<AnnotatedOperation> aops;
+  for (size_t i = 0; i < kNumOps; i++) {
+    AnnotatedOperation aop;
+    aop.op.set_type(InstallOperation::REPLACE_BZ);
+    *(aop.op.add_dst_extents()) = ExtentForRange(i, 1);
+    aop.op.set_data_offset(i);
+    aop.op.set_data_length(1);
+    aop.name = std::to_string(i);
+    aops.push_back(aop);
+  }
+
+  test_utils::ScopedTempFile data_file("MergeManyReplaceTest_data.XXXXXX");
+  int data_fd = open(data_file.path().c_str(), O_RDWR, 000);
+  EXPECT_GE(data_fd, 0);
+  ScopedFdCloser data_fd_closer(&data_fd);
+  off_t data_file_size = 0;
+  BlobFileWriter blob_file(data_fd, &data_file_size);
+
+  PayloadVersion version(kChromeOSMajorPayloadVersion,
+                         kSourceMinorPayloadVersion);
+  EXPECT_TRUE(ABGenerator::MergeOperations(
+      &aops, version, 2, part_file.path(), &blob_file));
+
+  // Every pair of operations was merged and the blobs were written in the
+  // order of the operations.
+  ASSERT_EQ(kNumOps / 2, aops.size());
+  uint64_t expected_offset = 0;
+  for (size_t i = 0; i < aops.size(); i++) {
+    EXPECT_EQ(std::to_string(2 * i) + "," + std::to_string(2 * i + 1),
+              aops[i].name);
+    EXPECT_EQ(InstallOperation::REPLACE_BZ, aops[i].op.type());
+    EXPECT_EQ(expected_offset, aops[i].op.data_offset());
+    expected_offset += aops[i].op.data_length();
+
+    brillo::Blob expected_blob;
+    ASSERT_TRUE(BzipCompress(
+        brillo::Blob(part_data.begin() + 2 * i * kBlockSize,
+                     part_data.begin() + (2 * i + 2) * kBlockSize),
+        &expected_blob));
+    brillo::Blob blob(aops[i].op.data_length());
+    ssize_t bytes_read;
+    ASSERT_TRUE(utils::PReadAll(data_fd,
+                                blob.data(),
+                                blob.size(),
+                                aops[i].op.data_offset(),
+                                &bytes_read));
+    EXPECT_EQ(expected_blob, blob);
+  }
+  EXPECT_EQ(expected_offset, static_cast<uint64_t>(data_file_size));
+}
+
 TEST_F(ABGeneratorTest, NoMergeOperationsTest) {
   // Test to make sure we don't merge operations that shouldn't be merged.
   vector<AnnotatedOperation> aops;
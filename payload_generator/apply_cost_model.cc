@@ -0,0 +1,528 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/apply_cost_model.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+
+#include <algorithm>
+#include <memory>
+#include <utility>
+
+#include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/stringprintf.h>
+#include <base/time/time.h>
+#include <bsdiff/bspatch.h>
+#include <puffin/puffpatch.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/bzip_extent_writer.h"
+#include "update_engine/payload_consumer/extent_reader.h"
+#include "update_engine/payload_consumer/extent_stream_adapters.h"
+#include "update_engine/payload_consumer/extent_writer.h"
+#include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_consumer/file_descriptor_utils.h"
+#include "update_engine/payload_consumer/lz4patch.h"
+#include "update_engine/payload_consumer/memory_budget.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_consumer/payload_metadata.h"
+#include "update_engine/payload_consumer/xz_extent_writer.h"
+#include "update_engine/payload_consumer/zstd_extent_writer.h"
+
+using std::map;
+using std::pair;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const double kMiB = 1024 * 1024;
+
+// Decode throughput of the operations that were not calibrated, in target bytes
+// per second, as measured on a typical workstation.
+double DefaultDecodeBytesPerSecond(InstallOperation::Type type) {
+  switch (type) {
+    case InstallOperation::REPLACE:
+      return 2000 * kMiB;
+    case InstallOperation::REPLACE_BZ:
+      return 30 * kMiB;
+    case InstallOperation::REPLACE_XZ:
+      return 80 * kMiB;
+    case InstallOperation::REPLACE_ZSTD:
+      return 500 * kMiB;
+    case InstallOperation::MOVE:
+    case InstallOperation::SOURCE_COPY:
+      return 1000 * kMiB;
+    case InstallOperation::BSDIFF:
+    case InstallOperation::SOURCE_BSDIFF:
+      return 150 * kMiB;
+    case InstallOperation::BROTLI_BSDIFF:
+      return 100 * kMiB;
+    case InstallOperation::PUFFDIFF:
+      return 40 * kMiB;
+    case InstallOperation::ZSTD_DIFF:
+      return 400 * kMiB;
+    case InstallOperation::LZ4DIFF:
+      // Dominated by the LZ4 HC compression of the target.
+      return 15 * kMiB;
+    case InstallOperation::ZERO:
+    case InstallOperation::DISCARD:
+      return 0;
+  }
+  return 0;
+}
+
+// Whether operations of type |type| read the source partition.
+bool ReadsSource(InstallOperation::Type type) {
+  return type == InstallOperation::MOVE || type == InstallOperation::BSDIFF ||
+         type == InstallOperation::SOURCE_COPY ||
+         type == InstallOperation::SOURCE_BSDIFF ||
+         type == InstallOperation::BROTLI_BSDIFF ||
+         type == InstallOperation::PUFFDIFF ||
+         type == InstallOperation::ZSTD_DIFF ||
+         type == InstallOperation::LZ4DIFF;
+}
+
+// Adds the bytes of |extents| to |*bytes| and counts in |*random_accesses|
+// those that don't start where the previous one ended, at |*next_block|.
+void AccountExtents(const google::protobuf::RepeatedPtrField<Extent>& extents,
+                    uint32_t block_size,
+                    uint64_t* next_block,
+                    uint64_t* bytes,
+                    uint64_t* random_accesses) {
+  for (const Extent& extent : extents) {
+    if (extent.start_block() == kSparseHole)
+      continue;
+    if (extent.start_block() != *next_block)
+      (*random_accesses)++;
+    *next_block = extent.start_block() + extent.num_blocks();
+    *bytes += extent.num_blocks() * block_size;
+  }
+}
+
+bool GetUint64(const brillo::KeyValueStore& store,
+               const string& key,
+               uint64_t* value) {
+  string str;
+  if (!store.GetString(key, &str))
+    return true;
+  TEST_AND_RETURN_FALSE(base::StringToUint64(str, value));
+  return true;
+}
+
+bool GetDouble(const brillo::KeyValueStore& store,
+               const string& key,
+               double* value) {
+  string str;
+  if (!store.GetString(key, &str))
+    return true;
+  TEST_AND_RETURN_FALSE(base::StringToDouble(str, value) && *value >= 0);
+  return true;
+}
+
+}  // namespace
+
+bool ApplyDeviceProfile::Load(const brillo::KeyValueStore& store) {
+  TEST_AND_RETURN_FALSE(GetDouble(store, "CPU_SLOWDOWN", &cpu_slowdown));
+  TEST_AND_RETURN_FALSE(
+      GetUint64(store, "READ_BYTES_PER_SECOND", &read_bytes_per_second));
+  TEST_AND_RETURN_FALSE(
+      GetUint64(store, "WRITE_BYTES_PER_SECOND", &write_bytes_per_second));
+  TEST_AND_RETURN_FALSE(GetDouble(store, "SEEK_SECONDS", &seek_seconds));
+  TEST_AND_RETURN_FALSE(GetUint64(store, "MEMORY_BUDGET", &memory_budget));
+  TEST_AND_RETURN_FALSE(read_bytes_per_second > 0 &&
+                        write_bytes_per_second > 0);
+  return true;
+}
+
+bool ApplyCostModel::LoadPayload(const string& payload_path) {
+  brillo::Blob payload;
+  TEST_AND_RETURN_FALSE(utils::ReadFileChunk(
+      payload_path, 0, PayloadMetadata::kDeltaManifestSizeOffset +
+                           PayloadMetadata::kDeltaManifestSizeSize +
+                           PayloadMetadata::kDeltaMetadataSignatureSizeSize,
+      &payload));
+  PayloadMetadata payload_metadata;
+  TEST_AND_RETURN_FALSE(payload_metadata.ParsePayloadHeader(payload));
+  payload.clear();
+  TEST_AND_RETURN_FALSE(utils::ReadFileChunk(
+      payload_path, 0, payload_metadata.GetMetadataSize(), &payload));
+  DeltaArchiveManifest manifest;
+  TEST_AND_RETURN_FALSE(payload_metadata.GetManifest(payload, &manifest));
+
+  payload_path_ = payload_path;
+  data_offset_ = payload_metadata.GetMetadataSize() +
+                 payload_metadata.GetMetadataSignatureSize();
+  block_size_ = manifest.block_size();
+  partitions_.clear();
+  calibrated_bytes_per_second_.clear();
+  calibrated_operations_.clear();
+  if (payload_metadata.GetMajorVersion() == kChromeOSMajorPayloadVersion) {
+    partitions_.resize(2);
+    partitions_[0].set_partition_name(kPartitionNameRoot);
+    partitions_[0].mutable_operations()->Swap(
+        manifest.mutable_install_operations());
+    partitions_[1].set_partition_name(kPartitionNameKernel);
+    partitions_[1].mutable_operations()->Swap(
+        manifest.mutable_kernel_install_operations());
+  } else {
+    partitions_.assign(manifest.partitions().begin(),
+                       manifest.partitions().end());
+  }
+  return true;
+}
+
+bool ApplyCostModel::RunOperation(const PartitionUpdate& partition,
+                                  const InstallOperation& operation,
+                                  const string& source_path,
+                                  double* out_seconds) const {
+  MemoryBudget memory_budget(profile_.memory_budget);
+  brillo::Blob data;
+  if (operation.data_length() > 0) {
+    TEST_AND_RETURN_FALSE(
+        utils::ReadFileChunk(payload_path_,
+                             data_offset_ + operation.data_offset(),
+                             operation.data_length(),
+                             &data));
+    TEST_AND_RETURN_FALSE(data.size() == operation.data_length());
+  }
+
+  FileDescriptorPtr source_fd;
+  if (ReadsSource(operation.type())) {
+    source_fd.reset(new EintrSafeFileDescriptor());
+    TEST_AND_RETURN_FALSE(source_fd->Open(source_path.c_str(), O_RDONLY));
+    // Read the source once first, so the measurement doesn't depend on the
+    // disk of this machine, which the I/O model accounts for separately.
+    TEST_AND_RETURN_FALSE(fd_utils::ReadAndHashExtents(
+        source_fd, operation.src_extents(), block_size_, nullptr));
+  }
+  // Only the decoding is measured, so the target data is discarded.
+  FileDescriptorPtr target_fd(new EintrSafeFileDescriptor());
+  TEST_AND_RETURN_FALSE(target_fd->Open("/dev/null", O_WRONLY));
+  uint64_t src_size = utils::BlocksInExtents(operation.src_extents()) *
+                      block_size_;
+  uint64_t dst_size = utils::BlocksInExtents(operation.dst_extents()) *
+                      block_size_;
+
+  base::TimeTicks start = base::TimeTicks::Now();
+  switch (operation.type()) {
+    case InstallOperation::REPLACE:
+    case InstallOperation::REPLACE_BZ:
+    case InstallOperation::REPLACE_XZ:
+    case InstallOperation::REPLACE_ZSTD: {
+      std::unique_ptr<ExtentWriter> writer =
+          std::make_unique<DirectExtentWriter>();
+      if (operation.type() == InstallOperation::REPLACE_BZ) {
+        writer.reset(new BzipExtentWriter(
+            std::move(writer), memory_budget.decoder_buffer_size()));
+      } else if (operation.type() == InstallOperation::REPLACE_XZ) {
+        writer.reset(new XzExtentWriter(std::move(writer),
+                                        memory_budget.decoder_buffer_size()));
+      } else if (operation.type() == InstallOperation::REPLACE_ZSTD) {
+        writer.reset(new ZstdExtentWriter(
+            std::move(writer), memory_budget.decoder_buffer_size()));
+      }
+      TEST_AND_RETURN_FALSE(
+          writer->Init(target_fd, operation.dst_extents(), block_size_));
+      TEST_AND_RETURN_FALSE(writer->Write(data.data(), data.size()));
+      break;
+    }
+    case InstallOperation::MOVE:
+    case InstallOperation::SOURCE_COPY:
+      TEST_AND_RETURN_FALSE(
+          fd_utils::CopyAndHashExtents(source_fd,
+                                       operation.src_extents(),
+                                       target_fd,
+                                       operation.dst_extents(),
+                                       block_size_,
+                                       nullptr,
+                                       memory_budget.copy_buffer_size()));
+      break;
+    case InstallOperation::BSDIFF:
+    case InstallOperation::SOURCE_BSDIFF:
+    case InstallOperation::BROTLI_BSDIFF: {
+      auto reader = std::make_unique<CachedExtentReader>(
+          memory_budget.source_read_cache_size());
+      TEST_AND_RETURN_FALSE(
+          reader->Init(source_fd, operation.src_extents(), block_size_));
+      auto writer = std::make_unique<DirectExtentWriter>();
+      TEST_AND_RETURN_FALSE(
+          writer->Init(target_fd, operation.dst_extents(), block_size_));
+      TEST_AND_RETURN_FALSE(
+          bsdiff::bspatch(
+              std::make_unique<BsdiffExtentFile>(std::move(reader), src_size),
+              std::make_unique<BsdiffExtentFile>(std::move(writer), dst_size),
+              data.data(),
+              data.size()) == 0);
+      break;
+    }
+    case InstallOperation::PUFFDIFF: {
+      auto reader = std::make_unique<CachedExtentReader>(
+          memory_budget.source_read_cache_size());
+      TEST_AND_RETURN_FALSE(
+          reader->Init(source_fd, operation.src_extents(), block_size_));
+      auto writer = std::make_unique<DirectExtentWriter>();
+      TEST_AND_RETURN_FALSE(
+          writer->Init(target_fd, operation.dst_extents(), block_size_));
+      TEST_AND_RETURN_FALSE(puffin::PuffPatch(
+          puffin::UniqueStreamPtr(
+              new PuffinExtentStream(std::move(reader), src_size)),
+          puffin::UniqueStreamPtr(
+              new PuffinExtentStream(std::move(writer), dst_size)),
+          data.data(),
+          data.size(),
+          memory_budget.puffpatch_cache_size()));
+      break;
+    }
+    case InstallOperation::ZSTD_DIFF: {
+      brillo::Blob prefix(src_size);
+      DirectExtentReader reader;
+      TEST_AND_RETURN_FALSE(
+          reader.Init(source_fd, operation.src_extents(), block_size_));
+      TEST_AND_RETURN_FALSE(reader.Read(prefix.data(), prefix.size()));
+      ZstdExtentWriter writer(std::make_unique<DirectExtentWriter>(),
+                              memory_budget.decoder_buffer_size(),
+                              std::move(prefix));
+      TEST_AND_RETURN_FALSE(
+          writer.Init(target_fd, operation.dst_extents(), block_size_));
+      TEST_AND_RETURN_FALSE(writer.Write(data.data(), data.size()));
+      break;
+    }
+    case InstallOperation::LZ4DIFF: {
+      brillo::Blob src(src_size);
+      DirectExtentReader reader;
+      TEST_AND_RETURN_FALSE(
+          reader.Init(source_fd, operation.src_extents(), block_size_));
+      TEST_AND_RETURN_FALSE(reader.Read(src.data(), src.size()));
+      brillo::Blob dst;
+      TEST_AND_RETURN_FALSE(Lz4Patch(src, data.data(), data.size(), &dst));
+      TEST_AND_RETURN_FALSE(dst.size() == dst_size);
+      DirectExtentWriter writer;
+      TEST_AND_RETURN_FALSE(
+          writer.Init(target_fd, operation.dst_extents(), block_size_));
+      TEST_AND_RETURN_FALSE(writer.Write(dst.data(), dst.size()));
+      break;
+    }
+    case InstallOperation::ZERO:
+    case InstallOperation::DISCARD:
+      break;
+  }
+  *out_seconds = (base::TimeTicks::Now() - start).InSecondsF();
+  LOG(INFO) << "Ran " << InstallOperationTypeName(operation.type())
+            << " operation of " << dst_size << " bytes in partition "
+            << partition.partition_name() << " in " << *out_seconds << "s.";
+  return true;
+}
+
+bool ApplyCostModel::Calibrate(const map<string, string>& source_paths,
+                               size_t samples_per_type) {
+  // The operations that can be run, by type, in apply order.
+  map<InstallOperation::Type, vector<pair<size_t, size_t>>> candidates;
+  for (size_t p = 0; p < partitions_.size(); p++) {
+    const PartitionUpdate& partition = partitions_[p];
+    bool has_source = source_paths.count(partition.partition_name()) > 0;
+    for (int i = 0; i < partition.operations_size(); i++) {
+      InstallOperation::Type type = partition.operations(i).type();
+      if (DefaultDecodeBytesPerSecond(type) == 0 ||
+          (ReadsSource(type) && !has_source)) {
+        continue;
+      }
+      candidates[type].emplace_back(p, i);
+    }
+  }
+
+  calibrated_bytes_per_second_.clear();
+  calibrated_operations_.clear();
+  for (const auto& type_candidates : candidates) {
+    const vector<pair<size_t, size_t>>& ops = type_candidates.second;
+    // Spread the samples evenly over the payload.
+    size_t num_samples = std::min(samples_per_type, ops.size());
+    uint64_t total_bytes = 0;
+    double total_seconds = 0;
+    for (size_t s = 0; s < num_samples; s++) {
+      const pair<size_t, size_t>& op_index = ops[s * ops.size() / num_samples];
+      const PartitionUpdate& partition = partitions_[op_index.first];
+      const InstallOperation& operation =
+          partition.operations(op_index.second);
+      auto source_path = source_paths.find(partition.partition_name());
+      double seconds;
+      TEST_AND_RETURN_FALSE(RunOperation(
+          partition,
+          operation,
+          source_path == source_paths.end() ? "" : source_path->second,
+          &seconds));
+      total_bytes += utils::BlocksInExtents(operation.dst_extents()) *
+                     block_size_;
+      total_seconds += seconds;
+      calibrated_operations_.push_back(op_index);
+    }
+    if (num_samples == 0 || total_seconds <= 0)
+      continue;
+    calibrated_bytes_per_second_[type_candidates.first] =
+        total_bytes / total_seconds;
+    LOG(INFO) << "Calibrated "
+              << InstallOperationTypeName(type_candidates.first) << " with "
+              << num_samples << " operations: "
+              << total_bytes / total_seconds / kMiB << " MiB/s.";
+  }
+  std::sort(calibrated_operations_.begin(), calibrated_operations_.end());
+  return true;
+}
+
+double ApplyCostModel::decode_bytes_per_second(
+    InstallOperation::Type type) const {
+  auto it = calibrated_bytes_per_second_.find(type);
+  if (it != calibrated_bytes_per_second_.end())
+    return it->second;
+  return DefaultDecodeBytesPerSecond(type);
+}
+
+vector<OperationApplyCost> ApplyCostModel::EstimateCosts() const {
+  MemoryBudget memory_budget(profile_.memory_budget);
+  vector<OperationApplyCost> costs;
+  for (size_t p = 0; p < partitions_.size(); p++) {
+    const PartitionUpdate& partition = partitions_[p];
+    // The first access to every partition is a random one.
+    uint64_t next_source_block = kSparseHole;
+    uint64_t next_target_block = kSparseHole;
+    for (int i = 0; i < partition.operations_size(); i++) {
+      const InstallOperation& operation = partition.operations(i);
+      OperationApplyCost cost;
+      cost.partition_name = partition.partition_name();
+      cost.index = i;
+      cost.type = operation.type();
+      cost.data_bytes = operation.data_length();
+      if (ReadsSource(operation.type())) {
+        AccountExtents(operation.src_extents(),
+                       block_size_,
+                       &next_source_block,
+                       &cost.source_bytes,
+                       &cost.source_random_accesses);
+      }
+      uint64_t target_bytes = 0;
+      AccountExtents(operation.dst_extents(),
+                     block_size_,
+                     &next_target_block,
+                     &target_bytes,
+                     &cost.target_random_accesses);
+      // Discarded blocks are not written.
+      if (operation.type() != InstallOperation::DISCARD)
+        cost.target_bytes = target_bytes;
+
+      cost.peak_buffer_bytes = cost.data_bytes;
+      switch (operation.type()) {
+        case InstallOperation::REPLACE_BZ:
+        case InstallOperation::REPLACE_XZ:
+        case InstallOperation::REPLACE_ZSTD:
+          cost.peak_buffer_bytes += memory_budget.decoder_buffer_size();
+          break;
+        case InstallOperation::MOVE:
+        case InstallOperation::SOURCE_COPY:
+        case InstallOperation::ZERO:
+          cost.peak_buffer_bytes += memory_budget.copy_buffer_size();
+          break;
+        case InstallOperation::BSDIFF:
+        case InstallOperation::SOURCE_BSDIFF:
+        case InstallOperation::BROTLI_BSDIFF:
+          cost.peak_buffer_bytes += memory_budget.source_read_cache_size();
+          break;
+        case InstallOperation::PUFFDIFF:
+          cost.peak_buffer_bytes += memory_budget.source_read_cache_size() +
+                                    memory_budget.puffpatch_cache_size();
+          break;
+        case InstallOperation::ZSTD_DIFF:
+          // The whole source is the prefix, and the whole target fits in the
+          // decompressor window.
+          cost.peak_buffer_bytes += cost.source_bytes + target_bytes +
+                                    memory_budget.decoder_buffer_size();
+          break;
+        case InstallOperation::LZ4DIFF:
+          // The cached decompressed source blocks, plus a compressed source
+          // block and a target block before and after compression.
+          cost.peak_buffer_bytes +=
+              memory_budget.source_read_cache_size() +
+              (std::max<uint64_t>(memory_budget.puffpatch_cache_size() /
+                                      kLz4LegacyBlockSize,
+                                  1) +
+               3) *
+                  kLz4LegacyBlockSize;
+          break;
+        default:
+          break;
+      }
+      if (cost.target_bytes > 0)
+        cost.peak_buffer_bytes += memory_budget.write_cache_size();
+
+      double bytes_per_second = decode_bytes_per_second(operation.type());
+      if (bytes_per_second > 0) {
+        cost.decode_seconds =
+            target_bytes / bytes_per_second * profile_.cpu_slowdown;
+      }
+      cost.io_seconds =
+          static_cast<double>(cost.source_bytes) /
+              profile_.read_bytes_per_second +
+          static_cast<double>(cost.target_bytes) /
+              profile_.write_bytes_per_second +
+          (cost.source_random_accesses + cost.target_random_accesses) *
+              profile_.seek_seconds;
+      cost.calibrated =
+          std::binary_search(calibrated_operations_.begin(),
+                             calibrated_operations_.end(),
+                             std::make_pair(p, static_cast<size_t>(i)));
+      costs.push_back(cost);
+    }
+  }
+  return costs;
+}
+
+double ApplyCostModel::TotalSeconds(const vector<OperationApplyCost>& costs) {
+  double total = 0;
+  for (const OperationApplyCost& cost : costs)
+    total += cost.decode_seconds + cost.io_seconds;
+  return total;
+}
+
+bool ApplyCostModel::WriteReport(const string& path,
+                                 const vector<OperationApplyCost>& costs) {
+  string report =
+      "partition,index,type,data_bytes,source_bytes,target_bytes,"
+      "source_random_accesses,target_random_accesses,peak_buffer_bytes,"
+      "decode_seconds,io_seconds,calibrated\n";
+  for (const OperationApplyCost& cost : costs) {
+    report += base::StringPrintf(
+        "%s,%zu,%s,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64
+        ",%" PRIu64 ",%.6f,%.6f,%d\n",
+        cost.partition_name.c_str(),
+        cost.index,
+        InstallOperationTypeName(cost.type),
+        cost.data_bytes,
+        cost.source_bytes,
+        cost.target_bytes,
+        cost.source_random_accesses,
+        cost.target_random_accesses,
+        cost.peak_buffer_bytes,
+        cost.decode_seconds,
+        cost.io_seconds,
+        cost.calibrated ? 1 : 0);
+  }
+  return utils::WriteFile(path.c_str(), report.data(), report.size());
+}
+
+}  // namespace chromeos_update_engine
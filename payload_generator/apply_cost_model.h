@@ -0,0 +1,149 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_APPLY_COST_MODEL_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_APPLY_COST_MODEL_H_
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <base/macros.h>
+#include <brillo/key_value_store.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// The characteristics of the class of devices the apply time of a payload is
+// predicted for.
+struct ApplyDeviceProfile {
+  // Loads the values present in |store|, keeping the default of the missing
+  // ones. Returns false if a value is invalid.
+  bool Load(const brillo::KeyValueStore& store);
+
+  // How many times slower than the machine running the calibration the device
+  // decodes the operations.
+  double cpu_slowdown{4.0};
+
+  // Throughput of sequential reads from the source partition and writes to
+  // the target partition.
+  uint64_t read_bytes_per_second{100 * 1024 * 1024};
+  uint64_t write_bytes_per_second{40 * 1024 * 1024};
+
+  // Time spent on every access that doesn't continue where the previous access
+  // to the same partition ended.
+  double seek_seconds{0.0005};
+
+  // The memory budget update_engine uses to apply the payload on the device.
+  // See MemoryBudget.
+  uint64_t memory_budget{32 * 1024 * 1024};
+};
+
+// The predicted cost of applying a single operation.
+struct OperationApplyCost {
+  std::string partition_name;
+  // Index of the operation in its partition.
+  size_t index{0};
+  InstallOperation::Type type{InstallOperation::REPLACE};
+
+  // Bytes of the operation data in the payload.
+  uint64_t data_bytes{0};
+  // Bytes read from the source partition and written to the target one.
+  uint64_t source_bytes{0};
+  uint64_t target_bytes{0};
+  // Number of accesses to the source and target partitions that don't follow
+  // the previous one.
+  uint64_t source_random_accesses{0};
+  uint64_t target_random_accesses{0};
+  // The largest amount of memory held while applying the operation: its data
+  // plus the caches and buffers its type uses.
+  uint64_t peak_buffer_bytes{0};
+
+  // Predicted time on the device, spent decoding and waiting for I/O.
+  double decode_seconds{0};
+  double io_seconds{0};
+
+  // Whether the operation was run during the calibration.
+  bool calibrated{false};
+};
+
+// ApplyCostModel predicts the time a device needs to apply a payload, one
+// operation at a time. The decode time of every operation type is calibrated
+// by running a sample of the operations of the payload locally with the same
+// extent writers, bspatch and puffpatch that DeltaPerformer uses, and scaled to
+// the device with an ApplyDeviceProfile. The I/O time is derived from the
+// bytes read and written and from how sequential the accesses are.
+class ApplyCostModel {
+ public:
+  explicit ApplyCostModel(const ApplyDeviceProfile& profile)
+      : profile_(profile) {}
+
+  // Loads the manifest of the payload at |payload_path|.
+  bool LoadPayload(const std::string& payload_path);
+
+  // Runs up to |samples_per_type| operations of every type and replaces the
+  // default decode throughput of the type with the measured one. Operations
+  // reading from the source partition are only run when |source_paths|, which
+  // maps partition names to source images, has their partition.
+  bool Calibrate(const std::map<std::string, std::string>& source_paths,
+                 size_t samples_per_type);
+
+  // Returns the cost of every operation of the payload, in apply order.
+  std::vector<OperationApplyCost> EstimateCosts() const;
+
+  // Writes |costs| to |path| as comma separated values, one operation per line
+  // after a header line.
+  static bool WriteReport(const std::string& path,
+                          const std::vector<OperationApplyCost>& costs);
+
+  // Returns the total predicted time of |costs| in seconds.
+  static double TotalSeconds(const std::vector<OperationApplyCost>& costs);
+
+  // Bytes of target data this machine decodes per second for operations of
+  // type |type|. Zero for operations that don't decode anything.
+  double decode_bytes_per_second(InstallOperation::Type type) const;
+
+ private:
+  // Runs |operation| of |partition| writing to /dev/null, and returns the time
+  // it took in |out_seconds|.
+  bool RunOperation(const PartitionUpdate& partition,
+                    const InstallOperation& operation,
+                    const std::string& source_path,
+                    double* out_seconds) const;
+
+  ApplyDeviceProfile profile_;
+
+  std::string payload_path_;
+  // Offset of the operation data in the payload.
+  uint64_t data_offset_{0};
+  uint32_t block_size_{0};
+  // The partitions of the payload, with the operations of major version 1
+  // payloads converted to partitions.
+  std::vector<PartitionUpdate> partitions_;
+
+  // Measured decode throughput per operation type, overriding the defaults.
+  std::map<InstallOperation::Type, double> calibrated_bytes_per_second_;
+  // The calibrated operations, as pairs of partition and operation index.
+  std::vector<std::pair<size_t, size_t>> calibrated_operations_;
+
+  DISALLOW_COPY_AND_ASSIGN(ApplyCostModel);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_APPLY_COST_MODEL_H_
@@ -0,0 +1,195 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/apply_cost_model.h"
+
+#include <string>
+#include <vector>
+
+#include <base/strings/string_split.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/bzip.h"
+#include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/payload_file.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class ApplyCostModelTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    // A source partition of 4 blocks of random data.
+    brillo::Blob source_data(4 * kBlockSize);
+    test_utils::FillWithData(&source_data);
+    EXPECT_TRUE(test_utils::WriteFileVector(source_file_.path(), source_data));
+
+    brillo::Blob replace_data(kBlockSize);
+    test_utils::FillWithData(&replace_data);
+    brillo::Blob bz_data;
+    EXPECT_TRUE(BzipCompress(brillo::Blob(kBlockSize, 0), &bz_data));
+    brillo::Blob blobs = replace_data;
+    blobs.insert(blobs.end(), bz_data.begin(), bz_data.end());
+    EXPECT_TRUE(test_utils::WriteFileVector(blob_file_.path(), blobs));
+
+    vector<AnnotatedOperation> aops(4);
+    aops[0].op.set_type(InstallOperation::REPLACE);
+    aops[0].op.set_data_offset(0);
+    aops[0].op.set_data_length(replace_data.size());
+    *aops[0].op.add_dst_extents() = ExtentForRange(0, 1);
+    aops[1].op.set_type(InstallOperation::REPLACE_BZ);
+    aops[1].op.set_data_offset(replace_data.size());
+    aops[1].op.set_data_length(bz_data.size());
+    *aops[1].op.add_dst_extents() = ExtentForRange(1, 1);
+    // Both the source read and the target write jump.
+    aops[2].op.set_type(InstallOperation::SOURCE_COPY);
+    *aops[2].op.add_src_extents() = ExtentForRange(2, 1);
+    *aops[2].op.add_dst_extents() = ExtentForRange(5, 1);
+    // Continues where the copy ended.
+    aops[3].op.set_type(InstallOperation::ZERO);
+    *aops[3].op.add_dst_extents() = ExtentForRange(6, 2);
+
+    PayloadGenerationConfig config;
+    config.version.major = kBrilloMajorPayloadVersion;
+    config.version.minor = kSourceMinorPayloadVersion;
+    PayloadFile payload;
+    EXPECT_TRUE(payload.Init(config));
+    PartitionConfig old_part(kPartitionNameRoot);
+    old_part.path = source_file_.path();
+    old_part.size = source_data.size();
+    PartitionConfig new_part(kPartitionNameRoot);
+    new_part.path = "/dev/zero";
+    new_part.size = 8 * kBlockSize;
+    EXPECT_TRUE(payload.AddPartition(old_part, new_part, aops));
+    uint64_t metadata_size;
+    EXPECT_TRUE(payload.WritePayload(
+        payload_file_.path(), blob_file_.path(), "", &metadata_size));
+  }
+
+  test_utils::ScopedTempFile source_file_{"Source-XXXXXX"};
+  test_utils::ScopedTempFile blob_file_{"Blob-XXXXXX"};
+  test_utils::ScopedTempFile payload_file_{"Payload-XXXXXX"};
+};
+
+TEST_F(ApplyCostModelTest, EstimateCostsTest) {
+  ApplyDeviceProfile profile;
+  profile.cpu_slowdown = 2;
+  profile.read_bytes_per_second = kBlockSize;
+  profile.write_bytes_per_second = 2 * kBlockSize;
+  profile.seek_seconds = 1;
+  ApplyCostModel model(profile);
+  ASSERT_TRUE(model.LoadPayload(payload_file_.path()));
+
+  vector<OperationApplyCost> costs = model.EstimateCosts();
+  ASSERT_EQ(4u, costs.size());
+  for (const OperationApplyCost& cost : costs) {
+    EXPECT_EQ(kPartitionNameRoot, cost.partition_name);
+    EXPECT_FALSE(cost.calibrated);
+  }
+
+  // The first write to the partition is a random access.
+  EXPECT_EQ(InstallOperation::REPLACE, costs[0].type);
+  EXPECT_EQ(kBlockSize, costs[0].data_bytes);
+  EXPECT_EQ(kBlockSize, costs[0].target_bytes);
+  EXPECT_EQ(1u, costs[0].target_random_accesses);
+  EXPECT_DOUBLE_EQ(0.5 + 1, costs[0].io_seconds);
+  EXPECT_DOUBLE_EQ(
+      kBlockSize / model.decode_bytes_per_second(InstallOperation::REPLACE) * 2,
+      costs[0].decode_seconds);
+
+  EXPECT_EQ(InstallOperation::REPLACE_BZ, costs[1].type);
+  EXPECT_EQ(0u, costs[1].target_random_accesses);
+  EXPECT_GT(costs[1].peak_buffer_bytes, costs[1].data_bytes);
+
+  EXPECT_EQ(InstallOperation::SOURCE_COPY, costs[2].type);
+  EXPECT_EQ(kBlockSize, costs[2].source_bytes);
+  EXPECT_EQ(1u, costs[2].source_random_accesses);
+  EXPECT_EQ(1u, costs[2].target_random_accesses);
+  EXPECT_DOUBLE_EQ(1 + 0.5 + 2, costs[2].io_seconds);
+
+  EXPECT_EQ(InstallOperation::ZERO, costs[3].type);
+  EXPECT_EQ(0u, costs[3].target_random_accesses);
+  EXPECT_EQ(0, costs[3].decode_seconds);
+
+  double total = 0;
+  for (const OperationApplyCost& cost : costs)
+    total += cost.decode_seconds + cost.io_seconds;
+  EXPECT_DOUBLE_EQ(total, ApplyCostModel::TotalSeconds(costs));
+}
+
+TEST_F(ApplyCostModelTest, CalibrateTest) {
+  ApplyCostModel model(ApplyDeviceProfile{});
+  ASSERT_TRUE(model.LoadPayload(payload_file_.path()));
+  double default_copy_speed =
+      model.decode_bytes_per_second(InstallOperation::SOURCE_COPY);
+
+  // Without a source image only the operations that don't read it run.
+  ASSERT_TRUE(model.Calibrate({}, 1));
+  vector<OperationApplyCost> costs = model.EstimateCosts();
+  ASSERT_EQ(4u, costs.size());
+  EXPECT_TRUE(costs[0].calibrated);
+  EXPECT_TRUE(costs[1].calibrated);
+  EXPECT_FALSE(costs[2].calibrated);
+  EXPECT_FALSE(costs[3].calibrated);
+  EXPECT_EQ(default_copy_speed,
+            model.decode_bytes_per_second(InstallOperation::SOURCE_COPY));
+
+  ASSERT_TRUE(model.Calibrate({{kPartitionNameRoot, source_file_.path()}}, 1));
+  costs = model.EstimateCosts();
+  EXPECT_TRUE(costs[2].calibrated);
+  EXPECT_GT(model.decode_bytes_per_second(InstallOperation::SOURCE_COPY), 0);
+}
+
+TEST_F(ApplyCostModelTest, WriteReportTest) {
+  ApplyCostModel model(ApplyDeviceProfile{});
+  ASSERT_TRUE(model.LoadPayload(payload_file_.path()));
+  test_utils::ScopedTempFile report_file("Report-XXXXXX");
+  EXPECT_TRUE(
+      ApplyCostModel::WriteReport(report_file.path(), model.EstimateCosts()));
+
+  string report;
+  EXPECT_TRUE(utils::ReadFile(report_file.path(), &report));
+  vector<string> lines = base::SplitString(
+      report, "\n", base::KEEP_WHITESPACE, base::SPLIT_WANT_NONEMPTY);
+  ASSERT_EQ(5u, lines.size());
+  EXPECT_EQ(0u, lines[0].find("partition,index,type,"));
+  EXPECT_EQ(0u, lines[3].find("root,2,SOURCE_COPY,0,4096,4096,1,1,"));
+}
+
+TEST_F(ApplyCostModelTest, LoadDeviceProfileTest) {
+  brillo::KeyValueStore store;
+  store.SetString("CPU_SLOWDOWN", "6.5");
+  store.SetString("WRITE_BYTES_PER_SECOND", "1000");
+  ApplyDeviceProfile profile;
+  uint64_t default_read_speed = profile.read_bytes_per_second;
+  EXPECT_TRUE(profile.Load(store));
+  EXPECT_DOUBLE_EQ(6.5, profile.cpu_slowdown);
+  EXPECT_EQ(1000u, profile.write_bytes_per_second);
+  EXPECT_EQ(default_read_speed, profile.read_bytes_per_second);
+
+  store.SetString("READ_BYTES_PER_SECOND", "0");
+  EXPECT_FALSE(profile.Load(store));
+  store.SetString("READ_BYTES_PER_SECOND", "fast");
+  EXPECT_FALSE(profile.Load(store));
+}
+
+}  // namespace chromeos_update_engine
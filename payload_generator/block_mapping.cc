@@ -21,6 +21,7 @@
 #include <sys/types.h>
 
 #include <functional>
+#include <memory>
 #include <string>
 #include <utility>
 #include <vector>
@@ -42,20 +43,20 @@ size_t HashValue(const brillo::Blob& blob) {
 namespace chromeos_update_engine {
 
 BlockMapping::BlockId BlockMapping::AddBlock(const brillo::Blob& block_data) {
-  return AddBlock(-1, 0, block_data);
+  return AddBlock(nullptr, 0, block_data);
 }
 
-BlockMapping::BlockId BlockMapping::AddDiskBlock(int fd, off_t byte_offset) {
+BlockMapping::BlockId BlockMapping::AddDiskBlock(const PartitionReader* reader,
+                                                 off_t byte_offset) {
+  if (reader->IsZero(byte_offset, block_size_))
+    return AddBlock(brillo::Blob(block_size_, 0));
   brillo::Blob blob(block_size_);
-  ssize_t bytes_read = 0;
-  if (!utils::PReadAll(fd, blob.data(), block_size_, byte_offset, &bytes_read))
+  if (!reader->Read(blob.data(), block_size_, byte_offset))
     return -1;
-  if (static_cast<size_t>(bytes_read) != block_size_)
-    return -1;
-  return AddBlock(fd, byte_offset, blob);
+  return AddBlock(reader, byte_offset, blob);
 }
 
-bool BlockMapping::AddManyDiskBlocks(int fd,
+bool BlockMapping::AddManyDiskBlocks(const PartitionReader* reader,
                                      off_t initial_byte_offset,
                                      size_t num_blocks,
                                      vector<BlockId>* block_ids) {
@@ -63,13 +64,13 @@ bool BlockMapping::AddManyDiskBlocks(int fd,
   block_ids->resize(num_blocks);
   for (size_t block = 0; block < num_blocks; block++) {
     (*block_ids)[block] =
-        AddDiskBlock(fd, initial_byte_offset + block * block_size_);
+        AddDiskBlock(reader, initial_byte_offset + block * block_size_);
     ret = ret && (*block_ids)[block] != -1;
   }
   return ret;
 }
 
-BlockMapping::BlockId BlockMapping::AddBlock(int fd,
+BlockMapping::BlockId BlockMapping::AddBlock(const PartitionReader* reader,
                                              off_t byte_offset,
                                              const brillo::Blob& block_data) {
   if (block_data.size() != block_size_)
@@ -101,11 +102,11 @@ BlockMapping::BlockId BlockMapping::AddBlock(int fd,
   UniqueBlock* new_ublock = &bucket->back();
 
   new_ublock->times_read = 1;
-  new_ublock->fd = fd;
+  new_ublock->reader = reader;
   new_ublock->byte_offset = byte_offset;
   new_ublock->block_id = used_block_ids++;
   // We need to cache blocks that are not referencing any disk location.
-  if (fd == -1)
+  if (!reader)
     new_ublock->block_data = block_data;
 
   return new_ublock->block_id;
@@ -119,10 +120,7 @@ bool BlockMapping::UniqueBlock::CompareData(const brillo::Blob& other_block,
   }
   const size_t block_size = other_block.size();
   brillo::Blob blob(block_size);
-  ssize_t bytes_read = 0;
-  if (!utils::PReadAll(fd, blob.data(), block_size, byte_offset, &bytes_read))
-    return false;
-  if (static_cast<size_t>(bytes_read) != block_size)
+  if (!reader->Read(blob.data(), block_size, byte_offset))
     return false;
   *equals = blob == other_block;
 
@@ -147,15 +145,21 @@ bool MapPartitionBlocks(const string& old_part,
   BlockMapping mapping(block_size);
   if (mapping.AddBlock(brillo::Blob(block_size, '\0')) != 0)
     return false;
-  int old_fd = HANDLE_EINTR(open(old_part.c_str(), O_RDONLY));
-  int new_fd = HANDLE_EINTR(open(new_part.c_str(), O_RDONLY));
-  ScopedFdCloser old_fd_closer(&old_fd);
-  ScopedFdCloser new_fd_closer(&new_fd);
+  // A partition without blocks may not have an image.
+  std::unique_ptr<PartitionReader> old_reader, new_reader;
+  if (old_size >= block_size) {
+    old_reader = PartitionReader::Open(old_part);
+    TEST_AND_RETURN_FALSE(old_reader);
+  }
+  if (new_size >= block_size) {
+    new_reader = PartitionReader::Open(new_part);
+    TEST_AND_RETURN_FALSE(new_reader);
+  }
 
   TEST_AND_RETURN_FALSE(mapping.AddManyDiskBlocks(
-      old_fd, 0, old_size / block_size, old_block_ids));
+      old_reader.get(), 0, old_size / block_size, old_block_ids));
   TEST_AND_RETURN_FALSE(mapping.AddManyDiskBlocks(
-      new_fd, 0, new_size / block_size, new_block_ids));
+      new_reader.get(), 0, new_size / block_size, new_block_ids));
   return true;
 }
 
@@ -24,6 +24,7 @@
 #include <brillo/secure_blob.h>
 #include <gtest/gtest_prod.h>  // for FRIEND_TEST
 
+#include "update_engine/payload_generator/partition_reader.h"
 #include "update_engine/payload_generator/payload_generation_config.h"
 
 namespace chromeos_update_engine {
@@ -43,17 +44,18 @@ class BlockMapping {
   // In case of error returns -1.
   BlockId AddBlock(const brillo::Blob& block_data);
 
-  // Add a block from disk reading it from the file descriptor |fd| from the
+  // Add a block from disk reading it from the partition |reader| from the
   // offset in bytes |byte_offset|. The data block may or may not be cached, so
-  // the file descriptor must be available until the BlockMapping is destroyed.
+  // the reader must be available until the BlockMapping is destroyed. Blocks
+  // the reader knows to be zeros are not read.
   // Returns the unique block id of the added block or -1 in case of error.
-  BlockId AddDiskBlock(int fd, off_t byte_offset);
+  BlockId AddDiskBlock(const PartitionReader* reader, off_t byte_offset);
 
   // This is a helper method to add |num_blocks| contiguous blocks reading them
-  // from the file descriptor |fd| starting at offset |initial_byte_offset|.
+  // from the partition |reader| starting at offset |initial_byte_offset|.
   // Returns whether it succeeded to add all the disk blocks and stores in
   // |block_ids| the block id for each one of the added blocks.
-  bool AddManyDiskBlocks(int fd,
+  bool AddManyDiskBlocks(const PartitionReader* reader,
                          off_t initial_byte_offset,
                          size_t num_blocks,
                          std::vector<BlockId>* block_ids);
@@ -61,10 +63,12 @@ class BlockMapping {
  private:
   FRIEND_TEST(BlockMappingTest, BlocksAreNotKeptInMemory);
 
-  // Add a single block passed in |block_data|. If |fd| is not -1, the block
-  // can be discarded to save RAM and retrieved later from |fd| at the position
-  // |byte_offset|.
-  BlockId AddBlock(int fd, off_t byte_offset, const brillo::Blob& block_data);
+  // Add a single block passed in |block_data|. If |reader| is not null, the
+  // block can be discarded to save RAM and retrieved later from |reader| at the
+  // position |byte_offset|.
+  BlockId AddBlock(const PartitionReader* reader,
+                   off_t byte_offset,
+                   const brillo::Blob& block_data);
 
   size_t block_size_;
 
@@ -79,7 +83,7 @@ class BlockMapping {
     BlockId block_id;
 
     // The location on this unique block on disk (if not cached in block_data).
-    int fd{-1};
+    const PartitionReader* reader{nullptr};
     off_t byte_offset{0};
 
     // Number of times we have seen this data block. Used for caching.
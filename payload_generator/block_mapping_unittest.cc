@@ -20,6 +20,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -55,10 +56,11 @@ TEST_F(BlockMappingTest, FirstAddedBlockIsZero) {
 
 TEST_F(BlockMappingTest, BlocksAreNotKeptInMemory) {
   test_utils::WriteFileString(old_part_.path(), string(block_size_, 'a'));
-  int old_fd = HANDLE_EINTR(open(old_part_.path().c_str(), O_RDONLY));
-  ScopedFdCloser old_fd_closer(&old_fd);
+  std::unique_ptr<PartitionReader> old_reader =
+      PartitionReader::Open(old_part_.path());
+  ASSERT_TRUE(old_reader);
 
-  EXPECT_EQ(0, bm_.AddDiskBlock(old_fd, 0));
+  EXPECT_EQ(0, bm_.AddDiskBlock(old_reader.get(), 0));
 
   // Check that the block_data is not stored on memory if we just used the block
   // once.
@@ -0,0 +1,269 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/compressibility.h"
+
+#include <inttypes.h>
+
+#include <algorithm>
+#include <cmath>
+#include <unordered_set>
+#include <vector>
+
+#include <base/strings/stringprintf.h>
+
+#include "update_engine/payload_generator/content_chunker.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The byte entropy is computed from this many samples of kEntropySampleSize
+// bytes, or from the whole data when it is smaller than that.
+const size_t kEntropySamples = 64;
+const size_t kEntropySampleSize = 1024;
+
+// The content anchors are sampled on average once every 2^kAnchorBits bytes.
+const int kAnchorBits = 8;
+
+// The thresholds of a CompressibilityFilter level. Data is considered
+// incompressible when its byte entropy is at least |min_entropy| and at most
+// |max_repeated| of its content repeats. A diff is considered hopeless when
+// the new data is incompressible and shares at most |max_shared| of its
+// content with the old data.
+struct FilterThresholds {
+  double min_entropy;
+  double max_repeated;
+  double max_shared;
+};
+
+const FilterThresholds kConservativeThresholds = {7.95, 0.01, 0.01};
+const FilterThresholds kAggressiveThresholds = {7.8, 0.05, 0.1};
+
+const FilterThresholds& GetThresholds(CompressibilityFilter filter) {
+  return filter == CompressibilityFilter::kAggressive ? kAggressiveThresholds
+                                                      : kConservativeThresholds;
+}
+
+double ByteEntropy(const brillo::Blob& data) {
+  uint64_t counts[256] = {};
+  uint64_t total = 0;
+  auto count_range = [&counts, &total, &data](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++)
+      counts[data[i]]++;
+    total += end - begin;
+  };
+  if (data.size() <= kEntropySamples * kEntropySampleSize) {
+    count_range(0, data.size());
+  } else {
+    size_t stride = data.size() / kEntropySamples;
+    for (size_t i = 0; i < kEntropySamples; i++)
+      count_range(i * stride, i * stride + kEntropySampleSize);
+  }
+  if (total == 0)
+    return 0;
+  double entropy = 0;
+  for (uint64_t count : counts) {
+    if (count == 0)
+      continue;
+    double p = static_cast<double>(count) / total;
+    entropy -= p * std::log2(p);
+  }
+  return entropy;
+}
+
+bool IsIncompressible(const CompressibilityEstimate& estimate,
+                      const FilterThresholds& thresholds) {
+  return estimate.entropy >= thresholds.min_entropy &&
+         estimate.repeated <= thresholds.max_repeated;
+}
+
+// Estimates the bytes compressing |size| bytes of data with |estimate| could
+// save: an entropy coder saves what the byte distribution wastes, and the
+// matches save the repeated content.
+uint64_t CompressionSaving(uint64_t size,
+                           const CompressibilityEstimate& estimate) {
+  return static_cast<uint64_t>(
+      size * std::max(1.0 - estimate.entropy / 8, estimate.repeated));
+}
+
+}  // namespace
+
+CompressibilityEstimate EstimateCompressibility(const brillo::Blob& data) {
+  CompressibilityEstimate estimate;
+  estimate.entropy = ByteEntropy(data);
+  vector<uint64_t> anchors = ContentAnchors(data, kAnchorBits);
+  if (!anchors.empty()) {
+    std::unordered_set<uint64_t> distinct(anchors.begin(), anchors.end());
+    estimate.repeated =
+        static_cast<double>(anchors.size() - distinct.size()) / anchors.size();
+  }
+  return estimate;
+}
+
+double SharedContentFraction(const brillo::Blob& old_data,
+                             const brillo::Blob& new_data) {
+  vector<uint64_t> new_anchors = ContentAnchors(new_data, kAnchorBits);
+  // Without anchors there is nothing to tell, assume everything is shared.
+  if (new_anchors.empty())
+    return 1.0;
+  vector<uint64_t> old_anchors = ContentAnchors(old_data, kAnchorBits);
+  std::unordered_set<uint64_t> old_set(old_anchors.begin(), old_anchors.end());
+  size_t shared = std::count_if(
+      new_anchors.begin(), new_anchors.end(), [&old_set](uint64_t anchor) {
+        return old_set.count(anchor) > 0;
+      });
+  return static_cast<double>(shared) / new_anchors.size();
+}
+
+bool ShouldSkipCompression(const brillo::Blob& data,
+                           CompressibilityFilter filter) {
+  if (filter == CompressibilityFilter::kOff)
+    return false;
+  base::TimeTicks start = base::TimeTicks::Now();
+  CompressibilityEstimate estimate = EstimateCompressibility(data);
+  bool skip = IsIncompressible(estimate, GetThresholds(filter));
+  CompressibilityStats::Get()->AddEstimate(base::TimeTicks::Now() - start);
+  if (skip) {
+    CompressibilityStats::Get()->AddMissedSaving(
+        CompressionSaving(data.size(), estimate));
+  }
+  return skip;
+}
+
+DiffFilter FilterDiffs(const brillo::Blob& old_data,
+                       const brillo::Blob& new_data,
+                       CompressibilityFilter filter) {
+  DiffFilter result;
+  if (filter == CompressibilityFilter::kOff)
+    return result;
+  base::TimeTicks start = base::TimeTicks::Now();
+  const FilterThresholds& thresholds = GetThresholds(filter);
+  uint64_t missed_saving = 0;
+  if (IsIncompressible(EstimateCompressibility(new_data), thresholds)) {
+    double shared = SharedContentFraction(old_data, new_data);
+    if (shared <= thresholds.max_shared) {
+      result.skip_raw_diffs = true;
+      // The decompressed streams may still be similar when the compressed
+      // ones aren't, so only the aggressive level gives up on them.
+      result.skip_decompressing_diffs =
+          filter == CompressibilityFilter::kAggressive;
+      // A diff saves at most the content shared with the old data.
+      missed_saving = static_cast<uint64_t>(new_data.size() * shared);
+    }
+  }
+  CompressibilityStats::Get()->AddEstimate(base::TimeTicks::Now() - start);
+  if (result.skip_raw_diffs)
+    CompressibilityStats::Get()->AddMissedSaving(missed_saving);
+  return result;
+}
+
+CompressibilityStats* CompressibilityStats::Get() {
+  static CompressibilityStats stats;
+  return &stats;
+}
+
+void CompressibilityStats::AddCompression(uint64_t bytes,
+                                          bool skipped,
+                                          base::TimeDelta duration) {
+  if (skipped) {
+    compressions_skipped_.fetch_add(1, std::memory_order_relaxed);
+    compression_bytes_skipped_.fetch_add(bytes, std::memory_order_relaxed);
+    return;
+  }
+  compressions_run_.fetch_add(1, std::memory_order_relaxed);
+  compression_bytes_run_.fetch_add(bytes, std::memory_order_relaxed);
+  compression_time_us_.fetch_add(duration.InMicroseconds(),
+                                 std::memory_order_relaxed);
+}
+
+void CompressibilityStats::AddDiff(uint64_t bytes,
+                                   bool skipped,
+                                   base::TimeDelta duration) {
+  if (skipped) {
+    diffs_skipped_.fetch_add(1, std::memory_order_relaxed);
+    diff_bytes_skipped_.fetch_add(bytes, std::memory_order_relaxed);
+    return;
+  }
+  diffs_run_.fetch_add(1, std::memory_order_relaxed);
+  diff_bytes_run_.fetch_add(bytes, std::memory_order_relaxed);
+  diff_time_us_.fetch_add(duration.InMicroseconds(),
+                          std::memory_order_relaxed);
+}
+
+void CompressibilityStats::AddEstimate(base::TimeDelta duration) {
+  estimate_time_us_.fetch_add(duration.InMicroseconds(),
+                              std::memory_order_relaxed);
+}
+
+void CompressibilityStats::AddMissedSaving(uint64_t bytes) {
+  missed_saving_bytes_.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void CompressibilityStats::Reset() {
+  compressions_run_ = 0;
+  compressions_skipped_ = 0;
+  compression_bytes_run_ = 0;
+  compression_bytes_skipped_ = 0;
+  compression_time_us_ = 0;
+  diffs_run_ = 0;
+  diffs_skipped_ = 0;
+  diff_bytes_run_ = 0;
+  diff_bytes_skipped_ = 0;
+  diff_time_us_ = 0;
+  estimate_time_us_ = 0;
+  missed_saving_bytes_ = 0;
+}
+
+base::TimeDelta CompressibilityStats::EstimatedTimeSaved() const {
+  // The skipped work would have run at the throughput of the work that ran.
+  auto extrapolate = [](uint64_t bytes_skipped,
+                        uint64_t bytes_run,
+                        int64_t time_us) -> double {
+    return bytes_run ? static_cast<double>(time_us) * bytes_skipped / bytes_run
+                     : 0;
+  };
+  double saved_us = extrapolate(compression_bytes_skipped_,
+                                compression_bytes_run_,
+                                compression_time_us_) +
+                    extrapolate(diff_bytes_skipped_,
+                                diff_bytes_run_,
+                                diff_time_us_) -
+                    estimate_time_us_;
+  return base::TimeDelta::FromMicroseconds(static_cast<int64_t>(saved_us));
+}
+
+string CompressibilityStats::ToString() const {
+  return base::StringPrintf(
+      "skipped the compression of %" PRIu64 " of %" PRIu64
+      " chunks (%" PRIu64 " bytes), the diffs of %" PRIu64 " of %" PRIu64
+      " chunks (%" PRIu64 " bytes); estimating took %.3fs and saved about "
+      "%.3fs, for up to about %" PRIu64 " more bytes of payload",
+      compressions_skipped_.load(),
+      compressions_skipped_.load() + compressions_run_.load(),
+      compression_bytes_skipped_.load(),
+      diffs_skipped_.load(),
+      diffs_skipped_.load() + diffs_run_.load(),
+      diff_bytes_skipped_.load(),
+      base::TimeDelta::FromMicroseconds(estimate_time_us_).InSecondsF(),
+      EstimatedTimeSaved().InSecondsF(),
+      missed_saving_bytes_.load());
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,146 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_COMPRESSIBILITY_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_COMPRESSIBILITY_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+
+#include <base/macros.h>
+#include <base/time/time.h>
+#include <brillo/secure_blob.h>
+
+// Cheap estimates of how compressible some data is, used by the payload
+// generator to skip the compressors and the diff algorithms that are unlikely
+// to beat storing already compressed data (media, stored APK entries,
+// squashfs blocks) as is.
+
+namespace chromeos_update_engine {
+
+// How aggressively the compressors and the diff algorithms are skipped.
+enum class CompressibilityFilter {
+  // Always try all of them.
+  kOff = 0,
+  // Skip them when the data looks random, where they almost never win.
+  kConservative = 1,
+  // Also skip them when the data looks mostly random, and skip the diffs that
+  // decompress the data as well. This trades a slightly bigger payload for a
+  // faster generation.
+  kAggressive = 2,
+};
+
+struct CompressibilityEstimate {
+  // The entropy of the distribution of the byte values, in bits per byte,
+  // from samples spread evenly across the data.
+  double entropy{0};
+
+  // The fraction of the content anchors of the data that appeared earlier in
+  // it, that is, the repetitions longer than a few dozen bytes which the
+  // entropy of the bytes doesn't see.
+  double repeated{0};
+};
+
+// Estimates the compressibility of |data| in a single pass, much faster than
+// any compressor.
+CompressibilityEstimate EstimateCompressibility(const brillo::Blob& data);
+
+// Returns the fraction of the content anchors of |new_data| also found in
+// |old_data|, which estimates how much of the new data a diff can take from
+// the old data.
+double SharedContentFraction(const brillo::Blob& old_data,
+                             const brillo::Blob& new_data);
+
+// Returns whether compressing |data| is unlikely to help with |filter|.
+bool ShouldSkipCompression(const brillo::Blob& data,
+                           CompressibilityFilter filter);
+
+// The diff algorithms to skip to produce some new data from some old data.
+struct DiffFilter {
+  // bsdiff and ZSTD_DIFF, which diff the data as is.
+  bool skip_raw_diffs{false};
+  // PUFFDIFF and LZ4DIFF, which diff the decompressed streams in the data.
+  bool skip_decompressing_diffs{false};
+};
+
+// Returns the diffs of |old_data| and |new_data| unlikely to beat storing
+// |new_data| as is with |filter|.
+DiffFilter FilterDiffs(const brillo::Blob& old_data,
+                       const brillo::Blob& new_data,
+                       CompressibilityFilter filter);
+
+// CompressibilityStats accumulates how much work the filter saved while
+// generating a payload. The compressions and diffs that ran give the
+// throughput used to estimate the time the skipped ones would have taken.
+// The counters are atomic, so they can be updated from the worker threads.
+class CompressibilityStats {
+ public:
+  // Returns the stats of this process.
+  static CompressibilityStats* Get();
+
+  CompressibilityStats() = default;
+
+  // Records the compressions of |bytes| of data for a full operation, which
+  // were either skipped or took |duration|.
+  void AddCompression(uint64_t bytes, bool skipped, base::TimeDelta duration);
+
+  // Records the diffs producing |bytes| of new data. Either the diffs of the
+  // data as is were skipped, or all the diffs took |duration|.
+  void AddDiff(uint64_t bytes, bool skipped, base::TimeDelta duration);
+
+  // Records the |duration| of an estimate.
+  void AddEstimate(base::TimeDelta duration);
+
+  // Records the estimated |bytes| a skipped compression or diff could have
+  // saved from the payload.
+  void AddMissedSaving(uint64_t bytes);
+
+  // Resets all the counters.
+  void Reset();
+
+  // Returns a human readable summary of the counters.
+  std::string ToString() const;
+
+  // Returns the time the skipped work would have taken at the throughput of
+  // the work that ran, minus the time spent estimating.
+  base::TimeDelta EstimatedTimeSaved() const;
+
+  uint64_t compressions_skipped() const { return compressions_skipped_; }
+  uint64_t diffs_skipped() const { return diffs_skipped_; }
+  uint64_t missed_saving_bytes() const { return missed_saving_bytes_; }
+
+ private:
+  std::atomic<uint64_t> compressions_run_{0};
+  std::atomic<uint64_t> compressions_skipped_{0};
+  std::atomic<uint64_t> compression_bytes_run_{0};
+  std::atomic<uint64_t> compression_bytes_skipped_{0};
+  std::atomic<int64_t> compression_time_us_{0};
+  std::atomic<uint64_t> diffs_run_{0};
+  std::atomic<uint64_t> diffs_skipped_{0};
+  std::atomic<uint64_t> diff_bytes_run_{0};
+  std::atomic<uint64_t> diff_bytes_skipped_{0};
+  std::atomic<int64_t> diff_time_us_{0};
+  std::atomic<int64_t> estimate_time_us_{0};
+  std::atomic<uint64_t> missed_saving_bytes_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(CompressibilityStats);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_COMPRESSIBILITY_H_
@@ -0,0 +1,150 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/compressibility.h"
+
+#include <random>
+#include <string>
+
+#include <gtest/gtest.h>
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Returns |size| bytes of random data.
+brillo::Blob RandomData(size_t size, uint32_t seed) {
+  std::mt19937 rng(seed);
+  brillo::Blob data(size);
+  for (auto& byte : data)
+    byte = rng();
+  return data;
+}
+
+// Returns |size| bytes of English-like text.
+brillo::Blob TextData(size_t size) {
+  const std::string kText =
+      "The quick brown fox jumps over the lazy dog while the update engine "
+      "applies the payload. ";
+  brillo::Blob data;
+  for (size_t i = 0; data.size() < size; i++)
+    data.push_back(kText[(i * 7) % kText.size()]);
+  return data;
+}
+
+}  // namespace
+
+class CompressibilityTest : public ::testing::Test {
+ protected:
+  void SetUp() override { CompressibilityStats::Get()->Reset(); }
+};
+
+TEST_F(CompressibilityTest, EstimateTest) {
+  CompressibilityEstimate random =
+      EstimateCompressibility(RandomData(1024 * 1024, 1));
+  EXPECT_LT(7.95, random.entropy);
+  EXPECT_GT(0.01, random.repeated);
+
+  CompressibilityEstimate text = EstimateCompressibility(TextData(64 * 1024));
+  EXPECT_GT(6.0, text.entropy);
+
+  // Random data repeated twice has the same byte distribution but half of its
+  // content repeats.
+  brillo::Blob once = RandomData(256 * 1024, 1);
+  brillo::Blob twice = once;
+  twice.insert(twice.end(), once.begin(), once.end());
+  CompressibilityEstimate repeated = EstimateCompressibility(twice);
+  EXPECT_LT(7.95, repeated.entropy);
+  EXPECT_LT(0.4, repeated.repeated);
+
+  CompressibilityEstimate empty = EstimateCompressibility(brillo::Blob());
+  EXPECT_EQ(0, empty.entropy);
+  EXPECT_EQ(0, empty.repeated);
+}
+
+TEST_F(CompressibilityTest, SkipCompressionTest) {
+  brillo::Blob random = RandomData(256 * 1024, 1);
+  EXPECT_FALSE(ShouldSkipCompression(random, CompressibilityFilter::kOff));
+  EXPECT_TRUE(
+      ShouldSkipCompression(random, CompressibilityFilter::kConservative));
+  // Compressing random data could hardly have saved anything.
+  EXPECT_GT(random.size() / 100,
+            CompressibilityStats::Get()->missed_saving_bytes());
+  EXPECT_TRUE(
+      ShouldSkipCompression(random, CompressibilityFilter::kAggressive));
+
+  brillo::Blob text = TextData(256 * 1024);
+  EXPECT_FALSE(
+      ShouldSkipCompression(text, CompressibilityFilter::kConservative));
+  EXPECT_FALSE(ShouldSkipCompression(text, CompressibilityFilter::kAggressive));
+
+  brillo::Blob once = RandomData(128 * 1024, 1);
+  brillo::Blob twice = once;
+  twice.insert(twice.end(), once.begin(), once.end());
+  EXPECT_FALSE(
+      ShouldSkipCompression(twice, CompressibilityFilter::kAggressive));
+}
+
+TEST_F(CompressibilityTest, FilterDiffsTest) {
+  brillo::Blob old_data = RandomData(256 * 1024, 1);
+  brillo::Blob unrelated = RandomData(256 * 1024, 2);
+
+  DiffFilter filter =
+      FilterDiffs(old_data, unrelated, CompressibilityFilter::kConservative);
+  EXPECT_TRUE(filter.skip_raw_diffs);
+  EXPECT_FALSE(filter.skip_decompressing_diffs);
+
+  filter = FilterDiffs(old_data, unrelated, CompressibilityFilter::kAggressive);
+  EXPECT_TRUE(filter.skip_raw_diffs);
+  EXPECT_TRUE(filter.skip_decompressing_diffs);
+
+  filter = FilterDiffs(old_data, unrelated, CompressibilityFilter::kOff);
+  EXPECT_FALSE(filter.skip_raw_diffs);
+  EXPECT_FALSE(filter.skip_decompressing_diffs);
+
+  // A few bytes inserted in random data, like a stored file of an archive
+  // that moved, still diff well.
+  brillo::Blob shifted(old_data.begin(), old_data.begin() + 1000);
+  shifted.insert(shifted.end(), 100, 'x');
+  shifted.insert(shifted.end(), old_data.begin() + 1000, old_data.end());
+  EXPECT_LT(0.9, SharedContentFraction(old_data, shifted));
+  filter = FilterDiffs(old_data, shifted, CompressibilityFilter::kAggressive);
+  EXPECT_FALSE(filter.skip_raw_diffs);
+  EXPECT_FALSE(filter.skip_decompressing_diffs);
+}
+
+TEST_F(CompressibilityTest, StatsTest) {
+  CompressibilityStats* stats = CompressibilityStats::Get();
+  stats->AddCompression(1000, false, base::TimeDelta::FromSeconds(1));
+  stats->AddCompression(3000, true, base::TimeDelta());
+  stats->AddDiff(2000, false, base::TimeDelta::FromSeconds(2));
+  stats->AddDiff(1000, true, base::TimeDelta());
+  stats->AddEstimate(base::TimeDelta::FromMilliseconds(500));
+  stats->AddMissedSaving(100);
+  EXPECT_EQ(1U, stats->compressions_skipped());
+  EXPECT_EQ(100U, stats->missed_saving_bytes());
+  EXPECT_EQ(1U, stats->diffs_skipped());
+  // 3 seconds of compression and 1 second of diff, minus the estimate.
+  EXPECT_EQ(base::TimeDelta::FromMilliseconds(3500),
+            stats->EstimatedTimeSaved());
+
+  stats->Reset();
+  EXPECT_EQ(0U, stats->compressions_skipped());
+  EXPECT_EQ(0U, stats->missed_saving_bytes());
+  EXPECT_EQ(base::TimeDelta(), stats->EstimatedTimeSaved());
+}
+
+}  // namespace chromeos_update_engine
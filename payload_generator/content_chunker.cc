@@ -0,0 +1,216 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/content_chunker.h"
+
+#include <algorithm>
+#include <array>
+#include <map>
+#include <set>
+#include <unordered_map>
+
+#include "update_engine/payload_generator/extent_utils.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The rolling hash only depends on the last 64 bytes, since every byte shifts
+// the previous ones out by one bit.
+const size_t kHashWindowSize = 64;
+
+// Anchors, the hash values used to compare the content of the chunks, are
+// sampled on average once every 2^kAnchorBits bytes.
+const int kAnchorBits = 10;
+
+// Anchors found in more old chunks than this, like those of zeroed or padding
+// data, don't tell the chunks apart and are ignored.
+const size_t kMaxChunksPerAnchor = 8;
+
+// The random values of the gear rolling hash, one per byte value.
+using GearTable = std::array<uint64_t, 256>;
+
+// Returns the gear table. The values are generated with splitmix64 so the
+// chunks are the same on every run.
+const GearTable& GetGearTable() {
+  static const GearTable table = [] {
+    GearTable values;
+    uint64_t state = 0;
+    for (uint64_t& value : values) {
+      state += 0x9e3779b97f4a7c15ULL;
+      uint64_t z = state;
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+      value = z ^ (z >> 31);
+    }
+    return values;
+  }();
+  return table;
+}
+
+inline uint64_t RollHash(const GearTable& gear, uint64_t hash, uint8_t byte) {
+  return (hash << 1) + gear[byte];
+}
+
+// Returns a mask selecting the |bits| most significant bits, which depend on
+// the whole hash window.
+inline uint64_t TopBitsMask(int bits) {
+  return bits <= 0 ? 0 : ~0ULL << (64 - bits);
+}
+
+// Returns the hash of the window of data ending right before |pos|.
+uint64_t HashBefore(const GearTable& gear,
+                    const brillo::Blob& data,
+                    size_t pos) {
+  uint64_t hash = 0;
+  for (size_t i = pos - std::min(pos, kHashWindowSize); i < pos; i++)
+    hash = RollHash(gear, hash, data[i]);
+  return hash;
+}
+
+// Returns the distinct anchors found in |chunk| of |data|.
+std::set<uint64_t> ChunkAnchors(const brillo::Blob& data,
+                                const Extent& chunk,
+                                size_t block_size) {
+  std::set<uint64_t> anchors;
+  size_t start = chunk.start_block() * block_size;
+  size_t end = std::min(
+      data.size(),
+      static_cast<size_t>(chunk.start_block() + chunk.num_blocks()) *
+          block_size);
+  if (start >= end)
+    return anchors;
+  const GearTable& gear = GetGearTable();
+  uint64_t mask = TopBitsMask(kAnchorBits);
+  uint64_t hash = HashBefore(gear, data, start);
+  for (size_t i = start; i < end; i++) {
+    hash = RollHash(gear, hash, data[i]);
+    if (i + 1 - start >= kHashWindowSize && (hash & mask) == 0)
+      anchors.insert(hash);
+  }
+  return anchors;
+}
+
+}  // namespace
+
+vector<Extent> ContentDefinedChunks(const brillo::Blob& data,
+                                    size_t block_size,
+                                    uint64_t max_chunk_blocks) {
+  vector<Extent> chunks;
+  uint64_t total_blocks = (data.size() + block_size - 1) / block_size;
+  max_chunk_blocks = std::max<uint64_t>(max_chunk_blocks, 1);
+  // The chunks are at least a quarter of the maximum size, and the boundary
+  // after that is expected within another quarter.
+  uint64_t min_chunk_blocks = std::max<uint64_t>(max_chunk_blocks / 4, 1);
+  int boundary_bits = 0;
+  while ((1ULL << (boundary_bits + 1)) <= min_chunk_blocks * block_size)
+    boundary_bits++;
+  uint64_t mask = TopBitsMask(boundary_bits);
+  const GearTable& gear = GetGearTable();
+
+  uint64_t start_block = 0;
+  while (start_block < total_blocks) {
+    uint64_t end_block = std::min(start_block + max_chunk_blocks, total_blocks);
+    if (min_chunk_blocks < max_chunk_blocks &&
+        start_block + min_chunk_blocks < end_block) {
+      // Look for the first boundary past the minimum chunk size, and end the
+      // chunk at the block containing it.
+      size_t scan_start = (start_block + min_chunk_blocks) * block_size;
+      size_t scan_end =
+          std::min(data.size(), static_cast<size_t>(end_block * block_size));
+      uint64_t hash = HashBefore(gear, data, scan_start);
+      for (size_t i = scan_start; i < scan_end; i++) {
+        hash = RollHash(gear, hash, data[i]);
+        if ((hash & mask) == 0) {
+          end_block = i / block_size + 1;
+          break;
+        }
+      }
+    }
+    chunks.push_back(ExtentForRange(start_block, end_block - start_block));
+    start_block = end_block;
+  }
+  return chunks;
+}
+
+vector<ssize_t> MatchChunks(const brillo::Blob& old_data,
+                            const vector<Extent>& old_chunks,
+                            const brillo::Blob& new_data,
+                            const vector<Extent>& new_chunks,
+                            size_t block_size) {
+  vector<ssize_t> matches(new_chunks.size(), -1);
+  if (old_chunks.empty())
+    return matches;
+
+  std::unordered_map<uint64_t, vector<size_t>> old_anchors;
+  for (size_t i = 0; i < old_chunks.size(); i++) {
+    for (uint64_t anchor : ChunkAnchors(old_data, old_chunks[i], block_size))
+      old_anchors[anchor].push_back(i);
+  }
+
+  ssize_t last_match = -1;
+  for (size_t i = 0; i < new_chunks.size(); i++) {
+    // The number of anchors shared with each old chunk.
+    std::map<size_t, size_t> scores;
+    for (uint64_t anchor : ChunkAnchors(new_data, new_chunks[i], block_size)) {
+      auto it = old_anchors.find(anchor);
+      if (it == old_anchors.end() || it->second.size() > kMaxChunksPerAnchor)
+        continue;
+      for (size_t old_index : it->second)
+        scores[old_index]++;
+    }
+
+    // On ties, prefer the old chunk closest to the one after the last match,
+    // which keeps the chunks in order when the content repeats.
+    size_t expected = last_match + 1;
+    auto distance = [expected](size_t index) {
+      return index > expected ? index - expected : expected - index;
+    };
+    ssize_t best = -1;
+    size_t best_score = 0;
+    for (const auto& score : scores) {
+      if (best < 0 || score.second > best_score ||
+          (score.second == best_score &&
+           distance(score.first) < distance(best))) {
+        best = score.first;
+        best_score = score.second;
+      }
+    }
+    if (best < 0 && expected < old_chunks.size())
+      best = expected;
+    matches[i] = best;
+    if (best >= 0)
+      last_match = best;
+  }
+  return matches;
+}
+
+vector<uint64_t> ContentAnchors(const brillo::Blob& data, int anchor_bits) {
+  vector<uint64_t> anchors;
+  const GearTable& gear = GetGearTable();
+  uint64_t mask = TopBitsMask(anchor_bits);
+  uint64_t hash = 0;
+  for (size_t i = 0; i < data.size(); i++) {
+    hash = RollHash(gear, hash, data[i]);
+    if (i + 1 >= kHashWindowSize && (hash & mask) == 0)
+      anchors.push_back(hash);
+  }
+  return anchors;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,63 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_CONTENT_CHUNKER_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_CONTENT_CHUNKER_H_
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+// Utility functions to split large files in chunks whose boundaries depend on
+// the content instead of fixed offsets, so that data inserted or removed in
+// the new version of a file only changes the chunks around it.
+
+namespace chromeos_update_engine {
+
+// Splits the |data| of a file in chunks of whole blocks of |block_size| bytes
+// and at most |max_chunk_blocks| blocks. The chunk boundaries are found with a
+// rolling hash of the data, and are at |max_chunk_blocks| / 2 blocks from
+// each other on average. The returned chunks are expressed as Extents relative
+// to the beginning of the file, and cover all of it.
+std::vector<Extent> ContentDefinedChunks(const brillo::Blob& data,
+                                         size_t block_size,
+                                         uint64_t max_chunk_blocks);
+
+// Returns, for each chunk in |new_chunks| of |new_data|, the index in
+// |old_chunks| of the chunk of |old_data| that shares the most content with
+// it, or -1 if there are no old chunks. A new chunk sharing nothing with the
+// old chunks is paired with the old chunk after the one paired with the
+// previous new chunk, if any.
+std::vector<ssize_t> MatchChunks(const brillo::Blob& old_data,
+                                 const std::vector<Extent>& old_chunks,
+                                 const brillo::Blob& new_data,
+                                 const std::vector<Extent>& new_chunks,
+                                 size_t block_size);
+
+// Returns the anchors of |data|, in order: hashes of its content sampled on
+// average once every 2^|anchor_bits| bytes, at positions that only depend on
+// the content. The same content yields the same anchors wherever it is, so
+// comparing anchors estimates how much content two buffers share.
+std::vector<uint64_t> ContentAnchors(const brillo::Blob& data, int anchor_bits);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_CONTENT_CHUNKER_H_
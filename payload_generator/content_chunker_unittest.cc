@@ -0,0 +1,161 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#include "update_engine/payload_generator/content_chunker.h"
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const size_t kBlockSize = 4096;
+const uint64_t kMaxChunkBlocks = 512;
+
+// Returns |num_blocks| blocks of random data.
+brillo::Blob RandomData(size_t num_blocks) {
+  std::mt19937 rng(1);
+  brillo::Blob data(num_blocks * kBlockSize);
+  for (auto& byte : data)
+    byte = rng();
+  return data;
+}
+
+}  // namespace
+
+class ContentChunkerTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    old_data_ = RandomData(4000);
+    // Insert 1000 bytes near the beginning of the new file, which shifts all
+    // the data after them by less than a block.
+    new_data_.assign(old_data_.begin(), old_data_.begin() + 100);
+    new_data_.insert(new_data_.end(), 1000, 'x');
+    new_data_.insert(new_data_.end(), old_data_.begin() + 100, old_data_.end());
+    new_data_.resize(old_data_.size() + kBlockSize);
+  }
+
+  // Checks that |chunks| are contiguous, cover |data| and are not bigger than
+  // |max_chunk_blocks|.
+  void ExpectValidChunks(const vector<Extent>& chunks,
+                         const brillo::Blob& data,
+                         uint64_t max_chunk_blocks) {
+    uint64_t next_block = 0;
+    for (const Extent& chunk : chunks) {
+      EXPECT_EQ(next_block, chunk.start_block());
+      EXPECT_LT(0U, chunk.num_blocks());
+      EXPECT_GE(max_chunk_blocks, chunk.num_blocks());
+      next_block += chunk.num_blocks();
+    }
+    EXPECT_EQ(data.size() / kBlockSize, next_block);
+  }
+
+  brillo::Blob old_data_;
+  brillo::Blob new_data_;
+};
+
+TEST_F(ContentChunkerTest, ChunksCoverDataTest) {
+  vector<Extent> chunks =
+      ContentDefinedChunks(old_data_, kBlockSize, kMaxChunkBlocks);
+  ExpectValidChunks(chunks, old_data_, kMaxChunkBlocks);
+  // The chunks are not all split at the maximum size.
+  EXPECT_LT(old_data_.size() / kBlockSize / kMaxChunkBlocks + 1,
+            chunks.size());
+}
+
+TEST_F(ContentChunkerTest, ZerosTest) {
+  brillo::Blob zeros(100 * kBlockSize);
+  vector<Extent> chunks = ContentDefinedChunks(zeros, kBlockSize, 16);
+  ExpectValidChunks(chunks, zeros, 16);
+}
+
+TEST_F(ContentChunkerTest, InsertionKeepsBoundariesTest) {
+  vector<Extent> old_chunks =
+      ContentDefinedChunks(old_data_, kBlockSize, kMaxChunkBlocks);
+  vector<Extent> new_chunks =
+      ContentDefinedChunks(new_data_, kBlockSize, kMaxChunkBlocks);
+  ExpectValidChunks(new_chunks, new_data_, kMaxChunkBlocks);
+  ASSERT_EQ(old_chunks.size(), new_chunks.size());
+  // The chunks after the inserted data end at the same content, in the block
+  // containing it, so they only differ by a block at most. Fixed size chunks
+  // would all be shifted instead.
+  for (size_t i = 1; i < old_chunks.size(); i++) {
+    EXPECT_NEAR(static_cast<double>(old_chunks[i].num_blocks()),
+                static_cast<double>(new_chunks[i].num_blocks()),
+                1);
+  }
+}
+
+TEST_F(ContentChunkerTest, MatchChunksTest) {
+  vector<Extent> old_chunks =
+      ContentDefinedChunks(old_data_, kBlockSize, kMaxChunkBlocks);
+  vector<Extent> new_chunks =
+      ContentDefinedChunks(new_data_, kBlockSize, kMaxChunkBlocks);
+  vector<ssize_t> matches =
+      MatchChunks(old_data_, old_chunks, new_data_, new_chunks, kBlockSize);
+  ASSERT_EQ(new_chunks.size(), matches.size());
+  for (size_t i = 0; i < matches.size(); i++)
+    EXPECT_EQ(static_cast<ssize_t>(i), matches[i]);
+}
+
+TEST_F(ContentChunkerTest, MatchMovedChunkTest) {
+  vector<Extent> old_chunks =
+      ContentDefinedChunks(old_data_, kBlockSize, kMaxChunkBlocks);
+  ASSERT_LT(3U, old_chunks.size());
+  // The new file only has the data of the third old chunk.
+  const Extent& old_chunk = old_chunks[2];
+  brillo::Blob new_data(
+      old_data_.begin() + old_chunk.start_block() * kBlockSize,
+      old_data_.begin() +
+          (old_chunk.start_block() + old_chunk.num_blocks()) * kBlockSize);
+  vector<Extent> new_chunks =
+      ContentDefinedChunks(new_data, kBlockSize, kMaxChunkBlocks);
+  vector<ssize_t> matches =
+      MatchChunks(old_data_, old_chunks, new_data, new_chunks, kBlockSize);
+  ASSERT_FALSE(matches.empty());
+  EXPECT_EQ(2, matches[0]);
+}
+
+TEST_F(ContentChunkerTest, MatchWithoutOldChunksTest) {
+  vector<Extent> new_chunks =
+      ContentDefinedChunks(new_data_, kBlockSize, kMaxChunkBlocks);
+  vector<ssize_t> matches =
+      MatchChunks(brillo::Blob(), {}, new_data_, new_chunks, kBlockSize);
+  EXPECT_EQ(vector<ssize_t>(new_chunks.size(), -1), matches);
+}
+
+TEST_F(ContentChunkerTest, AnchorsIgnoreShiftsTest) {
+  vector<uint64_t> old_anchors = ContentAnchors(old_data_, 8);
+  vector<uint64_t> new_anchors = ContentAnchors(new_data_, 8);
+  // About one anchor every 256 bytes.
+  EXPECT_LT(old_data_.size() / 512, old_anchors.size());
+  EXPECT_GT(old_data_.size() / 128, old_anchors.size());
+  // Past the inserted data, the new anchors are the old ones.
+  ASSERT_LT(10U, new_anchors.size());
+  EXPECT_NE(old_anchors.end(),
+            std::find(old_anchors.begin(),
+                      old_anchors.end(),
+                      new_anchors[new_anchors.size() / 2]));
+}
+
+}  // namespace chromeos_update_engine
@@ -17,6 +17,7 @@
 #include "update_engine/payload_generator/deflate_utils.h"
 
 #include <algorithm>
+#include <memory>
 #include <string>
 #include <utility>
 
@@ -28,6 +29,7 @@
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/partition_reader.h"
 #include "update_engine/payload_generator/squashfs_filesystem.h"
 #include "update_engine/update_metadata.pb.h"
 
@@ -51,7 +53,7 @@ bool CopyExtentsToFile(const string& in_path,
                        size_t block_size) {
   brillo::Blob data(utils::BlocksInExtents(extents) * block_size);
   TEST_AND_RETURN_FALSE(
-      utils::ReadExtents(in_path, extents, &data, data.size(), block_size));
+      ReadPartitionExtents(in_path, extents, &data, data.size(), block_size));
   TEST_AND_RETURN_FALSE(
       utils::WriteFile(out_path.c_str(), data.data(), data.size()));
   return true;
@@ -264,6 +266,8 @@ bool PreprocessPartitionFiles(const PartitionConfig& part,
   part.fs_interface->GetFiles(&tmp_files);
   result_files->reserve(tmp_files.size());
 
+  // The image is only opened once to read all the compressed files.
+  std::unique_ptr<PartitionReader> reader;
   for (auto& file : tmp_files) {
     if (IsSquashfsImage(part.path, file)) {
       // Read the image into a file.
@@ -303,9 +307,13 @@ bool PreprocessPartitionFiles(const PartitionConfig& part,
           file.name, {".apk", ".zip", ".jar", ".zvoice", ".apex"});
       bool is_gzip = IsFileExtensions(file.name, {".gz", ".gzip", ".tgz"});
       if (is_zip || is_gzip) {
+        if (!reader) {
+          reader = PartitionReader::Open(part.path);
+          TEST_AND_RETURN_FALSE(reader);
+        }
         brillo::Blob data;
-        TEST_AND_RETURN_FALSE(utils::ReadExtents(
-            part.path,
+        TEST_AND_RETURN_FALSE(ReadPartitionExtents(
+            *reader,
             file.extents,
             &data,
             kBlockSize * utils::BlocksInExtents(file.extents),
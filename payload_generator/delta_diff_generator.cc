@@ -23,22 +23,28 @@
 #include <sys/types.h>
 
 #include <algorithm>
+#include <iterator>
 #include <memory>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include <base/logging.h>
+#include <base/time/time.h>
 
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/delta_performer.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_generator/ab_generator.h"
 #include "update_engine/payload_generator/blob_file_writer.h"
+#include "update_engine/payload_generator/compressibility.h"
 #include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/extent_utils.h"
 #include "update_engine/payload_generator/full_update_generator.h"
 #include "update_engine/payload_generator/inplace_generator.h"
 #include "update_engine/payload_generator/payload_file.h"
+#include "update_engine/payload_generator/payload_shard.h"
 
 using std::string;
 using std::unique_ptr;
@@ -59,6 +65,10 @@ bool GenerateUpdatePayloadFile(const PayloadGenerationConfig& config,
                << "." << config.version.minor;
     return false;
   }
+  if (config.shard.IsSharded()) {
+    LOG(ERROR) << "The shards of a payload are generated separately.";
+    return false;
+  }
 
   // Create empty payload file object.
   PayloadFile payload;
@@ -105,11 +115,25 @@ bool GenerateUpdatePayloadFile(const PayloadGenerationConfig& config,
         strategy.reset(new FullUpdateGenerator());
       }
 
+      CompressibilityStats::Get()->Reset();
+      base::TimeTicks start_time = base::TimeTicks::Now();
+      off_t start_data_size = data_file_size;
+
       vector<AnnotatedOperation> aops;
       // Generate the operations using the strategy we selected above.
       TEST_AND_RETURN_FALSE(strategy->GenerateOperations(
           config, old_part, new_part, &blob_file, &aops));
 
+      LOG(INFO) << "Generated " << new_part.name << " in "
+                << utils::FormatTimeDelta(base::TimeTicks::Now() - start_time)
+                << " with " << data_file_size - start_data_size
+                << " bytes of data.";
+      if (config.version.compressibility_filter !=
+          CompressibilityFilter::kOff) {
+        LOG(INFO) << "Compressibility filter of " << new_part.name << ": "
+                  << CompressibilityStats::Get()->ToString();
+      }
+
       // Filter the no-operations. OperationsGenerators should not output this
       // kind of operations normally, but this is an extra step to fix that if
       // happened.
@@ -129,4 +153,163 @@ bool GenerateUpdatePayloadFile(const PayloadGenerationConfig& config,
   return true;
 }
 
+bool GenerateUpdatePayloadShard(const PayloadGenerationConfig& config,
+                                const string& output_path) {
+  if (!config.is_delta || config.version.InplaceUpdate()) {
+    LOG(ERROR) << "Only A/B delta payloads can be generated in shards.";
+    return false;
+  }
+  TEST_AND_RETURN_FALSE(config.source.partitions.size() ==
+                        config.target.partitions.size());
+  string fingerprint;
+  TEST_AND_RETURN_FALSE(PayloadShardFingerprint(config, &fingerprint));
+
+  const string kTempFileTemplate("CrAU_temp_data.XXXXXX");
+  string temp_file_path;
+  int data_file_fd;
+  TEST_AND_RETURN_FALSE(
+      utils::MakeTempFile(kTempFileTemplate, &temp_file_path, &data_file_fd));
+  ScopedPathUnlinker temp_file_unlinker(temp_file_path);
+  TEST_AND_RETURN_FALSE(data_file_fd >= 0);
+
+  vector<ShardPartition> partitions;
+  {
+    off_t data_file_size = 0;
+    ScopedFdCloser data_file_fd_closer(&data_file_fd);
+    BlobFileWriter blob_file(data_file_fd, &data_file_size);
+    for (size_t i = 0; i < config.target.partitions.size(); i++) {
+      const PartitionConfig& old_part = config.source.partitions[i];
+      const PartitionConfig& new_part = config.target.partitions[i];
+      ShardPartition partition;
+      partition.name = new_part.name;
+      // The partitions without a source are generated when merging.
+      if (!old_part.path.empty()) {
+        LOG(INFO) << "Generating shard " << config.shard.index << "/"
+                  << config.shard.count << " of " << new_part.name;
+        TEST_AND_RETURN_FALSE(ABGenerator::GenerateShardOperations(
+            config, old_part, new_part, &blob_file, &partition.aops));
+      }
+      partitions.push_back(std::move(partition));
+    }
+  }
+
+  TEST_AND_RETURN_FALSE(WritePayloadShard(
+      output_path, config.shard, fingerprint, partitions, temp_file_path));
+  LOG(INFO) << "All done. Successfully created shard file " << output_path;
+  return true;
+}
+
+bool MergeUpdatePayloadShards(const PayloadGenerationConfig& config,
+                              const vector<string>& shard_paths,
+                              const string& output_path,
+                              const string& private_key_path,
+                              uint64_t* metadata_size) {
+  if (!config.version.Validate()) {
+    LOG(ERROR) << "Unsupported major.minor version: " << config.version.major
+               << "." << config.version.minor;
+    return false;
+  }
+  if (!config.is_delta || config.version.InplaceUpdate()) {
+    LOG(ERROR) << "Only A/B delta payloads can be generated in shards.";
+    return false;
+  }
+  TEST_AND_RETURN_FALSE(config.source.partitions.size() ==
+                        config.target.partitions.size());
+  string fingerprint;
+  TEST_AND_RETURN_FALSE(PayloadShardFingerprint(config, &fingerprint));
+
+  PayloadFile payload;
+  TEST_AND_RETURN_FALSE(payload.Init(config));
+
+  const string kTempFileTemplate("CrAU_temp_data.XXXXXX");
+  string temp_file_path;
+  int data_file_fd;
+  TEST_AND_RETURN_FALSE(
+      utils::MakeTempFile(kTempFileTemplate, &temp_file_path, &data_file_fd));
+  ScopedPathUnlinker temp_file_unlinker(temp_file_path);
+  TEST_AND_RETURN_FALSE(data_file_fd >= 0);
+
+  {
+    off_t data_file_size = 0;
+    ScopedFdCloser data_file_fd_closer(&data_file_fd);
+    BlobFileWriter blob_file(data_file_fd, &data_file_size);
+
+    // The operations of each shard, by shard index.
+    vector<vector<ShardPartition>> shards(shard_paths.size());
+    vector<bool> shard_read(shard_paths.size(), false);
+    for (const string& shard_path : shard_paths) {
+      PayloadShard shard;
+      string shard_fingerprint;
+      vector<ShardPartition> partitions;
+      TEST_AND_RETURN_FALSE(ReadPayloadShard(
+          shard_path, &blob_file, &shard, &shard_fingerprint, &partitions));
+      if (shard_fingerprint != fingerprint) {
+        LOG(ERROR) << shard_path << " was generated from other images or "
+                   << "options:\n"
+                   << shard_fingerprint << "instead of:\n"
+                   << fingerprint;
+        return false;
+      }
+      if (shard.count != shard_paths.size() || shard_read[shard.index]) {
+        LOG(ERROR) << shard_path << " is the shard " << shard.index << "/"
+                   << shard.count << ", but " << shard_paths.size()
+                   << " different shards are needed.";
+        return false;
+      }
+      TEST_AND_RETURN_FALSE(partitions.size() ==
+                            config.target.partitions.size());
+      for (size_t i = 0; i < partitions.size(); i++)
+        TEST_AND_RETURN_FALSE(partitions[i].name ==
+                              config.target.partitions[i].name);
+      shard_read[shard.index] = true;
+      shards[shard.index] = std::move(partitions);
+    }
+
+    for (size_t i = 0; i < config.target.partitions.size(); i++) {
+      const PartitionConfig& old_part = config.source.partitions[i];
+      const PartitionConfig& new_part = config.target.partitions[i];
+      LOG(INFO) << "Merging the " << shards.size() << " shards of "
+                << new_part.name;
+
+      vector<AnnotatedOperation> aops;
+      if (old_part.path.empty()) {
+        TEST_AND_RETURN_FALSE(FullUpdateGenerator().GenerateOperations(
+            config, old_part, new_part, &blob_file, &aops));
+      } else {
+        for (vector<ShardPartition>& partitions : shards) {
+          std::move(partitions[i].aops.begin(),
+                    partitions[i].aops.end(),
+                    std::back_inserter(aops));
+        }
+        // The verity blocks are written by the client, see DeltaReadPartition.
+        ExtentRanges blocks;
+        blocks.AddExtent(ExtentForRange(0, new_part.size / config.block_size));
+        if (config.version.minor >= kVerityMinorPayloadVersion &&
+            !new_part.verity.IsEmpty()) {
+          blocks.SubtractExtent(new_part.verity.hash_tree_extent);
+          blocks.SubtractExtent(new_part.verity.fec_extent);
+        }
+        if (!WritesBlocksOnce(aops, blocks)) {
+          LOG(ERROR) << "The shards don't cover " << new_part.name
+                     << " exactly once.";
+          return false;
+        }
+        TEST_AND_RETURN_FALSE(ABGenerator::FinalizeOperations(
+            config, old_part, new_part, &blob_file, &aops));
+      }
+      diff_utils::FilterNoopOperations(&aops);
+      TEST_AND_RETURN_FALSE(payload.AddPartition(old_part, new_part, aops));
+    }
+  }
+
+  LOG(INFO) << "Writing payload file...";
+  TEST_AND_RETURN_FALSE(payload.WritePayload(
+      output_path, temp_file_path, private_key_path, metadata_size));
+
+  LOG(INFO) << "All done. Successfully merged " << shard_paths.size()
+            << " shards into a delta file with metadata size = "
+            << *metadata_size;
+  return true;
+}
+
 };  // namespace chromeos_update_engine
@@ -18,6 +18,7 @@
 #define UPDATE_ENGINE_PAYLOAD_GENERATOR_DELTA_DIFF_GENERATOR_H_
 
 #include <string>
+#include <vector>
 
 #include "update_engine/payload_generator/payload_generation_config.h"
 
@@ -41,6 +42,24 @@ bool GenerateUpdatePayloadFile(const PayloadGenerationConfig& config,
                                const std::string& private_key_path,
                                uint64_t* metadata_size);
 
+// Generates the operations of the files of the A/B delta payload described by
+// |config| assigned to |config.shard|, and writes them with their data to the
+// shard file |output_path|. Returns true on success.
+bool GenerateUpdatePayloadShard(const PayloadGenerationConfig& config,
+                                const std::string& output_path);
+
+// Merges the shard files |shard_paths|, generated with
+// GenerateUpdatePayloadShard() from the same |config|, into the payload
+// |output_path|, signed with |private_key_path| if not empty. The payload is
+// identical to the one GenerateUpdatePayloadFile() generates in a single
+// process. Returns true on success. Also writes the size of the metadata into
+// |metadata_size|.
+bool MergeUpdatePayloadShards(const PayloadGenerationConfig& config,
+                              const std::vector<std::string>& shard_paths,
+                              const std::string& output_path,
+                              const std::string& private_key_path,
+                              uint64_t* metadata_size);
+
 };  // namespace chromeos_update_engine
 
 #endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_DELTA_DIFF_GENERATOR_H_
@@ -51,15 +51,23 @@
 #include "update_engine/common/subprocess.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_consumer/zstd_extent_writer.h"
 #include "update_engine/payload_generator/ab_generator.h"
 #include "update_engine/payload_generator/block_mapping.h"
 #include "update_engine/payload_generator/bzip.h"
+#include "update_engine/payload_generator/compressibility.h"
+#include "update_engine/payload_generator/content_chunker.h"
 #include "update_engine/payload_generator/deflate_utils.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/lz4diff.h"
+#include "update_engine/payload_generator/memory_budget_scheduler.h"
+#include "update_engine/payload_generator/partition_reader.h"
+#include "update_engine/payload_generator/payload_shard.h"
 #include "update_engine/payload_generator/squashfs_filesystem.h"
 #include "update_engine/payload_generator/xz.h"
+#include "update_engine/payload_generator/zstd.h"
 
 using std::list;
 using std::map;
@@ -83,6 +91,25 @@ const uint64_t kMaxPuffdiffDestinationSize = 150 * 1024 * 1024;  // bytes
 
 const int kBrotliCompressionQuality = 11;
 
+// REPLACE_ZSTD decodes several times faster than REPLACE_XZ on the client, so
+// it is preferred unless it is bigger than the REPLACE_XZ blob by more than
+// this percentage.
+const uint64_t kZstdMaxSizeOverheadPercent = 5;
+
+// The size of the reads of the partitions to compute their hash.
+const size_t kHashBufferSize = 1024 * 1024;  // bytes
+
+// bsdiff builds a suffix array of 64-bit indexes of the old data.
+const uint64_t kBsdiffMemoryPerOldByte = 8;
+
+// The diffs of the decompressed streams, PUFFDIFF and LZ4DIFF, work on data
+// about this many times bigger than the compressed data.
+const uint64_t kDecompressedSizeFactor = 3;
+
+// ZSTD_DIFF indexes the old data and the new data with the hash and chain
+// tables of the compressor, a few times their size.
+const uint64_t kZstdDiffMemoryFactor = 4;
+
 // Process a range of blocks from |range_start| to |range_end| in the extent at
 // position |*idx_p| of |extents|. If |do_remove| is true, this range will be
 // removed, which may cause the extent to be trimmed, split or removed entirely.
@@ -228,6 +255,23 @@ int LevenshteinDistance(const string& a, const string& b) {
   }
   return distances.back();
 }
+
+// Opens the images |old_part| and |new_part| to read |old_extents| and some
+// extents of the new image. The old image is only opened if there is data to
+// read from it.
+bool OpenPartitionReaders(const string& old_part,
+                          const string& new_part,
+                          const vector<Extent>& old_extents,
+                          std::unique_ptr<PartitionReader>* old_reader,
+                          std::unique_ptr<PartitionReader>* new_reader) {
+  if (utils::BlocksInExtents(old_extents) > 0) {
+    *old_reader = PartitionReader::Open(old_part);
+    TEST_AND_RETURN_FALSE(*old_reader);
+  }
+  *new_reader = PartitionReader::Open(new_part);
+  TEST_AND_RETURN_FALSE(*new_reader);
+  return true;
+}
 }  // namespace
 
 namespace diff_utils {
@@ -237,8 +281,8 @@ namespace diff_utils {
 // and write the compressed delta to the blob.
 class FileDeltaProcessor : public base::DelegateSimpleThread::Delegate {
  public:
-  FileDeltaProcessor(const string& old_part,
-                     const string& new_part,
+  FileDeltaProcessor(const PartitionReader* old_reader,
+                     const PartitionReader& new_reader,
                      const PayloadVersion& version,
                      const vector<Extent>& old_extents,
                      const vector<Extent>& new_extents,
@@ -246,9 +290,10 @@ class FileDeltaProcessor : public base::DelegateSimpleThread::Delegate {
                      const vector<puffin::BitExtent>& new_deflates,
                      const string& name,
                      ssize_t chunk_blocks,
+                     bool zstd_diff_only,
                      BlobFileWriter* blob_file)
-      : old_part_(old_part),
-        new_part_(new_part),
+      : old_reader_(old_reader),
+        new_reader_(new_reader),
         version_(version),
         old_extents_(old_extents),
         new_extents_(new_extents),
@@ -257,12 +302,19 @@ class FileDeltaProcessor : public base::DelegateSimpleThread::Delegate {
         new_deflates_(new_deflates),
         name_(name),
         chunk_blocks_(chunk_blocks),
+        zstd_diff_only_(zstd_diff_only),
         blob_file_(blob_file) {}
 
   bool operator>(const FileDeltaProcessor& other) const {
     return new_extents_blocks_ > other.new_extents_blocks_;
   }
 
+  // Returns the memory estimated to generate the operations of the largest
+  // chunk of the file.
+  uint64_t EstimatedMemory() const;
+
+  size_t new_blocks() const { return new_extents_blocks_; }
+
   ~FileDeltaProcessor() override = default;
 
   // Overrides DelegateSimpleThread::Delegate.
@@ -274,8 +326,9 @@ class FileDeltaProcessor : public base::DelegateSimpleThread::Delegate {
   bool MergeOperation(vector<AnnotatedOperation>* aops);
 
  private:
-  const string& old_part_;  // NOLINT(runtime/member_string_references)
-  const string& new_part_;  // NOLINT(runtime/member_string_references)
+  // The old partition, or null if there is none.
+  const PartitionReader* old_reader_;
+  const PartitionReader& new_reader_;
   const PayloadVersion& version_;
 
   // The block ranges of the old/new file within the src/tgt image
@@ -287,6 +340,8 @@ class FileDeltaProcessor : public base::DelegateSimpleThread::Delegate {
   const string name_;
   // Block limit of one aop.
   const ssize_t chunk_blocks_;
+  // Whether ZSTD_DIFF is the only diff tried, see ReadExtentsToDiff().
+  const bool zstd_diff_only_;
   BlobFileWriter* blob_file_;
 
   // The list of ops to reach the new file from the old file.
@@ -302,8 +357,8 @@ void FileDeltaProcessor::Run() {
   base::TimeTicks start = base::TimeTicks::Now();
 
   if (!DeltaReadFile(&file_aops_,
-                     old_part_,
-                     new_part_,
+                     old_reader_,
+                     new_reader_,
                      old_extents_,
                      new_extents_,
                      old_deflates_,
@@ -311,6 +366,7 @@ void FileDeltaProcessor::Run() {
                      name_,
                      chunk_blocks_,
                      version_,
+                     zstd_diff_only_,
                      blob_file_)) {
     LOG(ERROR) << "Failed to generate delta for " << name_ << " ("
                << new_extents_blocks_ << " blocks)";
@@ -320,7 +376,7 @@ void FileDeltaProcessor::Run() {
 
   if (!version_.InplaceUpdate()) {
     if (!ABGenerator::FragmentOperations(
-            version_, &file_aops_, new_part_, blob_file_)) {
+            version_, &file_aops_, new_reader_, blob_file_)) {
       LOG(ERROR) << "Failed to fragment operations for " << name_;
       failed_ = true;
       return;
@@ -331,6 +387,25 @@ void FileDeltaProcessor::Run() {
             << " blocks) in " << (base::TimeTicks::Now() - start);
 }
 
+uint64_t FileDeltaProcessor::EstimatedMemory() const {
+  uint64_t old_blocks = utils::BlocksInExtents(old_extents_);
+  uint64_t new_blocks = new_extents_blocks_;
+  if (chunk_blocks_ != -1) {
+    old_blocks = std::min(old_blocks, static_cast<uint64_t>(chunk_blocks_));
+    new_blocks = std::min(new_blocks, static_cast<uint64_t>(chunk_blocks_));
+  }
+  if (zstd_diff_only_) {
+    // The old and new data, the two blobs and the zstd tables.
+    return (old_blocks + 3 * new_blocks +
+            (old_blocks + new_blocks) * kZstdDiffMemoryFactor) *
+           kBlockSize;
+  }
+  return EstimateDeltaMemory(old_blocks * kBlockSize,
+                             new_blocks * kBlockSize,
+                             !old_deflates_.empty() && !new_deflates_.empty(),
+                             version_);
+}
+
 bool FileDeltaProcessor::MergeOperation(vector<AnnotatedOperation>* aops) {
   if (failed_)
     return false;
@@ -339,6 +414,122 @@ bool FileDeltaProcessor::MergeOperation(vector<AnnotatedOperation>* aops) {
   return true;
 }
 
+// A new file and the old data it is diffed against. Files bigger than an
+// operation may be split in content-defined chunks, which is done in a worker
+// thread since it reads and hashes the whole file.
+class FileChunker : public base::DelegateSimpleThread::Delegate {
+ public:
+  FileChunker(const PartitionReader* old_reader,
+              const PartitionReader& new_reader,
+              const PayloadVersion& version,
+              vector<Extent> old_extents,
+              vector<Extent> new_extents,
+              const vector<puffin::BitExtent>& old_deflates,
+              const vector<puffin::BitExtent>& new_deflates,
+              const string& name,
+              ssize_t chunk_blocks,
+              bool split,
+              bool zstd_diff_only)
+      : old_reader_(old_reader),
+        new_reader_(new_reader),
+        version_(version),
+        old_extents_(std::move(old_extents)),
+        new_extents_(std::move(new_extents)),
+        old_deflates_(old_deflates),
+        new_deflates_(new_deflates),
+        name_(name),
+        chunk_blocks_(chunk_blocks),
+        split_(split),
+        zstd_diff_only_(zstd_diff_only) {}
+
+  ~FileChunker() override = default;
+
+  bool split() const { return split_; }
+
+  // Returns the memory needed to split the file, which is read whole.
+  uint64_t EstimatedMemory() const {
+    return (utils::BlocksInExtents(old_extents_) +
+            utils::BlocksInExtents(new_extents_)) *
+           kBlockSize;
+  }
+
+  // Overrides DelegateSimpleThread::Delegate.
+  // Splits the file in chunks if needed.
+  void Run() override {
+    failed_ = !SplitFileByContent(*old_reader_,
+                                  new_reader_,
+                                  old_extents_,
+                                  new_extents_,
+                                  chunk_blocks_,
+                                  &old_chunks_,
+                                  &new_chunks_);
+    if (failed_)
+      LOG(ERROR) << "Failed to split " << name_ << " in chunks";
+  }
+
+  // Adds to |processors| a processor for the file, or one per chunk if it was
+  // split, storing their blobs in |blob_file|.
+  bool AddProcessors(BlobFileWriter* blob_file,
+                     list<FileDeltaProcessor>* processors) {
+    TEST_AND_RETURN_FALSE(!failed_);
+    if (!split_) {
+      processors->emplace_back(old_reader_,
+                               new_reader_,
+                               version_,
+                               old_extents_,
+                               new_extents_,
+                               old_deflates_,
+                               new_deflates_,
+                               name_,  // operation name
+                               chunk_blocks_,
+                               false,  // zstd_diff_only
+                               blob_file);
+      return true;
+    }
+    for (size_t i = 0; i < new_chunks_.size(); i++) {
+      processors->emplace_back(
+          old_reader_,
+          new_reader_,
+          version_,
+          old_chunks_[i],
+          new_chunks_[i],
+          old_deflates_,
+          new_deflates_,
+          base::StringPrintf("%s:%" PRIuS, name_.c_str(), i),
+          chunk_blocks_,
+          zstd_diff_only_,
+          blob_file);
+    }
+    return true;
+  }
+
+ private:
+  // The old partition, or null if there is none. Only files with old data
+  // are split.
+  const PartitionReader* old_reader_;
+  const PartitionReader& new_reader_;
+  const PayloadVersion& version_;
+
+  const vector<Extent> old_extents_;
+  const vector<Extent> new_extents_;
+  const vector<puffin::BitExtent> old_deflates_;
+  const vector<puffin::BitExtent> new_deflates_;
+  const string name_;
+  const ssize_t chunk_blocks_;
+  const bool split_;
+  // Whether the file is split to fit the ZSTD_DIFF window, and its chunks are
+  // only diffed with it.
+  const bool zstd_diff_only_;
+
+  // The extents of the chunks once split.
+  vector<vector<Extent>> old_chunks_;
+  vector<vector<Extent>> new_chunks_;
+
+  bool failed_ = false;
+
+  DISALLOW_COPY_AND_ASSIGN(FileChunker);
+};
+
 FilesystemInterface::File GetOldFile(
     const map<string, FilesystemInterface::File>& old_files_map,
     const string& new_file_name) {
@@ -372,6 +563,7 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
                         ssize_t hard_chunk_blocks,
                         size_t soft_chunk_blocks,
                         const PayloadVersion& version,
+                        const PayloadShard& shard,
                         BlobFileWriter* blob_file) {
   ExtentRanges old_visited_blocks;
   ExtentRanges new_visited_blocks;
@@ -388,18 +580,22 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
     new_visited_blocks.AddExtent(new_part.verity.fec_extent);
   }
 
+  // All the shards need the blocks visited by the moved and zero blocks, but
+  // only the first one keeps their operations.
   ExtentRanges old_zero_blocks;
-  TEST_AND_RETURN_FALSE(DeltaMovedAndZeroBlocks(aops,
-                                                old_part.path,
-                                                new_part.path,
-                                                old_part.size / kBlockSize,
-                                                new_part.size / kBlockSize,
-                                                soft_chunk_blocks,
-                                                version,
-                                                blob_file,
-                                                &old_visited_blocks,
-                                                &new_visited_blocks,
-                                                &old_zero_blocks));
+  vector<AnnotatedOperation> other_shard_aops;
+  TEST_AND_RETURN_FALSE(DeltaMovedAndZeroBlocks(
+      shard.index == 0 ? aops : &other_shard_aops,
+      old_part.path,
+      new_part.path,
+      old_part.size / kBlockSize,
+      new_part.size / kBlockSize,
+      soft_chunk_blocks,
+      version,
+      blob_file,
+      &old_visited_blocks,
+      &new_visited_blocks,
+      &old_zero_blocks));
 
   bool puffdiff_allowed = version.OperationAllowed(InstallOperation::PUFFDIFF);
   map<string, FilesystemInterface::File> old_files_map;
@@ -416,7 +612,30 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
   TEST_AND_RETURN_FALSE(deflate_utils::PreprocessPartitionFiles(
       new_part, &new_files, puffdiff_allowed));
 
-  list<FileDeltaProcessor> file_delta_processors;
+  size_t max_threads = GetMaxThreads();
+  uint64_t memory_budget = version.memory_budget ? version.memory_budget
+                                                 : GetDefaultMemoryBudget();
+
+  // All the files and chunks read the images through the same readers, so
+  // each image is only opened once.
+  std::unique_ptr<PartitionReader> old_reader;
+  if (!old_part.path.empty()) {
+    old_reader = PartitionReader::Open(old_part.path);
+    TEST_AND_RETURN_FALSE(old_reader);
+  }
+  std::unique_ptr<PartitionReader> new_reader =
+      PartitionReader::Open(new_part.path);
+  TEST_AND_RETURN_FALSE(new_reader);
+
+  list<FileChunker> file_chunkers;
+
+  // The old and new chunks paired by SplitFileByContent() are at most
+  // |zstd_diff_chunk_blocks| blocks each, so together they fit in the window.
+  const bool zstd_diff_allowed =
+      version.OperationAllowed(InstallOperation::ZSTD_DIFF);
+  const uint64_t max_bsdiff_blocks = kMaxBsdiffDestinationSize / kBlockSize;
+  const ssize_t zstd_diff_chunk_blocks =
+      (1ULL << ZstdExtentWriter::kMaxPrefixWindowLog) / 2 / kBlockSize;
 
   // The processing is very straightforward here, we generate operations for
   // every file (and pseudo-file such as the metadata) in the new filesystem
@@ -455,17 +674,59 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
       old_file_extents = FilterExtentRanges(old_file.extents, old_zero_blocks);
     old_visited_blocks.AddExtents(old_file_extents);
 
-    file_delta_processors.emplace_back(old_part.path,
-                                       new_part.path,
-                                       version,
-                                       std::move(old_file_extents),
-                                       std::move(new_file_extents),
-                                       old_file.deflates,
-                                       new_file.deflates,
-                                       new_file.name,  // operation name
-                                       hard_chunk_blocks,
-                                       blob_file);
+    // Files bigger than an operation are split in chunks processed in
+    // parallel. On A/B updates, the chunk boundaries depend on the content so
+    // that data inserted in the new file doesn't misalign all the chunks
+    // after it.
+    bool split = hard_chunk_blocks != -1 && !version.InplaceUpdate() &&
+                 !old_file_extents.empty() &&
+                 utils::BlocksInExtents(new_file_extents) >
+                     static_cast<uint64_t>(hard_chunk_blocks);
+    ssize_t chunk_blocks = hard_chunk_blocks;
+
+    // The operations of files too big for bsdiff could only be a REPLACE,
+    // since they are also too big for the ZSTD_DIFF window. These files are
+    // split in chunks small enough for the old and new chunks paired together
+    // to fit in the window, and each chunk is diffed with ZSTD_DIFF.
+    bool zstd_diff_only =
+        zstd_diff_allowed && !old_file_extents.empty() &&
+        utils::BlocksInExtents(old_file_extents) > max_bsdiff_blocks &&
+        (hard_chunk_blocks == -1 ||
+         static_cast<uint64_t>(hard_chunk_blocks) > max_bsdiff_blocks);
+    if (zstd_diff_only) {
+      split = true;
+      chunk_blocks = zstd_diff_chunk_blocks;
+    }
+    file_chunkers.emplace_back(old_reader.get(),
+                               *new_reader,
+                               version,
+                               std::move(old_file_extents),
+                               std::move(new_file_extents),
+                               old_file.deflates,
+                               new_file.deflates,
+                               new_file.name,
+                               chunk_blocks,
+                               split,
+                               zstd_diff_only);
+  }
+
+  // Split the big files in parallel, only reading as many of them at once as
+  // fit in the memory budget. The processors are then created in the order of
+  // the files, regardless of the order in which they were split.
+  MemoryBudgetScheduler chunk_scheduler(memory_budget);
+  for (FileChunker& chunker : file_chunkers) {
+    if (chunker.split())
+      chunk_scheduler.AddTask(&chunker, chunker.EstimatedMemory());
+  }
+  chunk_scheduler.Run("content-chunker", max_threads);
+
+  list<FileDeltaProcessor> file_delta_processors;
+  for (FileChunker& chunker : file_chunkers) {
+    TEST_AND_RETURN_FALSE(
+        chunker.AddProcessors(blob_file, &file_delta_processors));
   }
+  file_chunkers.clear();
+
   // Process all the blocks not included in any file. We provided all the unused
   // blocks in the old partition as available data.
   vector<Extent> new_unvisited = {
@@ -485,8 +746,8 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
     // really know the structure of this data and we should not expect it to
     // have redundancy between partitions.
     file_delta_processors.emplace_back(
-        old_part.path,
-        new_part.path,
+        old_reader.get(),
+        *new_reader,
         version,
         std::move(old_unvisited),
         std::move(new_unvisited),
@@ -494,10 +755,30 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
         vector<puffin::BitExtent>{},  // new_deflates
         "<non-file-data>",            // operation name
         soft_chunk_blocks,
+        false,  // zstd_diff_only
         blob_file);
   }
 
-  size_t max_threads = GetMaxThreads();
+  // Every shard splits the partition in the same files and chunks, and keeps
+  // its share of them.
+  if (shard.IsSharded()) {
+    vector<uint64_t> weights;
+    for (const auto& processor : file_delta_processors)
+      weights.push_back(processor.new_blocks());
+    vector<size_t> shards = AssignShards(weights, shard.count);
+    size_t i = 0;
+    for (auto it = file_delta_processors.begin();
+         it != file_delta_processors.end();
+         i++) {
+      if (shards[i] == shard.index)
+        it++;
+      else
+        it = file_delta_processors.erase(it);
+    }
+    LOG(INFO) << "Generating " << file_delta_processors.size() << " of the "
+              << shards.size() << " files and chunks of " << new_part.name
+              << " in shard " << shard.index << "/" << shard.count;
+  }
 
   // Sort the files in descending order based on number of new blocks to make
   // sure we start the largest ones first.
@@ -505,13 +786,17 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
     file_delta_processors.sort(std::greater<FileDeltaProcessor>());
   }
 
-  base::DelegateSimpleThreadPool thread_pool("incremental-update-generator",
-                                             max_threads);
-  thread_pool.Start();
+  // Only start the files while the memory they need fits in the budget, so a
+  // few big files at once don't run out of memory.
+  MemoryBudgetScheduler scheduler(memory_budget);
   for (auto& processor : file_delta_processors) {
-    thread_pool.AddWork(&processor);
+    scheduler.AddTask(&processor, processor.EstimatedMemory());
   }
-  thread_pool.JoinAll();
+  scheduler.Run("incremental-update-generator", max_threads);
+  LOG(INFO) << "Generated the delta of " << file_delta_processors.size()
+            << " files and chunks using up to " << scheduler.peak_memory()
+            << " bytes of estimated memory, with a budget of "
+            << memory_budget << " bytes.";
 
   for (auto& processor : file_delta_processors) {
     TEST_AND_RETURN_FALSE(processor.MergeOperation(aops));
@@ -614,6 +899,7 @@ bool DeltaMovedAndZeroBlocks(vector<AnnotatedOperation>* aops,
   // Produce operations for the zero blocks split per output extent.
   size_t num_ops = aops->size();
   new_visited_blocks->AddExtents(new_zeros);
+  std::unique_ptr<PartitionReader> new_reader;
   for (const Extent& extent : new_zeros) {
     if (version.OperationAllowed(InstallOperation::ZERO)) {
       for (uint64_t offset = 0; offset < extent.num_blocks();
@@ -628,9 +914,13 @@ bool DeltaMovedAndZeroBlocks(vector<AnnotatedOperation>* aops,
         aops->push_back({.name = "<zeros>", .op = operation});
       }
     } else {
+      if (!new_reader) {
+        new_reader = PartitionReader::Open(new_part);
+        TEST_AND_RETURN_FALSE(new_reader);
+      }
       TEST_AND_RETURN_FALSE(DeltaReadFile(aops,
-                                          "",
-                                          new_part,
+                                          nullptr,
+                                          *new_reader,
                                           {},        // old_extents
                                           {extent},  // new_extents
                                           {},        // old_deflates
@@ -638,6 +928,7 @@ bool DeltaMovedAndZeroBlocks(vector<AnnotatedOperation>* aops,
                                           "<zeros>",
                                           chunk_blocks,
                                           version,
+                                          false,  // zstd_diff_only
                                           blob_file));
     }
   }
@@ -689,6 +980,53 @@ bool DeltaMovedAndZeroBlocks(vector<AnnotatedOperation>* aops,
   return true;
 }
 
+bool SplitFileByContent(const PartitionReader& old_reader,
+                        const PartitionReader& new_reader,
+                        const vector<Extent>& old_extents,
+                        const vector<Extent>& new_extents,
+                        uint64_t chunk_blocks,
+                        vector<vector<Extent>>* old_chunks_extents,
+                        vector<vector<Extent>>* new_chunks_extents) {
+  uint64_t old_blocks = utils::BlocksInExtents(old_extents);
+  uint64_t new_blocks = utils::BlocksInExtents(new_extents);
+  brillo::Blob old_data, new_data;
+  TEST_AND_RETURN_FALSE(ReadPartitionExtents(
+      old_reader, old_extents, &old_data, old_blocks * kBlockSize, kBlockSize));
+  TEST_AND_RETURN_FALSE(ReadPartitionExtents(
+      new_reader, new_extents, &new_data, new_blocks * kBlockSize, kBlockSize));
+
+  vector<Extent> old_chunks =
+      ContentDefinedChunks(old_data, kBlockSize, chunk_blocks);
+  vector<Extent> new_chunks =
+      ContentDefinedChunks(new_data, kBlockSize, chunk_blocks);
+  vector<ssize_t> matches =
+      MatchChunks(old_data, old_chunks, new_data, new_chunks, kBlockSize);
+
+  old_chunks_extents->clear();
+  new_chunks_extents->clear();
+  size_t matched_chunks = 0;
+  for (size_t i = 0; i < new_chunks.size(); i++) {
+    vector<Extent> new_chunk_extents = ExtentsSublist(
+        new_extents, new_chunks[i].start_block(), new_chunks[i].num_blocks());
+    vector<Extent> old_chunk_extents;
+    if (matches[i] >= 0) {
+      const Extent& old_chunk = old_chunks[matches[i]];
+      old_chunk_extents = ExtentsSublist(
+          old_extents, old_chunk.start_block(), old_chunk.num_blocks());
+      if (static_cast<size_t>(matches[i]) != i)
+        matched_chunks++;
+    }
+    NormalizeExtents(&old_chunk_extents);
+    NormalizeExtents(&new_chunk_extents);
+    old_chunks_extents->push_back(std::move(old_chunk_extents));
+    new_chunks_extents->push_back(std::move(new_chunk_extents));
+  }
+  LOG(INFO) << "Split " << new_blocks << " blocks in " << new_chunks.size()
+            << " chunks, " << matched_chunks
+            << " of them paired with an old chunk at another index.";
+  return true;
+}
+
 bool DeltaReadFile(vector<AnnotatedOperation>* aops,
                    const string& old_part,
                    const string& new_part,
@@ -700,6 +1038,35 @@ bool DeltaReadFile(vector<AnnotatedOperation>* aops,
                    ssize_t chunk_blocks,
                    const PayloadVersion& version,
                    BlobFileWriter* blob_file) {
+  std::unique_ptr<PartitionReader> old_reader, new_reader;
+  TEST_AND_RETURN_FALSE(OpenPartitionReaders(
+      old_part, new_part, old_extents, &old_reader, &new_reader));
+  return DeltaReadFile(aops,
+                       old_reader.get(),
+                       *new_reader,
+                       old_extents,
+                       new_extents,
+                       old_deflates,
+                       new_deflates,
+                       name,
+                       chunk_blocks,
+                       version,
+                       false,  // zstd_diff_only
+                       blob_file);
+}
+
+bool DeltaReadFile(vector<AnnotatedOperation>* aops,
+                   const PartitionReader* old_reader,
+                   const PartitionReader& new_reader,
+                   const vector<Extent>& old_extents,
+                   const vector<Extent>& new_extents,
+                   const vector<puffin::BitExtent>& old_deflates,
+                   const vector<puffin::BitExtent>& new_deflates,
+                   const string& name,
+                   ssize_t chunk_blocks,
+                   const PayloadVersion& version,
+                   bool zstd_diff_only,
+                   BlobFileWriter* blob_file) {
   brillo::Blob data;
   InstallOperation operation;
 
@@ -720,13 +1087,14 @@ bool DeltaReadFile(vector<AnnotatedOperation>* aops,
     NormalizeExtents(&old_extents_chunk);
     NormalizeExtents(&new_extents_chunk);
 
-    TEST_AND_RETURN_FALSE(ReadExtentsToDiff(old_part,
-                                            new_part,
+    TEST_AND_RETURN_FALSE(ReadExtentsToDiff(old_reader,
+                                            new_reader,
                                             old_extents_chunk,
                                             new_extents_chunk,
                                             old_deflates,
                                             new_deflates,
                                             version,
+                                            zstd_diff_only,
                                             &data,
                                             &operation));
 
@@ -774,6 +1142,16 @@ bool GenerateBestFullOperation(const brillo::Blob& new_data,
     return true;
   }
 
+  // Already compressed data is stored as is.
+  if (ShouldSkipCompression(new_data, version.compressibility_filter)) {
+    CompressibilityStats::Get()->AddCompression(
+        new_data.size(), true, base::TimeDelta());
+    *out_type = InstallOperation::REPLACE;
+    *out_blob = new_data;
+    return true;
+  }
+  base::TimeTicks compress_start = base::TimeTicks::Now();
+
   bool out_blob_set = false;
 
   // Try compressing |new_data| with xz first.
@@ -786,6 +1164,20 @@ bool GenerateBestFullOperation(const brillo::Blob& new_data,
     }
   }
 
+  // Try compressing it with zstd, trading a slightly bigger blob for a faster
+  // decompression.
+  if (version.OperationAllowed(InstallOperation::REPLACE_ZSTD)) {
+    brillo::Blob new_data_zstd;
+    if (ZstdCompress(new_data, &new_data_zstd) && !new_data_zstd.empty() &&
+        (!out_blob_set ||
+         new_data_zstd.size() * 100 <=
+             out_blob->size() * (100 + kZstdMaxSizeOverheadPercent))) {
+      *out_type = InstallOperation::REPLACE_ZSTD;
+      *out_blob = std::move(new_data_zstd);
+      out_blob_set = true;
+    }
+  }
+
   // Try compressing it with bzip2.
   if (version.OperationAllowed(InstallOperation::REPLACE_BZ)) {
     brillo::Blob new_data_bz;
@@ -800,6 +1192,9 @@ bool GenerateBestFullOperation(const brillo::Blob& new_data,
     }
   }
 
+  CompressibilityStats::Get()->AddCompression(
+      new_data.size(), false, base::TimeTicks::Now() - compress_start);
+
   // If nothing else worked or it was badly compressed we try a REPLACE.
   if (!out_blob_set || out_blob->size() >= new_data.size()) {
     *out_type = InstallOperation::REPLACE;
@@ -820,6 +1215,31 @@ bool ReadExtentsToDiff(const string& old_part,
                        const PayloadVersion& version,
                        brillo::Blob* out_data,
                        InstallOperation* out_op) {
+  std::unique_ptr<PartitionReader> old_reader, new_reader;
+  TEST_AND_RETURN_FALSE(OpenPartitionReaders(
+      old_part, new_part, old_extents, &old_reader, &new_reader));
+  return ReadExtentsToDiff(old_reader.get(),
+                           *new_reader,
+                           old_extents,
+                           new_extents,
+                           old_deflates,
+                           new_deflates,
+                           version,
+                           false,  // zstd_diff_only
+                           out_data,
+                           out_op);
+}
+
+bool ReadExtentsToDiff(const PartitionReader* old_reader,
+                       const PartitionReader& new_reader,
+                       const vector<Extent>& old_extents,
+                       const vector<Extent>& new_extents,
+                       const vector<puffin::BitExtent>& old_deflates,
+                       const vector<puffin::BitExtent>& new_deflates,
+                       const PayloadVersion& version,
+                       bool zstd_diff_only,
+                       brillo::Blob* out_data,
+                       InstallOperation* out_op) {
   InstallOperation operation;
 
   // We read blocks from old_extents and write blocks to new_extents.
@@ -845,17 +1265,43 @@ bool ReadExtentsToDiff(const string& old_part,
     puffdiff_allowed = false;
   }
 
+  // The chunks of the files too big for bsdiff are only diffed with ZSTD_DIFF,
+  // which is what they were split for.
+  if (zstd_diff_only) {
+    bsdiff_allowed = false;
+    puffdiff_allowed = false;
+  }
+
+  // ZSTD_DIFF needs the source and target data to fit in the window the client
+  // accepts, since the client keeps both in memory. DeltaReadPartition() splits
+  // the files too big for bsdiff in chunks that fit, so it also covers them.
+  bool zstd_diff_allowed =
+      version.OperationAllowed(InstallOperation::ZSTD_DIFF);
+  if (zstd_diff_allowed &&
+      (blocks_to_read + blocks_to_write) * kBlockSize >
+          (1ULL << ZstdExtentWriter::kMaxPrefixWindowLog)) {
+    LOG(INFO) << "zstd diff blacklisted, data too big: "
+              << (blocks_to_read + blocks_to_write) * kBlockSize << " bytes";
+    zstd_diff_allowed = false;
+  }
+
+  // LZ4DIFF bounds the size of the decompressed data itself, and is only used
+  // when the client reproduces the target streams.
+  bool lz4diff_allowed =
+      !zstd_diff_only && version.OperationAllowed(InstallOperation::LZ4DIFF) &&
+      Lz4StreamsReproducible(version.client_lz4_version);
+
   // Make copies of the extents so we can modify them.
   vector<Extent> src_extents = old_extents;
   vector<Extent> dst_extents = new_extents;
 
   // Read in bytes from new data.
   brillo::Blob new_data;
-  TEST_AND_RETURN_FALSE(utils::ReadExtents(new_part,
-                                           new_extents,
-                                           &new_data,
-                                           kBlockSize * blocks_to_write,
-                                           kBlockSize));
+  TEST_AND_RETURN_FALSE(ReadPartitionExtents(new_reader,
+                                             new_extents,
+                                             &new_data,
+                                             kBlockSize * blocks_to_write,
+                                             kBlockSize));
   TEST_AND_RETURN_FALSE(!new_data.empty());
 
   // Data blob that will be written to delta file.
@@ -871,11 +1317,12 @@ bool ReadExtentsToDiff(const string& old_part,
   brillo::Blob old_data;
   if (blocks_to_read > 0) {
     // Read old data.
-    TEST_AND_RETURN_FALSE(utils::ReadExtents(old_part,
-                                             src_extents,
-                                             &old_data,
-                                             kBlockSize * blocks_to_read,
-                                             kBlockSize));
+    TEST_AND_RETURN_FALSE(old_reader);
+    TEST_AND_RETURN_FALSE(ReadPartitionExtents(*old_reader,
+                                               src_extents,
+                                               &old_data,
+                                               kBlockSize * blocks_to_read,
+                                               kBlockSize));
     if (old_data == new_data) {
       // No change in data.
       operation.set_type(version.OperationAllowed(InstallOperation::SOURCE_COPY)
@@ -886,6 +1333,17 @@ bool ReadExtentsToDiff(const string& old_part,
                    operation, data_blob.size(), 0, src_extents.size())) {
       // No point in trying diff if zero blob size diff operation is
       // still worse than replace.
+      DiffFilter diff_filter =
+          FilterDiffs(old_data, new_data, version.compressibility_filter);
+      if (diff_filter.skip_raw_diffs) {
+        bsdiff_allowed = false;
+        zstd_diff_allowed = false;
+      }
+      if (diff_filter.skip_decompressing_diffs) {
+        puffdiff_allowed = false;
+        lz4diff_allowed = false;
+      }
+      base::TimeTicks diff_start = base::TimeTicks::Now();
       if (bsdiff_allowed) {
         base::FilePath patch;
         TEST_AND_RETURN_FALSE(base::CreateTemporaryFile(&patch));
@@ -973,6 +1431,40 @@ bool ReadExtentsToDiff(const string& old_part,
           }
         }
       }
+      if (zstd_diff_allowed) {
+        brillo::Blob zstd_delta;
+        TEST_AND_RETURN_FALSE(
+            ZstdCompressWithPrefix(new_data, old_data, &zstd_delta));
+        if (IsDiffOperationBetter(operation,
+                                  data_blob.size(),
+                                  zstd_delta.size(),
+                                  src_extents.size())) {
+          operation.set_type(InstallOperation::ZSTD_DIFF);
+          data_blob = std::move(zstd_delta);
+        }
+      }
+      if (lz4diff_allowed) {
+        // The LZ4 streams of the kernels and ramdisks in boot images start at
+        // the beginning of a page, which may not be block aligned.
+        brillo::Blob lz4diff_delta;
+        TEST_AND_RETURN_FALSE(Lz4Diff(old_data,
+                                      new_data,
+                                      kBlockSize,
+                                      kMaxBsdiffDestinationSize,
+                                      &lz4diff_delta));
+        if (!lz4diff_delta.empty() &&
+            IsDiffOperationBetter(operation,
+                                  data_blob.size(),
+                                  lz4diff_delta.size(),
+                                  src_extents.size())) {
+          operation.set_type(InstallOperation::LZ4DIFF);
+          data_blob = std::move(lz4diff_delta);
+        }
+      }
+      CompressibilityStats::Get()->AddDiff(
+          new_data.size(),
+          diff_filter.skip_raw_diffs,
+          base::TimeTicks::Now() - diff_start);
     }
   }
 
@@ -1013,7 +1505,8 @@ bool ReadExtentsToDiff(const string& old_part,
 bool IsAReplaceOperation(InstallOperation::Type op_type) {
   return (op_type == InstallOperation::REPLACE ||
           op_type == InstallOperation::REPLACE_BZ ||
-          op_type == InstallOperation::REPLACE_XZ);
+          op_type == InstallOperation::REPLACE_XZ ||
+          op_type == InstallOperation::REPLACE_ZSTD);
 }
 
 bool IsNoSourceOperation(InstallOperation::Type op_type) {
@@ -1039,9 +1532,17 @@ void FilterNoopOperations(vector<AnnotatedOperation>* ops) {
 
 bool InitializePartitionInfo(const PartitionConfig& part, PartitionInfo* info) {
   info->set_size(part.size);
+  std::unique_ptr<PartitionReader> reader = PartitionReader::Open(part.path);
+  TEST_AND_RETURN_FALSE(reader);
   HashCalculator hasher;
-  TEST_AND_RETURN_FALSE(hasher.UpdateFile(part.path, part.size) ==
-                        static_cast<off_t>(part.size));
+  brillo::Blob buffer(kHashBufferSize);
+  for (uint64_t offset = 0; offset < part.size;) {
+    size_t bytes = std::min(static_cast<uint64_t>(buffer.size()),
+                            part.size - offset);
+    TEST_AND_RETURN_FALSE(reader->Read(buffer.data(), bytes, offset));
+    TEST_AND_RETURN_FALSE(hasher.Update(buffer.data(), bytes));
+    offset += bytes;
+  }
   TEST_AND_RETURN_FALSE(hasher.Finalize());
   const brillo::Blob& hash = hasher.raw_hash();
   info->set_hash(hash.data(), hash.size());
@@ -1099,6 +1600,47 @@ bool IsExtFilesystem(const string& device) {
   return true;
 }
 
+uint64_t EstimateDeltaMemory(uint64_t old_size,
+                             uint64_t new_size,
+                             bool has_deflates,
+                             const PayloadVersion& version) {
+  // The old and new data, the blob of the best full operation and the blob of
+  // the best diff so far.
+  uint64_t memory = old_size + 3 * new_size;
+
+  // The diffs run one after the other, so only the biggest one counts.
+  uint64_t diff_memory = 0;
+  if ((version.OperationAllowed(InstallOperation::SOURCE_BSDIFF) ||
+       version.OperationAllowed(InstallOperation::BSDIFF)) &&
+      old_size <= kMaxBsdiffDestinationSize) {
+    diff_memory = std::max(diff_memory, old_size * kBsdiffMemoryPerOldByte);
+  }
+  if (version.OperationAllowed(InstallOperation::PUFFDIFF) && has_deflates &&
+      old_size <= kMaxPuffdiffDestinationSize) {
+    uint64_t old_puffed = old_size * kDecompressedSizeFactor;
+    uint64_t new_puffed = new_size * kDecompressedSizeFactor;
+    diff_memory = std::max(
+        diff_memory,
+        old_puffed + new_puffed + old_puffed * kBsdiffMemoryPerOldByte);
+  }
+  if (version.OperationAllowed(InstallOperation::ZSTD_DIFF) &&
+      old_size + new_size <= (1ULL << ZstdExtentWriter::kMaxPrefixWindowLog)) {
+    diff_memory =
+        std::max(diff_memory, (old_size + new_size) * kZstdDiffMemoryFactor);
+  }
+  if (version.OperationAllowed(InstallOperation::LZ4DIFF) &&
+      Lz4StreamsReproducible(version.client_lz4_version)) {
+    uint64_t old_decompressed = std::min<uint64_t>(
+        old_size * kDecompressedSizeFactor, kMaxBsdiffDestinationSize);
+    uint64_t new_decompressed = std::min<uint64_t>(
+        new_size * kDecompressedSizeFactor, kMaxBsdiffDestinationSize);
+    diff_memory = std::max(diff_memory,
+                           old_decompressed + new_decompressed +
+                               old_decompressed * kBsdiffMemoryPerOldByte);
+  }
+  return memory + diff_memory;
+}
+
 // Return the number of CPUs on the machine, and 4 threads in minimum.
 size_t GetMaxThreads() {
   return std::max(sysconf(_SC_NPROCESSORS_ONLN), 4L);
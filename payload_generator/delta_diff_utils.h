@@ -26,6 +26,7 @@
 
 #include "update_engine/payload_generator/annotated_operation.h"
 #include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/partition_reader.h"
 #include "update_engine/payload_generator/payload_generation_config.h"
 #include "update_engine/update_metadata.pb.h"
 
@@ -42,13 +43,15 @@ namespace diff_utils {
 // and soft chunk limits in number of blocks respectively. The soft chunk limit
 // is used to split MOVE and SOURCE_COPY operations and REPLACE_BZ of zeroed
 // blocks, while the hard limit is used to split a file when generating other
-// operations. A value of -1 in |hard_chunk_blocks| means whole files.
+// operations. A value of -1 in |hard_chunk_blocks| means whole files. Only
+// the operations of the files and chunks assigned to |shard| are created.
 bool DeltaReadPartition(std::vector<AnnotatedOperation>* aops,
                         const PartitionConfig& old_part,
                         const PartitionConfig& new_part,
                         ssize_t hard_chunk_blocks,
                         size_t soft_chunk_blocks,
                         const PayloadVersion& version,
+                        const PayloadShard& shard,
                         BlobFileWriter* blob_file);
 
 // Create operations in |aops| for identical blocks that moved around in the old
@@ -93,6 +96,38 @@ bool DeltaReadFile(std::vector<AnnotatedOperation>* aops,
                    const PayloadVersion& version,
                    BlobFileWriter* blob_file);
 
+// Same as above, but reading the partitions from the already open
+// |old_reader| and |new_reader|. |old_reader| may be null if |old_extents| is
+// empty. If |zstd_diff_only| is true, ZSTD_DIFF is the only diff operation
+// tried, see ReadExtentsToDiff().
+bool DeltaReadFile(std::vector<AnnotatedOperation>* aops,
+                   const PartitionReader* old_reader,
+                   const PartitionReader& new_reader,
+                   const std::vector<Extent>& old_extents,
+                   const std::vector<Extent>& new_extents,
+                   const std::vector<puffin::BitExtent>& old_deflates,
+                   const std::vector<puffin::BitExtent>& new_deflates,
+                   const std::string& name,
+                   ssize_t chunk_blocks,
+                   const PayloadVersion& version,
+                   bool zstd_diff_only,
+                   BlobFileWriter* blob_file);
+
+// Splits a file stored in the |old_extents| of the partition of |old_reader|
+// and the |new_extents| of the partition of |new_reader| in content-defined
+// chunks of at most |chunk_blocks| blocks, and pairs each new chunk with the
+// old chunk sharing the most content with it. Stores the extents of each new
+// chunk in |new_chunks_extents| and those of the old chunk paired with it,
+// possibly empty, at the same index of |old_chunks_extents|. Returns true on
+// success.
+bool SplitFileByContent(const PartitionReader& old_reader,
+                        const PartitionReader& new_reader,
+                        const std::vector<Extent>& old_extents,
+                        const std::vector<Extent>& new_extents,
+                        uint64_t chunk_blocks,
+                        std::vector<std::vector<Extent>>* old_chunks_extents,
+                        std::vector<std::vector<Extent>>* new_chunks_extents);
+
 // Reads the blocks |old_extents| from |old_part| (if it exists) and the
 // |new_extents| from |new_part| and determines the smallest way to encode
 // this |new_extents| for the diff. It stores necessary data in |out_data| and
@@ -112,6 +147,21 @@ bool ReadExtentsToDiff(const std::string& old_part,
                        brillo::Blob* out_data,
                        InstallOperation* out_op);
 
+// Same as above, but reading the partitions from the already open
+// |old_reader| and |new_reader|. |old_reader| may be null if |old_extents| is
+// empty. If |zstd_diff_only| is true, ZSTD_DIFF is the only diff operation
+// tried, as for the chunks of the files too big for bsdiff.
+bool ReadExtentsToDiff(const PartitionReader* old_reader,
+                       const PartitionReader& new_reader,
+                       const std::vector<Extent>& old_extents,
+                       const std::vector<Extent>& new_extents,
+                       const std::vector<puffin::BitExtent>& old_deflates,
+                       const std::vector<puffin::BitExtent>& new_deflates,
+                       const PayloadVersion& version,
+                       bool zstd_diff_only,
+                       brillo::Blob* out_data,
+                       InstallOperation* out_op);
+
 // Generates the best allowed full operation to produce |new_data|. The allowed
 // operations are based on |payload_version|. The operation blob will be stored
 // in |out_blob| and the resulting operation type in |out_type|. Returns whether
@@ -148,6 +198,15 @@ bool CompareAopsByDestination(AnnotatedOperation first_aop,
 // false.
 bool IsExtFilesystem(const std::string& device);
 
+// Returns a rough upper bound of the memory used to generate the operation of
+// |new_size| bytes of new data from |old_size| bytes of old data, with the
+// diffs allowed by |version|. |has_deflates| tells whether the data has
+// deflate streams for PUFFDIFF.
+uint64_t EstimateDeltaMemory(uint64_t old_size,
+                             uint64_t new_size,
+                             bool has_deflates,
+                             const PayloadVersion& version);
+
 // Returns the max number of threads to process the files(chunks) in parallel.
 size_t GetMaxThreads();
 
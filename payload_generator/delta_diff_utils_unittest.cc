@@ -17,17 +17,21 @@
 #include "update_engine/payload_generator/delta_diff_utils.h"
 
 #include <algorithm>
+#include <memory>
 #include <random>
 #include <string>
 #include <vector>
 
 #include <base/files/scoped_file.h>
 #include <base/format_macros.h>
+#include <base/memory/ptr_util.h>
 #include <base/strings/stringprintf.h>
 #include <gtest/gtest.h>
 
 #include "update_engine/common/test_utils.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/fake_extent_writer.h"
+#include "update_engine/payload_consumer/zstd_extent_writer.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
@@ -182,6 +186,7 @@ TEST_F(DeltaDiffUtilsTest, SkipVerityExtentsTest) {
       -1,
       PayloadVersion(kMaxSupportedMajorPayloadVersion,
                      kVerityMinorPayloadVersion),
+      PayloadShard(),
       &blob_file));
   for (const auto& aop : aops_) {
     new_visited_blocks_.AddRepeatedExtents(aop.op.dst_extents());
@@ -469,6 +474,109 @@ TEST_F(DeltaDiffUtilsTest, SourceBsdiffTest) {
   EXPECT_EQ(InstallOperation::SOURCE_BSDIFF, op.type());
 }
 
+TEST_F(DeltaDiffUtilsTest, ZstdDiffTest) {
+  // Same setup as SourceBsdiffTest, where the source data compresses the new
+  // data better than bsdiff.
+  brillo::Blob data_blob(kBlockSize);
+  test_utils::FillWithData(&data_blob);
+
+  vector<Extent> old_extents = {ExtentForRange(1, 1)};
+  vector<Extent> new_extents = {ExtentForRange(2, 1)};
+
+  EXPECT_TRUE(WriteExtents(old_part_.path, old_extents, kBlockSize, data_blob));
+  brillo::Blob old_data = data_blob;
+  // Modify one byte in the new file.
+  data_blob[0]++;
+  EXPECT_TRUE(WriteExtents(new_part_.path, new_extents, kBlockSize, data_blob));
+
+  brillo::Blob data;
+  InstallOperation op;
+  EXPECT_TRUE(diff_utils::ReadExtentsToDiff(
+      old_part_.path,
+      new_part_.path,
+      old_extents,
+      new_extents,
+      {},  // old_deflates
+      {},  // new_deflates
+      PayloadVersion(kBrilloMajorPayloadVersion, kZstdMinorPayloadVersion),
+      &data,
+      &op));
+
+  EXPECT_TRUE(op.has_type());
+  EXPECT_EQ(InstallOperation::ZSTD_DIFF, op.type());
+  EXPECT_EQ(1, op.src_extents_size());
+
+  // The data decompresses to the new data after the old one.
+  FakeExtentWriter* fake_writer = new FakeExtentWriter();
+  ZstdExtentWriter writer(base::WrapUnique(fake_writer),
+                          ZstdExtentWriter::kDefaultOutputBufferSize,
+                          old_data);
+  EXPECT_TRUE(writer.Init(nullptr, {}, kBlockSize));
+  EXPECT_TRUE(writer.Write(data.data(), data.size()));
+  EXPECT_EQ(data_blob, fake_writer->WrittenData());
+}
+
+TEST_F(DeltaDiffUtilsTest, ZstdDiffFileTooBigForBsdiffTest) {
+  // A file bigger than the 200 MiB bsdiff limit, with random data so it
+  // doesn't compress and a byte changed in every block so no block is copied
+  // as is.
+  const uint64_t kFileBlocks = 210 * 1024 * 1024 / kBlockSize;
+  unlink(old_part_.path.c_str());
+  unlink(new_part_.path.c_str());
+  CreatePartition(&old_part_,
+                  "DeltaDiffUtilsTest-old_part-XXXXXX",
+                  block_size_,
+                  kFileBlocks * kBlockSize);
+  CreatePartition(&new_part_,
+                  "DeltaDiffUtilsTest-new_part-XXXXXX",
+                  block_size_,
+                  kFileBlocks * kBlockSize);
+  vector<Extent> extents = {ExtentForRange(0, kFileBlocks)};
+  for (PartitionConfig* part : {&old_part_, &new_part_}) {
+    auto fs = std::make_unique<FakeFilesystem>(kBlockSize, kFileBlocks);
+    fs->AddFile("/big-file", extents);
+    part->fs_interface = std::move(fs);
+  }
+
+  std::mt19937 rng(1);
+  brillo::Blob data_blob(kFileBlocks * kBlockSize);
+  for (auto& byte : data_blob)
+    byte = rng();
+  EXPECT_TRUE(WriteExtents(old_part_.path, extents, kBlockSize, data_blob));
+  for (uint64_t i = 0; i < kFileBlocks; i++)
+    data_blob[i * kBlockSize + i % kBlockSize]++;
+  EXPECT_TRUE(WriteExtents(new_part_.path, extents, kBlockSize, data_blob));
+  data_blob.clear();
+
+  // The aggressive filter skips compressing the random data, which would only
+  // make the test slower.
+  PayloadVersion version(kBrilloMajorPayloadVersion, kZstdMinorPayloadVersion);
+  version.compressibility_filter = CompressibilityFilter::kAggressive;
+  BlobFileWriter blob_file(blob_fd_, &blob_size_);
+  EXPECT_TRUE(diff_utils::DeltaReadPartition(&aops_,
+                                             old_part_,
+                                             new_part_,
+                                             -1,
+                                             -1,
+                                             version,
+                                             PayloadShard(),
+                                             &blob_file));
+
+  // The file is split in chunks fitting in the ZSTD_DIFF window, each diffed
+  // with ZSTD_DIFF instead of stored with a REPLACE.
+  EXPECT_LT(1U, aops_.size());
+  for (const AnnotatedOperation& aop : aops_) {
+    EXPECT_EQ(InstallOperation::ZSTD_DIFF, aop.op.type()) << aop.name;
+    EXPECT_LE((utils::BlocksInExtents(aop.op.src_extents()) +
+               utils::BlocksInExtents(aop.op.dst_extents())) *
+                  kBlockSize,
+              1ULL << ZstdExtentWriter::kMaxPrefixWindowLog)
+        << aop.name;
+    new_visited_blocks_.AddRepeatedExtents(aop.op.dst_extents());
+  }
+  EXPECT_EQ(kFileBlocks, new_visited_blocks_.blocks());
+}
+
 TEST_F(DeltaDiffUtilsTest, PreferReplaceTest) {
   brillo::Blob data_blob(kBlockSize);
   vector<Extent> extents = {ExtentForRange(1, 1)};
@@ -481,6 +589,8 @@ TEST_F(DeltaDiffUtilsTest, PreferReplaceTest) {
   std::iota(data_blob.begin(), data_blob.begin() + 50, 1);
   EXPECT_TRUE(WriteExtents(new_part_.path, extents, kBlockSize, data_blob));
 
+  // The zstd operations compress this better than REPLACE_BZ, so use the last
+  // minor version without them.
   brillo::Blob data;
   InstallOperation op;
   EXPECT_TRUE(diff_utils::ReadExtentsToDiff(
@@ -491,7 +601,7 @@ TEST_F(DeltaDiffUtilsTest, PreferReplaceTest) {
       {},  // old_deflates
       {},  // new_deflates
       PayloadVersion(kMaxSupportedMajorPayloadVersion,
-                     kMaxSupportedMinorPayloadVersion),
+                     kVerityMinorPayloadVersion),
       &data,
       &op));
 
@@ -500,6 +610,67 @@ TEST_F(DeltaDiffUtilsTest, PreferReplaceTest) {
   EXPECT_EQ(InstallOperation::REPLACE_BZ, op.type());
 }
 
+TEST_F(DeltaDiffUtilsTest, CompressibilityFilterTest) {
+  // Unrelated random data in the old and new partitions, like a media file
+  // replaced by another one.
+  vector<Extent> extents = {ExtentForRange(0, 16)};
+  std::mt19937 rng(1);
+  brillo::Blob data_blob(16 * kBlockSize);
+  for (auto& byte : data_blob)
+    byte = rng();
+  EXPECT_TRUE(WriteExtents(old_part_.path, extents, kBlockSize, data_blob));
+  for (auto& byte : data_blob)
+    byte = rng();
+  EXPECT_TRUE(WriteExtents(new_part_.path, extents, kBlockSize, data_blob));
+
+  PayloadVersion version(kBrilloMajorPayloadVersion, kZstdMinorPayloadVersion);
+  version.compressibility_filter = CompressibilityFilter::kConservative;
+  CompressibilityStats::Get()->Reset();
+  brillo::Blob data;
+  InstallOperation op;
+  EXPECT_TRUE(diff_utils::ReadExtentsToDiff(old_part_.path,
+                                            new_part_.path,
+                                            extents,
+                                            extents,
+                                            {},  // old_deflates
+                                            {},  // new_deflates
+                                            version,
+                                            &data,
+                                            &op));
+
+  // Neither compressed nor diffed, stored as is.
+  EXPECT_EQ(InstallOperation::REPLACE, op.type());
+  EXPECT_EQ(data_blob, data);
+  EXPECT_EQ(1U, CompressibilityStats::Get()->compressions_skipped());
+  EXPECT_EQ(1U, CompressibilityStats::Get()->diffs_skipped());
+}
+
+TEST_F(DeltaDiffUtilsTest, EstimateDeltaMemoryTest) {
+  const uint64_t kMiB = 1024 * 1024;
+  // Without diffs, only the data and the blobs are in memory.
+  PayloadVersion full(kChromeOSMajorPayloadVersion, kFullPayloadMinorVersion);
+  EXPECT_EQ(4 * kMiB,
+            diff_utils::EstimateDeltaMemory(kMiB, kMiB, false, full));
+
+  // bsdiff's suffix array dominates.
+  PayloadVersion source(kChromeOSMajorPayloadVersion,
+                        kSourceMinorPayloadVersion);
+  EXPECT_EQ(12 * kMiB,
+            diff_utils::EstimateDeltaMemory(kMiB, kMiB, false, source));
+  // The data too big for bsdiff isn't diffed.
+  EXPECT_EQ(1200 * kMiB,
+            diff_utils::EstimateDeltaMemory(
+                300 * kMiB, 300 * kMiB, false, source));
+
+  // PUFFDIFF only counts when there are deflates to diff.
+  PayloadVersion puffdiff(kChromeOSMajorPayloadVersion,
+                          kPuffdiffMinorPayloadVersion);
+  EXPECT_EQ(12 * kMiB,
+            diff_utils::EstimateDeltaMemory(kMiB, kMiB, false, puffdiff));
+  EXPECT_LT(12 * kMiB,
+            diff_utils::EstimateDeltaMemory(kMiB, kMiB, true, puffdiff));
+}
+
 TEST_F(DeltaDiffUtilsTest, IsNoopOperationTest) {
   InstallOperation op;
   op.set_type(InstallOperation::REPLACE_BZ);
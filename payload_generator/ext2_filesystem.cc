@@ -28,15 +28,23 @@
 #pragma clang diagnostic pop
 #endif
 
+#include <algorithm>
+#include <iterator>
 #include <map>
 #include <set>
+#include <utility>
 
 #include <base/logging.h>
 #include <base/strings/stringprintf.h>
+#include <base/threading/simple_thread.h>
+#include <base/time/time.h>
 
+#include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/delta_diff_utils.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/file_map_cache.h"
 #include "update_engine/update_metadata.pb.h"
 
 using std::set;
@@ -83,116 +91,100 @@ int AddMetadataBlocks(ext2_filsys fs,
   return 0;
 }
 
-struct UpdateFileAndAppendState {
-  std::map<ext2_ino_t, FilesystemInterface::File>* inodes = nullptr;
-  set<ext2_ino_t>* used_inodes = nullptr;
-  vector<FilesystemInterface::File>* files = nullptr;
-  ext2_filsys filsys;
+// Number of inode table blocks read at once while scanning the inodes.
+const int kInodeScanBufferBlocks = 256;
+
+// The inodes found in a range of block groups of the filesystem.
+struct InodeScanResult {
+  std::map<ext2_ino_t, FilesystemInterface::File> inodes;
+  // The directories, in increasing inode number.
+  vector<ext2_ino_t> directories;
+  // The indirect, double indirect and triple indirect blocks of all the
+  // inodes.
+  set<uint64_t> inode_blocks;
 };
 
-int UpdateFileAndAppend(ext2_ino_t dir,
-                        int entry,
-                        struct ext2_dir_entry* dirent,
-                        int offset,
-                        int blocksize,
-                        char* buf,
-                        void* priv_data) {
-  UpdateFileAndAppendState* state =
-      static_cast<UpdateFileAndAppendState*>(priv_data);
-  uint32_t file_type = dirent->name_len >> 8;
-  // Directories can't have hard links, and they are added from the outer loop.
-  if (file_type == EXT2_FT_DIR)
-    return 0;
+// This class scans the inodes of a range of block groups of the filesystem in
+// a worker thread, using its own handle to the filesystem since libext2fs
+// handles can't be shared between threads.
+class InodeScanProcessor : public base::DelegateSimpleThread::Delegate {
+ public:
+  InodeScanProcessor(const string& filename,
+                     dgrp_t first_group,
+                     dgrp_t end_group)
+      : filename_(filename), first_group_(first_group), end_group_(end_group) {}
+  InodeScanProcessor(InodeScanProcessor&&) = default;
+  ~InodeScanProcessor() override = default;
 
-  auto ino_file = state->inodes->find(dirent->inode);
-  if (ino_file == state->inodes->end())
-    return 0;
-  auto dir_file = state->inodes->find(dir);
-  if (dir_file == state->inodes->end())
-    return 0;
-  string basename(dirent->name, dirent->name_len & 0xff);
-  ino_file->second.name = dir_file->second.name;
-  if (dir_file->second.name != "/")
-    ino_file->second.name += "/";
-  ino_file->second.name += basename;
-
-  // Append this file to the output. If the file has a hard link, it will be
-  // added twice to the output, but with different names, which is ok. That will
-  // help identify all the versions of the same file.
-  state->files->push_back(ino_file->second);
-  state->used_inodes->insert(dirent->inode);
-  return 0;
-}
+  // Overrides DelegateSimpleThread::Delegate.
+  void Run() override;
 
-}  // namespace
+  bool failed() const { return failed_; }
+  InodeScanResult* result() { return &result_; }
 
-unique_ptr<Ext2Filesystem> Ext2Filesystem::CreateFromFile(
-    const string& filename) {
-  if (filename.empty())
-    return nullptr;
-  unique_ptr<Ext2Filesystem> result(new Ext2Filesystem());
-  result->filename_ = filename;
+ private:
+  bool ScanInodes(ext2_filsys filsys);
 
-  errcode_t err = ext2fs_open(filename.c_str(),
+  const string& filename_;  // NOLINT(runtime/member_string_references)
+  const dgrp_t first_group_;
+  const dgrp_t end_group_;
+
+  InodeScanResult result_;
+  bool failed_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(InodeScanProcessor);
+};
+
+void InodeScanProcessor::Run() {
+  ext2_filsys filsys = nullptr;
+  errcode_t err = ext2fs_open(filename_.c_str(),
                               0,  // flags (read only)
                               0,  // superblock block number
                               0,  // block_size (autodetect)
                               unix_io_manager,
-                              &result->filsys_);
+                              &filsys);
   if (err) {
-    LOG(ERROR) << "Opening ext2fs " << filename;
-    return nullptr;
+    LOG(ERROR) << "Opening ext2fs " << filename_ << " (error " << err << ")";
+    failed_ = true;
+    return;
   }
-  return result;
-}
-
-Ext2Filesystem::~Ext2Filesystem() {
-  ext2fs_free(filsys_);
-}
-
-size_t Ext2Filesystem::GetBlockSize() const {
-  return filsys_->blocksize;
-}
-
-size_t Ext2Filesystem::GetBlockCount() const {
-  return ext2fs_blocks_count(filsys_->super);
+  failed_ = !ScanInodes(filsys);
+  if (failed_) {
+    LOG(ERROR) << "Failed to scan the inodes of block groups " << first_group_
+               << " to " << end_group_ - 1;
+  }
+  ext2fs_free(filsys);
 }
 
-bool Ext2Filesystem::GetFiles(vector<File>* files) const {
-  TEST_AND_RETURN_FALSE_ERRCODE(ext2fs_read_inode_bitmap(filsys_));
+bool InodeScanProcessor::ScanInodes(ext2_filsys filsys) {
+  TEST_AND_RETURN_FALSE_ERRCODE(ext2fs_read_inode_bitmap(filsys));
 
   ext2_inode_scan iscan;
   TEST_AND_RETURN_FALSE_ERRCODE(
-      ext2fs_open_inode_scan(filsys_, 0 /* buffer_blocks */, &iscan));
-
-  std::map<ext2_ino_t, File> inodes;
-
-  // List of directories. We need to first parse all the files in a directory
-  // to later fix the absolute paths.
-  vector<ext2_ino_t> directories;
-
-  set<uint64_t> inode_blocks;
+      ext2fs_open_inode_scan(filsys, kInodeScanBufferBlocks, &iscan));
+  bool ok = ext2fs_inode_scan_goto_blockgroup(iscan, first_group_) == 0;
+  ext2_ino_t end_ino =
+      static_cast<ext2_ino_t>(end_group_) * filsys->super->s_inodes_per_group;
 
   // Iterator
   ext2_ino_t it_ino;
   ext2_inode it_inode;
 
-  bool ok = true;
-  while (true) {
+  while (ok) {
     errcode_t error = ext2fs_get_next_inode(iscan, &it_ino, &it_inode);
     if (error) {
       LOG(ERROR) << "Failed to retrieve next inode (" << error << ")";
       ok = false;
       break;
     }
-    if (it_ino == 0)
+    if (it_ino == 0 || it_ino > end_ino)
       break;
 
     // Skip inodes that are not in use.
-    if (!ext2fs_test_inode_bitmap(filsys_->inode_map, it_ino))
+    if (!ext2fs_test_inode_bitmap(filsys->inode_map, it_ino))
       continue;
 
-    File& file = inodes[it_ino];
+    FilesystemInterface::File& file = result_.inodes[it_ino];
     if (it_ino == EXT2_RESIZE_INO) {
       file.name = "<group-descriptors>";
     } else {
@@ -206,15 +198,16 @@ bool Ext2Filesystem::GetFiles(vector<File>* files) const {
     file.file_stat.st_uid = it_inode.i_uid;
     file.file_stat.st_gid = it_inode.i_gid;
     file.file_stat.st_size = it_inode.i_size;
-    file.file_stat.st_blksize = filsys_->blocksize;
+    file.file_stat.st_blksize = filsys->blocksize;
     file.file_stat.st_blocks = it_inode.i_blocks;
     file.file_stat.st_atime = it_inode.i_atime;
     file.file_stat.st_mtime = it_inode.i_mtime;
     file.file_stat.st_ctime = it_inode.i_ctime;
 
-    bool is_dir = (ext2fs_check_directory(filsys_, it_ino) == 0);
-    if (is_dir)
-      directories.push_back(it_ino);
+    // The inode was already read by the scan, so check its mode directly
+    // instead of reading it again with ext2fs_check_directory().
+    if (LINUX_S_ISDIR(it_inode.i_mode))
+      result_.directories.push_back(it_ino);
 
     if (!ext2fs_inode_has_valid_blocks(&it_inode))
       continue;
@@ -224,7 +217,7 @@ bool Ext2Filesystem::GetFiles(vector<File>* files) const {
     // and triple indirect blocks (no data blocks). For directories and
     // the journal, all blocks are considered metadata blocks.
     int flags = it_ino < EXT2_GOOD_OLD_FIRST_INO ? 0 : BLOCK_FLAG_DATA_ONLY;
-    error = ext2fs_block_iterate2(filsys_,
+    error = ext2fs_block_iterate2(filsys,
                                   it_ino,
                                   flags,
                                   nullptr,  // block_buf
@@ -237,52 +230,286 @@ bool Ext2Filesystem::GetFiles(vector<File>* files) const {
       continue;
     }
     if (it_ino >= EXT2_GOOD_OLD_FIRST_INO) {
-      ext2fs_block_iterate2(
-          filsys_, it_ino, 0, nullptr, AddMetadataBlocks, &inode_blocks);
+      ext2fs_block_iterate2(filsys,
+                            it_ino,
+                            0,
+                            nullptr,
+                            AddMetadataBlocks,
+                            &result_.inode_blocks);
     }
   }
   ext2fs_close_inode_scan(iscan);
-  if (!ok)
+  return ok;
+}
+
+// A directory entry that is not a directory.
+struct DirEntry {
+  ext2_ino_t ino;
+  string basename;
+};
+
+struct ListDirectoryState {
+  const set<ext2_ino_t>* directories = nullptr;
+  // The subdirectories and the rest of the entries of the directory.
+  vector<DirEntry>* subdirs = nullptr;
+  vector<DirEntry>* entries = nullptr;
+};
+
+int ListDirectory(ext2_ino_t dir,
+                  int entry,
+                  struct ext2_dir_entry* dirent,
+                  int offset,
+                  int blocksize,
+                  char* buf,
+                  void* priv_data) {
+  ListDirectoryState* state = static_cast<ListDirectoryState*>(priv_data);
+  string basename(dirent->name, dirent->name_len & 0xff);
+  if (basename == "." || basename == "..")
+    return 0;
+  // Directories can't have hard links, they are listed once from their
+  // parent directory.
+  if (state->directories->count(dirent->inode))
+    state->subdirs->push_back({dirent->inode, basename});
+  else
+    state->entries->push_back({dirent->inode, basename});
+  return 0;
+}
+
+// Lists the entries of the directory |dir_ino|, storing the ones in
+// |directories| in |subdirs| and the rest in |entries|.
+bool ListDirectoryEntries(ext2_filsys filsys,
+                          ext2_ino_t dir_ino,
+                          const set<ext2_ino_t>& directories,
+                          vector<DirEntry>* subdirs,
+                          vector<DirEntry>* entries) {
+  ListDirectoryState state;
+  state.directories = &directories;
+  state.subdirs = subdirs;
+  state.entries = entries;
+  errcode_t error = ext2fs_dir_iterate2(filsys,
+                                        dir_ino,
+                                        0,
+                                        nullptr /* block_buf */,
+                                        ListDirectory,
+                                        &state);
+  if (error) {
+    LOG(WARNING) << "Failed to enumerate files in directory on inode "
+                 << dir_ino << " (error " << error << ")";
     return false;
+  }
+  return true;
+}
+
+// Returns the path of the entry |basename| in the directory |dir_name|.
+string JoinPath(const string& dir_name, const string& basename) {
+  if (dir_name == "/")
+    return dir_name + basename;
+  return dir_name + "/" + basename;
+}
+
+}  // namespace
+
+unique_ptr<Ext2Filesystem> Ext2Filesystem::CreateFromFile(
+    const string& filename) {
+  if (filename.empty())
+    return nullptr;
+  unique_ptr<Ext2Filesystem> result(new Ext2Filesystem());
+  result->filename_ = filename;
+
+  errcode_t err = ext2fs_open(filename.c_str(),
+                              0,  // flags (read only)
+                              0,  // superblock block number
+                              0,  // block_size (autodetect)
+                              unix_io_manager,
+                              &result->filsys_);
+  if (err) {
+    LOG(ERROR) << "Opening ext2fs " << filename;
+    return nullptr;
+  }
+  return result;
+}
+
+Ext2Filesystem::~Ext2Filesystem() {
+  ext2fs_free(filsys_);
+}
+
+size_t Ext2Filesystem::GetBlockSize() const {
+  return filsys_->blocksize;
+}
+
+size_t Ext2Filesystem::GetBlockCount() const {
+  return ext2fs_blocks_count(filsys_->super);
+}
+
+bool Ext2Filesystem::GetFiles(vector<File>* files) const {
+  string cache_path;
+  if (!file_map_cache_dir_.empty()) {
+    brillo::Blob key;
+    if (ComputeContentKey(&key))
+      cache_path = FileMapCachePath(file_map_cache_dir_, key);
+    else
+      LOG(WARNING) << "Unable to compute the content key of " << filename_;
+    if (!cache_path.empty() && LoadFileMapCache(cache_path, files)) {
+      LOG(INFO) << "Loaded the list of files of " << filename_ << " from "
+                << cache_path;
+      return true;
+    }
+  }
+
+  TEST_AND_RETURN_FALSE(ListFiles(files));
+
+  if (!cache_path.empty() && !StoreFileMapCache(cache_path, *files))
+    LOG(WARNING) << "Unable to store the list of files in " << cache_path;
+  return true;
+}
+
+bool Ext2Filesystem::ComputeContentKey(brillo::Blob* key) const {
+  HashCalculator hasher;
+  TEST_AND_RETURN_FALSE(
+      hasher.Update(filsys_->super, sizeof(struct ext2_super_block)));
+  TEST_AND_RETURN_FALSE(hasher.Update(
+      filsys_->group_desc,
+      static_cast<size_t>(filsys_->group_desc_count) *
+          EXT2_DESC_SIZE(filsys_->super)));
+
+  // Hash the part of the inode table of each group in use. With the group
+  // descriptor checksums the unused inodes at the end of the table are never
+  // initialized, and reading them would only waste time.
+  const size_t inode_size = EXT2_INODE_SIZE(filsys_->super);
+  brillo::Blob table;
+  for (dgrp_t group = 0; group < filsys_->group_desc_count; group++) {
+    uint64_t used_inodes = filsys_->super->s_inodes_per_group;
+    if (ext2fs_has_group_desc_csum(filsys_))
+      used_inodes -= ext2fs_bg_itable_unused(filsys_, group);
+    uint64_t num_blocks = (used_inodes * inode_size + filsys_->blocksize - 1) /
+                          filsys_->blocksize;
+    if (num_blocks == 0)
+      continue;
+    table.resize(num_blocks * filsys_->blocksize);
+    errcode_t err =
+        io_channel_read_blk64(filsys_->io,
+                              ext2fs_inode_table_loc(filsys_, group),
+                              static_cast<int>(num_blocks),
+                              table.data());
+    if (err) {
+      LOG(ERROR) << "Reading the inode table of group " << group << " of "
+                 << filename_;
+      return false;
+    }
+    TEST_AND_RETURN_FALSE(hasher.Update(table.data(), table.size()));
+  }
+  TEST_AND_RETURN_FALSE(hasher.Finalize());
+  *key = hasher.raw_hash();
+  return true;
+}
+
+bool Ext2Filesystem::ListFiles(vector<File>* files) const {
+  // Scan the inode tables in parallel, splitting the block groups in ranges of
+  // consecutive groups. The results are merged in the order of the groups, so
+  // the output doesn't depend on the number of threads.
+  uint64_t group_count = filsys_->group_desc_count;
+  size_t num_workers = std::max<size_t>(
+      1, std::min<uint64_t>(diff_utils::GetMaxThreads(), group_count));
+  vector<InodeScanProcessor> processors;
+  processors.reserve(num_workers);
+  for (size_t i = 0; i < num_workers; i++) {
+    processors.emplace_back(filename_,
+                            group_count * i / num_workers,
+                            group_count * (i + 1) / num_workers);
+  }
+
+  base::TimeTicks start = base::TimeTicks::Now();
+  base::DelegateSimpleThreadPool thread_pool("ext2-inode-scan", num_workers);
+  thread_pool.Start();
+  for (InodeScanProcessor& processor : processors)
+    thread_pool.AddWork(&processor);
+  thread_pool.JoinAll();
+
+  std::map<ext2_ino_t, File> inodes;
+
+  // List of directories. We need to first parse all the files in a directory
+  // to later fix the absolute paths.
+  vector<ext2_ino_t> directories;
+
+  set<uint64_t> inode_blocks;
+
+  for (InodeScanProcessor& processor : processors) {
+    TEST_AND_RETURN_FALSE(!processor.failed());
+    InodeScanResult* result = processor.result();
+    inodes.insert(std::make_move_iterator(result->inodes.begin()),
+                  std::make_move_iterator(result->inodes.end()));
+    directories.insert(directories.end(),
+                       result->directories.begin(),
+                       result->directories.end());
+    inode_blocks.insert(result->inode_blocks.begin(),
+                        result->inode_blocks.end());
+  }
+  LOG(INFO) << "Scanned " << inodes.size() << " inodes of " << filename_
+            << " using " << num_workers << " threads in "
+            << (base::TimeTicks::Now() - start);
+
+  // Resolve the names of all the directories in a single pass over the
+  // directory tree starting from the root, listing the entries of each
+  // directory once.
+  set<ext2_ino_t> directory_set(directories.begin(), directories.end());
+  std::map<ext2_ino_t, vector<DirEntry>> dir_entries;
+  set<ext2_ino_t> named_dirs;
+  vector<ext2_ino_t> pending_dirs;
+  if (directory_set.count(EXT2_ROOT_INO)) {
+    inodes[EXT2_ROOT_INO].name = "/";
+    named_dirs.insert(EXT2_ROOT_INO);
+    pending_dirs.push_back(EXT2_ROOT_INO);
+  }
+  while (!pending_dirs.empty()) {
+    ext2_ino_t dir_ino = pending_dirs.back();
+    pending_dirs.pop_back();
+    vector<DirEntry> subdirs;
+    if (!ListDirectoryEntries(
+            filsys_, dir_ino, directory_set, &subdirs, &dir_entries[dir_ino])) {
+      continue;
+    }
+    const string& dir_name = inodes[dir_ino].name;
+    for (const DirEntry& subdir : subdirs) {
+      if (!named_dirs.insert(subdir.ino).second)
+        continue;
+      inodes[subdir.ino].name = JoinPath(dir_name, subdir.basename);
+      pending_dirs.push_back(subdir.ino);
+    }
+  }
 
   // The set of inodes already added to the output. There can be less elements
   // here than in files since the later can contain repeated inodes due to
   // hardlink files.
   set<ext2_ino_t> used_inodes;
 
-  UpdateFileAndAppendState priv_data;
-  priv_data.inodes = &inodes;
-  priv_data.used_inodes = &used_inodes;
-  priv_data.files = files;
-  priv_data.filsys = filsys_;
-
   files->clear();
-  // Iterate over all the files of each directory to update the name and add it.
+  // Add each directory followed by the files in it.
   for (ext2_ino_t dir_ino : directories) {
-    char* dir_name = nullptr;
-    errcode_t error = ext2fs_get_pathname(filsys_, dir_ino, 0, &dir_name);
-    if (error) {
-      // Not being able to read a directory name is not a fatal error, it is
-      // just skiped.
-      LOG(WARNING) << "Reading directory name on inode " << dir_ino
-                   << " (error " << error << ")";
-      inodes[dir_ino].name = base::StringPrintf("<dir-%u>", dir_ino);
-    } else {
-      inodes[dir_ino].name = dir_name;
-      files->push_back(inodes[dir_ino]);
+    File& dir_file = inodes[dir_ino];
+    if (named_dirs.count(dir_ino)) {
+      files->push_back(dir_file);
       used_inodes.insert(dir_ino);
+    } else {
+      // Not being able to find a directory from the root is not a fatal error,
+      // its files are added using a placeholder name for the directory.
+      LOG(WARNING) << "Directory on inode " << dir_ino
+                   << " is not reachable from the root directory.";
+      dir_file.name = base::StringPrintf("<dir-%u>", dir_ino);
+      vector<DirEntry> subdirs;
+      ListDirectoryEntries(
+          filsys_, dir_ino, directory_set, &subdirs, &dir_entries[dir_ino]);
     }
-    ext2fs_free_mem(&dir_name);
-
-    error = ext2fs_dir_iterate2(filsys_,
-                                dir_ino,
-                                0,
-                                nullptr /* block_buf */,
-                                UpdateFileAndAppend,
-                                &priv_data);
-    if (error) {
-      LOG(WARNING) << "Failed to enumerate files in directory "
-                   << inodes[dir_ino].name << " (error " << error << ")";
+
+    // If a file has a hard link, it will be added twice to the output, but with
+    // different names, which is ok. That will help identify all the versions
+    // of the same file.
+    for (const DirEntry& entry : dir_entries[dir_ino]) {
+      auto ino_file = inodes.find(entry.ino);
+      if (ino_file == inodes.end())
+        continue;
+      ino_file->second.name = JoinPath(dir_file.name, entry.basename);
+      files->push_back(ino_file->second);
+      used_inodes.insert(entry.ino);
     }
   }
 
@@ -33,6 +33,8 @@
 #pragma clang diagnostic pop
 #endif
 
+#include <brillo/secure_blob.h>
+
 namespace chromeos_update_engine {
 
 class Ext2Filesystem : public FilesystemInterface {
@@ -62,15 +64,34 @@ class Ext2Filesystem : public FilesystemInterface {
 
   bool LoadSettings(brillo::KeyValueStore* store) const override;
 
+  // Sets the directory where GetFiles() caches the list of files of the
+  // filesystem between runs. The cache is keyed by a hash of the filesystem
+  // metadata, so identical images share it and any change to the inodes
+  // misses it. An empty |dir| disables the cache.
+  void SetFileMapCacheDir(const std::string& dir) { file_map_cache_dir_ = dir; }
+
  private:
   Ext2Filesystem() = default;
 
+  // Computes in |key| a hash of the superblock, the group descriptors and the
+  // inode tables of the filesystem. These are updated by any change to the
+  // list of files or their blocks, but hashing them is much cheaper than
+  // listing the files or reading the whole image.
+  bool ComputeContentKey(brillo::Blob* key) const;
+
+  // Lists the files of the filesystem as described in GetFiles(), without
+  // using the cache.
+  bool ListFiles(std::vector<File>* files) const;
+
   // The ext2 main data structure holding the filesystem.
   ext2_filsys filsys_ = nullptr;
 
   // The file where the filesystem is stored.
   std::string filename_;
 
+  // The directory where the list of files is cached, if any.
+  std::string file_map_cache_dir_;
+
   DISALLOW_COPY_AND_ASSIGN(Ext2Filesystem);
 };
 
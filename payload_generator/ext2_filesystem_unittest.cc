@@ -23,6 +23,9 @@
 #include <string>
 #include <vector>
 
+#include <base/files/file_enumerator.h>
+#include <base/files/file_util.h>
+#include <base/files/scoped_temp_dir.h>
 #include <base/format_macros.h>
 #include <base/logging.h>
 #include <base/strings/string_number_conversions.h>
@@ -184,6 +187,56 @@ TEST_F(Ext2FilesystemTest, ParseGeneratedImages) {
   }
 }
 
+TEST_F(Ext2FilesystemTest, FileMapCacheTest) {
+  const string fs_path = GetBuildArtifactsPath("gen/disk_ext2_4k.img");
+  base::ScopedTempDir cache_dir;
+  ASSERT_TRUE(cache_dir.CreateUniqueTempDir());
+  auto CountCacheFiles = [&cache_dir]() {
+    base::FileEnumerator enumerator(
+        cache_dir.GetPath(), false, base::FileEnumerator::FILES);
+    int count = 0;
+    while (!enumerator.Next().empty())
+      count++;
+    return count;
+  };
+
+  unique_ptr<Ext2Filesystem> fs = Ext2Filesystem::CreateFromFile(fs_path);
+  ASSERT_NE(nullptr, fs.get());
+  vector<FilesystemInterface::File> expected_files;
+  EXPECT_TRUE(fs->GetFiles(&expected_files));
+
+  // A copy of the image has the same content key as the original, so after
+  // the first run stores the list of files in the cache, the second one
+  // loads it from there.
+  base::ScopedTempDir image_dir;
+  ASSERT_TRUE(image_dir.CreateUniqueTempDir());
+  const base::FilePath copy_path = image_dir.GetPath().Append("copy.img");
+  ASSERT_TRUE(base::CopyFile(base::FilePath(fs_path), copy_path));
+  for (const string& path : {fs_path, copy_path.value()}) {
+    fs = Ext2Filesystem::CreateFromFile(path);
+    ASSERT_NE(nullptr, fs.get());
+    fs->SetFileMapCacheDir(cache_dir.GetPath().value());
+    vector<FilesystemInterface::File> files;
+    EXPECT_TRUE(fs->GetFiles(&files));
+    ASSERT_EQ(expected_files.size(), files.size());
+    for (size_t j = 0; j < files.size(); j++) {
+      EXPECT_EQ(expected_files[j].name, files[j].name);
+      EXPECT_EQ(expected_files[j].extents, files[j].extents);
+      EXPECT_EQ(expected_files[j].file_stat.st_ino, files[j].file_stat.st_ino);
+    }
+    EXPECT_EQ(1, CountCacheFiles());
+  }
+
+  // A different filesystem gets its own cache.
+  fs = Ext2Filesystem::CreateFromFile(
+      GetBuildArtifactsPath("gen/disk_ext2_1k.img"));
+  ASSERT_NE(nullptr, fs.get());
+  fs->SetFileMapCacheDir(cache_dir.GetPath().value());
+  vector<FilesystemInterface::File> files;
+  EXPECT_TRUE(fs->GetFiles(&files));
+  EXPECT_EQ(2, CountCacheFiles());
+}
+
 TEST_F(Ext2FilesystemTest, LoadSettingsFailsTest) {
   unique_ptr<Ext2Filesystem> fs = Ext2Filesystem::CreateFromFile(
       GetBuildArtifactsPath("gen/disk_ext2_1k.img"));
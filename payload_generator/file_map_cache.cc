@@ -0,0 +1,144 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/file_map_cache.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include <sstream>
+
+#include <base/files/file_path.h>
+#include <base/files/file_util.h>
+#include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/stringprintf.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/update_metadata.pb.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The first line of a file map cache. It must be changed whenever the format
+// or the way the list of files is computed changes, to ignore older caches.
+const char kFileMapCacheHeader[] = "update_engine file map v1\n";
+
+}  // namespace
+
+string FileMapCachePath(const string& cache_dir, const brillo::Blob& key) {
+  return base::FilePath(cache_dir)
+      .Append(base::HexEncode(key.data(), key.size()) + ".filemap")
+      .value();
+}
+
+bool LoadFileMapCache(const string& path,
+                      vector<FilesystemInterface::File>* files) {
+  string data;
+  if (!base::ReadFileToString(base::FilePath(path), &data))
+    return false;
+  const size_t header_size = sizeof(kFileMapCacheHeader) - 1;
+  if (data.compare(0, header_size, kFileMapCacheHeader) != 0) {
+    LOG(WARNING) << "Ignoring file map cache " << path
+                 << " with an unknown format.";
+    return false;
+  }
+
+  // Each file is stored as the length of its name followed by the name, which
+  // may contain any character, the stat fields, and its extents.
+  std::istringstream stream(data.substr(header_size));
+  vector<FilesystemInterface::File> result;
+  size_t name_length;
+  while (stream >> name_length) {
+    FilesystemInterface::File file;
+    file.name.resize(name_length);
+    TEST_AND_RETURN_FALSE(stream.get() == ' ');
+    TEST_AND_RETURN_FALSE(stream.read(&file.name[0], name_length));
+
+    struct stat& st = file.file_stat;
+    uint64_t ino, mode, nlink, uid, gid, blksize, atime, mtime, ctime;
+    int64_t size, blocks;
+    size_t num_extents;
+    TEST_AND_RETURN_FALSE(stream >> ino >> mode >> nlink >> uid >> gid >>
+                          size >> blksize >> blocks >> atime >> mtime >>
+                          ctime >> num_extents);
+    st.st_ino = ino;
+    st.st_mode = mode;
+    st.st_nlink = nlink;
+    st.st_uid = uid;
+    st.st_gid = gid;
+    st.st_size = size;
+    st.st_blksize = blksize;
+    st.st_blocks = blocks;
+    st.st_atime = atime;
+    st.st_mtime = mtime;
+    st.st_ctime = ctime;
+
+    file.extents.reserve(num_extents);
+    for (size_t i = 0; i < num_extents; i++) {
+      uint64_t start_block, num_blocks;
+      TEST_AND_RETURN_FALSE(stream >> start_block >> num_blocks);
+      file.extents.push_back(ExtentForRange(start_block, num_blocks));
+    }
+    result.push_back(std::move(file));
+  }
+  TEST_AND_RETURN_FALSE(stream.eof());
+
+  *files = std::move(result);
+  return true;
+}
+
+bool StoreFileMapCache(const string& path,
+                       const vector<FilesystemInterface::File>& files) {
+  std::ostringstream stream;
+  stream << kFileMapCacheHeader;
+  for (const FilesystemInterface::File& file : files) {
+    const struct stat& st = file.file_stat;
+    stream << file.name.size() << ' ' << file.name << ' '
+           << static_cast<uint64_t>(st.st_ino) << ' '
+           << static_cast<uint64_t>(st.st_mode) << ' '
+           << static_cast<uint64_t>(st.st_nlink) << ' '
+           << static_cast<uint64_t>(st.st_uid) << ' '
+           << static_cast<uint64_t>(st.st_gid) << ' '
+           << static_cast<int64_t>(st.st_size) << ' '
+           << static_cast<uint64_t>(st.st_blksize) << ' '
+           << static_cast<int64_t>(st.st_blocks) << ' '
+           << static_cast<uint64_t>(st.st_atime) << ' '
+           << static_cast<uint64_t>(st.st_mtime) << ' '
+           << static_cast<uint64_t>(st.st_ctime) << ' ' << file.extents.size();
+    for (const Extent& extent : file.extents)
+      stream << ' ' << extent.start_block() << ' ' << extent.num_blocks();
+    stream << '\n';
+  }
+
+  string data = stream.str();
+  string temp_path = base::StringPrintf("%s.%d.tmp", path.c_str(), getpid());
+  TEST_AND_RETURN_FALSE(
+      utils::WriteFile(temp_path.c_str(), data.data(), data.size()));
+  if (rename(temp_path.c_str(), path.c_str()) != 0) {
+    PLOG(ERROR) << "Unable to rename " << temp_path << " to " << path;
+    unlink(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,51 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_FILE_MAP_CACHE_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_FILE_MAP_CACHE_H_
+
+#include <string>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+
+#include "update_engine/payload_generator/filesystem_interface.h"
+
+namespace chromeos_update_engine {
+
+// Helpers to store the list of files of a filesystem image in a file, so
+// listing the files of the same image again in a later run only requires
+// reading it back.
+
+// Returns the path of the file map cache in the directory |cache_dir| for an
+// image with the content key |key|, a hash of the filesystem metadata that
+// determines the list of files, so identical images share the cache.
+std::string FileMapCachePath(const std::string& cache_dir,
+                             const brillo::Blob& key);
+
+// Loads the list of |files| stored in the cache file |path|. Returns false if
+// the file doesn't exist or isn't a valid file map cache.
+bool LoadFileMapCache(const std::string& path,
+                      std::vector<FilesystemInterface::File>* files);
+
+// Stores the list of |files| in the cache file |path|. The file is replaced
+// atomically, so a concurrent reader never sees a partial cache.
+bool StoreFileMapCache(const std::string& path,
+                       const std::vector<FilesystemInterface::File>& files);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_FILE_MAP_CACHE_H_
@@ -0,0 +1,96 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/file_map_cache.h"
+
+#include <string>
+#include <vector>
+
+#include <base/files/file_path.h>
+#include <base/files/scoped_temp_dir.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class FileMapCacheTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_TRUE(temp_dir_.CreateUniqueTempDir());
+    cache_path_ = temp_dir_.GetPath().Append("cache.filemap").value();
+  }
+
+  base::ScopedTempDir temp_dir_;
+  string cache_path_;
+};
+
+TEST_F(FileMapCacheTest, StoreAndLoadTest) {
+  vector<FilesystemInterface::File> files(4);
+  files[0].name = "/";
+  files[0].file_stat.st_ino = 2;
+  files[0].file_stat.st_mode = 040755;
+  files[0].file_stat.st_mtime = 1234567890;
+  files[0].extents = {ExtentForRange(10, 1)};
+  // Names can contain spaces, newlines and look like numbers.
+  files[1].name = "/a file\nwith 12 34";
+  files[1].file_stat.st_size = 8192;
+  files[1].extents = {ExtentForRange(20, 2), ExtentForRange(5, 1)};
+  files[2].name = "/empty";
+  files[3].name = "<free-space>";
+  files[3].extents = {ExtentForRange(100, 1000)};
+
+  ASSERT_TRUE(StoreFileMapCache(cache_path_, files));
+  vector<FilesystemInterface::File> loaded;
+  ASSERT_TRUE(LoadFileMapCache(cache_path_, &loaded));
+
+  ASSERT_EQ(files.size(), loaded.size());
+  for (size_t i = 0; i < files.size(); i++) {
+    EXPECT_EQ(files[i].name, loaded[i].name);
+    EXPECT_EQ(files[i].extents, loaded[i].extents);
+    EXPECT_EQ(files[i].file_stat.st_ino, loaded[i].file_stat.st_ino);
+    EXPECT_EQ(files[i].file_stat.st_mode, loaded[i].file_stat.st_mode);
+    EXPECT_EQ(files[i].file_stat.st_size, loaded[i].file_stat.st_size);
+    EXPECT_EQ(files[i].file_stat.st_mtime, loaded[i].file_stat.st_mtime);
+  }
+}
+
+TEST_F(FileMapCacheTest, LoadInvalidCacheTest) {
+  vector<FilesystemInterface::File> files;
+  EXPECT_FALSE(LoadFileMapCache(cache_path_, &files));
+
+  ASSERT_TRUE(test_utils::WriteFileString(cache_path_, "/ 10-20\n"));
+  EXPECT_FALSE(LoadFileMapCache(cache_path_, &files));
+
+  ASSERT_TRUE(test_utils::WriteFileString(
+      cache_path_, "update_engine file map v1\n1 / 2 3"));
+  EXPECT_FALSE(LoadFileMapCache(cache_path_, &files));
+}
+
+TEST_F(FileMapCacheTest, CachePathDependsOnKeyTest) {
+  string dir = temp_dir_.GetPath().value();
+  string path1 = FileMapCachePath(dir, {0x01, 0xab});
+  EXPECT_EQ(temp_dir_.GetPath().Append("01AB.filemap").value(), path1);
+  EXPECT_EQ(path1, FileMapCachePath(dir, {0x01, 0xab}));
+  EXPECT_NE(path1, FileMapCachePath(dir, {0x01, 0xac}));
+}
+
+}  // namespace chromeos_update_engine
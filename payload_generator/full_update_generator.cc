@@ -32,6 +32,7 @@
 
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/partition_reader.h"
 
 using std::vector;
 
@@ -46,15 +47,15 @@ const size_t kDefaultFullChunkSize = 1024 * 1024;  // 1 MiB
 // it. The processor will destroy itself when the work is done.
 class ChunkProcessor : public base::DelegateSimpleThread::Delegate {
  public:
-  // Read a chunk of |size| bytes from |fd| starting at offset |offset|.
+  // Read a chunk of |size| bytes from |reader| starting at offset |offset|.
   ChunkProcessor(const PayloadVersion& version,
-                 int fd,
+                 const PartitionReader* reader,
                  off_t offset,
                  size_t size,
                  BlobFileWriter* blob_file,
                  AnnotatedOperation* aop)
       : version_(version),
-        fd_(fd),
+        reader_(reader),
         offset_(offset),
         size_(size),
         blob_file_(blob_file),
@@ -64,7 +65,7 @@ class ChunkProcessor : public base::DelegateSimpleThread::Delegate {
   ~ChunkProcessor() override = default;
 
   // Overrides DelegateSimpleThread::Delegate.
-  // Run() handles the read from |fd| in a thread-safe way, and stores the
+  // Run() handles the read from |reader| in a thread-safe way, and stores the
   // new operation to generate the region starting at |offset| of size |size|
   // in the output operation |aop|. The associated blob data is stored in
   // |blob_fd| and |blob_file_size| is updated.
@@ -75,7 +76,7 @@ class ChunkProcessor : public base::DelegateSimpleThread::Delegate {
 
   // Work parameters.
   const PayloadVersion& version_;
-  int fd_;
+  const PartitionReader* reader_;
   off_t offset_;
   size_t size_;
   BlobFileWriter* blob_file_;
@@ -94,10 +95,12 @@ void ChunkProcessor::Run() {
 bool ChunkProcessor::ProcessChunk() {
   brillo::Blob buffer_in_(size_);
   brillo::Blob op_blob;
-  ssize_t bytes_read = -1;
-  TEST_AND_RETURN_FALSE(utils::PReadAll(
-      fd_, buffer_in_.data(), buffer_in_.size(), offset_, &bytes_read));
-  TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(size_));
+  // The chunks known to be zeros, like the empty space of sparse images, don't
+  // need to be read.
+  if (!reader_->IsZero(offset_, size_)) {
+    TEST_AND_RETURN_FALSE(
+        reader_->Read(buffer_in_.data(), buffer_in_.size(), offset_));
+  }
 
   InstallOperation::Type op_type;
   TEST_AND_RETURN_FALSE(diff_utils::GenerateBestFullOperation(
@@ -142,9 +145,9 @@ bool FullUpdateGenerator::GenerateOperations(
             << " blocks (" << config.block_size << " bytes each) using "
             << max_threads << " threads";
 
-  int in_fd = open(new_part.path.c_str(), O_RDONLY, 0);
-  TEST_AND_RETURN_FALSE(in_fd >= 0);
-  ScopedFdCloser in_fd_closer(&in_fd);
+  std::unique_ptr<PartitionReader> reader =
+      PartitionReader::Open(new_part.path);
+  TEST_AND_RETURN_FALSE(reader);
 
   // We potentially have all the ChunkProcessors in memory but only
   // |max_threads| will actually hold a block in memory while we process.
@@ -172,7 +175,7 @@ bool FullUpdateGenerator::GenerateOperations(
 
     chunk_processors.emplace_back(
         config.version,
-        in_fd,
+        reader.get(),
         static_cast<off_t>(start_block) * config.block_size,
         num_blocks * config.block_size,
         blob_file,
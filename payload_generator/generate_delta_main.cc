@@ -14,6 +14,7 @@
 // limitations under the License.
 //
 
+#include <map>
 #include <string>
 #include <vector>
 
@@ -36,8 +37,10 @@
 #include "update_engine/payload_consumer/download_action.h"
 #include "update_engine/payload_consumer/filesystem_verifier_action.h"
 #include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/apply_cost_model.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/payload_generation_config.h"
+#include "update_engine/payload_generator/payload_shard.h"
 #include "update_engine/payload_generator/payload_signer.h"
 #include "update_engine/payload_generator/xz.h"
 #include "update_engine/update_metadata.pb.h"
@@ -165,6 +168,31 @@ void SignPayload(const string& in_file,
   }
 }
 
+int SignPayloadBatch(const string& batch_file, const string& private_keys) {
+  LOG(INFO) << "Signing payloads in batch.";
+  LOG_IF(FATAL, private_keys.empty())
+      << "Must pass --private_key to sign payloads in batch.";
+  string batch;
+  CHECK(utils::ReadFile(batch_file, &batch));
+  // One payload per line, ignoring empty lines and comments.
+  vector<string> payload_paths;
+  for (const string& line : base::SplitString(
+           batch, "\n", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY)) {
+    if (line[0] != '#')
+      payload_paths.push_back(line);
+  }
+
+  BatchPayloadSigner signer;
+  CHECK(signer.LoadKeys(base::SplitString(
+      private_keys, ":", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL)));
+  if (!signer.SignPayloads(payload_paths)) {
+    LOG(ERROR) << "Failed to sign some payloads. See errors above.";
+    return 1;
+  }
+  LOG(INFO) << "Done signing " << payload_paths.size() << " payloads.";
+  return 0;
+}
+
 int VerifySignedPayload(const string& in_file, const string& public_key) {
   LOG(INFO) << "Verifying signed payload.";
   LOG_IF(FATAL, in_file.empty())
@@ -268,6 +296,43 @@ bool ApplyPayload(const string& payload_file,
   return true;
 }
 
+int ReportApplyCost(const string& payload_file,
+                    const PayloadGenerationConfig& config,
+                    const string& device_profile_file,
+                    size_t calibration_samples,
+                    double max_apply_seconds,
+                    const string& report_file) {
+  LOG(INFO) << "Estimating the apply cost of " << payload_file;
+  ApplyDeviceProfile profile;
+  if (!device_profile_file.empty()) {
+    brillo::KeyValueStore store;
+    CHECK(store.Load(base::FilePath(device_profile_file)));
+    LOG_IF(FATAL, !profile.Load(store))
+        << "Invalid device profile in " << device_profile_file;
+  }
+  ApplyCostModel model(profile);
+  CHECK(model.LoadPayload(payload_file));
+
+  std::map<string, string> source_paths;
+  for (const PartitionConfig& part : config.source.partitions)
+    source_paths[part.name] = part.path;
+  xz_crc32_init();
+  CHECK(model.Calibrate(source_paths, calibration_samples));
+
+  vector<OperationApplyCost> costs = model.EstimateCosts();
+  CHECK(ApplyCostModel::WriteReport(report_file, costs));
+  double total_seconds = ApplyCostModel::TotalSeconds(costs);
+  LOG(INFO) << "Wrote the cost of " << costs.size() << " operations to "
+            << report_file << ". Predicted apply time: " << total_seconds
+            << "s.";
+  if (max_apply_seconds > 0 && total_seconds > max_apply_seconds) {
+    LOG(ERROR) << "The predicted apply time of " << total_seconds
+               << "s exceeds the limit of " << max_apply_seconds << "s.";
+    return 1;
+  }
+  return 0;
+}
+
 int ExtractProperties(const string& payload_path, const string& props_file) {
   brillo::KeyValueStore properties;
   TEST_AND_RETURN_FALSE(
@@ -297,7 +362,8 @@ int Main(int argc, char** argv) {
                 "Path to the new partitions. To pass multiple partitions, use "
                 "a single argument with a colon between paths, e.g. "
                 "/path/to/part:/path/to/part2:/path/to/last_part . Path has "
-                "to match the order of partition_names.");
+                "to match the order of partition_names. Android sparse images "
+                "are read without expanding them.");
   DEFINE_string(old_mapfiles,
                 "",
                 "Path to the .map files associated with the partition files "
@@ -309,6 +375,11 @@ int Main(int argc, char** argv) {
                 "",
                 "Path to the .map files associated with the partition files "
                 "in the new partition, similar to the -old_mapfiles flag.");
+  DEFINE_string(file_map_cache_dir,
+                "",
+                "Directory where the list of files of ext2/3/4 images is "
+                "cached between runs, keyed by a hash of the filesystem "
+                "metadata so identical images share the cache.");
   DEFINE_string(partition_names,
                 string(kPartitionNameRoot) + ":" + kPartitionNameKernel,
                 "Names of the partitions. To pass multiple names, use a single "
@@ -326,6 +397,12 @@ int Main(int argc, char** argv) {
   DEFINE_string(
       out_metadata_size_file, "", "Path to output metadata size file");
   DEFINE_string(private_key, "", "Path to private key in .pem format");
+  DEFINE_string(sign_batch_file,
+                "",
+                "Path to a file listing payloads to sign in place, one per "
+                "line, with all the keys passed in --private_key separated by "
+                "a colon. Payloads that already have room for the signatures "
+                "only get their signature blobs written.");
   DEFINE_string(public_key, "", "Path to public key in .pem format");
   DEFINE_int32(
       public_key_version, -1, "DEPRECATED. Key-check version # of client");
@@ -350,6 +427,42 @@ int Main(int argc, char** argv) {
                 "e.g. /path/to/sig:/path/to/next:/path/to/last_sig .");
   DEFINE_int32(
       chunk_size, 200 * 1024 * 1024, "Payload chunk size (-1 for whole files)");
+  DEFINE_bool(optimize_apply_order,
+              false,
+              "Reorder the operations of delta payloads so the source reads "
+              "during apply are more sequential.");
+  DEFINE_int32(compressibility_filter,
+               0,
+               "How aggressively to skip compressing or diffing data that "
+               "looks already compressed: 0 tries everything, 1 skips random "
+               "looking data, 2 also skips mostly random data.");
+  DEFINE_uint64(memory_budget_mb,
+                0,
+                "The memory, in MiB, used to generate the operations of a "
+                "delta payload in parallel. Big files wait for memory instead "
+                "of starting on every thread at once. 0 means 75% of the "
+                "physical memory.");
+  DEFINE_int32(client_lz4_version,
+               0,
+               "The LZ4 version number, as LZ4_versionNumber() returns it, of "
+               "the update_engine applying the payload. LZ4DIFF operations "
+               "are only generated when it's the version of this generator, "
+               "since other versions may not reproduce the LZ4 streams.");
+  DEFINE_bool(full_payload_zstd,
+              false,
+              "Allow REPLACE_ZSTD operations in a full payload. They "
+              "decompress faster than REPLACE_XZ, but only clients "
+              "supporting them can apply the payload.");
+  DEFINE_string(shard,
+                "",
+                "Generate only the shard <index>/<count> of the files of an "
+                "A/B delta payload, for example 0/4, and write it to "
+                "--out_file to be merged with --merge_shards.");
+  DEFINE_string(merge_shards,
+                "",
+                "Colon-separated list of the shard files generated with "
+                "--shard and the same images and options to merge into the "
+                "payload --out_file.");
   DEFINE_uint64(rootfs_partition_size,
                 chromeos_update_engine::kRootFSPartitionSize,
                 "RootFS partition size for the image once installed");
@@ -421,6 +534,24 @@ int Main(int argc, char** argv) {
                 "",
                 "An info file specifying dynamic partition metadata. "
                 "Only allowed in major version 2 or newer.");
+  DEFINE_string(apply_cost_report_file,
+                "",
+                "Path to write the predicted apply cost of every operation of "
+                "the payload passed in --in_file, as CSV. Operations reading "
+                "the source are calibrated with --old_partitions.");
+  DEFINE_string(device_profile_file,
+                "",
+                "A key-value file describing the device class the apply cost "
+                "is predicted for: CPU_SLOWDOWN, READ_BYTES_PER_SECOND, "
+                "WRITE_BYTES_PER_SECOND, SEEK_SECONDS and MEMORY_BUDGET.");
+  DEFINE_uint64(calibration_samples,
+                10,
+                "Number of operations of every type run locally to calibrate "
+                "the apply cost model.");
+  DEFINE_double(max_apply_seconds,
+                0,
+                "Fail if the predicted apply time exceeds this many seconds. "
+                "0 means no limit.");
 
   brillo::FlagHelper::Init(
       argc,
@@ -453,6 +584,9 @@ int Main(int argc, char** argv) {
                             FLAGS_in_file);
     return 0;
   }
+  if (!FLAGS_sign_batch_file.empty()) {
+    return SignPayloadBatch(FLAGS_sign_batch_file, FLAGS_private_key);
+  }
   if (!FLAGS_payload_signature_file.empty()) {
     SignPayload(FLAGS_in_file,
                 FLAGS_out_file,
@@ -529,6 +663,8 @@ int Main(int argc, char** argv) {
     payload_config.target.partitions.back().path = new_partitions[i];
     if (i < new_mapfiles.size())
       payload_config.target.partitions.back().mapfile_path = new_mapfiles[i];
+    payload_config.target.partitions.back().file_map_cache_dir =
+        FLAGS_file_map_cache_dir;
   }
 
   if (payload_config.is_delta) {
@@ -548,9 +684,22 @@ int Main(int argc, char** argv) {
       payload_config.source.partitions.back().path = old_partitions[i];
       if (i < old_mapfiles.size())
         payload_config.source.partitions.back().mapfile_path = old_mapfiles[i];
+      payload_config.source.partitions.back().file_map_cache_dir =
+          FLAGS_file_map_cache_dir;
     }
   }
 
+  if (!FLAGS_apply_cost_report_file.empty()) {
+    LOG_IF(FATAL, FLAGS_in_file.empty())
+        << "Must pass --in_file to report the apply cost.";
+    return ReportApplyCost(FLAGS_in_file,
+                           payload_config,
+                           FLAGS_device_profile_file,
+                           FLAGS_calibration_samples,
+                           FLAGS_max_apply_seconds,
+                           FLAGS_apply_cost_report_file);
+  }
+
   if (!FLAGS_in_file.empty()) {
     return ApplyPayload(FLAGS_in_file, payload_config) ? 0 : 1;
   }
@@ -566,6 +715,7 @@ int Main(int argc, char** argv) {
   // Use the default soft_chunk_size defined in the config.
   payload_config.hard_chunk_size = FLAGS_chunk_size;
   payload_config.block_size = kBlockSize;
+  payload_config.optimize_apply_order = FLAGS_optimize_apply_order;
 
   // The partition size is never passed to the delta_generator, so we
   // need to detect those from the provided files.
@@ -640,6 +790,26 @@ int Main(int argc, char** argv) {
     LOG(INFO) << "Using provided minor_version=" << FLAGS_minor_version;
   }
 
+  CHECK(FLAGS_compressibility_filter >=
+            static_cast<int>(CompressibilityFilter::kOff) &&
+        FLAGS_compressibility_filter <=
+            static_cast<int>(CompressibilityFilter::kAggressive))
+      << "Invalid --compressibility_filter=" << FLAGS_compressibility_filter;
+  payload_config.version.compressibility_filter =
+      static_cast<CompressibilityFilter>(FLAGS_compressibility_filter);
+  payload_config.version.memory_budget = FLAGS_memory_budget_mb * 1024 * 1024;
+  CHECK_GE(FLAGS_client_lz4_version, 0)
+      << "Invalid --client_lz4_version=" << FLAGS_client_lz4_version;
+  payload_config.version.client_lz4_version = FLAGS_client_lz4_version;
+  payload_config.version.full_payload_zstd = FLAGS_full_payload_zstd;
+
+  if (!FLAGS_shard.empty()) {
+    CHECK(FLAGS_merge_shards.empty())
+        << "--shard and --merge_shards are mutually exclusive.";
+    CHECK(ParsePayloadShard(FLAGS_shard, &payload_config.shard))
+        << "Invalid --shard=" << FLAGS_shard;
+  }
+
   payload_config.max_timestamp = FLAGS_max_timestamp;
 
   if (payload_config.version.minor >= kVerityMinorPayloadVersion)
@@ -654,9 +824,26 @@ int Main(int argc, char** argv) {
     return 1;
   }
 
+  if (!FLAGS_shard.empty())
+    return GenerateUpdatePayloadShard(payload_config, FLAGS_out_file) ? 0 : 1;
+
   uint64_t metadata_size;
-  if (!GenerateUpdatePayloadFile(
-          payload_config, FLAGS_out_file, FLAGS_private_key, &metadata_size)) {
+  if (!FLAGS_merge_shards.empty()) {
+    vector<string> shard_paths = base::SplitString(FLAGS_merge_shards,
+                                                   ":",
+                                                   base::TRIM_WHITESPACE,
+                                                   base::SPLIT_WANT_NONEMPTY);
+    if (!MergeUpdatePayloadShards(payload_config,
+                                  shard_paths,
+                                  FLAGS_out_file,
+                                  FLAGS_private_key,
+                                  &metadata_size)) {
+      return 1;
+    }
+  } else if (!GenerateUpdatePayloadFile(payload_config,
+                                        FLAGS_out_file,
+                                        FLAGS_private_key,
+                                        &metadata_size)) {
     return 1;
   }
   if (!FLAGS_out_metadata_size_file.empty()) {
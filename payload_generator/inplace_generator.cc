@@ -786,6 +786,7 @@ bool InplaceGenerator::GenerateOperations(const PayloadGenerationConfig& config,
                                                        hard_chunk_blocks,
                                                        soft_chunk_blocks,
                                                        config.version,
+                                                       PayloadShard(),
                                                        blob_file));
   LOG(INFO) << "Done reading " << new_part.name;
 
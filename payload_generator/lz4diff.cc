@@ -0,0 +1,176 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/lz4diff.h"
+
+#include <endian.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+
+#include <base/logging.h>
+#include <bsdiff/bsdiff.h>
+#include <bsdiff/patch_writer_factory.h>
+#include <lz4.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/lz4patch.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The compression levels tried to reproduce the streams, most common first:
+// the kernel builds use 9 or 12, and 1 is the default of the lz4 tool. Levels
+// 1 and 2 produce the same output.
+const int kLz4Levels[] = {12, 9, 1, 3, 4, 5, 6, 7, 8, 10, 11};
+
+// The quality of the patches, the same as the BROTLI_BSDIFF operations.
+const int kBrotliCompressionQuality = 11;
+
+// Whether |level| compresses |content| into the stream in the |size| bytes at
+// |data|. The first block is checked before compressing all the content,
+// which rules out most of the levels quickly.
+bool CompressesTo(const brillo::Blob& content,
+                  int level,
+                  const uint8_t* data,
+                  size_t size) {
+  brillo::Blob stream;
+  size_t first_block_size = std::min(content.size(), kLz4LegacyBlockSize);
+  if (!Lz4LegacyCompress(content.data(), first_block_size, level, &stream) ||
+      stream.size() > size || memcmp(stream.data(), data, stream.size()) != 0) {
+    return false;
+  }
+  if (first_block_size == content.size())
+    return stream.size() == size;
+  stream.clear();
+  return Lz4LegacyCompress(content.data(), content.size(), level, &stream) &&
+         stream.size() == size && memcmp(stream.data(), data, size) == 0;
+}
+
+// Returns |data| with the range of |stream| replaced by its content.
+brillo::Blob Decompressed(const brillo::Blob& data, const Lz4Stream& stream) {
+  brillo::Blob result(data.begin(), data.begin() + stream.offset);
+  result.insert(result.end(), stream.content.begin(), stream.content.end());
+  result.insert(
+      result.end(), data.begin() + stream.offset + stream.size, data.end());
+  return result;
+}
+
+}  // namespace
+
+bool FindLz4Stream(const brillo::Blob& data,
+                   size_t max_offset,
+                   Lz4Stream* stream) {
+  uint32_t magic = htole32(kLz4LegacyMagic);
+  size_t search_size =
+      std::min(data.size(), max_offset + sizeof(magic) - 1);
+  const uint8_t* begin = data.data();
+  const uint8_t* end = begin + search_size;
+  for (const uint8_t* pos = begin; pos < end; pos++) {
+    pos = static_cast<const uint8_t*>(
+        memmem(pos, end - pos, &magic, sizeof(magic)));
+    if (!pos)
+      break;
+    size_t offset = pos - begin;
+    brillo::Blob content;
+    size_t stream_size;
+    if (!Lz4LegacyDecompress(
+            pos, data.size() - offset, &content, &stream_size)) {
+      continue;
+    }
+    for (int level : kLz4Levels) {
+      if (CompressesTo(content, level, pos, stream_size)) {
+        stream->offset = offset;
+        stream->size = stream_size;
+        stream->content = std::move(content);
+        stream->level = level;
+        return true;
+      }
+    }
+    LOG(INFO) << "The LZ4 stream at offset " << offset << " of "
+              << stream_size << " bytes can't be reproduced.";
+  }
+  return false;
+}
+
+bool Lz4StreamsReproducible(uint32_t client_lz4_version) {
+  return client_lz4_version == static_cast<uint32_t>(LZ4_versionNumber());
+}
+
+bool Lz4Diff(const brillo::Blob& old_data,
+             const brillo::Blob& new_data,
+             size_t max_offset,
+             size_t max_decompressed_size,
+             brillo::Blob* patch) {
+  patch->clear();
+  Lz4Stream old_stream, new_stream;
+  if (!FindLz4Stream(old_data, max_offset, &old_stream) ||
+      !FindLz4Stream(new_data, max_offset, &new_stream)) {
+    return true;
+  }
+  if (old_data.size() - old_stream.size + old_stream.content.size() >
+          max_decompressed_size ||
+      new_data.size() - new_stream.size + new_stream.content.size() >
+          max_decompressed_size) {
+    LOG(INFO) << "LZ4 streams of " << old_stream.content.size() << " and "
+              << new_stream.content.size() << " bytes too big to diff.";
+    return true;
+  }
+
+  brillo::Blob old_decompressed = Decompressed(old_data, old_stream);
+  brillo::Blob new_decompressed = Decompressed(new_data, new_stream);
+  string patch_path;
+  TEST_AND_RETURN_FALSE(
+      utils::MakeTempFile("lz4diff-patch.XXXXXX", &patch_path, nullptr));
+  ScopedPathUnlinker patch_unlinker(patch_path);
+  std::unique_ptr<bsdiff::PatchWriterInterface> patch_writer =
+      bsdiff::CreateBSDF2PatchWriter(patch_path,
+                                     bsdiff::CompressorType::kBrotli,
+                                     kBrotliCompressionQuality);
+  TEST_AND_RETURN_FALSE(bsdiff::bsdiff(old_decompressed.data(),
+                                       old_decompressed.size(),
+                                       new_decompressed.data(),
+                                       new_decompressed.size(),
+                                       patch_writer.get(),
+                                       nullptr) == 0);
+  brillo::Blob bsdiff_patch;
+  TEST_AND_RETURN_FALSE(utils::ReadFile(patch_path, &bsdiff_patch));
+
+  Lz4diffHeader header;
+  header.src_stream_offset = old_stream.offset;
+  header.src_stream_size = old_stream.size;
+  header.src_content_size = old_stream.content.size();
+  header.dst_stream_offset = new_stream.offset;
+  header.dst_stream_size = new_stream.size;
+  header.dst_content_size = new_stream.content.size();
+  header.dst_compression_level = new_stream.level;
+  header.lz4_version = LZ4_versionNumber();
+  TEST_AND_RETURN_FALSE(
+      HashCalculator::RawHashOfBytes(new_data.data() + new_stream.offset,
+                                     new_stream.size,
+                                     &header.dst_stream_hash));
+  WriteLz4diffHeader(header, patch);
+  patch->insert(patch->end(), bsdiff_patch.begin(), bsdiff_patch.end());
+  return true;
+}
+
+}  // namespace chromeos_update_engine
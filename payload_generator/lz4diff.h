@@ -0,0 +1,66 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_LZ4DIFF_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_LZ4DIFF_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <brillo/secure_blob.h>
+
+namespace chromeos_update_engine {
+
+// A LZ4 legacy stream found in some data.
+struct Lz4Stream {
+  // The range of the data holding the stream.
+  size_t offset;
+  size_t size;
+  // The decompressed content of the stream.
+  brillo::Blob content;
+  // The compression level that produces the exact same stream from
+  // |content|.
+  int level;
+};
+
+// Looks for an LZ4 legacy stream starting at an offset lower than
+// |max_offset| in |data| that can be compressed back into the same bytes, and
+// stores it in |stream|. Returns whether such a stream was found.
+bool FindLz4Stream(const brillo::Blob& data,
+                   size_t max_offset,
+                   Lz4Stream* stream);
+
+// Whether the client, which uses |client_lz4_version| as LZ4_versionNumber(),
+// compresses the target streams into the exact same bytes as the generator.
+// The output of the LZ4 compressors changes between versions, so only the
+// same version is known to match.
+bool Lz4StreamsReproducible(uint32_t client_lz4_version);
+
+// Generates the data of an LZ4DIFF operation from |old_data| to |new_data|,
+// see lz4patch.h, in |patch|. The LZ4 streams must start at an offset lower
+// than |max_offset|, and the data with the streams decompressed must not
+// exceed |max_decompressed_size| bytes. Stores an empty |patch| if either
+// data doesn't hold a stream that can be compressed back into the same bytes
+// or is too big once decompressed.
+bool Lz4Diff(const brillo::Blob& old_data,
+             const brillo::Blob& new_data,
+             size_t max_offset,
+             size_t max_decompressed_size,
+             brillo::Blob* patch);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_LZ4DIFF_H_
@@ -0,0 +1,122 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/lz4diff.h"
+
+#include <gtest/gtest.h>
+#include <lz4.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/payload_consumer/lz4patch.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The maximum size of the data with the streams decompressed.
+const size_t kMaxDecompressedSize = 64 * 1024 * 1024;
+
+// Returns |size| bytes of compressible data, which vary with |seed|.
+brillo::Blob CompressibleData(size_t size, int seed) {
+  brillo::Blob data(size);
+  for (size_t i = 0; i < size; i++)
+    data[i] = (i / 7) % 13 + (i % 1000 == 0 ? i / 1000 + seed : 0);
+  return data;
+}
+
+// Returns |head_size| bytes of 0xff, followed by |content| compressed at
+// |level| and a few bytes of padding.
+brillo::Blob MakeData(size_t head_size,
+                      const brillo::Blob& content,
+                      int level) {
+  brillo::Blob data(head_size, 0xff);
+  EXPECT_TRUE(
+      Lz4LegacyCompress(content.data(), content.size(), level, &data));
+  data.insert(data.end(), {0x00, 0x00, 0x80, 0x02, 0, 0, 0, 0});
+  return data;
+}
+
+}  // namespace
+
+class Lz4DiffTest : public ::testing::Test {};
+
+TEST_F(Lz4DiffTest, FindLz4StreamTest) {
+  brillo::Blob content = CompressibleData(3 * 1024 * 1024, 0);
+  brillo::Blob data = MakeData(2048, content, 12);
+
+  Lz4Stream stream;
+  EXPECT_TRUE(FindLz4Stream(data, 4096, &stream));
+  EXPECT_EQ(2048U, stream.offset);
+  EXPECT_EQ(data.size() - 2048 - 8, stream.size);
+  EXPECT_EQ(content, stream.content);
+  EXPECT_EQ(12, stream.level);
+
+  // The stream starts too far into the data.
+  EXPECT_FALSE(FindLz4Stream(data, 2048, &stream));
+}
+
+TEST_F(Lz4DiffTest, NoLz4StreamTest) {
+  brillo::Blob old_data(8192);
+  test_utils::FillWithData(&old_data);
+  brillo::Blob new_data = MakeData(0, CompressibleData(10000, 0), 9);
+  brillo::Blob patch = {1};
+  EXPECT_TRUE(
+      Lz4Diff(old_data, new_data, 4096, kMaxDecompressedSize, &patch));
+  EXPECT_TRUE(patch.empty());
+}
+
+TEST_F(Lz4DiffTest, TooBigTest) {
+  brillo::Blob old_data = MakeData(0, CompressibleData(1024 * 1024, 0), 9);
+  brillo::Blob new_data = MakeData(0, CompressibleData(1024 * 1024, 1), 9);
+  brillo::Blob patch = {1};
+  EXPECT_TRUE(Lz4Diff(old_data, new_data, 4096, 1024 * 1024, &patch));
+  EXPECT_TRUE(patch.empty());
+}
+
+TEST_F(Lz4DiffTest, Lz4StreamsReproducibleTest) {
+  EXPECT_TRUE(Lz4StreamsReproducible(LZ4_versionNumber()));
+  EXPECT_FALSE(Lz4StreamsReproducible(0));
+  EXPECT_FALSE(Lz4StreamsReproducible(LZ4_versionNumber() + 1));
+}
+
+TEST_F(Lz4DiffTest, DiffAndPatchTest) {
+  brillo::Blob old_data = MakeData(0, CompressibleData(10 * 1024 * 1024, 0), 9);
+  brillo::Blob new_data =
+      MakeData(2048, CompressibleData(10 * 1024 * 1024 + 500, 1), 12);
+
+  brillo::Blob patch;
+  EXPECT_TRUE(
+      Lz4Diff(old_data, new_data, 4096, kMaxDecompressedSize, &patch));
+  ASSERT_FALSE(patch.empty());
+  EXPECT_LT(patch.size(), new_data.size() / 10);
+
+  Lz4diffHeader header;
+  EXPECT_TRUE(ParseLz4diffHeader(patch.data(), patch.size(), &header));
+  EXPECT_EQ(2048U, header.dst_stream_offset);
+  EXPECT_EQ(12U, header.dst_compression_level);
+  EXPECT_EQ(10U * 1024 * 1024, header.src_content_size);
+  EXPECT_EQ(static_cast<uint32_t>(LZ4_versionNumber()), header.lz4_version);
+
+  brillo::Blob patched;
+  EXPECT_TRUE(Lz4Patch(old_data, patch.data(), patch.size(), &patched));
+  EXPECT_EQ(new_data, patched);
+
+  // The target stream compressed by the client must match the hash.
+  patch[kLz4diffHeaderSize - 1] ^= 1;
+  EXPECT_FALSE(Lz4Patch(old_data, patch.data(), patch.size(), &patched));
+}
+
+}  // namespace chromeos_update_engine
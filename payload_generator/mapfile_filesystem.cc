@@ -28,6 +28,7 @@
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/partition_reader.h"
 #include "update_engine/update_metadata.pb.h"
 
 using std::string;
@@ -45,7 +46,7 @@ std::unique_ptr<MapfileFilesystem> MapfileFilesystem::CreateFromFile(
   if (filename.empty() || mapfile_filename.empty())
     return nullptr;
 
-  off_t file_size = utils::FileSize(filename);
+  off_t file_size = PartitionImageSize(filename);
   if (file_size < 0)
     return nullptr;
 
@@ -0,0 +1,141 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/memory_budget_scheduler.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <limits>
+#include <list>
+
+#include <base/logging.h>
+
+using std::list;
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The percentage of the physical memory used by default, leaving the rest to
+// the blob file cache and the other processes of the build.
+const uint64_t kDefaultBudgetPercent = 75;
+
+// How many later tasks may start before a task waiting for memory, per
+// thread. Past that, no task starts until the waiting one fits.
+const size_t kMaxOvertakesPerThread = 4;
+
+}  // namespace
+
+uint64_t GetDefaultMemoryBudget() {
+  long pages = sysconf(_SC_PHYS_PAGES);  // NOLINT(runtime/int)
+  long page_size = sysconf(_SC_PAGESIZE);  // NOLINT(runtime/int)
+  if (pages <= 0 || page_size <= 0) {
+    LOG(WARNING) << "Unknown physical memory size, not limiting the memory.";
+    return std::numeric_limits<uint64_t>::max();
+  }
+  return static_cast<uint64_t>(pages) * page_size * kDefaultBudgetPercent /
+         100;
+}
+
+// A thread of the pool, running the pending tasks until there are none left.
+class MemoryBudgetScheduler::Worker
+    : public base::DelegateSimpleThread::Delegate {
+ public:
+  explicit Worker(MemoryBudgetScheduler* scheduler) : scheduler_(scheduler) {}
+  ~Worker() override = default;
+
+  // Overrides DelegateSimpleThread::Delegate.
+  void Run() override {
+    Task task;
+    while (scheduler_->StartTask(&task)) {
+      task.delegate->Run();
+      scheduler_->FinishTask(task);
+    }
+  }
+
+ private:
+  MemoryBudgetScheduler* scheduler_;
+
+  DISALLOW_COPY_AND_ASSIGN(Worker);
+};
+
+MemoryBudgetScheduler::MemoryBudgetScheduler(uint64_t budget)
+    : budget_(budget), task_finished_(&lock_) {}
+
+void MemoryBudgetScheduler::AddTask(base::DelegateSimpleThread::Delegate* task,
+                                    uint64_t memory) {
+  base::AutoLock auto_lock(lock_);
+  pending_.push_back(Task{task, memory, 0});
+}
+
+void MemoryBudgetScheduler::Run(const string& name, size_t max_threads) {
+  size_t num_threads;
+  {
+    base::AutoLock auto_lock(lock_);
+    num_threads = std::max<size_t>(1, std::min(max_threads, pending_.size()));
+  }
+  max_overtakes_ = num_threads * kMaxOvertakesPerThread;
+
+  list<Worker> workers;
+  base::DelegateSimpleThreadPool thread_pool(name, num_threads);
+  thread_pool.Start();
+  for (size_t i = 0; i < num_threads; i++) {
+    workers.emplace_back(this);
+    thread_pool.AddWork(&workers.back());
+  }
+  thread_pool.JoinAll();
+}
+
+bool MemoryBudgetScheduler::StartTask(Task* task) {
+  base::AutoLock auto_lock(lock_);
+  // A task always fits when nothing else runs, so the tasks bigger than the
+  // budget still run, alone.
+  auto fits = [this](const Task& pending) {
+    return running_ == 0 || (used_memory_ <= budget_ &&
+                             pending.memory <= budget_ - used_memory_);
+  };
+  while (!pending_.empty()) {
+    auto it = pending_.begin();
+    if (!fits(*it)) {
+      it = pending_.front().overtaken < max_overtakes_
+               ? std::find_if(std::next(it), pending_.end(), fits)
+               : pending_.end();
+      if (it != pending_.end())
+        pending_.front().overtaken++;
+    }
+    if (it != pending_.end()) {
+      *task = *it;
+      pending_.erase(it);
+      used_memory_ += task->memory;
+      running_++;
+      peak_memory_ = std::max(peak_memory_, used_memory_);
+      return true;
+    }
+    task_finished_.Wait();
+  }
+  return false;
+}
+
+void MemoryBudgetScheduler::FinishTask(const Task& task) {
+  base::AutoLock auto_lock(lock_);
+  used_memory_ -= task.memory;
+  running_--;
+  task_finished_.Broadcast();
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,93 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_MEMORY_BUDGET_SCHEDULER_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_MEMORY_BUDGET_SCHEDULER_H_
+
+#include <stdint.h>
+
+#include <list>
+#include <string>
+
+#include <base/macros.h>
+#include <base/synchronization/condition_variable.h>
+#include <base/synchronization/lock.h>
+#include <base/threading/simple_thread.h>
+
+namespace chromeos_update_engine {
+
+// Returns the memory the payload generator may use by default, a fraction of
+// the physical memory of the machine.
+uint64_t GetDefaultMemoryBudget();
+
+// MemoryBudgetScheduler runs tasks on a pool of threads like a
+// DelegateSimpleThreadPool, but only starts a task while the memory estimated
+// for it fits in the budget along with the tasks already running. Small tasks
+// run at full parallelism while big ones are throttled instead of making the
+// process run out of memory.
+class MemoryBudgetScheduler {
+ public:
+  explicit MemoryBudgetScheduler(uint64_t budget);
+  ~MemoryBudgetScheduler() = default;
+
+  // Adds the |task| estimated to use |memory| bytes while it runs. The |task|
+  // must outlive the call to Run().
+  void AddTask(base::DelegateSimpleThread::Delegate* task, uint64_t memory);
+
+  // Runs all the added tasks on up to |max_threads| threads and returns when
+  // they are all done. The tasks start in the order they were added, except
+  // that the tasks after one that doesn't fit yet may start before it, a
+  // limited number of times so it isn't starved. A task bigger than the whole
+  // budget runs alone.
+  void Run(const std::string& name, size_t max_threads);
+
+  // The highest sum of the memory of the tasks running at the same time.
+  uint64_t peak_memory() const { return peak_memory_; }
+
+ private:
+  struct Task {
+    base::DelegateSimpleThread::Delegate* delegate;
+    uint64_t memory;
+    // How many later tasks started while this one was waiting at the front.
+    size_t overtaken;
+  };
+
+  class Worker;
+
+  // Blocks until a pending task fits and removes it in |task|. Returns false
+  // when there are no pending tasks left.
+  bool StartTask(Task* task);
+
+  // Releases the memory of the finished |task|.
+  void FinishTask(const Task& task);
+
+  const uint64_t budget_;
+  size_t max_overtakes_{0};
+
+  // The members below are protected with the |lock_|.
+  base::Lock lock_;
+  base::ConditionVariable task_finished_;
+  std::list<Task> pending_;
+  uint64_t used_memory_{0};
+  size_t running_{0};
+  uint64_t peak_memory_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(MemoryBudgetScheduler);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_MEMORY_BUDGET_SCHEDULER_H_
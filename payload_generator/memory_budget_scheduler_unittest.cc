@@ -0,0 +1,144 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/memory_budget_scheduler.h"
+
+#include <atomic>
+#include <list>
+
+#include <base/threading/platform_thread.h>
+#include <base/time/time.h>
+#include <gtest/gtest.h>
+
+using std::list;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Tracks the memory of the tasks running at the same time.
+struct MemoryTracker {
+  std::atomic<uint64_t> used{0};
+  std::atomic<uint64_t> peak{0};
+  std::atomic<int> running{0};
+  std::atomic<int> peak_running{0};
+};
+
+class FakeTask : public base::DelegateSimpleThread::Delegate {
+ public:
+  FakeTask(MemoryTracker* tracker, uint64_t memory)
+      : tracker_(tracker), memory_(memory) {}
+  ~FakeTask() override = default;
+
+  void Run() override {
+    uint64_t used = tracker_->used += memory_;
+    int running = ++tracker_->running;
+    UpdateMax(&tracker_->peak, used);
+    UpdateMax(&tracker_->peak_running, running);
+    base::PlatformThread::Sleep(base::TimeDelta::FromMilliseconds(20));
+    tracker_->used -= memory_;
+    tracker_->running--;
+    done_ = true;
+  }
+
+  bool done() const { return done_; }
+
+ private:
+  template <typename T>
+  static void UpdateMax(std::atomic<T>* max, T value) {
+    T current = *max;
+    while (current < value && !max->compare_exchange_weak(current, value)) {
+    }
+  }
+
+  MemoryTracker* tracker_;
+  uint64_t memory_;
+  bool done_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(FakeTask);
+};
+
+}  // namespace
+
+class MemoryBudgetSchedulerTest : public ::testing::Test {
+ protected:
+  // Adds a task using |memory| bytes to the |scheduler_|.
+  void AddTask(uint64_t memory) {
+    tasks_.emplace_back(&tracker_, memory);
+    scheduler_.AddTask(&tasks_.back(), memory);
+  }
+
+  void ExpectAllDone() {
+    for (const FakeTask& task : tasks_)
+      EXPECT_TRUE(task.done());
+  }
+
+  MemoryTracker tracker_;
+  list<FakeTask> tasks_;
+  MemoryBudgetScheduler scheduler_{1000};
+};
+
+TEST_F(MemoryBudgetSchedulerTest, SmallTasksRunInParallelTest) {
+  for (int i = 0; i < 16; i++)
+    AddTask(10);
+  scheduler_.Run("test", 4);
+  ExpectAllDone();
+  EXPECT_GE(4, tracker_.peak_running);
+  EXPECT_LT(1, tracker_.peak_running);
+}
+
+TEST_F(MemoryBudgetSchedulerTest, BigTasksAreThrottledTest) {
+  for (int i = 0; i < 8; i++)
+    AddTask(400);
+  scheduler_.Run("test", 8);
+  ExpectAllDone();
+  EXPECT_GE(2, tracker_.peak_running);
+  EXPECT_GE(800U, tracker_.peak);
+  EXPECT_GE(800U, scheduler_.peak_memory());
+}
+
+TEST_F(MemoryBudgetSchedulerTest, SmallTasksFillTheBudgetTest) {
+  AddTask(600);
+  AddTask(600);
+  for (int i = 0; i < 4; i++)
+    AddTask(100);
+  scheduler_.Run("test", 4);
+  ExpectAllDone();
+  EXPECT_GE(1000U, tracker_.peak);
+  // The small tasks ran along with one of the big ones.
+  EXPECT_LT(600U, tracker_.peak);
+}
+
+TEST_F(MemoryBudgetSchedulerTest, TaskBiggerThanBudgetRunsAloneTest) {
+  AddTask(5000);
+  AddTask(10);
+  AddTask(10);
+  scheduler_.Run("test", 4);
+  ExpectAllDone();
+  EXPECT_EQ(5000U, scheduler_.peak_memory());
+  EXPECT_EQ(5000U, tracker_.peak);
+}
+
+TEST_F(MemoryBudgetSchedulerTest, NoTasksTest) {
+  scheduler_.Run("test", 4);
+  EXPECT_EQ(0U, scheduler_.peak_memory());
+}
+
+TEST(MemoryBudgetTest, DefaultMemoryBudgetTest) {
+  EXPECT_LT(0U, GetDefaultMemoryBudget());
+}
+
+}  // namespace chromeos_update_engine
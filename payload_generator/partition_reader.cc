@@ -0,0 +1,356 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/partition_reader.h"
+
+#include <endian.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <map>
+#include <utility>
+
+#include <base/logging.h>
+#include <base/memory/ptr_util.h>
+#include <base/synchronization/lock.h>
+
+#include "update_engine/common/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The headers of the sparse image format, see
+// system/core/libsparse/sparse_format.h. All the fields are little endian.
+const uint32_t kSparseHeaderMagic = 0xed26ff3a;
+
+struct SparseHeader {
+  uint32_t magic;
+  uint16_t major_version;
+  uint16_t minor_version;
+  uint16_t file_hdr_sz;
+  uint16_t chunk_hdr_sz;
+  uint32_t blk_sz;
+  uint32_t total_blks;
+  uint32_t total_chunks;
+  uint32_t image_checksum;
+};
+
+struct ChunkHeader {
+  uint16_t chunk_type;
+  uint16_t reserved1;
+  uint32_t chunk_sz;
+  uint32_t total_sz;
+};
+
+using Chunk = PartitionReader::Chunk;
+using ChunkList = vector<Chunk>;
+
+// Parses the chunks of the sparse image |fd| of |file_size| bytes, whose
+// |header| was already read, into |chunks|.
+bool ParseSparseChunks(int fd,
+                       uint64_t file_size,
+                       const SparseHeader& header,
+                       ChunkList* chunks) {
+  TEST_AND_RETURN_FALSE(le16toh(header.major_version) == 1);
+  const uint16_t file_hdr_sz = le16toh(header.file_hdr_sz);
+  const uint16_t chunk_hdr_sz = le16toh(header.chunk_hdr_sz);
+  const uint64_t blk_sz = le32toh(header.blk_sz);
+  TEST_AND_RETURN_FALSE(file_hdr_sz >= sizeof(SparseHeader));
+  TEST_AND_RETURN_FALSE(chunk_hdr_sz >= sizeof(ChunkHeader));
+  TEST_AND_RETURN_FALSE(blk_sz > 0 && blk_sz % sizeof(uint32_t) == 0);
+
+  const uint32_t total_chunks = le32toh(header.total_chunks);
+  chunks->clear();
+  chunks->reserve(total_chunks);
+  uint64_t offset = 0;
+  uint64_t file_offset = file_hdr_sz;
+  for (uint32_t i = 0; i < total_chunks; i++) {
+    ChunkHeader chunk_header;
+    ssize_t bytes_read;
+    TEST_AND_RETURN_FALSE(utils::PReadAll(
+        fd, &chunk_header, sizeof(chunk_header), file_offset, &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read == sizeof(chunk_header));
+
+    Chunk chunk;
+    chunk.offset = offset;
+    chunk.size = le32toh(chunk_header.chunk_sz) * blk_sz;
+    chunk.type = static_cast<PartitionReader::ChunkType>(
+        le16toh(chunk_header.chunk_type));
+    chunk.data_offset = file_offset + chunk_hdr_sz;
+    chunk.fill_value = 0;
+    const uint64_t total_sz = le32toh(chunk_header.total_sz);
+    TEST_AND_RETURN_FALSE(total_sz >= chunk_hdr_sz);
+    const uint64_t data_size = total_sz - chunk_hdr_sz;
+    TEST_AND_RETURN_FALSE(chunk.data_offset + data_size <= file_size);
+
+    switch (chunk.type) {
+      case PartitionReader::kChunkRaw:
+        TEST_AND_RETURN_FALSE(data_size == chunk.size);
+        break;
+      case PartitionReader::kChunkFill:
+        TEST_AND_RETURN_FALSE(data_size == sizeof(chunk.fill_value));
+        // The value is kept in the byte order of the image, since it is
+        // repeated as is.
+        TEST_AND_RETURN_FALSE(utils::PReadAll(fd,
+                                              &chunk.fill_value,
+                                              sizeof(chunk.fill_value),
+                                              chunk.data_offset,
+                                              &bytes_read));
+        TEST_AND_RETURN_FALSE(bytes_read == sizeof(chunk.fill_value));
+        break;
+      case PartitionReader::kChunkDontCare:
+        TEST_AND_RETURN_FALSE(data_size == 0);
+        break;
+      case PartitionReader::kChunkCrc32:
+        // The checksum of the data so far doesn't cover any block.
+        TEST_AND_RETURN_FALSE(data_size == sizeof(uint32_t));
+        TEST_AND_RETURN_FALSE(chunk.size == 0);
+        break;
+      default:
+        LOG(ERROR) << "Unknown chunk type 0x" << std::hex << chunk.type
+                   << " in sparse image.";
+        return false;
+    }
+    if (chunk.size > 0)
+      chunks->push_back(chunk);
+    offset += chunk.size;
+    file_offset = chunk.data_offset + data_size;
+  }
+  TEST_AND_RETURN_FALSE(offset == le32toh(header.total_blks) * blk_sz);
+  return true;
+}
+
+// The chunks of a sparse image file, parsed once per version of the file since
+// the image is read by many short-lived readers.
+struct CachedChunks {
+  dev_t dev;
+  ino_t ino;
+  uint64_t size;
+  struct timespec mtime;
+  std::shared_ptr<const ChunkList> chunks;
+
+  bool Matches(const struct stat& stbuf, uint64_t file_size) const {
+    return dev == stbuf.st_dev && ino == stbuf.st_ino && size == file_size &&
+           mtime.tv_sec == stbuf.st_mtim.tv_sec &&
+           mtime.tv_nsec == stbuf.st_mtim.tv_nsec;
+  }
+};
+
+// Returns the chunks of the sparse image |fd| of |file_size| bytes at |path|,
+// whose |header| was already read, or nullptr on error.
+std::shared_ptr<const ChunkList> LoadSparseChunks(const string& path,
+                                                  int fd,
+                                                  uint64_t file_size,
+                                                  const struct stat& stbuf,
+                                                  const SparseHeader& header) {
+  static base::Lock* cache_lock = new base::Lock();
+  static std::map<string, CachedChunks>* cache =
+      new std::map<string, CachedChunks>();
+  {
+    base::AutoLock auto_lock(*cache_lock);
+    auto it = cache->find(path);
+    if (it != cache->end() && it->second.Matches(stbuf, file_size))
+      return it->second.chunks;
+  }
+
+  auto chunks = std::make_shared<ChunkList>();
+  if (!ParseSparseChunks(fd, file_size, header, chunks.get())) {
+    LOG(ERROR) << "Invalid sparse image " << path;
+    return nullptr;
+  }
+  LOG(INFO) << "Reading sparse image " << path << " with " << chunks->size()
+            << " chunks.";
+  base::AutoLock auto_lock(*cache_lock);
+  (*cache)[path] = CachedChunks{
+      stbuf.st_dev, stbuf.st_ino, file_size, stbuf.st_mtim, chunks};
+  return chunks;
+}
+
+}  // namespace
+
+std::unique_ptr<PartitionReader> PartitionReader::Open(const string& path) {
+  int fd = HANDLE_EINTR(open(path.c_str(), O_RDONLY));
+  if (fd < 0) {
+    PLOG(ERROR) << "Unable to open " << path;
+    return nullptr;
+  }
+  ScopedFdCloser fd_closer(&fd);
+  struct stat stbuf;
+  if (fstat(fd, &stbuf) != 0) {
+    PLOG(ERROR) << "Unable to stat " << path;
+    return nullptr;
+  }
+  // The st_size of a block device is 0, so get its size from the device.
+  off_t file_size = utils::FileSize(fd);
+  if (file_size < 0) {
+    LOG(ERROR) << "Unable to get the size of " << path;
+    return nullptr;
+  }
+
+  SparseHeader header;
+  ssize_t bytes_read = 0;
+  if (!utils::PReadAll(fd, &header, sizeof(header), 0, &bytes_read))
+    return nullptr;
+
+  std::shared_ptr<const ChunkList> chunks;
+  bool is_sparse = bytes_read == sizeof(header) &&
+                   le32toh(header.magic) == kSparseHeaderMagic;
+  if (is_sparse) {
+    chunks = LoadSparseChunks(path, fd, file_size, stbuf, header);
+    if (!chunks)
+      return nullptr;
+  } else {
+    // A raw image is a single chunk with all the data.
+    auto raw_chunks = std::make_shared<ChunkList>();
+    if (file_size > 0) {
+      raw_chunks->push_back(
+          Chunk{0, static_cast<uint64_t>(file_size), kChunkRaw, 0, 0});
+    }
+    chunks = std::move(raw_chunks);
+  }
+
+  fd_closer.set_should_close(false);
+  return base::WrapUnique(new PartitionReader(fd, chunks, is_sparse));
+}
+
+PartitionReader::PartitionReader(int fd,
+                                 std::shared_ptr<const ChunkList> chunks,
+                                 bool is_sparse)
+    : fd_(fd), chunks_(chunks), is_sparse_(is_sparse) {
+  if (!chunks_->empty())
+    size_ = chunks_->back().offset + chunks_->back().size;
+}
+
+PartitionReader::~PartitionReader() {
+  ScopedFdCloser fd_closer(&fd_);
+}
+
+bool PartitionReader::Read(void* buf, size_t count, uint64_t offset) const {
+  TEST_AND_RETURN_FALSE(offset <= size_ && count <= size_ - offset);
+  uint8_t* out = static_cast<uint8_t*>(buf);
+  // The first chunk ending after |offset|.
+  auto chunk = std::upper_bound(
+      chunks_->begin(),
+      chunks_->end(),
+      offset,
+      [](uint64_t offset, const Chunk& chunk) {
+        return offset < chunk.offset + chunk.size;
+      });
+  for (; count > 0; ++chunk) {
+    const uint64_t chunk_offset = offset - chunk->offset;
+    const size_t bytes = std::min(static_cast<uint64_t>(count),
+                                  chunk->size - chunk_offset);
+    if (chunk->type == kChunkRaw) {
+      ssize_t bytes_read;
+      TEST_AND_RETURN_FALSE(utils::PReadAll(
+          fd_, out, bytes, chunk->data_offset + chunk_offset, &bytes_read));
+      TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(bytes));
+    } else if (chunk->type == kChunkFill && chunk->fill_value != 0) {
+      const uint8_t* fill =
+          reinterpret_cast<const uint8_t*>(&chunk->fill_value);
+      for (size_t i = 0; i < bytes; i++)
+        out[i] = fill[(chunk_offset + i) % sizeof(chunk->fill_value)];
+    } else {
+      memset(out, 0, bytes);
+    }
+    out += bytes;
+    offset += bytes;
+    count -= bytes;
+  }
+  return true;
+}
+
+bool PartitionReader::IsZero(uint64_t offset, uint64_t count) const {
+  if (offset > size_ || count > size_ - offset)
+    return false;
+  for (const Chunk& chunk : *chunks_) {
+    if (chunk.offset + chunk.size <= offset)
+      continue;
+    if (chunk.offset >= offset + count)
+      break;
+    if (chunk.type == kChunkRaw ||
+        (chunk.type == kChunkFill && chunk.fill_value != 0))
+      return false;
+  }
+  return true;
+}
+
+bool ReadPartitionExtents(const PartitionReader& reader,
+                          const vector<Extent>& extents,
+                          brillo::Blob* out_data,
+                          ssize_t out_data_size,
+                          size_t block_size) {
+  brillo::Blob data(out_data_size);
+  ssize_t bytes_read = 0;
+  for (const Extent& extent : extents) {
+    ssize_t bytes = extent.num_blocks() * block_size;
+    TEST_AND_RETURN_FALSE(bytes_read + bytes <= out_data_size);
+    TEST_AND_RETURN_FALSE(reader.Read(
+        data.data() + bytes_read, bytes, extent.start_block() * block_size));
+    bytes_read += bytes;
+  }
+  TEST_AND_RETURN_FALSE(out_data_size == bytes_read);
+  *out_data = std::move(data);
+  return true;
+}
+
+bool ReadPartitionExtents(const string& path,
+                          const vector<Extent>& extents,
+                          brillo::Blob* out_data,
+                          ssize_t out_data_size,
+                          size_t block_size) {
+  std::unique_ptr<PartitionReader> reader = PartitionReader::Open(path);
+  TEST_AND_RETURN_FALSE(reader);
+  return ReadPartitionExtents(
+      *reader, extents, out_data, out_data_size, block_size);
+}
+
+bool ReadPartitionChunk(const PartitionReader& reader,
+                        uint64_t offset,
+                        size_t count,
+                        brillo::Blob* out_data) {
+  // Like utils::ReadFileChunk(), only read up to the end of the partition.
+  if (offset >= reader.size())
+    return true;
+  count = std::min(static_cast<uint64_t>(count), reader.size() - offset);
+  size_t old_size = out_data->size();
+  out_data->resize(old_size + count);
+  return reader.Read(out_data->data() + old_size, count, offset);
+}
+
+bool ReadPartitionChunk(const string& path,
+                        uint64_t offset,
+                        size_t count,
+                        brillo::Blob* out_data) {
+  std::unique_ptr<PartitionReader> reader = PartitionReader::Open(path);
+  TEST_AND_RETURN_FALSE(reader);
+  return ReadPartitionChunk(*reader, offset, count, out_data);
+}
+
+off_t PartitionImageSize(const string& path) {
+  std::unique_ptr<PartitionReader> reader = PartitionReader::Open(path);
+  if (!reader)
+    return -1;
+  return reader->size();
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,136 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_PARTITION_READER_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_PARTITION_READER_H_
+
+#include <sys/types.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// Reads the content of a partition from its image file, which can be either a
+// raw image or an Android sparse image. Sparse images are read in place
+// without expanding them: the data of the RAW chunks is read from the image
+// file, and the FILL and DONT_CARE chunks are generated on the fly. The
+// DONT_CARE chunks read as zeros, like in the image expanded by simg2img.
+class PartitionReader {
+ public:
+  // Opens the image file at |path|. Returns nullptr on error.
+  static std::unique_ptr<PartitionReader> Open(const std::string& path);
+
+  ~PartitionReader();
+
+  // The size in bytes of the partition, which is the expanded size for sparse
+  // images.
+  uint64_t size() const { return size_; }
+
+  bool is_sparse() const { return is_sparse_; }
+
+  // Reads the |count| bytes of the partition at |offset| into |buf|. Returns
+  // false on error or if the range is past the end of the partition. It is
+  // safe to call it from several threads at the same time.
+  bool Read(void* buf, size_t count, uint64_t offset) const;
+
+  // Returns whether the |count| bytes at |offset| are known to be zeros
+  // without reading them, because they are in DONT_CARE chunks or FILL chunks
+  // of zeros of a sparse image.
+  bool IsZero(uint64_t offset, uint64_t count) const;
+
+  // The chunk types of the sparse image format, see
+  // system/core/libsparse/sparse_format.h.
+  enum ChunkType : uint16_t {
+    kChunkRaw = 0xCAC1,
+    kChunkFill = 0xCAC2,
+    kChunkDontCare = 0xCAC3,
+    kChunkCrc32 = 0xCAC4,
+  };
+
+  // A range of the partition with the same kind of content.
+  struct Chunk {
+    // The range of the partition covered, in bytes.
+    uint64_t offset;
+    uint64_t size;
+    ChunkType type;
+    // The offset of the data in the image file for kChunkRaw chunks.
+    uint64_t data_offset;
+    // The 32-bit value repeated over the range for kChunkFill chunks.
+    uint32_t fill_value;
+  };
+
+ private:
+  PartitionReader(int fd,
+                  std::shared_ptr<const std::vector<Chunk>> chunks,
+                  bool is_sparse);
+
+  // The image file.
+  int fd_;
+  // The chunks of the partition, in order, covering all of it. Raw images
+  // have a single kChunkRaw chunk.
+  std::shared_ptr<const std::vector<Chunk>> chunks_;
+  uint64_t size_{0};
+  bool is_sparse_;
+
+  DISALLOW_COPY_AND_ASSIGN(PartitionReader);
+};
+
+// Reads the data in |extents| of the partition of |reader| into |out_data|,
+// like utils::ReadExtents() but also for sparse images. |out_data_size| is the
+// size of |out_data|. Returns false if the number of bytes to read given in
+// |extents| does not equal |out_data_size|.
+bool ReadPartitionExtents(const PartitionReader& reader,
+                          const std::vector<Extent>& extents,
+                          brillo::Blob* out_data,
+                          ssize_t out_data_size,
+                          size_t block_size);
+
+// Same as above, but for the partition image at |path|. Prefer the version
+// above when reading the same image several times, since this one opens it on
+// every call.
+bool ReadPartitionExtents(const std::string& path,
+                          const std::vector<Extent>& extents,
+                          brillo::Blob* out_data,
+                          ssize_t out_data_size,
+                          size_t block_size);
+
+// Reads the |count| bytes at |offset| of the partition of |reader| and appends
+// them to |out_data|, like utils::ReadFileChunk().
+bool ReadPartitionChunk(const PartitionReader& reader,
+                        uint64_t offset,
+                        size_t count,
+                        brillo::Blob* out_data);
+
+// Same as above, but for the partition image at |path|.
+bool ReadPartitionChunk(const std::string& path,
+                        uint64_t offset,
+                        size_t count,
+                        brillo::Blob* out_data);
+
+// Returns the size in bytes of the partition in the image at |path|, or -1 on
+// error.
+off_t PartitionImageSize(const std::string& path);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_PARTITION_READER_H_
@@ -0,0 +1,262 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/partition_reader.h"
+
+#include <endian.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const uint32_t kSparseBlockSize = 1024;
+
+// Builds an Android sparse image and the raw image it expands to.
+class SparseImageBuilder {
+ public:
+  void AddRaw(const brillo::Blob& data) {
+    ASSERT_EQ(0U, data.size() % kSparseBlockSize);
+    AddChunk(PartitionReader::kChunkRaw, data.size() / kSparseBlockSize, data);
+    raw_.insert(raw_.end(), data.begin(), data.end());
+  }
+
+  void AddFill(uint32_t num_blocks, const brillo::Blob& fill) {
+    ASSERT_EQ(4U, fill.size());
+    AddChunk(PartitionReader::kChunkFill, num_blocks, fill);
+    for (size_t i = 0; i < num_blocks * kSparseBlockSize; i++)
+      raw_.push_back(fill[i % fill.size()]);
+  }
+
+  void AddDontCare(uint32_t num_blocks) {
+    AddChunk(PartitionReader::kChunkDontCare, num_blocks, {});
+    raw_.resize(raw_.size() + num_blocks * kSparseBlockSize);
+  }
+
+  void AddCrc32() { AddChunk(PartitionReader::kChunkCrc32, 0, {0, 0, 0, 0}); }
+
+  // Returns the sparse image, declaring |total_blocks| blocks if not 0.
+  brillo::Blob Build(uint32_t total_blocks = 0) const {
+    brillo::Blob image;
+    Append32(&image, 0xed26ff3a);
+    Append16(&image, 1);   // major_version
+    Append16(&image, 0);   // minor_version
+    Append16(&image, 28);  // file_hdr_sz
+    Append16(&image, 12);  // chunk_hdr_sz
+    Append32(&image, kSparseBlockSize);
+    Append32(&image, total_blocks ? total_blocks : total_blocks_);
+    Append32(&image, num_chunks_);
+    Append32(&image, 0);  // image_checksum
+    image.insert(image.end(), chunks_.begin(), chunks_.end());
+    return image;
+  }
+
+  const brillo::Blob& raw() const { return raw_; }
+
+ private:
+  static void Append16(brillo::Blob* blob, uint16_t value) {
+    value = htole16(value);
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+    blob->insert(blob->end(), bytes, bytes + sizeof(value));
+  }
+
+  static void Append32(brillo::Blob* blob, uint32_t value) {
+    value = htole32(value);
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+    blob->insert(blob->end(), bytes, bytes + sizeof(value));
+  }
+
+  void AddChunk(uint16_t type, uint32_t num_blocks, const brillo::Blob& data) {
+    Append16(&chunks_, type);
+    Append16(&chunks_, 0);
+    Append32(&chunks_, num_blocks);
+    Append32(&chunks_, 12 + data.size());
+    chunks_.insert(chunks_.end(), data.begin(), data.end());
+    num_chunks_++;
+    total_blocks_ += num_blocks;
+  }
+
+  brillo::Blob chunks_;
+  uint32_t num_chunks_{0};
+  uint32_t total_blocks_{0};
+  brillo::Blob raw_;
+};
+
+}  // namespace
+
+class PartitionReaderTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    brillo::Blob data(2 * kSparseBlockSize);
+    test_utils::FillWithData(&data);
+    builder_.AddRaw(data);
+    builder_.AddFill(1, {1, 2, 3, 4});
+    builder_.AddDontCare(2);
+    builder_.AddCrc32();
+    data.resize(kSparseBlockSize);
+    builder_.AddRaw(data);
+    builder_.AddFill(1, {0, 0, 0, 0});
+  }
+
+  // Writes the sparse image to |image_file_| and opens it.
+  std::unique_ptr<PartitionReader> OpenSparseImage() {
+    EXPECT_TRUE(
+        test_utils::WriteFileVector(image_file_.path(), builder_.Build()));
+    return PartitionReader::Open(image_file_.path());
+  }
+
+  SparseImageBuilder builder_;
+  test_utils::ScopedTempFile image_file_{"PartitionReaderTest.XXXXXX"};
+};
+
+TEST_F(PartitionReaderTest, RawImageTest) {
+  const brillo::Blob& raw = builder_.raw();
+  ASSERT_TRUE(test_utils::WriteFileVector(image_file_.path(), raw));
+  std::unique_ptr<PartitionReader> reader =
+      PartitionReader::Open(image_file_.path());
+  ASSERT_TRUE(reader);
+  EXPECT_FALSE(reader->is_sparse());
+  EXPECT_EQ(raw.size(), reader->size());
+
+  brillo::Blob data(100);
+  EXPECT_TRUE(reader->Read(data.data(), data.size(), 1000));
+  EXPECT_EQ(brillo::Blob(raw.begin() + 1000, raw.begin() + 1100), data);
+  // The zeros of a raw image are only known after reading them.
+  EXPECT_FALSE(reader->IsZero(3 * kSparseBlockSize, kSparseBlockSize));
+  EXPECT_FALSE(reader->Read(data.data(), data.size(), raw.size() - 10));
+}
+
+// The st_size of a block device is 0, so its size must come from the device.
+TEST_F(PartitionReaderTest, RunAsRootBlockDeviceTest) {
+  const brillo::Blob& raw = builder_.raw();
+  ASSERT_TRUE(test_utils::WriteFileVector(image_file_.path(), raw));
+  std::string dev;
+  test_utils::ScopedLoopbackDeviceBinder loop(image_file_.path(), false, &dev);
+  std::unique_ptr<PartitionReader> reader = PartitionReader::Open(dev);
+  ASSERT_TRUE(reader);
+  EXPECT_FALSE(reader->is_sparse());
+  EXPECT_EQ(raw.size(), reader->size());
+  brillo::Blob data(raw.size());
+  EXPECT_TRUE(reader->Read(data.data(), data.size(), 0));
+  EXPECT_EQ(raw, data);
+}
+
+TEST_F(PartitionReaderTest, RunAsRootSparseBlockDeviceTest) {
+  // The loop device rounds the image up to 512 bytes with zeros.
+  brillo::Blob image = builder_.Build();
+  image.resize((image.size() + 511) / 512 * 512);
+  ASSERT_TRUE(test_utils::WriteFileVector(image_file_.path(), image));
+  std::string dev;
+  test_utils::ScopedLoopbackDeviceBinder loop(image_file_.path(), false, &dev);
+  std::unique_ptr<PartitionReader> reader = PartitionReader::Open(dev);
+  ASSERT_TRUE(reader);
+  EXPECT_TRUE(reader->is_sparse());
+  EXPECT_EQ(builder_.raw().size(), reader->size());
+}
+
+TEST_F(PartitionReaderTest, SparseImageTest) {
+  std::unique_ptr<PartitionReader> reader = OpenSparseImage();
+  ASSERT_TRUE(reader);
+  EXPECT_TRUE(reader->is_sparse());
+  const brillo::Blob& raw = builder_.raw();
+  ASSERT_EQ(7 * kSparseBlockSize, raw.size());
+  EXPECT_EQ(raw.size(), reader->size());
+
+  brillo::Blob data(raw.size());
+  EXPECT_TRUE(reader->Read(data.data(), data.size(), 0));
+  EXPECT_EQ(raw, data);
+
+  // Reads across chunks, not aligned to the blocks nor to the fill value.
+  data.resize(3 * kSparseBlockSize);
+  EXPECT_TRUE(reader->Read(data.data(), data.size(), kSparseBlockSize + 3));
+  EXPECT_EQ(brillo::Blob(raw.begin() + kSparseBlockSize + 3,
+                         raw.begin() + 4 * kSparseBlockSize + 3),
+            data);
+  EXPECT_FALSE(reader->Read(data.data(), data.size(), raw.size() - 10));
+}
+
+TEST_F(PartitionReaderTest, SparseImageZerosTest) {
+  std::unique_ptr<PartitionReader> reader = OpenSparseImage();
+  ASSERT_TRUE(reader);
+  // The DONT_CARE chunk.
+  EXPECT_TRUE(reader->IsZero(3 * kSparseBlockSize, 2 * kSparseBlockSize));
+  // The FILL chunk of zeros at the end.
+  EXPECT_TRUE(reader->IsZero(6 * kSparseBlockSize, kSparseBlockSize));
+  // The FILL chunk with another value, the RAW chunks and past the end.
+  EXPECT_FALSE(reader->IsZero(2 * kSparseBlockSize, kSparseBlockSize));
+  EXPECT_FALSE(reader->IsZero(4 * kSparseBlockSize, 2 * kSparseBlockSize));
+  EXPECT_FALSE(reader->IsZero(6 * kSparseBlockSize, 2 * kSparseBlockSize));
+}
+
+TEST_F(PartitionReaderTest, ReadPartitionExtentsTest) {
+  ASSERT_TRUE(OpenSparseImage());
+  const brillo::Blob& raw = builder_.raw();
+  vector<Extent> extents = {ExtentForRange(5, 1), ExtentForRange(1, 3)};
+  brillo::Blob data;
+  EXPECT_TRUE(ReadPartitionExtents(image_file_.path(),
+                                   extents,
+                                   &data,
+                                   4 * kSparseBlockSize,
+                                   kSparseBlockSize));
+  brillo::Blob expected(raw.begin() + 5 * kSparseBlockSize,
+                        raw.begin() + 6 * kSparseBlockSize);
+  expected.insert(expected.end(),
+                  raw.begin() + kSparseBlockSize,
+                  raw.begin() + 4 * kSparseBlockSize);
+  EXPECT_EQ(expected, data);
+
+  // The same read with an already open reader.
+  std::unique_ptr<PartitionReader> reader =
+      PartitionReader::Open(image_file_.path());
+  ASSERT_TRUE(reader);
+  data.clear();
+  EXPECT_TRUE(ReadPartitionExtents(
+      *reader, extents, &data, 4 * kSparseBlockSize, kSparseBlockSize));
+  EXPECT_EQ(expected, data);
+
+  EXPECT_EQ(static_cast<off_t>(raw.size()),
+            PartitionImageSize(image_file_.path()));
+  data.clear();
+  EXPECT_TRUE(
+      ReadPartitionChunk(image_file_.path(), raw.size() - 10, 20, &data));
+  EXPECT_EQ(brillo::Blob(raw.end() - 10, raw.end()), data);
+}
+
+TEST_F(PartitionReaderTest, InvalidSparseImageTest) {
+  // The chunks don't cover all the declared blocks.
+  ASSERT_TRUE(
+      test_utils::WriteFileVector(image_file_.path(), builder_.Build(10)));
+  EXPECT_FALSE(PartitionReader::Open(image_file_.path()));
+
+  // The last chunk is truncated.
+  brillo::Blob image = builder_.Build();
+  image.resize(image.size() - 1);
+  ASSERT_TRUE(test_utils::WriteFileVector(image_file_.path(), image));
+  EXPECT_FALSE(PartitionReader::Open(image_file_.path()));
+}
+
+}  // namespace chromeos_update_engine
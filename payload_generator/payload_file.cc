@@ -64,6 +64,8 @@ bool PayloadFile::Init(const PayloadGenerationConfig& config) {
   TEST_AND_RETURN_FALSE(config.version.Validate());
   major_version_ = config.version.major;
   manifest_.set_minor_version(config.version.minor);
+  if (!config.version.IsDelta() && config.version.full_payload_zstd)
+    manifest_.set_full_payload_zstd(true);
 
   if (!config.source.ImageInfoIsEmpty())
     *(manifest_.mutable_old_image_info()) = config.source.image_info;
@@ -148,6 +150,8 @@ bool PayloadFile::WritePayload(const string& payload_file,
         if (!part.postinstall.filesystem_type.empty())
           partition->set_filesystem_type(part.postinstall.filesystem_type);
         partition->set_postinstall_optional(part.postinstall.optional);
+        if (part.postinstall.independent)
+          partition->set_postinstall_independent(true);
       }
       if (!part.verity.IsEmpty()) {
         if (part.verity.hash_tree_extent.num_blocks() != 0) {
@@ -18,6 +18,7 @@
 
 #include <algorithm>
 #include <map>
+#include <memory>
 #include <utility>
 
 #include <base/logging.h>
@@ -31,6 +32,7 @@
 #include "update_engine/payload_generator/delta_diff_utils.h"
 #include "update_engine/payload_generator/ext2_filesystem.h"
 #include "update_engine/payload_generator/mapfile_filesystem.h"
+#include "update_engine/payload_generator/partition_reader.h"
 #include "update_engine/payload_generator/raw_filesystem.h"
 
 using std::string;
@@ -38,7 +40,8 @@ using std::string;
 namespace chromeos_update_engine {
 
 bool PostInstallConfig::IsEmpty() const {
-  return !run && path.empty() && filesystem_type.empty() && !optional;
+  return !run && path.empty() && filesystem_type.empty() && !optional &&
+         !independent;
 }
 
 bool VerityConfig::IsEmpty() const {
@@ -52,9 +55,8 @@ bool PartitionConfig::ValidateExists() const {
   TEST_AND_RETURN_FALSE(!path.empty());
   TEST_AND_RETURN_FALSE(utils::FileExists(path.c_str()));
   TEST_AND_RETURN_FALSE(size > 0);
-  // The requested size is within the limits of the file.
-  TEST_AND_RETURN_FALSE(static_cast<off_t>(size) <=
-                        utils::FileSize(path.c_str()));
+  // The requested size is within the limits of the partition in the file.
+  TEST_AND_RETURN_FALSE(static_cast<off_t>(size) <= PartitionImageSize(path));
   return true;
 }
 
@@ -63,10 +65,13 @@ bool PartitionConfig::OpenFilesystem() {
     return true;
   fs_interface.reset();
   if (diff_utils::IsExtFilesystem(path)) {
-    fs_interface = Ext2Filesystem::CreateFromFile(path);
+    std::unique_ptr<Ext2Filesystem> ext2_fs =
+        Ext2Filesystem::CreateFromFile(path);
     // TODO(deymo): The delta generator algorithm doesn't support a block size
     // different than 4 KiB. Remove this check once that's fixed. b/26972455
-    if (fs_interface) {
+    if (ext2_fs) {
+      ext2_fs->SetFileMapCacheDir(file_map_cache_dir);
+      fs_interface = std::move(ext2_fs);
       TEST_AND_RETURN_FALSE(fs_interface->GetBlockSize() == kBlockSize);
       return true;
     }
@@ -102,7 +107,7 @@ bool ImageConfig::LoadImageSize() {
   for (PartitionConfig& part : partitions) {
     if (part.path.empty())
       continue;
-    part.size = utils::FileSize(part.path);
+    part.size = PartitionImageSize(part.path);
   }
   return true;
 }
@@ -121,6 +126,8 @@ bool ImageConfig::LoadPostInstallConfig(const brillo::KeyValueStore& store) {
                     &part.postinstall.filesystem_type);
     store.GetBoolean("POSTINSTALL_OPTIONAL_" + part.name,
                      &part.postinstall.optional);
+    store.GetBoolean("POSTINSTALL_INDEPENDENT_" + part.name,
+                     &part.postinstall.independent);
   }
   if (!found_postinstall) {
     LOG(ERROR) << "No valid postinstall config found.";
@@ -218,7 +225,9 @@ bool PayloadVersion::Validate() const {
                         minor == kOpSrcHashMinorPayloadVersion ||
                         minor == kBrotliBsdiffMinorPayloadVersion ||
                         minor == kPuffdiffMinorPayloadVersion ||
-                        minor == kVerityMinorPayloadVersion);
+                        minor == kVerityMinorPayloadVersion ||
+                        minor == kZstdMinorPayloadVersion ||
+                        minor == kLz4diffMinorPayloadVersion);
   return true;
 }
 
@@ -260,6 +269,18 @@ bool PayloadVersion::OperationAllowed(InstallOperation::Type operation) const {
 
     case InstallOperation::PUFFDIFF:
       return minor >= kPuffdiffMinorPayloadVersion;
+
+    case InstallOperation::REPLACE_ZSTD:
+      // Full payloads always have minor version 0, so they opt in with a
+      // manifest field instead.
+      return minor >= kZstdMinorPayloadVersion ||
+             (minor == kFullPayloadMinorVersion && full_payload_zstd);
+
+    case InstallOperation::ZSTD_DIFF:
+      return minor >= kZstdMinorPayloadVersion;
+
+    case InstallOperation::LZ4DIFF:
+      return minor >= kLz4diffMinorPayloadVersion;
   }
   return false;
 }
@@ -313,6 +334,11 @@ bool PayloadGenerationConfig::Validate() const {
 
   TEST_AND_RETURN_FALSE(rootfs_partition_size % block_size == 0);
 
+  // Only the files of A/B delta payloads can be generated in shards.
+  TEST_AND_RETURN_FALSE(shard.index < shard.count);
+  if (shard.IsSharded())
+    TEST_AND_RETURN_FALSE(is_delta && !version.InplaceUpdate());
+
   return true;
 }
 
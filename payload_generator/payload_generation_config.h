@@ -27,6 +27,7 @@
 #include <brillo/secure_blob.h>
 
 #include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/compressibility.h"
 #include "update_engine/payload_generator/filesystem_interface.h"
 #include "update_engine/update_metadata.pb.h"
 
@@ -50,6 +51,10 @@ struct PostInstallConfig {
 
   // Whether this postinstall script should be ignored if it fails.
   bool optional = false;
+
+  // Whether this postinstall script may run at the same time as the other
+  // independent ones.
+  bool independent = false;
 };
 
 // Data will be written to the payload and used for hash tree and FEC generation
@@ -91,7 +96,8 @@ struct PartitionConfig {
   // |fs_interface|. Returns whether opening the filesystem worked.
   bool OpenFilesystem();
 
-  // The path to the partition file. This can be a regular file or a block
+  // The path to the partition file. This can be a regular file, an Android
+  // sparse image read without expanding it (see PartitionReader) or a block
   // device such as a loop device.
   std::string path;
 
@@ -100,6 +106,10 @@ struct PartitionConfig {
   // filesystem and describes the blocks used by each file.
   std::string mapfile_path;
 
+  // The directory where the list of files of ext2/3/4 filesystems is cached
+  // between runs, if any. See Ext2Filesystem::SetFileMapCacheDir().
+  std::string file_map_cache_dir;
+
   // The size of the data in |path|. If rootfs verification is used (verity)
   // this value should match the size of the verity device for the rootfs, and
   // the size of the whole kernel. This value could be smaller than the
@@ -179,6 +189,39 @@ struct PayloadVersion {
 
   // The minor version of the payload.
   uint32_t minor;
+
+  // How aggressively the generator skips, among the allowed operations, those
+  // unlikely to beat storing the data as is. It doesn't change the format of
+  // the payload.
+  CompressibilityFilter compressibility_filter{CompressibilityFilter::kOff};
+
+  // The memory, in bytes, the generator may use for the operations generated
+  // in parallel. A value of 0 means a fraction of the physical memory. It
+  // doesn't change the format of the payload either.
+  uint64_t memory_budget{0};
+
+  // The LZ4_versionNumber() of the update_engine applying the payload, or 0 if
+  // unknown. The LZ4DIFF operations are only generated when it's the version
+  // of the generator, as other versions may not compress the target streams
+  // into the same bytes.
+  uint32_t client_lz4_version{0};
+
+  // Whether a full payload may use REPLACE_ZSTD operations. It is recorded in
+  // the manifest, and only clients supporting it can apply the payload.
+  bool full_payload_zstd{false};
+};
+
+// A PayloadShard is one of the |count| subsets of the files of the partitions
+// generated by separate processes and then merged into a single payload.
+struct PayloadShard {
+  // Whether the files are split between several shards.
+  bool IsSharded() const { return count > 1; }
+
+  // The index of this shard, from 0 to |count| - 1.
+  size_t index = 0;
+
+  // The number of shards.
+  size_t count = 1;
 };
 
 // The PayloadGenerationConfig struct encapsulates all the configuration to
@@ -222,6 +265,14 @@ struct PayloadGenerationConfig {
   // chunks.
   size_t soft_chunk_size = 2 * 1024 * 1024;
 
+  // Whether to reorder the operations of delta payloads so the source reads
+  // during apply are more sequential. See ABGenerator::OptimizeApplyOrder().
+  bool optimize_apply_order = false;
+
+  // The subset of the files of a delta payload generated by this process. See
+  // GenerateUpdatePayloadShard().
+  PayloadShard shard;
+
   // TODO(deymo): Remove the block_size member and maybe replace it with a
   // minimum alignment size for blocks (if needed). Algorithms should be able to
   // pick the block_size they want, but for now only 4 KiB is supported.
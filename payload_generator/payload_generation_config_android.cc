@@ -16,6 +16,8 @@
 
 #include "update_engine/payload_generator/payload_generation_config.h"
 
+#include <memory>
+
 #include <base/logging.h>
 #include <base/strings/string_number_conversions.h>
 #include <base/strings/string_split.h>
@@ -27,6 +29,7 @@
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/verity_writer_android.h"
 #include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/partition_reader.h"
 
 namespace chromeos_update_engine {
 
@@ -75,6 +78,8 @@ bool AvbDescriptorCallback(const AvbDescriptor* descriptor, void* user_data) {
 // matches the hash tree and FEC stored in the image.
 bool VerifyVerityConfig(const PartitionConfig& part) {
   const size_t block_size = part.fs_interface->GetBlockSize();
+  std::unique_ptr<PartitionReader> reader = PartitionReader::Open(part.path);
+  TEST_AND_RETURN_FALSE(reader);
   if (part.verity.hash_tree_extent.num_blocks() != 0) {
     auto hash_function =
         HashTreeBuilder::HashFunction(part.verity.hash_tree_algorithm);
@@ -96,15 +101,15 @@ bool VerifyVerityConfig(const PartitionConfig& part) {
       constexpr uint64_t kBufferSize = 1024 * 1024;
       size_t bytes_to_read = std::min(kBufferSize, data_end - offset);
       TEST_AND_RETURN_FALSE(
-          utils::ReadFileChunk(part.path, offset, bytes_to_read, &buffer));
+          ReadPartitionChunk(*reader, offset, bytes_to_read, &buffer));
       TEST_AND_RETURN_FALSE(
           hash_tree_builder.Update(buffer.data(), buffer.size()));
       offset += buffer.size();
       buffer.clear();
     }
     TEST_AND_RETURN_FALSE(hash_tree_builder.BuildHashTree());
-    TEST_AND_RETURN_FALSE(utils::ReadFileChunk(
-        part.path,
+    TEST_AND_RETURN_FALSE(ReadPartitionChunk(
+        *reader,
         part.verity.hash_tree_extent.start_block() * block_size,
         tree_size,
         &buffer));
@@ -112,6 +117,11 @@ bool VerifyVerityConfig(const PartitionConfig& part) {
   }
 
   if (part.verity.fec_extent.num_blocks() != 0) {
+    // The FEC is computed from the image file, which must be a raw image.
+    if (reader->is_sparse()) {
+      LOG(WARNING) << "Not verifying the FEC of the sparse image " << part.path;
+      return true;
+    }
     TEST_AND_RETURN_FALSE(VerityWriterAndroid::EncodeFEC(
         part.path,
         part.verity.fec_data_extent.start_block() * block_size,
@@ -128,12 +138,19 @@ bool VerifyVerityConfig(const PartitionConfig& part) {
 
 bool ImageConfig::LoadVerityConfig() {
   for (PartitionConfig& part : partitions) {
+    // The image is opened once for all the metadata read below.
+    std::unique_ptr<PartitionReader> reader;
+    if (part.size > 0) {
+      reader = PartitionReader::Open(part.path);
+      TEST_AND_RETURN_FALSE(reader);
+    }
+
     // Parse AVB devices.
     if (part.size > sizeof(AvbFooter)) {
       uint64_t footer_offset = part.size - sizeof(AvbFooter);
       brillo::Blob buffer;
-      TEST_AND_RETURN_FALSE(utils::ReadFileChunk(
-          part.path, footer_offset, sizeof(AvbFooter), &buffer));
+      TEST_AND_RETURN_FALSE(ReadPartitionChunk(
+          *reader, footer_offset, sizeof(AvbFooter), &buffer));
       if (memcmp(buffer.data(), AVB_FOOTER_MAGIC, AVB_FOOTER_MAGIC_LEN) == 0) {
         LOG(INFO) << "Parsing verity config from AVB footer for " << part.name;
         AvbFooter footer;
@@ -143,8 +160,8 @@ bool ImageConfig::LoadVerityConfig() {
 
         TEST_AND_RETURN_FALSE(
             footer.vbmeta_offset + sizeof(AvbVBMetaImageHeader) <= part.size);
-        TEST_AND_RETURN_FALSE(utils::ReadFileChunk(
-            part.path, footer.vbmeta_offset, footer.vbmeta_size, &buffer));
+        TEST_AND_RETURN_FALSE(ReadPartitionChunk(
+            *reader, footer.vbmeta_offset, footer.vbmeta_size, &buffer));
         TEST_AND_RETURN_FALSE(avb_descriptor_foreach(
             buffer.data(), buffer.size(), AvbDescriptorCallback, &part));
       }
@@ -154,16 +171,22 @@ bool ImageConfig::LoadVerityConfig() {
     // FEC will be skipped for now.
     if (part.verity.IsEmpty() && part.size > FEC_BLOCKSIZE) {
       brillo::Blob fec_metadata;
-      TEST_AND_RETURN_FALSE(utils::ReadFileChunk(part.path,
-                                                 part.size - FEC_BLOCKSIZE,
-                                                 sizeof(fec_header),
-                                                 &fec_metadata));
+      TEST_AND_RETURN_FALSE(ReadPartitionChunk(*reader,
+                                               part.size - FEC_BLOCKSIZE,
+                                               sizeof(fec_header),
+                                               &fec_metadata));
       const fec_header* header =
           reinterpret_cast<const fec_header*>(fec_metadata.data());
       if (header->magic == FEC_MAGIC) {
         LOG(INFO)
             << "Parsing verity config from Verified Boot 1.0 metadata for "
             << part.name;
+        // libfec reads the metadata from the image file.
+        if (reader->is_sparse()) {
+          LOG(ERROR) << "Verified Boot 1.0 sparse images are not supported, "
+                     << "expand " << part.path << " with simg2img.";
+          return false;
+        }
         const size_t block_size = part.fs_interface->GetBlockSize();
         // FEC_VERITY_DISABLE skips verifying verity hash tree, because we will
         // verify it ourselves later.
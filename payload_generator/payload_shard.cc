@@ -0,0 +1,351 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/payload_shard.h"
+
+#include <endian.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <numeric>
+#include <utility>
+
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
+#include <base/strings/stringprintf.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/file_writer.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// A shard file starts with this magic and format version, followed by the
+// index and the count of the shard, the fingerprint of its config and its
+// partitions. A partition is its name and its operations. An operation is its
+// name, the serialized InstallOperation without its data offset and its blob.
+// The strings and the blobs are prefixed by their size, and all the integers
+// are 64-bit big endian.
+const char kShardMagic[] = "CrAUshrd";
+const uint64_t kShardFormatVersion = 2;
+
+// The maximum size of the names and the serialized operations, to not trust
+// the sizes in a corrupt file.
+const uint64_t kMaxShardStringSize = 16 * 1024 * 1024;
+
+bool WriteUint64(FileWriter* writer, uint64_t value) {
+  uint64_t value_be = htobe64(value);
+  TEST_AND_RETURN_FALSE(writer->Write(&value_be, sizeof(value_be)));
+  return true;
+}
+
+bool WriteString(FileWriter* writer, const string& value) {
+  TEST_AND_RETURN_FALSE(WriteUint64(writer, value.size()));
+  TEST_AND_RETURN_FALSE(writer->Write(value.data(), value.size()));
+  return true;
+}
+
+// Appends to |fingerprint| the name and size of |part| and the hashes of its
+// image and map file, if any, as the |image| of the payload.
+bool AppendPartitionFingerprint(const char* image,
+                                const PartitionConfig& part,
+                                string* fingerprint) {
+  *fingerprint += base::StringPrintf(
+      "%s %s %" PRIu64, image, part.name.c_str(), part.size);
+  for (const string& path : {part.path, part.mapfile_path}) {
+    if (path.empty()) {
+      *fingerprint += " -";
+      continue;
+    }
+    brillo::Blob hash;
+    if (HashCalculator::RawHashOfFile(path, -1, &hash) < 0) {
+      LOG(ERROR) << "Unable to hash " << path;
+      return false;
+    }
+    *fingerprint += " " + base::HexEncode(hash.data(), hash.size());
+  }
+  *fingerprint += "\n";
+  return true;
+}
+
+// Reads the fields of a shard file in order, checking their sizes against the
+// size of the file.
+class ShardFileReader {
+ public:
+  ShardFileReader() = default;
+  ~ShardFileReader() {
+    if (fd_ >= 0)
+      IGNORE_EINTR(close(fd_));
+  }
+
+  bool Open(const string& path) {
+    fd_ = HANDLE_EINTR(open(path.c_str(), O_RDONLY));
+    TEST_AND_RETURN_FALSE_ERRNO(fd_ >= 0);
+    struct stat stbuf;
+    TEST_AND_RETURN_FALSE_ERRNO(fstat(fd_, &stbuf) == 0);
+    remaining_ = stbuf.st_size;
+    return true;
+  }
+
+  bool Read(void* buf, uint64_t size) {
+    TEST_AND_RETURN_FALSE(size <= remaining_);
+    size_t bytes_read;
+    bool eof;
+    TEST_AND_RETURN_FALSE(utils::ReadAll(fd_, buf, size, &bytes_read, &eof));
+    TEST_AND_RETURN_FALSE(bytes_read == size);
+    remaining_ -= size;
+    return true;
+  }
+
+  bool ReadUint64(uint64_t* value) {
+    uint64_t value_be;
+    TEST_AND_RETURN_FALSE(Read(&value_be, sizeof(value_be)));
+    *value = be64toh(value_be);
+    return true;
+  }
+
+  bool ReadString(string* value) {
+    uint64_t size;
+    TEST_AND_RETURN_FALSE(ReadUint64(&size));
+    TEST_AND_RETURN_FALSE(size <= kMaxShardStringSize);
+    value->resize(size);
+    return Read(&(*value)[0], size);
+  }
+
+  bool ReadBlob(brillo::Blob* blob) {
+    uint64_t size;
+    TEST_AND_RETURN_FALSE(ReadUint64(&size));
+    TEST_AND_RETURN_FALSE(size <= remaining_);
+    blob->resize(size);
+    return Read(blob->data(), size);
+  }
+
+  bool AtEnd() const { return remaining_ == 0; }
+
+ private:
+  int fd_{-1};
+  uint64_t remaining_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(ShardFileReader);
+};
+
+}  // namespace
+
+bool ParsePayloadShard(const string& spec, PayloadShard* shard) {
+  vector<string> fields = base::SplitString(
+      spec, "/", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL);
+  TEST_AND_RETURN_FALSE(fields.size() == 2);
+  PayloadShard result;
+  TEST_AND_RETURN_FALSE(base::StringToSizeT(fields[0], &result.index));
+  TEST_AND_RETURN_FALSE(base::StringToSizeT(fields[1], &result.count));
+  TEST_AND_RETURN_FALSE(result.index < result.count);
+  *shard = result;
+  return true;
+}
+
+vector<size_t> AssignShards(const vector<uint64_t>& weights, size_t count) {
+  // Assign the heaviest remaining task to the lightest shard, breaking the
+  // ties by position so the result is deterministic.
+  vector<size_t> order(weights.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&weights](size_t a, size_t b) {
+    return weights[a] > weights[b];
+  });
+  vector<uint64_t> loads(count, 0);
+  vector<size_t> shards(weights.size(), 0);
+  for (size_t task : order) {
+    size_t shard = std::min_element(loads.begin(), loads.end()) - loads.begin();
+    shards[task] = shard;
+    loads[shard] += weights[task];
+  }
+  return shards;
+}
+
+bool PayloadShardFingerprint(const PayloadGenerationConfig& config,
+                             string* fingerprint) {
+  // The memory budget and the apply order optimization don't change the
+  // operations of the shards.
+  *fingerprint = base::StringPrintf(
+      "version %" PRIu64 ".%" PRIu32 " filter %d lz4 %" PRIu32
+      " full_zstd %d\nblock %zu hard_chunk %zd soft_chunk %zu\n",
+      config.version.major,
+      config.version.minor,
+      static_cast<int>(config.version.compressibility_filter),
+      config.version.client_lz4_version,
+      config.version.full_payload_zstd,
+      config.block_size,
+      config.hard_chunk_size,
+      config.soft_chunk_size);
+  TEST_AND_RETURN_FALSE(config.source.partitions.size() ==
+                        config.target.partitions.size());
+  for (size_t i = 0; i < config.target.partitions.size(); i++) {
+    TEST_AND_RETURN_FALSE(AppendPartitionFingerprint(
+        "source", config.source.partitions[i], fingerprint));
+    TEST_AND_RETURN_FALSE(AppendPartitionFingerprint(
+        "target", config.target.partitions[i], fingerprint));
+  }
+  return true;
+}
+
+bool WritePayloadShard(const string& shard_path,
+                       const PayloadShard& shard,
+                       const string& fingerprint,
+                       const vector<ShardPartition>& partitions,
+                       const string& data_blobs_path) {
+  int blobs_fd = HANDLE_EINTR(open(data_blobs_path.c_str(), O_RDONLY));
+  TEST_AND_RETURN_FALSE_ERRNO(blobs_fd >= 0);
+  ScopedFdCloser blobs_fd_closer(&blobs_fd);
+
+  DirectFileWriter writer;
+  if (writer.Open(shard_path.c_str(), O_WRONLY | O_TRUNC | O_CREAT, 0644) !=
+      0) {
+    PLOG(ERROR) << "Error creating " << shard_path;
+    return false;
+  }
+  ScopedFileWriterCloser writer_closer(&writer);
+
+  TEST_AND_RETURN_FALSE(writer.Write(kShardMagic, strlen(kShardMagic)));
+  TEST_AND_RETURN_FALSE(WriteUint64(&writer, kShardFormatVersion));
+  TEST_AND_RETURN_FALSE(WriteUint64(&writer, shard.index));
+  TEST_AND_RETURN_FALSE(WriteUint64(&writer, shard.count));
+  TEST_AND_RETURN_FALSE(WriteString(&writer, fingerprint));
+  TEST_AND_RETURN_FALSE(WriteUint64(&writer, partitions.size()));
+  for (const ShardPartition& partition : partitions) {
+    TEST_AND_RETURN_FALSE(WriteString(&writer, partition.name));
+    TEST_AND_RETURN_FALSE(WriteUint64(&writer, partition.aops.size()));
+    for (const AnnotatedOperation& aop : partition.aops) {
+      brillo::Blob blob;
+      if (aop.op.has_data_offset()) {
+        blob.resize(aop.op.data_length());
+        ssize_t bytes_read;
+        TEST_AND_RETURN_FALSE(utils::PReadAll(blobs_fd,
+                                              blob.data(),
+                                              blob.size(),
+                                              aop.op.data_offset(),
+                                              &bytes_read));
+        TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(blob.size()));
+      }
+      InstallOperation op = aop.op;
+      op.clear_data_offset();
+      op.clear_data_length();
+      string serialized_op;
+      TEST_AND_RETURN_FALSE(op.AppendToString(&serialized_op));
+
+      TEST_AND_RETURN_FALSE(WriteString(&writer, aop.name));
+      TEST_AND_RETURN_FALSE(WriteString(&writer, serialized_op));
+      TEST_AND_RETURN_FALSE(WriteUint64(&writer, blob.size()));
+      TEST_AND_RETURN_FALSE(writer.Write(blob.data(), blob.size()));
+    }
+  }
+  return true;
+}
+
+bool ReadPayloadShard(const string& shard_path,
+                      BlobFileWriter* blob_file,
+                      PayloadShard* shard,
+                      string* fingerprint,
+                      vector<ShardPartition>* partitions) {
+  ShardFileReader reader;
+  TEST_AND_RETURN_FALSE(reader.Open(shard_path));
+
+  string magic(strlen(kShardMagic), '\0');
+  TEST_AND_RETURN_FALSE(reader.Read(&magic[0], magic.size()));
+  if (magic != kShardMagic) {
+    LOG(ERROR) << shard_path << " is not a payload shard file.";
+    return false;
+  }
+  uint64_t format_version, index, count, num_partitions;
+  TEST_AND_RETURN_FALSE(reader.ReadUint64(&format_version));
+  if (format_version != kShardFormatVersion) {
+    LOG(ERROR) << "Unsupported format version " << format_version
+               << " of the payload shard file " << shard_path;
+    return false;
+  }
+  TEST_AND_RETURN_FALSE(reader.ReadUint64(&index));
+  TEST_AND_RETURN_FALSE(reader.ReadUint64(&count));
+  TEST_AND_RETURN_FALSE(index < count);
+  shard->index = index;
+  shard->count = count;
+  TEST_AND_RETURN_FALSE(reader.ReadString(fingerprint));
+
+  TEST_AND_RETURN_FALSE(reader.ReadUint64(&num_partitions));
+  partitions->clear();
+  for (uint64_t i = 0; i < num_partitions; i++) {
+    ShardPartition partition;
+    uint64_t num_aops;
+    TEST_AND_RETURN_FALSE(reader.ReadString(&partition.name));
+    TEST_AND_RETURN_FALSE(reader.ReadUint64(&num_aops));
+    for (uint64_t j = 0; j < num_aops; j++) {
+      AnnotatedOperation aop;
+      string serialized_op;
+      brillo::Blob blob;
+      TEST_AND_RETURN_FALSE(reader.ReadString(&aop.name));
+      TEST_AND_RETURN_FALSE(reader.ReadString(&serialized_op));
+      TEST_AND_RETURN_FALSE(aop.op.ParseFromString(serialized_op));
+      TEST_AND_RETURN_FALSE(reader.ReadBlob(&blob));
+      TEST_AND_RETURN_FALSE(aop.SetOperationBlob(blob, blob_file));
+      partition.aops.push_back(std::move(aop));
+    }
+    partitions->push_back(std::move(partition));
+  }
+  if (!reader.AtEnd()) {
+    LOG(ERROR) << "Unexpected data at the end of " << shard_path;
+    return false;
+  }
+  return true;
+}
+
+bool WritesBlocksOnce(const vector<AnnotatedOperation>& aops,
+                      const ExtentRanges& blocks) {
+  // The blocks are written once each when the operations write as many
+  // blocks as they cover, and they cover exactly |blocks|.
+  ExtentRanges written;
+  uint64_t num_written = 0;
+  for (const AnnotatedOperation& aop : aops) {
+    written.AddRepeatedExtents(aop.op.dst_extents());
+    num_written += utils::BlocksInExtents(aop.op.dst_extents());
+  }
+  if (num_written != written.blocks()) {
+    LOG(ERROR) << "The operations write "
+               << num_written - written.blocks()
+               << " blocks more than once.";
+    return false;
+  }
+  ExtentRanges missing = blocks;
+  missing.SubtractRanges(written);
+  written.SubtractRanges(blocks);
+  if (missing.blocks() != 0 || written.blocks() != 0) {
+    LOG(ERROR) << "The operations don't write " << missing.blocks()
+               << " of the blocks and write " << written.blocks()
+               << " other blocks.";
+    return false;
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
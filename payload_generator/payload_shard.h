@@ -0,0 +1,87 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_PAYLOAD_SHARD_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_PAYLOAD_SHARD_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "update_engine/payload_generator/annotated_operation.h"
+#include "update_engine/payload_generator/blob_file_writer.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/payload_generation_config.h"
+
+// The delta of the files of big images can be generated by several processes,
+// each one generating a shard of the files into a shard file. The shard files
+// are then merged into the payload, which is the same as if a single process
+// generated all the files.
+
+namespace chromeos_update_engine {
+
+// The operations generated by a shard for a partition.
+struct ShardPartition {
+  std::string name;
+  std::vector<AnnotatedOperation> aops;
+};
+
+// Parses a shard from |spec| in the "<index>/<count>" format, for example
+// "0/4" for the first of four shards. Returns whether it is valid.
+bool ParsePayloadShard(const std::string& spec, PayloadShard* shard);
+
+// Returns the shard, from 0 to |count| - 1, of each task of the |weights|, so
+// that all the shards get about the same total weight. The result only
+// depends on the arguments, so all the shards compute the same one.
+std::vector<size_t> AssignShards(const std::vector<uint64_t>& weights,
+                                 size_t count);
+
+// Stores in |fingerprint| a description of everything in |config| the
+// operations of a shard depend on: the payload version and the options
+// changing the operations, the chunk sizes, and the names, sizes and SHA-256
+// hashes of the images. The shards merged into a payload must all have the
+// fingerprint of the merge. Returns whether the images could be read.
+bool PayloadShardFingerprint(const PayloadGenerationConfig& config,
+                             std::string* fingerprint);
+
+// Writes the operations generated by |shard| for the |partitions| to the shard
+// file |shard_path| with the |fingerprint| of the config, along with their
+// blobs read from |data_blobs_path|.
+bool WritePayloadShard(const std::string& shard_path,
+                       const PayloadShard& shard,
+                       const std::string& fingerprint,
+                       const std::vector<ShardPartition>& partitions,
+                       const std::string& data_blobs_path);
+
+// Reads the shard file |shard_path| written by WritePayloadShard() into
+// |shard|, |fingerprint| and |partitions|. The blobs of the operations are
+// stored to |blob_file|.
+bool ReadPayloadShard(const std::string& shard_path,
+                      BlobFileWriter* blob_file,
+                      PayloadShard* shard,
+                      std::string* fingerprint,
+                      std::vector<ShardPartition>* partitions);
+
+// Returns whether the destination extents of |aops| write each of the
+// |blocks| of a partition exactly once and no other block, as the operations
+// merged from the shards must.
+bool WritesBlocksOnce(const std::vector<AnnotatedOperation>& aops,
+                      const ExtentRanges& blocks);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_PAYLOAD_SHARD_H_
@@ -0,0 +1,294 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/payload_shard.h"
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/fake_filesystem.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+TEST(PayloadShardTest, ParsePayloadShardTest) {
+  PayloadShard shard;
+  EXPECT_TRUE(ParsePayloadShard("2/4", &shard));
+  EXPECT_EQ(2U, shard.index);
+  EXPECT_EQ(4U, shard.count);
+  EXPECT_TRUE(shard.IsSharded());
+
+  EXPECT_TRUE(ParsePayloadShard("0/1", &shard));
+  EXPECT_FALSE(shard.IsSharded());
+
+  EXPECT_FALSE(ParsePayloadShard("4/4", &shard));
+  EXPECT_FALSE(ParsePayloadShard("1", &shard));
+  EXPECT_FALSE(ParsePayloadShard("a/4", &shard));
+  EXPECT_FALSE(ParsePayloadShard("1/2/3", &shard));
+  EXPECT_FALSE(ParsePayloadShard("", &shard));
+}
+
+TEST(PayloadShardTest, AssignShardsTest) {
+  // The heaviest tasks go first to the lightest shards.
+  EXPECT_EQ((vector<size_t>{0, 1, 1, 1, 0}),
+            AssignShards({10, 8, 1, 3, 2}, 2));
+
+  // Equal weights are assigned by position.
+  EXPECT_EQ((vector<size_t>{0, 1, 2, 0}), AssignShards({1, 1, 1, 1}, 3));
+
+  EXPECT_EQ((vector<size_t>{0, 0, 0}), AssignShards({3, 2, 1}, 1));
+  EXPECT_TRUE(AssignShards({}, 2).empty());
+}
+
+TEST(PayloadShardTest, WriteAndReadTest) {
+  test_utils::ScopedTempFile blobs_file("PayloadShardTest-blobs-XXXXXX");
+  test_utils::ScopedTempFile shard_file("PayloadShardTest-shard-XXXXXX");
+  test_utils::ScopedTempFile merged_file("PayloadShardTest-merged-XXXXXX");
+
+  // The blob of the operation is in the middle of the blobs file.
+  brillo::Blob blobs = {'x', 'x', 'b', 'l', 'o', 'b'};
+  ASSERT_TRUE(test_utils::WriteFileVector(blobs_file.path(), blobs));
+  vector<ShardPartition> partitions(2);
+  partitions[0].name = "system";
+  partitions[0].aops.resize(2);
+  partitions[0].aops[0].name = "/bin/sh";
+  partitions[0].aops[0].op.set_type(InstallOperation::REPLACE);
+  partitions[0].aops[0].op.set_data_offset(2);
+  partitions[0].aops[0].op.set_data_length(4);
+  *partitions[0].aops[0].op.add_dst_extents() = ExtentForRange(5, 1);
+  partitions[0].aops[1].name = "<zeros>";
+  partitions[0].aops[1].op.set_type(InstallOperation::ZERO);
+  *partitions[0].aops[1].op.add_dst_extents() = ExtentForRange(6, 2);
+  partitions[1].name = "vendor";
+
+  PayloadShard shard;
+  shard.index = 1;
+  shard.count = 3;
+  ASSERT_TRUE(WritePayloadShard(
+      shard_file.path(), shard, "fingerprint", partitions, blobs_file.path()));
+
+  int merged_fd = open(merged_file.path().c_str(), O_RDWR);
+  ASSERT_GE(merged_fd, 0);
+  ScopedFdCloser merged_fd_closer(&merged_fd);
+  off_t merged_size = 0;
+  BlobFileWriter blob_file(merged_fd, &merged_size);
+  PayloadShard read_shard;
+  string fingerprint;
+  vector<ShardPartition> read_partitions;
+  ASSERT_TRUE(ReadPayloadShard(shard_file.path(),
+                               &blob_file,
+                               &read_shard,
+                               &fingerprint,
+                               &read_partitions));
+
+  EXPECT_EQ(1U, read_shard.index);
+  EXPECT_EQ(3U, read_shard.count);
+  EXPECT_EQ("fingerprint", fingerprint);
+  ASSERT_EQ(2U, read_partitions.size());
+  EXPECT_EQ("system", read_partitions[0].name);
+  EXPECT_EQ("vendor", read_partitions[1].name);
+  EXPECT_TRUE(read_partitions[1].aops.empty());
+  ASSERT_EQ(2U, read_partitions[0].aops.size());
+
+  // The blob was copied to the start of the merged blobs.
+  const AnnotatedOperation& replace = read_partitions[0].aops[0];
+  EXPECT_EQ("/bin/sh", replace.name);
+  EXPECT_EQ(InstallOperation::REPLACE, replace.op.type());
+  EXPECT_EQ(0U, replace.op.data_offset());
+  EXPECT_EQ(4U, replace.op.data_length());
+  EXPECT_EQ(ExtentForRange(5, 1), replace.op.dst_extents(0));
+  brillo::Blob merged_blobs;
+  EXPECT_TRUE(utils::ReadFile(merged_file.path(), &merged_blobs));
+  EXPECT_EQ((brillo::Blob{'b', 'l', 'o', 'b'}), merged_blobs);
+
+  const AnnotatedOperation& zero = read_partitions[0].aops[1];
+  EXPECT_EQ("<zeros>", zero.name);
+  EXPECT_EQ(InstallOperation::ZERO, zero.op.type());
+  EXPECT_FALSE(zero.op.has_data_offset());
+  EXPECT_FALSE(zero.op.has_data_length());
+
+  // Corrupt shard files are rejected.
+  brillo::Blob shard_data;
+  EXPECT_TRUE(utils::ReadFile(shard_file.path(), &shard_data));
+  shard_data.resize(shard_data.size() - 1);
+  ASSERT_TRUE(test_utils::WriteFileVector(shard_file.path(), shard_data));
+  EXPECT_FALSE(ReadPayloadShard(shard_file.path(),
+                                &blob_file,
+                                &read_shard,
+                                &fingerprint,
+                                &read_partitions));
+}
+
+TEST(PayloadShardTest, WritesBlocksOnceTest) {
+  vector<AnnotatedOperation> aops(2);
+  *aops[0].op.add_dst_extents() = ExtentForRange(0, 4);
+  *aops[0].op.add_dst_extents() = ExtentForRange(6, 2);
+  *aops[1].op.add_dst_extents() = ExtentForRange(4, 2);
+  ExtentRanges blocks;
+  blocks.AddExtent(ExtentForRange(0, 8));
+  EXPECT_TRUE(WritesBlocksOnce(aops, blocks));
+
+  // A block missing, another one written or a block written twice.
+  blocks.AddBlock(8);
+  EXPECT_FALSE(WritesBlocksOnce(aops, blocks));
+  blocks.SubtractExtent(ExtentForRange(7, 2));
+  EXPECT_FALSE(WritesBlocksOnce(aops, blocks));
+  blocks.AddBlock(7);
+  *aops[1].op.add_dst_extents() = ExtentForRange(3, 1);
+  EXPECT_FALSE(WritesBlocksOnce(aops, blocks));
+}
+
+class ShardedPayloadTest : public ::testing::Test {
+ protected:
+  const uint64_t kNumBlocks = 64;
+
+  void SetUp() override {
+    // The old partition has random data, the new one changes some blocks of
+    // it and moves others around, in files of various sizes.
+    brillo::Blob old_data(kNumBlocks * kBlockSize);
+    test_utils::FillWithData(&old_data);
+    brillo::Blob new_data = old_data;
+    for (size_t block : {3, 17, 18, 40, 63})
+      new_data[block * kBlockSize + 100] ^= 0xff;
+    std::copy(old_data.begin(),
+              old_data.begin() + 4 * kBlockSize,
+              new_data.begin() + 50 * kBlockSize);
+    ASSERT_TRUE(test_utils::WriteFileVector(old_file_.path(), old_data));
+    ASSERT_TRUE(test_utils::WriteFileVector(new_file_.path(), new_data));
+
+    config_.is_delta = true;
+    config_.version =
+        PayloadVersion(kBrilloMajorPayloadVersion, kSourceMinorPayloadVersion);
+    config_.hard_chunk_size = 8 * kBlockSize;
+    config_.source.partitions.push_back(
+        MakePartition(kPartitionNameRoot, old_file_.path()));
+    config_.target.partitions.push_back(
+        MakePartition(kPartitionNameRoot, new_file_.path()));
+  }
+
+  PartitionConfig MakePartition(const string& name, const string& path) {
+    PartitionConfig part(name);
+    part.path = path;
+    part.size = kNumBlocks * kBlockSize;
+    FakeFilesystem* fs = new FakeFilesystem(kBlockSize, kNumBlocks);
+    fs->AddFile("/a", {ExtentForRange(0, 2)});
+    fs->AddFile("/b", {ExtentForRange(2, 30)});
+    fs->AddFile("/c", {ExtentForRange(32, 5), ExtentForRange(40, 3)});
+    fs->AddFile("/d", {ExtentForRange(50, 14)});
+    part.fs_interface.reset(fs);
+    return part;
+  }
+
+  test_utils::ScopedTempFile old_file_{"ShardedPayloadTest-old-XXXXXX"};
+  test_utils::ScopedTempFile new_file_{"ShardedPayloadTest-new-XXXXXX"};
+  PayloadGenerationConfig config_;
+};
+
+TEST_F(ShardedPayloadTest, MergedShardsMatchSingleProcessTest) {
+  test_utils::ScopedTempFile payload_file("ShardedPayloadTest-payload-XXXXXX");
+  uint64_t metadata_size;
+  ASSERT_TRUE(GenerateUpdatePayloadFile(
+      config_, payload_file.path(), "", &metadata_size));
+
+  for (size_t count : {1, 2, 3}) {
+    vector<test_utils::ScopedTempFile> shard_files;
+    vector<string> shard_paths;
+    for (size_t index = 0; index < count; index++) {
+      shard_files.emplace_back("ShardedPayloadTest-shard-XXXXXX");
+      shard_paths.push_back(shard_files.back().path());
+      // The config isn't copyable, since it owns the filesystems.
+      config_.shard.index = index;
+      config_.shard.count = count;
+      ASSERT_TRUE(GenerateUpdatePayloadShard(config_, shard_paths.back()));
+    }
+    config_.shard = PayloadShard();
+    // The shards can be passed in any order.
+    std::reverse(shard_paths.begin(), shard_paths.end());
+
+    test_utils::ScopedTempFile merged_file("ShardedPayloadTest-merged-XXXXXX");
+    uint64_t merged_metadata_size;
+    ASSERT_TRUE(MergeUpdatePayloadShards(config_,
+                                         shard_paths,
+                                         merged_file.path(),
+                                         "",
+                                         &merged_metadata_size));
+    EXPECT_EQ(metadata_size, merged_metadata_size);
+    brillo::Blob payload, merged_payload;
+    EXPECT_TRUE(utils::ReadFile(payload_file.path(), &payload));
+    EXPECT_TRUE(utils::ReadFile(merged_file.path(), &merged_payload));
+    EXPECT_EQ(payload, merged_payload) << "with " << count << " shards";
+  }
+}
+
+TEST_F(ShardedPayloadTest, MissingShardTest) {
+  test_utils::ScopedTempFile shard_file("ShardedPayloadTest-shard-XXXXXX");
+  config_.shard.count = 2;
+  ASSERT_TRUE(GenerateUpdatePayloadShard(config_, shard_file.path()));
+
+  config_.shard = PayloadShard();
+  test_utils::ScopedTempFile merged_file("ShardedPayloadTest-merged-XXXXXX");
+  uint64_t metadata_size;
+  // The same shard twice instead of the two shards.
+  EXPECT_FALSE(MergeUpdatePayloadShards(config_,
+                                        {shard_file.path(), shard_file.path()},
+                                        merged_file.path(),
+                                        "",
+                                        &metadata_size));
+  // Only one of the two shards.
+  EXPECT_FALSE(MergeUpdatePayloadShards(
+      config_, {shard_file.path()}, merged_file.path(), "", &metadata_size));
+}
+
+TEST_F(ShardedPayloadTest, MismatchedShardTest) {
+  test_utils::ScopedTempFile shard_file("ShardedPayloadTest-shard-XXXXXX");
+  ASSERT_TRUE(GenerateUpdatePayloadShard(config_, shard_file.path()));
+  test_utils::ScopedTempFile merged_file("ShardedPayloadTest-merged-XXXXXX");
+  uint64_t metadata_size;
+  EXPECT_TRUE(MergeUpdatePayloadShards(
+      config_, {shard_file.path()}, merged_file.path(), "", &metadata_size));
+
+  // Other options.
+  config_.version.compressibility_filter = CompressibilityFilter::kConservative;
+  EXPECT_FALSE(MergeUpdatePayloadShards(
+      config_, {shard_file.path()}, merged_file.path(), "", &metadata_size));
+  config_.version.compressibility_filter = CompressibilityFilter::kOff;
+  config_.soft_chunk_size /= 2;
+  EXPECT_FALSE(MergeUpdatePayloadShards(
+      config_, {shard_file.path()}, merged_file.path(), "", &metadata_size));
+  config_.soft_chunk_size *= 2;
+
+  // Another target image of the same size.
+  brillo::Blob new_data;
+  ASSERT_TRUE(utils::ReadFile(new_file_.path(), &new_data));
+  new_data[0] ^= 0xff;
+  ASSERT_TRUE(test_utils::WriteFileVector(new_file_.path(), new_data));
+  EXPECT_FALSE(MergeUpdatePayloadShards(
+      config_, {shard_file.path()}, merged_file.path(), "", &metadata_size));
+}
+
+}  // namespace chromeos_update_engine
@@ -17,13 +17,17 @@
 #include "update_engine/payload_generator/payload_signer.h"
 
 #include <endian.h>
+#include <fcntl.h>
 
+#include <algorithm>
 #include <utility>
 
 #include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
 #include <base/strings/string_number_conversions.h>
 #include <base/strings/string_split.h>
 #include <base/strings/string_util.h>
+#include <base/threading/simple_thread.h>
 #include <brillo/data_encoding.h>
 #include <openssl/err.h>
 #include <openssl/pem.h>
@@ -37,6 +41,7 @@
 #include "update_engine/payload_consumer/payload_metadata.h"
 #include "update_engine/payload_consumer/payload_verifier.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/delta_diff_utils.h"
 #include "update_engine/payload_generator/payload_file.h"
 #include "update_engine/update_metadata.pb.h"
 
@@ -52,6 +57,55 @@ namespace {
 // version field to be included and be 1.
 const uint32_t kSignatureMessageLegacyVersion = 1;
 
+// The size of the reads used to hash a payload from disk.
+const size_t kHashChunkSize = 1024 * 1024;
+
+// Reads the RSA private key in .pem format from |private_key_path|. Returns
+// nullptr on error.
+RSA* ReadPrivateKey(const string& private_key_path) {
+  FILE* fprikey = fopen(private_key_path.c_str(), "rb");
+  if (fprikey == nullptr) {
+    PLOG(ERROR) << "Unable to open private key " << private_key_path;
+    return nullptr;
+  }
+  RSA* rsa = PEM_read_RSAPrivateKey(fprikey, nullptr, nullptr, nullptr);
+  fclose(fprikey);
+  LOG_IF(ERROR, rsa == nullptr)
+      << "Unable to read private key " << private_key_path;
+  return rsa;
+}
+
+// Given a raw |hash| and a loaded private key |rsa| calculates the raw
+// signature in |out_signature|. Returns true on success, false otherwise.
+bool SignHashWithKey(const brillo::Blob& hash,
+                     RSA* rsa,
+                     brillo::Blob* out_signature) {
+  // We expect unpadded SHA256 hash coming in
+  TEST_AND_RETURN_FALSE(hash.size() == kSHA256Size);
+  // The code below executes the equivalent of:
+  //
+  // openssl rsautl -raw -sign -inkey |private_key_path|
+  //   -in |padded_hash| -out |out_signature|
+  brillo::Blob padded_hash = hash;
+  PayloadVerifier::PadRSASHA256Hash(&padded_hash, RSA_size(rsa));
+
+  brillo::Blob signature(RSA_size(rsa));
+  ssize_t signature_size = RSA_private_encrypt(padded_hash.size(),
+                                               padded_hash.data(),
+                                               signature.data(),
+                                               rsa,
+                                               RSA_NO_PADDING);
+  if (signature_size < 0) {
+    LOG(ERROR) << "Signing hash failed: "
+               << ERR_error_string(ERR_get_error(), nullptr);
+    return false;
+  }
+  TEST_AND_RETURN_FALSE(static_cast<size_t>(signature_size) ==
+                        signature.size());
+  out_signature->swap(signature);
+  return true;
+}
+
 // Given raw |signatures|, packs them into a protobuf and serializes it into a
 // string. Returns true on success, false otherwise.
 bool ConvertSignaturesToProtobuf(const vector<brillo::Blob>& signatures,
@@ -203,6 +257,114 @@ bool CalculateHashFromPayload(const brillo::Blob& payload,
   return true;
 }
 
+// Given a payload in |payload_path| whose header and manifest already reserve
+// |signature_blob_length| bytes for the payload signature blob and, in major
+// version 2, for the metadata signature blob, calculates the payload and
+// metadata hashes reading the payload in chunks, without loading it in memory.
+// Sets |out_reserved| to false and doesn't calculate anything if the payload
+// doesn't have a matching reservation. |out_metadata_signature_offset| is set
+// to 0 if the payload doesn't carry a metadata signature. Returns true on
+// success, false otherwise.
+bool HashPayloadWithReservedSignatures(const string& payload_path,
+                                       uint64_t signature_blob_length,
+                                       bool* out_reserved,
+                                       uint64_t* out_metadata_signature_offset,
+                                       uint64_t* out_signatures_offset,
+                                       brillo::Blob* out_hash_data,
+                                       brillo::Blob* out_metadata_hash) {
+  *out_reserved = false;
+  int fd = HANDLE_EINTR(open(payload_path.c_str(), O_RDONLY));
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  ScopedFdCloser fd_closer(&fd);
+
+  brillo::Blob metadata(kMaxPayloadHeaderSize);
+  ssize_t bytes_read;
+  TEST_AND_RETURN_FALSE(
+      utils::PReadAll(fd, metadata.data(), metadata.size(), 0, &bytes_read));
+  metadata.resize(bytes_read);
+  PayloadMetadata payload_metadata;
+  TEST_AND_RETURN_FALSE(payload_metadata.ParsePayloadHeader(metadata));
+  uint64_t metadata_size = payload_metadata.GetMetadataSize();
+  uint32_t metadata_signature_size =
+      payload_metadata.GetMetadataSignatureSize();
+  metadata.resize(metadata_size);
+  TEST_AND_RETURN_FALSE(
+      utils::PReadAll(fd, metadata.data(), metadata_size, 0, &bytes_read));
+  TEST_AND_RETURN_FALSE(static_cast<uint64_t>(bytes_read) == metadata_size);
+  DeltaArchiveManifest manifest;
+  TEST_AND_RETURN_FALSE(payload_metadata.GetManifest(metadata, &manifest));
+
+  bool has_metadata_signature =
+      payload_metadata.GetMajorVersion() == kBrilloMajorPayloadVersion;
+  if (!manifest.has_signatures_size() ||
+      manifest.signatures_size() != signature_blob_length ||
+      (has_metadata_signature &&
+       metadata_signature_size != signature_blob_length)) {
+    return true;
+  }
+  // The payload signature blob may or may not be written already, but nothing
+  // else can follow it.
+  uint64_t signatures_offset =
+      metadata_size + metadata_signature_size + manifest.signatures_offset();
+  uint64_t file_size = utils::FileSize(fd);
+  if (file_size != signatures_offset &&
+      file_size != signatures_offset + signature_blob_length) {
+    return true;
+  }
+  *out_reserved = true;
+
+  TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfBytes(
+      metadata.data(), metadata_size, out_metadata_hash));
+  // Note that we skip metadata signature and payload signature.
+  HashCalculator calc;
+  TEST_AND_RETURN_FALSE(calc.Update(metadata.data(), metadata_size));
+  brillo::Blob buffer(kHashChunkSize);
+  for (uint64_t offset = metadata_size + metadata_signature_size;
+       offset < signatures_offset;
+       offset += bytes_read) {
+    size_t count = std::min(static_cast<uint64_t>(buffer.size()),
+                            signatures_offset - offset);
+    TEST_AND_RETURN_FALSE(
+        utils::PReadAll(fd, buffer.data(), count, offset, &bytes_read));
+    TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) == count);
+    TEST_AND_RETURN_FALSE(calc.Update(buffer.data(), count));
+  }
+  TEST_AND_RETURN_FALSE(calc.Finalize());
+  *out_hash_data = calc.raw_hash();
+  *out_metadata_signature_offset = has_metadata_signature ? metadata_size : 0;
+  *out_signatures_offset = signatures_offset;
+  return true;
+}
+
+// Signs a payload with a BatchPayloadSigner in a worker thread.
+class PayloadSignProcessor : public base::DelegateSimpleThread::Delegate {
+ public:
+  PayloadSignProcessor(const BatchPayloadSigner* signer,
+                       const string& payload_path)
+      : signer_(signer), payload_path_(payload_path) {}
+  PayloadSignProcessor(PayloadSignProcessor&&) = default;
+  ~PayloadSignProcessor() override = default;
+
+  // Overrides DelegateSimpleThread::Delegate.
+  void Run() override {
+    failed_ = !signer_->SignPayload(payload_path_, &in_place_);
+    if (failed_)
+      LOG(ERROR) << "Failed to sign " << payload_path_;
+  }
+
+  bool failed() const { return failed_; }
+  bool in_place() const { return in_place_; }
+
+ private:
+  const BatchPayloadSigner* signer_;
+  const string& payload_path_;  // NOLINT(runtime/member_string_references)
+
+  bool failed_{false};
+  bool in_place_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(PayloadSignProcessor);
+};
+
 }  // namespace
 
 void PayloadSigner::AddSignatureToManifest(uint64_t signature_blob_offset,
@@ -271,38 +433,11 @@ bool PayloadSigner::SignHash(const brillo::Blob& hash,
                              const string& private_key_path,
                              brillo::Blob* out_signature) {
   LOG(INFO) << "Signing hash with private key: " << private_key_path;
-  // We expect unpadded SHA256 hash coming in
-  TEST_AND_RETURN_FALSE(hash.size() == kSHA256Size);
-  // The code below executes the equivalent of:
-  //
-  // openssl rsautl -raw -sign -inkey |private_key_path|
-  //   -in |padded_hash| -out |out_signature|
-
-  FILE* fprikey = fopen(private_key_path.c_str(), "rb");
-  TEST_AND_RETURN_FALSE(fprikey != nullptr);
-  RSA* rsa = PEM_read_RSAPrivateKey(fprikey, nullptr, nullptr, nullptr);
-  fclose(fprikey);
+  RSA* rsa = ReadPrivateKey(private_key_path);
   TEST_AND_RETURN_FALSE(rsa != nullptr);
-
-  brillo::Blob padded_hash = hash;
-  PayloadVerifier::PadRSASHA256Hash(&padded_hash, RSA_size(rsa));
-
-  brillo::Blob signature(RSA_size(rsa));
-  ssize_t signature_size = RSA_private_encrypt(padded_hash.size(),
-                                               padded_hash.data(),
-                                               signature.data(),
-                                               rsa,
-                                               RSA_NO_PADDING);
+  bool success = SignHashWithKey(hash, rsa, out_signature);
   RSA_free(rsa);
-  if (signature_size < 0) {
-    LOG(ERROR) << "Signing hash failed: "
-               << ERR_error_string(ERR_get_error(), nullptr);
-    return false;
-  }
-  TEST_AND_RETURN_FALSE(static_cast<size_t>(signature_size) ==
-                        signature.size());
-  out_signature->swap(signature);
-  return true;
+  return success;
 }
 
 bool PayloadSigner::SignHashWithKeys(const brillo::Blob& hash_data,
@@ -465,4 +600,133 @@ bool PayloadSigner::ExtractPayloadProperties(
   return true;
 }
 
+BatchPayloadSigner::~BatchPayloadSigner() {
+  for (RSA* rsa : keys_)
+    RSA_free(rsa);
+}
+
+bool BatchPayloadSigner::LoadKeys(const vector<string>& private_key_paths) {
+  TEST_AND_RETURN_FALSE(keys_.empty());
+  TEST_AND_RETURN_FALSE(!private_key_paths.empty());
+  vector<brillo::Blob> signatures;
+  for (const string& path : private_key_paths) {
+    LOG(INFO) << "Loading private key: " << path;
+    RSA* rsa = ReadPrivateKey(path);
+    TEST_AND_RETURN_FALSE(rsa != nullptr);
+    keys_.push_back(rsa);
+    signatures.emplace_back(RSA_size(rsa), 0);
+  }
+  // The size of the signature blob only depends on the size of the keys.
+  string signature;
+  TEST_AND_RETURN_FALSE(ConvertSignaturesToProtobuf(signatures, &signature));
+  signature_blob_length_ = signature.size();
+  return true;
+}
+
+bool BatchPayloadSigner::SignHash(const brillo::Blob& hash,
+                                  vector<brillo::Blob>* out_signatures) const {
+  out_signatures->clear();
+  for (RSA* rsa : keys_) {
+    brillo::Blob signature;
+    TEST_AND_RETURN_FALSE(SignHashWithKey(hash, rsa, &signature));
+    out_signatures->push_back(std::move(signature));
+  }
+  return true;
+}
+
+bool BatchPayloadSigner::SignPayload(const string& payload_path,
+                                     bool* out_in_place) const {
+  TEST_AND_RETURN_FALSE(!keys_.empty());
+  bool reserved;
+  uint64_t metadata_signature_offset, signatures_offset;
+  brillo::Blob payload_hash, metadata_hash;
+  TEST_AND_RETURN_FALSE(
+      HashPayloadWithReservedSignatures(payload_path,
+                                        signature_blob_length_,
+                                        &reserved,
+                                        &metadata_signature_offset,
+                                        &signatures_offset,
+                                        &payload_hash,
+                                        &metadata_hash));
+  vector<brillo::Blob> payload_signatures, metadata_signatures;
+  if (!reserved) {
+    LOG(INFO) << "No room reserved for the signatures in " << payload_path
+              << ", rewriting the payload.";
+    vector<int> signature_sizes;
+    for (RSA* rsa : keys_)
+      signature_sizes.push_back(RSA_size(rsa));
+    TEST_AND_RETURN_FALSE(PayloadSigner::HashPayloadForSigning(
+        payload_path, signature_sizes, &payload_hash, &metadata_hash));
+    TEST_AND_RETURN_FALSE(SignHash(payload_hash, &payload_signatures));
+    TEST_AND_RETURN_FALSE(SignHash(metadata_hash, &metadata_signatures));
+    uint64_t metadata_size;
+    TEST_AND_RETURN_FALSE(
+        PayloadSigner::AddSignatureToPayload(payload_path,
+                                             payload_signatures,
+                                             metadata_signatures,
+                                             payload_path,
+                                             &metadata_size));
+    *out_in_place = false;
+    return true;
+  }
+
+  // The layout of the payload doesn't change, so only the signature blobs
+  // need to be written.
+  string payload_signature, metadata_signature;
+  TEST_AND_RETURN_FALSE(SignHash(payload_hash, &payload_signatures));
+  TEST_AND_RETURN_FALSE(
+      ConvertSignaturesToProtobuf(payload_signatures, &payload_signature));
+  TEST_AND_RETURN_FALSE(payload_signature.size() == signature_blob_length_);
+  if (metadata_signature_offset) {
+    TEST_AND_RETURN_FALSE(SignHash(metadata_hash, &metadata_signatures));
+    TEST_AND_RETURN_FALSE(
+        ConvertSignaturesToProtobuf(metadata_signatures, &metadata_signature));
+    TEST_AND_RETURN_FALSE(metadata_signature.size() == signature_blob_length_);
+  }
+
+  int fd = HANDLE_EINTR(open(payload_path.c_str(), O_WRONLY));
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  ScopedFdCloser fd_closer(&fd);
+  if (metadata_signature_offset) {
+    TEST_AND_RETURN_FALSE(utils::PWriteAll(fd,
+                                           metadata_signature.data(),
+                                           metadata_signature.size(),
+                                           metadata_signature_offset));
+  }
+  TEST_AND_RETURN_FALSE(utils::PWriteAll(fd,
+                                         payload_signature.data(),
+                                         payload_signature.size(),
+                                         signatures_offset));
+  LOG(INFO) << "Signed " << payload_path << " in place.";
+  *out_in_place = true;
+  return true;
+}
+
+bool BatchPayloadSigner::SignPayloads(
+    const vector<string>& payload_paths) const {
+  vector<PayloadSignProcessor> processors;
+  processors.reserve(payload_paths.size());
+  for (const string& payload_path : payload_paths)
+    processors.emplace_back(this, payload_path);
+
+  base::DelegateSimpleThreadPool thread_pool("sign-payloads",
+                                             diff_utils::GetMaxThreads());
+  thread_pool.Start();
+  for (PayloadSignProcessor& processor : processors)
+    thread_pool.AddWork(&processor);
+  thread_pool.JoinAll();
+
+  size_t num_failed = 0, num_in_place = 0;
+  for (const PayloadSignProcessor& processor : processors) {
+    if (processor.failed())
+      num_failed++;
+    else if (processor.in_place())
+      num_in_place++;
+  }
+  LOG(INFO) << "Signed " << processors.size() - num_failed << " of "
+            << processors.size() << " payloads, " << num_in_place
+            << " of them in place.";
+  return num_failed == 0;
+}
+
 }  // namespace chromeos_update_engine
@@ -23,6 +23,7 @@
 #include <base/macros.h>
 #include <brillo/key_value_store.h>
 #include <brillo/secure_blob.h>
+#include <openssl/rsa.h>
 
 #include "update_engine/update_metadata.pb.h"
 
@@ -127,6 +128,43 @@ class PayloadSigner {
   DISALLOW_IMPLICIT_CONSTRUCTORS(PayloadSigner);
 };
 
+// Signs many payloads with the same private keys, which are loaded only once.
+// Payloads whose header and manifest already reserve room for signatures of
+// the right size are hashed by streaming them from disk and signed in place,
+// only writing the signature blobs. Other payloads are signed like
+// PayloadSigner::AddSignatureToPayload() does, rewriting the whole file.
+class BatchPayloadSigner {
+ public:
+  BatchPayloadSigner() = default;
+  ~BatchPayloadSigner();
+
+  // Loads the private keys in |private_key_paths|, in .pem format. Returns
+  // false on error.
+  bool LoadKeys(const std::vector<std::string>& private_key_paths);
+
+  // Signs the payload in |payload_path| in place with the loaded keys.
+  // |out_in_place| is set to whether only the signatures were written, as
+  // opposed to rewriting the whole payload. Returns false on error.
+  bool SignPayload(const std::string& payload_path, bool* out_in_place) const;
+
+  // Signs all the payloads in |payload_paths| concurrently. Returns false if
+  // any of them failed, in which case the others are still signed.
+  bool SignPayloads(const std::vector<std::string>& payload_paths) const;
+
+ private:
+  // Signs |hash| with every loaded key, in order, into |out_signatures|.
+  bool SignHash(const brillo::Blob& hash,
+                std::vector<brillo::Blob>* out_signatures) const;
+
+  // The loaded private keys, owned by this class.
+  std::vector<RSA*> keys_;
+
+  // The size of the serialized signature blob produced by SignHash().
+  uint64_t signature_blob_length_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(BatchPayloadSigner);
+};
+
 }  // namespace chromeos_update_engine
 
 #endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_PAYLOAD_SIGNER_H_
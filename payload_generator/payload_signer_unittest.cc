@@ -205,4 +205,99 @@ TEST_F(PayloadSignerTest, VerifySignedPayloadTest) {
       payload_file.path(), GetBuildArtifactsPath(kUnittestPublicKeyPath)));
 }
 
+TEST_F(PayloadSignerTest, BatchSignReservedPayloadInPlaceTest) {
+  test_utils::ScopedTempFile payload_file("payload.XXXXXX");
+  PayloadGenerationConfig config;
+  config.version.major = kBrilloMajorPayloadVersion;
+  PayloadFile payload;
+  EXPECT_TRUE(payload.Init(config));
+  uint64_t metadata_size;
+  EXPECT_TRUE(
+      payload.WritePayload(payload_file.path(),
+                           "/dev/null",
+                           GetBuildArtifactsPath(kUnittestPrivateKeyPath),
+                           &metadata_size));
+  brillo::Blob signed_payload;
+  EXPECT_TRUE(utils::ReadFile(payload_file.path(), &signed_payload));
+
+  // Re-signing with a key of the same size only replaces the signatures.
+  BatchPayloadSigner signer;
+  EXPECT_TRUE(
+      signer.LoadKeys({GetBuildArtifactsPath(kUnittestPrivateKey2Path)}));
+  bool in_place = false;
+  EXPECT_TRUE(signer.SignPayload(payload_file.path(), &in_place));
+  EXPECT_TRUE(in_place);
+  EXPECT_EQ(signed_payload.size(), utils::FileSize(payload_file.path()));
+  EXPECT_TRUE(PayloadSigner::VerifySignedPayload(
+      payload_file.path(), GetBuildArtifactsPath(kUnittestPublicKey2Path)));
+
+  // Signing back with the original key gives the original payload.
+  BatchPayloadSigner original_signer;
+  EXPECT_TRUE(original_signer.LoadKeys(
+      {GetBuildArtifactsPath(kUnittestPrivateKeyPath)}));
+  EXPECT_TRUE(original_signer.SignPayload(payload_file.path(), &in_place));
+  EXPECT_TRUE(in_place);
+  brillo::Blob resigned_payload;
+  EXPECT_TRUE(utils::ReadFile(payload_file.path(), &resigned_payload));
+  EXPECT_EQ(signed_payload, resigned_payload);
+}
+
+TEST_F(PayloadSignerTest, BatchSignUnreservedPayloadTest) {
+  test_utils::ScopedTempFile payload_file("payload.XXXXXX");
+  PayloadGenerationConfig config;
+  config.version.major = kBrilloMajorPayloadVersion;
+  PayloadFile payload;
+  EXPECT_TRUE(payload.Init(config));
+  uint64_t metadata_size;
+  EXPECT_TRUE(payload.WritePayload(
+      payload_file.path(), "/dev/null", "", &metadata_size));
+
+  BatchPayloadSigner signer;
+  EXPECT_TRUE(
+      signer.LoadKeys({GetBuildArtifactsPath(kUnittestPrivateKeyPath),
+                       GetBuildArtifactsPath(kUnittestPrivateKeyRSA4096Path)}));
+  bool in_place = true;
+  EXPECT_TRUE(signer.SignPayload(payload_file.path(), &in_place));
+  EXPECT_FALSE(in_place);
+  EXPECT_TRUE(PayloadSigner::VerifySignedPayload(
+      payload_file.path(), GetBuildArtifactsPath(kUnittestPublicKeyPath)));
+
+  // The payload has room for the signatures now.
+  EXPECT_TRUE(signer.SignPayload(payload_file.path(), &in_place));
+  EXPECT_TRUE(in_place);
+  EXPECT_TRUE(PayloadSigner::VerifySignedPayload(
+      payload_file.path(),
+      GetBuildArtifactsPath(kUnittestPublicKeyRSA4096Path)));
+}
+
+TEST_F(PayloadSignerTest, BatchSignPayloadsTest) {
+  PayloadGenerationConfig config;
+  config.version.major = kBrilloMajorPayloadVersion;
+  PayloadFile payload;
+  EXPECT_TRUE(payload.Init(config));
+  vector<test_utils::ScopedTempFile> payload_files(4);
+  vector<string> payload_paths;
+  for (size_t i = 0; i < payload_files.size(); i++) {
+    uint64_t metadata_size;
+    EXPECT_TRUE(payload.WritePayload(
+        payload_files[i].path(),
+        "/dev/null",
+        i % 2 ? GetBuildArtifactsPath(kUnittestPrivateKey2Path) : "",
+        &metadata_size));
+    payload_paths.push_back(payload_files[i].path());
+  }
+
+  BatchPayloadSigner signer;
+  EXPECT_TRUE(
+      signer.LoadKeys({GetBuildArtifactsPath(kUnittestPrivateKeyPath)}));
+  EXPECT_TRUE(signer.SignPayloads(payload_paths));
+  for (const string& payload_path : payload_paths) {
+    EXPECT_TRUE(PayloadSigner::VerifySignedPayload(
+        payload_path, GetBuildArtifactsPath(kUnittestPublicKeyPath)));
+  }
+
+  payload_paths.push_back("/non/existent/payload");
+  EXPECT_FALSE(signer.SignPayloads(payload_paths));
+}
+
 }  // namespace chromeos_update_engine
@@ -0,0 +1,127 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/zstd.h"
+
+#include <zstd.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+
+#include "update_engine/payload_consumer/zstd_extent_writer.h"
+#include "update_engine/payload_generator/delta_diff_utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The compression level. Levels above 19 ("ultra") require a bigger window
+// than the decompressor allows.
+const int kZstdCompressionLevel = 19;
+
+// The size of the input compressed by each worker thread. Smaller inputs are
+// compressed in the calling thread, since operations are already generated in
+// parallel.
+const size_t kZstdJobSize = 8 * 1024 * 1024;
+
+// A ZSTD_CCtx freed when going out of scope.
+struct ScopedZstdCCtx {
+  ScopedZstdCCtx() : cctx(ZSTD_createCCtx()) {}
+  ~ScopedZstdCCtx() { ZSTD_freeCCtx(cctx); }
+  ZSTD_CCtx* cctx;
+};
+
+bool SetParameter(ZSTD_CCtx* cctx, ZSTD_cParameter param, int value) {
+  size_t ret = ZSTD_CCtx_setParameter(cctx, param, value);
+  if (ZSTD_isError(ret)) {
+    LOG(ERROR) << "Unable to set zstd parameter " << param << " to " << value
+               << ": " << ZSTD_getErrorName(ret);
+    return false;
+  }
+  return true;
+}
+
+// Compresses |in| into |out| after the |prefix|, if not empty, with a window
+// of up to 2^|max_window_log| bytes.
+bool Compress(const brillo::Blob& in,
+              const brillo::Blob& prefix,
+              int max_window_log,
+              brillo::Blob* out) {
+  out->clear();
+  if (in.empty())
+    return true;
+
+  // The window only needs to cover the prefix and the input.
+  int window_log = ZSTD_cParam_getBounds(ZSTD_c_windowLog).lowerBound;
+  while (window_log < max_window_log &&
+         (1ULL << window_log) < prefix.size() + in.size())
+    window_log++;
+
+  ScopedZstdCCtx ctx;
+  TEST_AND_RETURN_FALSE(ctx.cctx != nullptr);
+  TEST_AND_RETURN_FALSE(SetParameter(
+      ctx.cctx, ZSTD_c_compressionLevel, kZstdCompressionLevel));
+  TEST_AND_RETURN_FALSE(
+      SetParameter(ctx.cctx, ZSTD_c_enableLongDistanceMatching, 1));
+  TEST_AND_RETURN_FALSE(
+      SetParameter(ctx.cctx, ZSTD_c_windowLog, window_log));
+  // The whole blob is already checked by its hash in the manifest.
+  TEST_AND_RETURN_FALSE(SetParameter(ctx.cctx, ZSTD_c_checksumFlag, 0));
+
+  size_t workers =
+      std::min(diff_utils::GetMaxThreads(), in.size() / kZstdJobSize);
+  if (workers > 1) {
+    // zstd may be built without thread support, in which case the blob is
+    // just compressed in this thread.
+    if (SetParameter(ctx.cctx, ZSTD_c_nbWorkers, workers))
+      TEST_AND_RETURN_FALSE(
+          SetParameter(ctx.cctx, ZSTD_c_jobSize, kZstdJobSize));
+  }
+
+  if (!prefix.empty()) {
+    size_t ret = ZSTD_CCtx_refPrefix(ctx.cctx, prefix.data(), prefix.size());
+    if (ZSTD_isError(ret)) {
+      LOG(ERROR) << "Unable to set the zstd prefix: " << ZSTD_getErrorName(ret);
+      return false;
+    }
+  }
+
+  out->resize(ZSTD_compressBound(in.size()));
+  size_t size = ZSTD_compress2(
+      ctx.cctx, out->data(), out->size(), in.data(), in.size());
+  if (ZSTD_isError(size)) {
+    LOG(ERROR) << "ZSTD_compress2 failed: " << ZSTD_getErrorName(size);
+    out->clear();
+    return false;
+  }
+  out->resize(size);
+  return true;
+}
+
+}  // namespace
+
+bool ZstdCompress(const brillo::Blob& in, brillo::Blob* out) {
+  return Compress(in, brillo::Blob(), ZstdExtentWriter::kMaxWindowLog, out);
+}
+
+bool ZstdCompressWithPrefix(const brillo::Blob& in,
+                            const brillo::Blob& prefix,
+                            brillo::Blob* out) {
+  return Compress(in, prefix, ZstdExtentWriter::kMaxPrefixWindowLog, out);
+}
+
+}  // namespace chromeos_update_engine
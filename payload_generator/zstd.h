@@ -0,0 +1,40 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_ZSTD_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_ZSTD_H_
+
+#include <brillo/secure_blob.h>
+
+namespace chromeos_update_engine {
+
+// Compresses the input buffer |in| into |out| as a single zstd frame. The
+// frame uses long distance matching with a window of up to 64 MiB, which is
+// the most ZstdExtentWriter accepts. Inputs spanning several compression jobs
+// are compressed with multiple threads.
+bool ZstdCompress(const brillo::Blob& in, brillo::Blob* out);
+
+// Compresses |in| into |out| like ZstdCompress(), but as if it followed
+// |prefix|, so matches can reference the data in |prefix|. The window covers
+// both, up to the 512 MiB ZstdExtentWriter accepts with a prefix, so the size
+// of |prefix| and |in| together should not exceed it.
+bool ZstdCompressWithPrefix(const brillo::Blob& in,
+                            const brillo::Blob& prefix,
+                            brillo::Blob* out);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_ZSTD_H_
@@ -86,6 +86,13 @@ class PayloadState : public PayloadStateInterface {
                : "";
   }
 
+  inline std::string GetPayloadUrl(size_t payload_index) override {
+    return (payload_index < candidate_urls_.size() &&
+            url_index_ < candidate_urls_[payload_index].size())
+               ? candidate_urls_[payload_index][url_index_]
+               : "";
+  }
+
   inline uint32_t GetUrlFailureCount() override { return url_failure_count_; }
 
   inline uint32_t GetUrlSwitchCount() override { return url_switch_count_; }
@@ -114,6 +114,11 @@ class PayloadStateInterface {
   // Returns the current URL. Returns an empty string if there's no valid URL.
   virtual std::string GetCurrentUrl() = 0;
 
+  // Returns the URL the payload at |payload_index| would be downloaded from,
+  // using the current URL index. Returns an empty string if there's no valid
+  // URL.
+  virtual std::string GetPayloadUrl(size_t payload_index) = 0;
+
   // Returns the current URL's failure count.
   virtual uint32_t GetUrlFailureCount() = 0;
 
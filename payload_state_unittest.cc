@@ -244,6 +244,29 @@ TEST(PayloadStateTest, SetResponseWorksWithMultipleUrls) {
   EXPECT_EQ(1, payload_state.GetNumResponsesSeen());
 }
 
+TEST(PayloadStateTest, GetPayloadUrlWithMultiplePayloads) {
+  OmahaResponse response;
+  response.packages.push_back({.payload_urls = {"https://first.url.test"},
+                               .size = 523456789,
+                               .metadata_size = 558123,
+                               .metadata_signature = "metasign",
+                               .hash = "hash1"});
+  response.packages.push_back({.payload_urls = {"https://second.url.test"},
+                               .size = 1234,
+                               .metadata_size = 123,
+                               .metadata_signature = "metasign",
+                               .hash = "hash2"});
+  FakeSystemState fake_system_state;
+  PayloadState payload_state;
+  EXPECT_TRUE(payload_state.Initialize(&fake_system_state));
+  payload_state.SetResponse(response);
+
+  EXPECT_EQ("https://first.url.test", payload_state.GetCurrentUrl());
+  EXPECT_EQ("https://first.url.test", payload_state.GetPayloadUrl(0));
+  EXPECT_EQ("https://second.url.test", payload_state.GetPayloadUrl(1));
+  EXPECT_EQ("", payload_state.GetPayloadUrl(2));
+}
+
 TEST(PayloadStateTest, CanAdvanceUrlIndexCorrectly) {
   OmahaResponse response;
   FakeSystemState fake_system_state;
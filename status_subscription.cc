@@ -0,0 +1,100 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/status_subscription.h"
+
+#include <base/bind.h>
+#include <base/location.h>
+
+using brillo::MessageLoop;
+using update_engine::StatusField;
+using update_engine::UpdateEngineStatus;
+
+namespace chromeos_update_engine {
+
+int32_t ChangedStatusFields(const UpdateEngineStatus& a,
+                            const UpdateEngineStatus& b) {
+  int32_t fields = StatusField::kStatusFieldNone;
+  if (a.last_checked_time != b.last_checked_time)
+    fields |= StatusField::kStatusFieldLastCheckedTime;
+  if (a.progress != b.progress)
+    fields |= StatusField::kStatusFieldProgress;
+  if (a.status != b.status)
+    fields |= StatusField::kStatusFieldStatus;
+  if (a.new_version != b.new_version ||
+      a.new_system_version != b.new_system_version)
+    fields |= StatusField::kStatusFieldNewVersion;
+  if (a.new_size_bytes != b.new_size_bytes)
+    fields |= StatusField::kStatusFieldNewSize;
+  if (a.current_version != b.current_version ||
+      a.current_system_version != b.current_system_version)
+    fields |= StatusField::kStatusFieldCurrentVersion;
+  return fields;
+}
+
+StatusSubscription::StatusSubscription(int32_t fields,
+                                       base::TimeDelta min_interval,
+                                       const Callback& callback)
+    : fields_(fields), min_interval_(min_interval), callback_(callback) {}
+
+StatusSubscription::~StatusSubscription() {
+  if (interval_task_id_ != MessageLoop::kTaskIdNull)
+    MessageLoop::current()->CancelTask(interval_task_id_);
+}
+
+void StatusSubscription::Offer(const UpdateEngineStatus& status) {
+  if (!delivered_) {
+    Deliver(status);
+    return;
+  }
+  int32_t changed = ChangedStatusFields(last_status_, status) & fields_;
+  if (changed == StatusField::kStatusFieldNone) {
+    // Back to the last delivered status, nothing left to deliver.
+    has_pending_ = false;
+    return;
+  }
+  if (changed == StatusField::kStatusFieldProgress &&
+      interval_task_id_ != MessageLoop::kTaskIdNull) {
+    // Coalesce with the other progress changes of this interval.
+    pending_status_ = status;
+    has_pending_ = true;
+    return;
+  }
+  Deliver(status);
+}
+
+void StatusSubscription::Deliver(const UpdateEngineStatus& status) {
+  last_status_ = status;
+  delivered_ = true;
+  has_pending_ = false;
+  if (min_interval_ > base::TimeDelta()) {
+    if (interval_task_id_ != MessageLoop::kTaskIdNull)
+      MessageLoop::current()->CancelTask(interval_task_id_);
+    interval_task_id_ = MessageLoop::current()->PostDelayedTask(
+        FROM_HERE,
+        base::Bind(&StatusSubscription::OnIntervalEnd, base::Unretained(this)),
+        min_interval_);
+  }
+  callback_.Run(last_status_);
+}
+
+void StatusSubscription::OnIntervalEnd() {
+  interval_task_id_ = MessageLoop::kTaskIdNull;
+  if (has_pending_)
+    Deliver(pending_status_);
+}
+
+}  // namespace chromeos_update_engine
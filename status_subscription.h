@@ -0,0 +1,89 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_STATUS_SUBSCRIPTION_H_
+#define UPDATE_ENGINE_STATUS_SUBSCRIPTION_H_
+
+#include <base/callback.h>
+#include <base/macros.h>
+#include <base/time/time.h>
+#include <brillo/message_loops/message_loop.h>
+
+#include "update_engine/client_library/include/update_engine/update_status.h"
+
+namespace chromeos_update_engine {
+
+// Returns the fields, among the update_engine::StatusField flags, that differ
+// between |a| and |b|.
+int32_t ChangedStatusFields(const update_engine::UpdateEngineStatus& a,
+                            const update_engine::UpdateEngineStatus& b);
+
+// Delivers the status broadcasts to one observer, only for the fields it
+// subscribed to and at the rate it asked for. A status is delivered when one
+// of the subscribed fields changed since the last delivered status. Changes
+// of the progress alone are delivered at most once every |min_interval|: the
+// intermediate values are dropped and the latest one is delivered when the
+// interval ends. Any other change is delivered right away, so the observer
+// never misses a transition.
+//
+// A brillo::MessageLoop must be running on the current thread when
+// |min_interval| isn't zero.
+class StatusSubscription {
+ public:
+  using Callback =
+      base::Callback<void(const update_engine::UpdateEngineStatus&)>;
+
+  StatusSubscription(int32_t fields,
+                     base::TimeDelta min_interval,
+                     const Callback& callback);
+  ~StatusSubscription();
+
+  // Offers a new broadcast status to the subscription, which delivers it now,
+  // later or never. The first status offered is always delivered.
+  void Offer(const update_engine::UpdateEngineStatus& status);
+
+  int32_t fields() const { return fields_; }
+  base::TimeDelta min_interval() const { return min_interval_; }
+
+ private:
+  // Runs the callback with |status| and starts a new interval.
+  void Deliver(const update_engine::UpdateEngineStatus& status);
+
+  // Called at the end of the interval started by the last delivery. Delivers
+  // the latest status offered since then, if any.
+  void OnIntervalEnd();
+
+  const int32_t fields_;
+  const base::TimeDelta min_interval_;
+  Callback callback_;
+
+  // The last delivered status, valid once |delivered_| is set.
+  bool delivered_{false};
+  update_engine::UpdateEngineStatus last_status_;
+
+  // The latest status offered during the current interval and not delivered.
+  bool has_pending_{false};
+  update_engine::UpdateEngineStatus pending_status_;
+
+  brillo::MessageLoop::TaskId interval_task_id_{
+      brillo::MessageLoop::kTaskIdNull};
+
+  DISALLOW_COPY_AND_ASSIGN(StatusSubscription);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_STATUS_SUBSCRIPTION_H_
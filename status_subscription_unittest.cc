@@ -0,0 +1,159 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/status_subscription.h"
+
+#include <vector>
+
+#include <base/bind.h>
+#include <brillo/message_loops/fake_message_loop.h>
+#include <gtest/gtest.h>
+
+using base::TimeDelta;
+using std::vector;
+using update_engine::StatusField;
+using update_engine::UpdateEngineStatus;
+using update_engine::UpdateStatus;
+
+namespace chromeos_update_engine {
+
+class StatusSubscriptionTest : public ::testing::Test {
+ protected:
+  void SetUp() override { loop_.SetAsCurrent(); }
+
+  void TearDown() override { EXPECT_FALSE(loop_.PendingTasks()); }
+
+  StatusSubscription::Callback RecordTo(vector<UpdateEngineStatus>* out) {
+    return base::Bind(
+        [](vector<UpdateEngineStatus>* out, const UpdateEngineStatus& status) {
+          out->push_back(status);
+        },
+        out);
+  }
+
+  UpdateEngineStatus Status(UpdateStatus status, double progress) {
+    UpdateEngineStatus result = {};
+    result.status = status;
+    result.progress = progress;
+    return result;
+  }
+
+  brillo::FakeMessageLoop loop_{nullptr};
+};
+
+TEST_F(StatusSubscriptionTest, ChangedStatusFieldsTest) {
+  UpdateEngineStatus a = Status(UpdateStatus::DOWNLOADING, 0.5);
+  UpdateEngineStatus b = a;
+  EXPECT_EQ(StatusField::kStatusFieldNone, ChangedStatusFields(a, b));
+  b.progress = 0.6;
+  b.new_system_version = "1.2.3";
+  EXPECT_EQ(StatusField::kStatusFieldProgress |
+                StatusField::kStatusFieldNewVersion,
+            ChangedStatusFields(a, b));
+}
+
+TEST_F(StatusSubscriptionTest, DeliversEveryChangeTest) {
+  vector<UpdateEngineStatus> delivered;
+  StatusSubscription subscription(
+      StatusField::kStatusFieldAll, TimeDelta(), RecordTo(&delivered));
+
+  subscription.Offer(Status(UpdateStatus::DOWNLOADING, 0.1));
+  subscription.Offer(Status(UpdateStatus::DOWNLOADING, 0.1));
+  subscription.Offer(Status(UpdateStatus::DOWNLOADING, 0.2));
+  subscription.Offer(Status(UpdateStatus::VERIFYING, 0.2));
+  ASSERT_EQ(3U, delivered.size());
+  EXPECT_EQ(0.1, delivered[0].progress);
+  EXPECT_EQ(0.2, delivered[1].progress);
+  EXPECT_EQ(UpdateStatus::VERIFYING, delivered[2].status);
+}
+
+TEST_F(StatusSubscriptionTest, FieldSubsetTest) {
+  vector<UpdateEngineStatus> delivered;
+  StatusSubscription subscription(
+      StatusField::kStatusFieldStatus, TimeDelta(), RecordTo(&delivered));
+
+  // The first status is always delivered.
+  subscription.Offer(Status(UpdateStatus::DOWNLOADING, 0.1));
+  subscription.Offer(Status(UpdateStatus::DOWNLOADING, 0.5));
+  subscription.Offer(Status(UpdateStatus::DOWNLOADING, 0.9));
+  subscription.Offer(Status(UpdateStatus::UPDATED_NEED_REBOOT, 1.0));
+  ASSERT_EQ(2U, delivered.size());
+  EXPECT_EQ(UpdateStatus::DOWNLOADING, delivered[0].status);
+  EXPECT_EQ(UpdateStatus::UPDATED_NEED_REBOOT, delivered[1].status);
+}
+
+TEST_F(StatusSubscriptionTest, CoalescesProgressTest) {
+  vector<UpdateEngineStatus> delivered;
+  StatusSubscription subscription(StatusField::kStatusFieldAll,
+                                  TimeDelta::FromSeconds(5),
+                                  RecordTo(&delivered));
+
+  subscription.Offer(Status(UpdateStatus::DOWNLOADING, 0.1));
+  subscription.Offer(Status(UpdateStatus::DOWNLOADING, 0.2));
+  subscription.Offer(Status(UpdateStatus::DOWNLOADING, 0.3));
+  ASSERT_EQ(1U, delivered.size());
+
+  // Only the latest progress is delivered at the end of the interval, which
+  // starts a new one.
+  EXPECT_TRUE(loop_.RunOnce(false));
+  ASSERT_EQ(2U, delivered.size());
+  EXPECT_EQ(0.3, delivered[1].progress);
+  EXPECT_TRUE(loop_.PendingTasks());
+
+  // An interval without progress ends without delivering anything.
+  EXPECT_TRUE(loop_.RunOnce(false));
+  EXPECT_EQ(2U, delivered.size());
+  EXPECT_FALSE(loop_.PendingTasks());
+
+  // Out of an interval, a progress change is delivered right away.
+  subscription.Offer(Status(UpdateStatus::DOWNLOADING, 0.4));
+  ASSERT_EQ(3U, delivered.size());
+  EXPECT_EQ(0.4, delivered[2].progress);
+  EXPECT_TRUE(loop_.RunOnce(false));
+}
+
+TEST_F(StatusSubscriptionTest, TransitionsAreNotDelayedTest) {
+  vector<UpdateEngineStatus> delivered;
+  StatusSubscription subscription(StatusField::kStatusFieldAll,
+                                  TimeDelta::FromSeconds(5),
+                                  RecordTo(&delivered));
+
+  subscription.Offer(Status(UpdateStatus::DOWNLOADING, 0.1));
+  subscription.Offer(Status(UpdateStatus::DOWNLOADING, 0.9));
+  subscription.Offer(Status(UpdateStatus::VERIFYING, 1.0));
+  ASSERT_EQ(2U, delivered.size());
+  EXPECT_EQ(UpdateStatus::VERIFYING, delivered[1].status);
+  EXPECT_EQ(1.0, delivered[1].progress);
+
+  // The pending progress was replaced by the transition.
+  EXPECT_TRUE(loop_.RunOnce(false));
+  EXPECT_EQ(2U, delivered.size());
+}
+
+TEST_F(StatusSubscriptionTest, DestructionCancelsIntervalTest) {
+  vector<UpdateEngineStatus> delivered;
+  {
+    StatusSubscription subscription(StatusField::kStatusFieldAll,
+                                    TimeDelta::FromSeconds(5),
+                                    RecordTo(&delivered));
+    subscription.Offer(Status(UpdateStatus::DOWNLOADING, 0.1));
+    subscription.Offer(Status(UpdateStatus::DOWNLOADING, 0.2));
+  }
+  EXPECT_FALSE(loop_.PendingTasks());
+  EXPECT_EQ(1U, delivered.size());
+}
+
+}  // namespace chromeos_update_engine
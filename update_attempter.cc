@@ -642,19 +642,19 @@ void UpdateAttempter::BuildUpdateActions(bool interactive) {
                                            system_state_->hardware()),
       false);
 
-  LibcurlHttpFetcher* download_fetcher =
-      new LibcurlHttpFetcher(GetProxyResolver(), system_state_->hardware());
-  download_fetcher->set_server_to_check(ServerToCheck::kDownload);
-  if (interactive)
-    download_fetcher->set_max_retry_count(kDownloadMaxRetryCountInteractive);
-  auto download_action =
-      std::make_unique<DownloadAction>(prefs_,
-                                       system_state_->boot_control(),
-                                       system_state_->hardware(),
-                                       system_state_,
-                                       download_fetcher,  // passes ownership
-                                       interactive);
+  auto download_action = std::make_unique<DownloadAction>(
+      prefs_,
+      system_state_->boot_control(),
+      system_state_->hardware(),
+      system_state_,
+      CreateDownloadFetcher(interactive),  // passes ownership
+      interactive);
   download_action->set_delegate(this);
+  download_action->set_concurrent_payloads(
+      kDownloadMaxConcurrentPayloads,
+      base::Bind(&UpdateAttempter::CreateDownloadFetcher,
+                 base::Unretained(this),
+                 interactive));
 
   auto download_finished_action = std::make_unique<OmahaRequestAction>(
       system_state_,
@@ -694,6 +694,15 @@ void UpdateAttempter::BuildUpdateActions(bool interactive) {
   processor_->EnqueueAction(std::move(update_complete_action));
 }
 
+HttpFetcher* UpdateAttempter::CreateDownloadFetcher(bool interactive) {
+  LibcurlHttpFetcher* download_fetcher =
+      new LibcurlHttpFetcher(GetProxyResolver(), system_state_->hardware());
+  download_fetcher->set_server_to_check(ServerToCheck::kDownload);
+  if (interactive)
+    download_fetcher->set_max_retry_count(kDownloadMaxRetryCountInteractive);
+  return download_fetcher;
+}
+
 bool UpdateAttempter::Rollback(bool powerwash) {
   is_install_ = false;
   if (!CanRollback()) {
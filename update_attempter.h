@@ -358,6 +358,9 @@ class UpdateAttempter : public ActionProcessorDelegate,
   // Update() method for the meaning of the parameters.
   void BuildUpdateActions(bool interactive);
 
+  // Returns a new fetcher to download payloads with, owned by the caller.
+  HttpFetcher* CreateDownloadFetcher(bool interactive);
+
   // Decrements the count in the kUpdateCheckCountFilePath.
   // Returns True if successfully decremented, false otherwise.
   bool DecrementUpdateCheckCount();
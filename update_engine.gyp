@@ -128,8 +128,10 @@
         'exported_deps': [
           'libcrypto',
           'xz-embedded',
+          'libzstd',
           'libbspatch',
           'libpuffpatch',
+          'liblz4',
         ],
         'deps': ['<@(exported_deps)'],
       },
@@ -179,14 +181,21 @@
         'payload_consumer/file_descriptor_utils.cc',
         'payload_consumer/file_writer.cc',
         'payload_consumer/filesystem_verifier_action.cc',
+        'payload_consumer/hashing_file_descriptor.cc',
         'payload_consumer/install_plan.cc',
+        'payload_consumer/lz4patch.cc',
+        'payload_consumer/memory_budget.cc',
         'payload_consumer/mount_history.cc',
+        'payload_consumer/operation_table.cc',
         'payload_consumer/payload_constants.cc',
         'payload_consumer/payload_metadata.cc',
         'payload_consumer/payload_verifier.cc',
+        'payload_consumer/perf_counters.cc',
         'payload_consumer/postinstall_runner_action.cc',
+        'payload_consumer/verity_block_repairer.cc',
         'payload_consumer/verity_writer_stub.cc',
         'payload_consumer/xz_extent_writer.cc',
+        'payload_consumer/zstd_extent_writer.cc',
       ],
       'conditions': [
         ['USE_mtd == 1', {
@@ -277,6 +286,7 @@
         'power_manager_chromeos.cc',
         'real_system_state.cc',
         'shill_proxy.cc',
+        'status_subscription.cc',
         'update_attempter.cc',
         'update_boot_flags_action.cc',
         'update_manager/boxed_value.cc',
@@ -352,6 +362,7 @@
       'sources': [
         'client_library/client.cc',
         'client_library/client_dbus.cc',
+        'status_subscription.cc',
         'update_status_utils.cc',
       ],
       'include_dirs': [
@@ -407,10 +418,13 @@
         'common/file_fetcher.cc',
         'payload_generator/ab_generator.cc',
         'payload_generator/annotated_operation.cc',
+        'payload_generator/apply_cost_model.cc',
         'payload_generator/blob_file_writer.cc',
         'payload_generator/block_mapping.cc',
         'payload_generator/boot_img_filesystem.cc',
         'payload_generator/bzip.cc',
+        'payload_generator/compressibility.cc',
+        'payload_generator/content_chunker.cc',
         'payload_generator/cycle_breaker.cc',
         'payload_generator/deflate_utils.cc',
         'payload_generator/delta_diff_generator.cc',
@@ -418,20 +432,26 @@
         'payload_generator/ext2_filesystem.cc',
         'payload_generator/extent_ranges.cc',
         'payload_generator/extent_utils.cc',
+        'payload_generator/file_map_cache.cc',
         'payload_generator/full_update_generator.cc',
         'payload_generator/graph_types.cc',
         'payload_generator/graph_utils.cc',
         'payload_generator/inplace_generator.cc',
+        'payload_generator/lz4diff.cc',
         'payload_generator/mapfile_filesystem.cc',
+        'payload_generator/memory_budget_scheduler.cc',
+        'payload_generator/partition_reader.cc',
         'payload_generator/payload_file.cc',
         'payload_generator/payload_generation_config_chromeos.cc',
         'payload_generator/payload_generation_config.cc',
+        'payload_generator/payload_shard.cc',
         'payload_generator/payload_signer.cc',
         'payload_generator/raw_filesystem.cc',
         'payload_generator/squashfs_filesystem.cc',
         'payload_generator/tarjan.cc',
         'payload_generator/topological_sort.cc',
         'payload_generator/xz_chromeos.cc',
+        'payload_generator/zstd.cc',
       ],
     },
     # server-side delta generator.
@@ -579,30 +599,46 @@
             'payload_consumer/file_descriptor_utils_unittest.cc',
             'payload_consumer/file_writer_unittest.cc',
             'payload_consumer/filesystem_verifier_action_unittest.cc',
+            'payload_consumer/hashing_file_descriptor_unittest.cc',
+            'payload_consumer/lz4patch_unittest.cc',
+            'payload_consumer/memory_budget_unittest.cc',
+            'payload_consumer/operation_table_unittest.cc',
+            'payload_consumer/perf_counters_unittest.cc',
             'payload_consumer/postinstall_runner_action_unittest.cc',
+            'payload_consumer/verity_block_repairer_unittest.cc',
             'payload_consumer/xz_extent_writer_unittest.cc',
+            'payload_consumer/zstd_extent_writer_unittest.cc',
             'payload_generator/ab_generator_unittest.cc',
+            'payload_generator/apply_cost_model_unittest.cc',
             'payload_generator/blob_file_writer_unittest.cc',
             'payload_generator/block_mapping_unittest.cc',
             'payload_generator/boot_img_filesystem_unittest.cc',
+            'payload_generator/compressibility_unittest.cc',
+            'payload_generator/content_chunker_unittest.cc',
             'payload_generator/cycle_breaker_unittest.cc',
             'payload_generator/deflate_utils_unittest.cc',
             'payload_generator/delta_diff_utils_unittest.cc',
             'payload_generator/ext2_filesystem_unittest.cc',
             'payload_generator/extent_ranges_unittest.cc',
             'payload_generator/extent_utils_unittest.cc',
+            'payload_generator/file_map_cache_unittest.cc',
             'payload_generator/full_update_generator_unittest.cc',
             'payload_generator/graph_utils_unittest.cc',
             'payload_generator/inplace_generator_unittest.cc',
+            'payload_generator/lz4diff_unittest.cc',
             'payload_generator/mapfile_filesystem_unittest.cc',
+            'payload_generator/memory_budget_scheduler_unittest.cc',
+            'payload_generator/partition_reader_unittest.cc',
             'payload_generator/payload_file_unittest.cc',
             'payload_generator/payload_generation_config_unittest.cc',
+            'payload_generator/payload_shard_unittest.cc',
             'payload_generator/payload_signer_unittest.cc',
             'payload_generator/squashfs_filesystem_unittest.cc',
             'payload_generator/tarjan_unittest.cc',
             'payload_generator/topological_sort_unittest.cc',
             'payload_generator/zip_unittest.cc',
             'payload_state_unittest.cc',
+            'status_subscription_unittest.cc',
             'testrunner.cc',
             'update_attempter_unittest.cc',
             'update_boot_flags_action_unittest.cc',
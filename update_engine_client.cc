@@ -316,11 +316,18 @@ int UpdateEngineClient::ProcessFlags() {
   DEFINE_bool(watch_for_updates,
               false,
               "Listen for status updates and print them to the screen.");
+  DEFINE_int64(watch_interval_ms,
+               0,
+               "With --watch_for_updates, print the progress at most once "
+               "every this many milliseconds.");
   DEFINE_bool(prev_version,
               false,
               "Show the previous OS version used before the update reboot.");
   DEFINE_bool(last_attempt_error, false, "Show the last attempt error.");
   DEFINE_bool(eol_status, false, "Show the current end-of-life status.");
+  DEFINE_bool(perf_stats,
+              false,
+              "Show the performance counters of the applied updates.");
   DEFINE_bool(install, false, "Requests an install.");
   DEFINE_string(dlc_module_ids, "", "colon-separated list of DLC IDs.");
 
@@ -571,7 +578,9 @@ int UpdateEngineClient::ProcessFlags() {
     LOG(INFO) << "Waiting for update to complete.";
     auto handler = new UpdateWaitHandler(true, client_.get());
     handlers_.emplace_back(handler);
-    client_->RegisterStatusUpdateHandler(handler);
+    // Only the status transitions matter, not the progress.
+    client_->RegisterStatusUpdateHandler(
+        handler, update_engine::kStatusFieldStatus, 0);
     return kContinueRunning;
   }
 
@@ -579,7 +588,8 @@ int UpdateEngineClient::ProcessFlags() {
     LOG(INFO) << "Watching for status updates.";
     auto handler = new WatchingStatusUpdateHandler();
     handlers_.emplace_back(handler);
-    client_->RegisterStatusUpdateHandler(handler);
+    client_->RegisterStatusUpdateHandler(
+        handler, update_engine::kStatusFieldAll, FLAGS_watch_interval_ms);
     return kContinueRunning;
   }
 
@@ -612,7 +622,8 @@ int UpdateEngineClient::ProcessFlags() {
   if (FLAGS_block_until_reboot_is_needed) {
     auto handler = new UpdateWaitHandler(false, nullptr);
     handlers_.emplace_back(handler);
-    client_->RegisterStatusUpdateHandler(handler);
+    client_->RegisterStatusUpdateHandler(
+        handler, update_engine::kStatusFieldStatus, 0);
     return kContinueRunning;
   }
 
@@ -640,6 +651,15 @@ int UpdateEngineClient::ProcessFlags() {
     }
   }
 
+  if (FLAGS_perf_stats) {
+    string perf_stats;
+    if (!client_->GetPerfStats(&perf_stats)) {
+      LOG(ERROR) << "Error getting the performance counters.";
+    } else {
+      printf("%s", perf_stats.c_str());
+    }
+  }
+
   return 0;
 }
 